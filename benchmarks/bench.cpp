@@ -0,0 +1,785 @@
+// bench.cpp
+// Benchmark suite: runs each server under the same loopback scenarios, writes the
+// results as JSON and compares them with a stored baseline.
+//
+// Every scenario starts a fresh server process, so one result never depends on
+// state left behind by another. Load comes from SimpleClient's load generator.
+// Latency is measured open loop wherever it is reported: messages go out on a
+// fixed schedule and each round trip is timed from the scheduled send, so a
+// stalled server is charged for every message it delayed (no coordinated
+// omission). Closed-loop runs are only used for throughput.
+
+#include <sys/resource.h> // File descriptor limits
+#include <poll.h>         // Connect timeouts
+#include <fcntl.h>        // fcntl
+#include <sys/socket.h>   // Socket functions
+#include <netinet/in.h>   // Internet address structures
+#include <arpa/inet.h>    // IP address conversion functions
+#include <unistd.h>       // close
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../multi-threaded/client/load_generator.hpp" // Echo load and latency recording
+#include "json.hpp"                                      // Result files
+#include "server_process.hpp"                            // Server child processes
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+/**
+ * @brief Settings chosen on the command line.
+ */
+struct BenchOptions
+{
+    string singleServer = "../single-threaded/server/server"; // Single-threaded server binary
+    string multiServer = "../multi-threaded/server/server";   // Multi-threaded server binary
+    vector<string> targets = {"single", "threaded", "epoll", "reuseport", "uring"};
+    vector<string> scenarios = {"storm", "idle", "echo", "large", "broadcast"};
+    int basePort = 9500;         // First port handed to a server; each run takes the next one
+    unsigned loopThreads = 2;    // Event loops of the multi-threaded server
+    unsigned clientThreads = 2;  // Load generator threads
+    unsigned duration = 5;       // Seconds measured per run
+    unsigned stormConnections = 2000;
+    unsigned idleConnections = 10000;
+    unsigned echoRate = 10000;   // Messages per second of the open-loop echo run
+    string output;               // JSON results file; empty = stdout only
+    string baseline;             // JSON file to compare with; empty = no comparison
+    double tolerance = 20;       // Percent a metric may get worse before it counts as a regression
+};
+
+/**
+ * @brief A server configuration under test.
+ */
+struct Target
+{
+    string name;
+    bool echoes; // Answers messages by itself; the interactive servers wait for the console
+    vector<string> arguments;
+};
+
+/**
+ * @brief The metrics of one scenario against one target, in report order.
+ */
+struct Result
+{
+    string target;
+    string scenario;
+    vector<pair<string, double>> metrics;
+    string error; // Set if the run could not be done
+};
+
+class BenchmarkSuite
+{
+private:
+    BenchOptions options;
+    int nextPort;
+
+public:
+    explicit BenchmarkSuite(const BenchOptions &options) : options(options), nextPort(options.basePort) {}
+
+    /**
+     * @brief Runs every selected scenario against every selected target.
+     */
+    vector<Result> run()
+    {
+        raiseFileLimit();
+        vector<Result> results;
+        for (const string &targetName : options.targets)
+        {
+            Target target = makeTarget(targetName);
+            for (const string &scenario : options.scenarios)
+            {
+                if (!target.echoes && scenario != "storm")
+                {
+                    continue; // Nothing to measure without replies
+                }
+                cerr << "Running " << scenario << " against " << target.name << "..." << endl;
+                results.push_back(runScenario(target, scenario));
+                if (!results.back().error.empty())
+                {
+                    cerr << "  " << results.back().error << endl;
+                }
+            }
+        }
+        return results;
+    }
+
+private:
+    Target makeTarget(const string &name) const
+    {
+        string threads = to_string(options.loopThreads);
+        if (name == "single")
+        {
+            return Target{name, false, {}};
+        }
+        if (name == "threaded")
+        {
+            return Target{name, false, {"--mode", "threaded"}};
+        }
+        if (name == "reuseport")
+        {
+            return Target{name, true, {"--mode", "reuseport", "--threads", threads}};
+        }
+        if (name == "uring")
+        {
+            return Target{name, true, {"--mode", "epoll", "--io", "uring", "--threads", threads}};
+        }
+        return Target{name, true, {"--mode", "epoll", "--threads", threads}};
+    }
+
+    Result runScenario(const Target &target, const string &scenario)
+    {
+        Result result{target.name, scenario, {}, {}};
+
+        // The single-threaded server always listens on 9999
+        int port = target.name == "single" ? 9999 : nextPort++;
+        vector<string> command;
+        if (target.name == "single")
+        {
+            command = {options.singleServer};
+        }
+        else
+        {
+            command = {options.multiServer, "--port", to_string(port)};
+            command.insert(command.end(), target.arguments.begin(), target.arguments.end());
+            if (scenario == "broadcast")
+            {
+                command.insert(command.end(), {"--broadcast", "on"});
+            }
+        }
+
+        ServerProcess server;
+        if (!server.start(command, port))
+        {
+            result.error = "Failed to start " + command[0] + " on port " + to_string(port) + ".";
+            return result;
+        }
+
+        if (scenario == "storm")
+        {
+            connectionStorm(port, result);
+        }
+        else if (scenario == "idle")
+        {
+            idleConnections(server, port, result);
+        }
+        else if (scenario == "echo")
+        {
+            echoPingPong(port, result);
+        }
+        else if (scenario == "large")
+        {
+            largePayloads(port, result);
+        }
+        else if (scenario == "broadcast")
+        {
+            broadcastFanOut(port, result);
+        }
+        else
+        {
+            result.error = "Unknown scenario " + scenario + ".";
+        }
+        return result;
+    }
+
+    LoadOptions loadOptions(int port) const
+    {
+        LoadOptions load;
+        load.port = port;
+        load.threads = options.clientThreads;
+        load.duration = options.duration;
+        return load;
+    }
+
+    static void addLatency(Result &result, const LoadResult &load)
+    {
+        auto micros = [](uint64_t nanos)
+        { return static_cast<double>(nanos) / 1000.0; };
+        result.metrics.emplace_back("p50_us", micros(load.latency.valueAt(50)));
+        result.metrics.emplace_back("p99_us", micros(load.latency.valueAt(99)));
+        result.metrics.emplace_back("p999_us", micros(load.latency.valueAt(99.9)));
+        result.metrics.emplace_back("max_us", micros(load.latency.max()));
+        result.metrics.emplace_back("unanswered", static_cast<double>(load.unanswered));
+        result.metrics.emplace_back("errors", static_cast<double>(load.errors));
+    }
+
+    /**
+     * @brief Opens and closes connections as fast as the server accepts them, timing each
+     * connect, until all have been made or the run's duration is up.
+     */
+    void connectionStorm(int port, Result &result)
+    {
+        unsigned threadCount = max(1u, options.clientThreads);
+        vector<LatencyHistogram> latencies(threadCount);
+        atomic<uint64_t> errors{0};
+        Clock::time_point start = Clock::now();
+        Clock::time_point end = start + chrono::seconds(options.duration);
+        vector<thread> workers;
+        for (unsigned t = 0; t < threadCount; ++t)
+        {
+            unsigned count = options.stormConnections / threadCount + (t < options.stormConnections % threadCount ? 1 : 0);
+            workers.emplace_back([&, t, count]
+                                 {
+                for (unsigned i = 0; i < count && Clock::now() < end; ++i)
+                {
+                    Clock::time_point begin = Clock::now();
+                    int fd = connectTo(port);
+                    if (fd < 0)
+                    {
+                        ++errors;
+                        continue;
+                    }
+                    latencies[t].record(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - begin).count()));
+                    close(fd);
+                } });
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+        LoadResult load;
+        for (const LatencyHistogram &latency : latencies)
+        {
+            load.latency.merge(latency);
+        }
+        load.errors = errors;
+        result.metrics.emplace_back("connections_per_s", static_cast<double>(load.latency.count()) / seconds);
+        addLatency(result, load);
+    }
+
+    /**
+     * @brief Holds many idle connections open, records the server's memory, then measures
+     * open-loop echo latency on a few active connections next to them.
+     *
+     * The idle connections are opened one at a time, each confirmed by a round trip, so
+     * every one of them is accepted and registered by the server before it is measured.
+     */
+    void idleConnections(const ServerProcess &server, int port, Result &result)
+    {
+        vector<int> idle;
+        uint64_t failed = 0;
+        for (unsigned i = 0; i < options.idleConnections; ++i)
+        {
+            int fd = connectTo(port);
+            if (fd >= 0 && echoOnce(fd))
+            {
+                idle.push_back(fd);
+                continue;
+            }
+            ++failed;
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+        this_thread::sleep_for(chrono::seconds(1)); // Let the server settle
+        result.metrics.emplace_back("rss_kib", static_cast<double>(server.residentKiB()));
+
+        LoadOptions load = loadOptions(port);
+        load.connections = 10;
+        load.rate = 1000;
+        LoadResult measured = LoadGenerator(load).run();
+        measured.errors += failed;
+        addLatency(result, measured);
+        for (int fd : idle)
+        {
+            close(fd);
+        }
+    }
+
+    /**
+     * @brief Small messages on 50 connections: closed loop for throughput, then a fixed
+     * rate for latency.
+     */
+    void echoPingPong(int port, Result &result)
+    {
+        LoadOptions load = loadOptions(port);
+        load.connections = 50;
+        load.messageSize = 64;
+        LoadResult closed = LoadGenerator(load).run();
+        result.metrics.emplace_back("messages_per_s", static_cast<double>(closed.messages) / closed.seconds);
+
+        load.rate = options.echoRate;
+        LoadResult open = LoadGenerator(load).run();
+        open.errors += closed.errors;
+        addLatency(result, open);
+    }
+
+    /**
+     * @brief 1 MiB messages on 4 connections, closed loop for throughput, then a fixed
+     * rate of 100 messages per second for latency.
+     */
+    void largePayloads(int port, Result &result)
+    {
+        LoadOptions load = loadOptions(port);
+        load.connections = 4;
+        load.messageSize = 1u << 20;
+        LoadResult closed = LoadGenerator(load).run();
+        result.metrics.emplace_back("mb_per_s", static_cast<double>(closed.bytes) / closed.seconds / 1e6);
+
+        load.rate = 100;
+        LoadResult open = LoadGenerator(load).run();
+        open.errors += closed.errors;
+        addLatency(result, open);
+    }
+
+    /**
+     * @brief One sender at 500 messages per second, relayed by the server to 100 clients;
+     * latency is measured for every delivery.
+     */
+    void broadcastFanOut(int port, Result &result)
+    {
+        LoadOptions load = loadOptions(port);
+        load.connections = 100;
+        load.senders = 1;
+        load.rate = 500;
+        LoadResult measured = LoadGenerator(load).run();
+        result.metrics.emplace_back("deliveries_per_s", static_cast<double>(measured.messages) / measured.seconds);
+        addLatency(result, measured);
+    }
+
+    /**
+     * @brief Opens a blocking loopback connection, giving up after one second.
+     *
+     * A server whose accept queue is full drops the SYN and the kernel retries with
+     * backoff; the timeout keeps that from stalling the whole run, and shows up as
+     * an error instead.
+     *
+     * @return The socket, or -1 on failure.
+     */
+    static int connectTo(int port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        {
+            pollfd pending{fd, POLLOUT, 0};
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (errno != EINPROGRESS || poll(&pending, 1, 1000) != 1 ||
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+            {
+                close(fd);
+                return -1;
+            }
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        return fd;
+    }
+
+    /**
+     * @brief Sends one short message and waits up to a second for its echo.
+     */
+    static bool echoOnce(int fd)
+    {
+        static const std::string ping = encodeFrame(FrameType::Text, "idle");
+        if (send(fd, ping.data(), ping.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(ping.size()))
+        {
+            return false;
+        }
+        size_t received = 0;
+        char buffer[16];
+        while (received < ping.size())
+        {
+            pollfd readable{fd, POLLIN, 0};
+            if (poll(&readable, 1, 1000) != 1)
+            {
+                return false;
+            }
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                return false;
+            }
+            received += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static void raiseFileLimit()
+    {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+};
+
+/**
+ * @brief Formats results in the layout read back by loadBaseline().
+ */
+string toJson(const vector<Result> &results, const BenchOptions &options)
+{
+    ostringstream out;
+    out << setprecision(10);
+    out << "{\n  \"duration_s\": " << options.duration << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Result &result = results[i];
+        out << (i > 0 ? "," : "") << "\n    {\"target\": " << Json::quote(result.target)
+            << ", \"scenario\": " << Json::quote(result.scenario);
+        if (!result.error.empty())
+        {
+            out << ", \"error\": " << Json::quote(result.error);
+        }
+        out << ", \"metrics\": {";
+        for (size_t m = 0; m < result.metrics.size(); ++m)
+        {
+            double value = result.metrics[m].second;
+            out << (m > 0 ? ", " : "") << Json::quote(result.metrics[m].first) << ": "
+                << (std::isfinite(value) ? value : 0);
+        }
+        out << "}}";
+    }
+    out << "\n  ]\n}\n";
+    return out.str();
+}
+
+/**
+ * @brief Reads a results file written by toJson().
+ *
+ * @return false if it cannot be read or parsed.
+ */
+bool loadBaseline(const string &path, vector<Result> &results)
+{
+    ifstream file(path);
+    if (!file)
+    {
+        return false;
+    }
+    stringstream contents;
+    contents << file.rdbuf();
+    Json document;
+    if (!Json::parse(contents.str(), document) || document.find("results") == nullptr)
+    {
+        return false;
+    }
+    for (const Json &entry : document.find("results")->items)
+    {
+        const Json *target = entry.find("target");
+        const Json *scenario = entry.find("scenario");
+        const Json *metrics = entry.find("metrics");
+        if (target == nullptr || scenario == nullptr || metrics == nullptr)
+        {
+            return false;
+        }
+        const Json *error = entry.find("error");
+        Result result{target->text, scenario->text, {}, error != nullptr ? error->text : string()};
+        for (const auto &metric : metrics->members)
+        {
+            result.metrics.emplace_back(metric.first, metric.second.number);
+        }
+        results.push_back(move(result));
+    }
+    return true;
+}
+
+/**
+ * @brief Describes every run that could not be done or counted errors. Their numbers
+ * mostly measure connect timeouts and lost connections, so they are neither stored nor
+ * compared.
+ */
+vector<string> failedRuns(const vector<Result> &results)
+{
+    vector<string> failures;
+    for (const Result &result : results)
+    {
+        string name = result.target + " " + result.scenario;
+        if (!result.error.empty())
+        {
+            failures.push_back(name + ": " + result.error);
+        }
+        for (const auto &metric : result.metrics)
+        {
+            if (metric.first == "errors" && metric.second > 0)
+            {
+                failures.push_back(name + ": " + to_string(static_cast<uint64_t>(metric.second)) + " errors");
+            }
+        }
+    }
+    return failures;
+}
+
+/**
+ * @brief Prints the failed runs.
+ *
+ * @return true if there were none.
+ */
+bool reportFailedRuns(const vector<Result> &results, const string &what)
+{
+    vector<string> failures = failedRuns(results);
+    for (const string &failure : failures)
+    {
+        cerr << "  " << failure << endl;
+    }
+    if (!failures.empty())
+    {
+        cerr << what << endl;
+    }
+    return failures.empty();
+}
+
+/**
+ * @brief Whether a larger value of the metric is better: rates are, latencies, memory
+ * and error counts are not.
+ */
+bool higherIsBetter(const string &metric)
+{
+    const string suffix = "_per_s";
+    return metric.size() >= suffix.size() && metric.compare(metric.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * @brief Prints every metric next to its baseline value.
+ *
+ * @return Number of metrics that got worse by more than the tolerance.
+ */
+int compareWithBaseline(const vector<Result> &results, const vector<Result> &baseline, double tolerance)
+{
+    int regressions = 0;
+    cout << left << setw(11) << "target" << setw(11) << "scenario" << setw(19) << "metric" << right
+         << setw(14) << "baseline" << setw(14) << "current" << setw(10) << "change" << endl;
+    for (const Result &result : results)
+    {
+        const Result *base = nullptr;
+        for (const Result &candidate : baseline)
+        {
+            if (candidate.target == result.target && candidate.scenario == result.scenario)
+            {
+                base = &candidate;
+            }
+        }
+        for (const auto &metric : result.metrics)
+        {
+            double before = NAN;
+            for (const auto &old : base != nullptr ? base->metrics : vector<pair<string, double>>())
+            {
+                if (old.first == metric.first)
+                {
+                    before = old.second;
+                }
+            }
+            double now = metric.second;
+            cout << left << setw(11) << result.target << setw(11) << result.scenario << setw(19) << metric.first
+                 << right << fixed << setprecision(1) << setw(14) << before << setw(14) << now;
+            if (std::isnan(before))
+            {
+                cout << setw(10) << "new" << endl;
+                continue;
+            }
+
+            double change = before != 0 ? (now - before) / before * 100 : (now != 0 ? 100 : 0);
+            bool worse = higherIsBetter(metric.first) ? change < -tolerance : change > tolerance;
+            if (before == 0 && !higherIsBetter(metric.first))
+            {
+                worse = now > 0; // Errors and unanswered messages that appear at all
+            }
+            if (metric.first == "max_us")
+            {
+                worse = false; // A single sample; shown, but too noisy to fail a run on
+            }
+            cout << setw(9) << showpos << change << noshowpos << "%" << (worse ? "  REGRESSION" : "") << endl;
+            regressions += worse ? 1 : 0;
+        }
+    }
+    return regressions;
+}
+
+/**
+ * @brief Prints the supported command line options.
+ */
+void printUsage(const char *program)
+{
+    cerr << "Usage: " << program << " [--single PATH] [--multi PATH] [--targets single,threaded,epoll,reuseport,uring]"
+         << " [--scenarios storm,idle,echo,large,broadcast] [--port N] [--threads N] [--client-threads N]"
+         << " [--duration SECONDS] [--storm-connections N] [--idle-connections N] [--echo-rate N]"
+         << " [--output FILE] [--baseline FILE] [--tolerance PERCENT]" << endl;
+}
+
+/**
+ * @brief Converts a non-negative numeric option value, exiting with a usage message on bad input.
+ */
+int parseNumber(const string &value, const char *program)
+{
+    try
+    {
+        int number = stoi(value);
+        if (number >= 0)
+        {
+            return number;
+        }
+    }
+    catch (const exception &)
+    {
+    }
+    printUsage(program);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Splits a comma separated list.
+ */
+vector<string> parseList(const string &value)
+{
+    vector<string> items;
+    stringstream stream(value);
+    string item;
+    while (getline(stream, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+/**
+ * @brief Parses command line options, exiting with a usage message on bad input.
+ */
+BenchOptions parseOptions(int argc, char *argv[])
+{
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        string value = argv[++i];
+
+        if (arg == "--single")
+        {
+            options.singleServer = value;
+        }
+        else if (arg == "--multi")
+        {
+            options.multiServer = value;
+        }
+        else if (arg == "--targets")
+        {
+            options.targets = parseList(value);
+        }
+        else if (arg == "--scenarios")
+        {
+            options.scenarios = parseList(value);
+        }
+        else if (arg == "--port")
+        {
+            options.basePort = parseNumber(value, argv[0]);
+        }
+        else if (arg == "--threads")
+        {
+            options.loopThreads = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--client-threads")
+        {
+            options.clientThreads = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--duration")
+        {
+            options.duration = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--storm-connections")
+        {
+            options.stormConnections = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--idle-connections")
+        {
+            options.idleConnections = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--echo-rate")
+        {
+            options.echoRate = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--output")
+        {
+            options.output = value;
+        }
+        else if (arg == "--baseline")
+        {
+            options.baseline = value;
+        }
+        else if (arg == "--tolerance")
+        {
+            options.tolerance = parseNumber(value, argv[0]);
+        }
+        else
+        {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.duration == 0 || options.clientThreads == 0)
+    {
+        printUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    return options;
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    BenchOptions options = parseOptions(argc, argv);
+    vector<Result> results = BenchmarkSuite(options).run();
+
+    string json = toJson(results, options);
+    bool valid = reportFailedRuns(results, "Some runs failed; their results are not stored or compared.");
+    if (options.output.empty())
+    {
+        cout << json;
+    }
+    else if (valid)
+    {
+        ofstream(options.output) << json;
+        cerr << "Results written to " << options.output << "." << endl;
+    }
+    if (!valid)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (!options.baseline.empty())
+    {
+        vector<Result> baseline;
+        if (!loadBaseline(options.baseline, baseline))
+        {
+            cerr << "Failed to read baseline " << options.baseline << "." << endl;
+            return EXIT_FAILURE;
+        }
+        if (!reportFailedRuns(baseline, "The baseline " + options.baseline + " holds failed runs; record it again."))
+        {
+            return EXIT_FAILURE;
+        }
+        int regressions = compareWithBaseline(results, baseline, options.tolerance);
+        cout << regressions << " regression(s) beyond " << options.tolerance << "%." << endl;
+        return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    return EXIT_SUCCESS;
+}
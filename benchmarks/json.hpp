@@ -0,0 +1,257 @@
+// json.hpp
+// Just enough JSON for the benchmark suite's result files.
+//
+// Results are written by hand in a fixed layout, and read back with a small
+// recursive-descent parser that understands objects, arrays, strings, numbers,
+// booleans and null, which is all a stored baseline needs.
+
+#pragma once
+
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief A parsed JSON value.
+ */
+struct Json
+{
+    enum class Kind
+    {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object,
+    };
+
+    Kind kind = Kind::Null;
+    double number = 0;                            // Number, or 1/0 for Bool
+    std::string text;                             // String
+    std::vector<Json> items;                      // Array
+    std::vector<std::pair<std::string, Json>> members; // Object, in file order
+
+    /**
+     * @brief The member with the given key, or null if this is not an object or has none.
+     */
+    const Json *find(std::string_view key) const
+    {
+        for (const auto &member : members)
+        {
+            if (member.first == key)
+            {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Parses a complete document.
+     *
+     * @return false on a syntax error.
+     */
+    static bool parse(std::string_view input, Json &out)
+    {
+        size_t pos = 0;
+        return parseValue(input, pos, out) && (skipSpace(input, pos), pos == input.size());
+    }
+
+    /**
+     * @brief Writes a string literal with the escapes JSON requires.
+     */
+    static std::string quote(std::string_view value)
+    {
+        std::string out = "\"";
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                static const char hex[] = "0123456789abcdef";
+                out += "\\u00";
+                out += hex[(c >> 4) & 0xf];
+                out += hex[c & 0xf];
+            }
+            else
+            {
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+
+private:
+    static void skipSpace(std::string_view input, size_t &pos)
+    {
+        while (pos < input.size() && std::isspace(static_cast<unsigned char>(input[pos])))
+        {
+            ++pos;
+        }
+    }
+
+    static bool parseValue(std::string_view input, size_t &pos, Json &out)
+    {
+        skipSpace(input, pos);
+        if (pos >= input.size())
+        {
+            return false;
+        }
+        char c = input[pos];
+        if (c == '{')
+        {
+            return parseObject(input, pos, out);
+        }
+        if (c == '[')
+        {
+            return parseArray(input, pos, out);
+        }
+        if (c == '"')
+        {
+            out.kind = Kind::String;
+            return parseString(input, pos, out.text);
+        }
+        for (std::string_view word : {"true", "false", "null"})
+        {
+            if (input.substr(pos, word.size()) == word)
+            {
+                pos += word.size();
+                out.kind = word == "null" ? Kind::Null : Kind::Bool;
+                out.number = word == "true" ? 1 : 0;
+                return true;
+            }
+        }
+        std::string number(input.substr(pos, 64));
+        char *end = nullptr;
+        out.number = std::strtod(number.c_str(), &end);
+        if (end == number.c_str())
+        {
+            return false;
+        }
+        out.kind = Kind::Number;
+        pos += static_cast<size_t>(end - number.c_str());
+        return true;
+    }
+
+    static bool parseString(std::string_view input, size_t &pos, std::string &out)
+    {
+        ++pos; // Opening quote
+        while (pos < input.size() && input[pos] != '"')
+        {
+            char c = input[pos++];
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos >= input.size())
+            {
+                return false;
+            }
+            char escape = input[pos++];
+            if (escape == 'u')
+            {
+                if (pos + 4 > input.size())
+                {
+                    return false;
+                }
+                out += static_cast<char>(std::strtol(std::string(input.substr(pos, 4)).c_str(), nullptr, 16));
+                pos += 4; // Only the control characters quote() writes are expected
+            }
+            else
+            {
+                out += escape == 'n' ? '\n' : escape == 't' ? '\t' : escape;
+            }
+        }
+        if (pos >= input.size())
+        {
+            return false;
+        }
+        ++pos; // Closing quote
+        return true;
+    }
+
+    static bool parseArray(std::string_view input, size_t &pos, Json &out)
+    {
+        out.kind = Kind::Array;
+        ++pos;
+        skipSpace(input, pos);
+        if (pos < input.size() && input[pos] == ']')
+        {
+            ++pos;
+            return true;
+        }
+        while (true)
+        {
+            out.items.emplace_back();
+            if (!parseValue(input, pos, out.items.back()))
+            {
+                return false;
+            }
+            skipSpace(input, pos);
+            if (pos < input.size() && input[pos] == ',')
+            {
+                ++pos;
+                continue;
+            }
+            if (pos < input.size() && input[pos] == ']')
+            {
+                ++pos;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    static bool parseObject(std::string_view input, size_t &pos, Json &out)
+    {
+        out.kind = Kind::Object;
+        ++pos;
+        skipSpace(input, pos);
+        if (pos < input.size() && input[pos] == '}')
+        {
+            ++pos;
+            return true;
+        }
+        while (true)
+        {
+            skipSpace(input, pos);
+            std::string key;
+            if (pos >= input.size() || input[pos] != '"' || !parseString(input, pos, key))
+            {
+                return false;
+            }
+            skipSpace(input, pos);
+            if (pos >= input.size() || input[pos] != ':')
+            {
+                return false;
+            }
+            ++pos;
+            out.members.emplace_back(std::move(key), Json());
+            if (!parseValue(input, pos, out.members.back().second))
+            {
+                return false;
+            }
+            skipSpace(input, pos);
+            if (pos < input.size() && input[pos] == ',')
+            {
+                ++pos;
+                continue;
+            }
+            if (pos < input.size() && input[pos] == '}')
+            {
+                ++pos;
+                return true;
+            }
+            return false;
+        }
+    }
+};
@@ -0,0 +1,211 @@
+// mailbox_bench.cpp
+// Micro-benchmark of the event loops' cross-thread handoff.
+//
+// Producers post numbered items to one consumer that sleeps on an eventfd, the
+// way the acceptor and the other loops post to an event loop. Two handoffs are
+// compared: the lock-free Mailbox the loops use, and the mutex-protected deque
+// with one eventfd write per post that they used before. The mailbox runs twice:
+// sized like the loops' mailboxes, and overflowed, with a ring of 8 cells and
+// room for 64 items behind it. There, most posts go through the overflow list
+// or find the mailbox full, and the producer retries them, as the acceptor and
+// the workers do. Every run also checks that nothing was lost and that each
+// producer's items arrived in order.
+
+#include <sys/eventfd.h> // Consumer wakeups
+#include <unistd.h>      // read, write, close
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../multi-threaded/server/mpsc_queue.hpp" // The handoff under test
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+/**
+ * @brief The previous handoff: a deque under a mutex, one eventfd write per post.
+ */
+class LockedQueue
+{
+private:
+    mutex queueMutex;
+    deque<uint64_t> items;
+    deque<uint64_t> taken; // Consumer's swap partner
+
+public:
+    LockedQueue(size_t, size_t) {}
+
+    PostResult post(uint64_t &item)
+    {
+        lock_guard<mutex> lock(queueMutex);
+        items.push_back(item);
+        return PostResult::WakeUp;
+    }
+
+    template <typename Handler>
+    void drain(Handler &&handle)
+    {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            taken.swap(items);
+        }
+        for (uint64_t &item : taken)
+        {
+            handle(item);
+        }
+        taken.clear();
+    }
+};
+
+struct RunResult
+{
+    double seconds = 0;
+    uint64_t wakeups = 0; // eventfd writes made by the producers
+    uint64_t full = 0;    // Posts turned down by a full mailbox, then retried
+    bool valid = true;
+};
+
+/**
+ * @brief Has each producer post its items as fast as it can while one consumer drains.
+ *
+ * Items carry the producer index in the top 16 bits and a sequence number below.
+ */
+template <typename Queue>
+RunResult runHandoff(unsigned producers, uint64_t perProducer, size_t capacity, size_t overflowLimit)
+{
+    Queue queue(capacity, overflowLimit);
+    int wakeFd = eventfd(0, EFD_CLOEXEC);
+    atomic<uint64_t> wakeups{0};
+    atomic<uint64_t> full{0};
+    RunResult result;
+
+    thread consumer([&]
+                    {
+        vector<uint64_t> expected(producers, 0);
+        uint64_t remaining = producers * perProducer;
+        while (remaining > 0)
+        {
+            uint64_t count;
+            if (read(wakeFd, &count, sizeof(count)) < 0)
+            {
+                result.valid = false;
+                return;
+            }
+            queue.drain([&](uint64_t item)
+                        {
+                unsigned producer = static_cast<unsigned>(item >> 48);
+                if (producer >= producers || (item & ((1ull << 48) - 1)) != expected[producer]++)
+                {
+                    result.valid = false;
+                }
+                --remaining; });
+        } });
+
+    Clock::time_point start = Clock::now();
+    vector<thread> workers;
+    for (unsigned p = 0; p < producers; ++p)
+    {
+        workers.emplace_back([&, p]
+                             {
+            for (uint64_t i = 0; i < perProducer; ++i)
+            {
+                uint64_t item = (static_cast<uint64_t>(p) << 48) | i;
+                PostResult posted;
+                while ((posted = queue.post(item)) == PostResult::Full)
+                {
+                    full.fetch_add(1, memory_order_relaxed);
+                    this_thread::yield(); // The consumer is already due to drain
+                }
+                if (posted == PostResult::WakeUp)
+                {
+                    uint64_t one = 1;
+                    ssize_t ignored = write(wakeFd, &one, sizeof(one));
+                    (void)ignored;
+                    wakeups.fetch_add(1, memory_order_relaxed);
+                }
+            } });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    consumer.join();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.wakeups = wakeups;
+    result.full = full;
+    close(wakeFd);
+    return result;
+}
+
+void report(const char *name, unsigned producers, uint64_t perProducer, const RunResult &result)
+{
+    double items = static_cast<double>(producers * perProducer);
+    cout << left << setw(14) << name << right << setw(10) << producers << fixed << setprecision(1)
+         << setw(14) << items / result.seconds / 1e6 << setw(12) << result.seconds * 1e9 / items
+         << setw(14) << result.wakeups << setw(12) << result.full << (result.valid ? "" : "  LOST OR REORDERED") << endl;
+}
+
+/**
+ * @brief Prints the supported command line options.
+ */
+void printUsage(const char *program)
+{
+    cerr << "Usage: " << program << " [--items N] [--capacity N] [--max-producers N]" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t perProducer = 1000000;
+    size_t capacity = 1024;
+    unsigned maxProducers = 4;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        unsigned long value = strtoul(argv[++i], nullptr, 10);
+        if (arg == "--items" && value > 0)
+        {
+            perProducer = value;
+        }
+        else if (arg == "--capacity" && value > 0)
+        {
+            capacity = value;
+        }
+        else if (arg == "--max-producers" && value > 0)
+        {
+            maxProducers = static_cast<unsigned>(value);
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    cout << left << setw(14) << "queue" << right << setw(10) << "producers" << setw(14) << "M items/s"
+         << setw(12) << "ns/item" << setw(14) << "wakeups" << setw(12) << "full" << endl;
+    bool valid = true;
+    for (unsigned producers = 1; producers <= maxProducers; producers *= 2)
+    {
+        RunResult locked = runHandoff<LockedQueue>(producers, perProducer, capacity, 0);
+        report("mutex+deque", producers, perProducer, locked);
+        RunResult mailbox = runHandoff<Mailbox<uint64_t>>(producers, perProducer, capacity, capacity * 15);
+        report("mailbox", producers, perProducer, mailbox);
+        RunResult overflowed = runHandoff<Mailbox<uint64_t>>(producers, perProducer, 8, 64);
+        report("overflowed", producers, perProducer, overflowed);
+        valid = valid && locked.valid && mailbox.valid && overflowed.valid;
+    }
+    return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
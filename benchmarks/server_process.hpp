@@ -0,0 +1,137 @@
+// server_process.hpp
+// Runs a server binary as a child process for one benchmark scenario.
+//
+// The server's output goes to /dev/null, since both servers log every message.
+// Its standard input is a pipe that stays open but is never written: the
+// interactive servers block reading a reply from the console instead of seeing
+// end-of-file and sending empty replies in a loop.
+
+#pragma once
+
+#include <sys/socket.h> // Connecting to check the server is up
+#include <sys/wait.h>   // waitpid
+#include <netinet/in.h> // Internet address structures
+#include <arpa/inet.h>  // inet_pton
+#include <fcntl.h>      // open
+#include <signal.h>     // kill
+#include <unistd.h>     // fork, execv, pipe2
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ServerProcess
+{
+private:
+    pid_t pid = -1;
+    int stdinPipe = -1; // Write end of the server's standard input
+
+public:
+    ServerProcess() = default;
+    ServerProcess(const ServerProcess &) = delete;
+    ServerProcess &operator=(const ServerProcess &) = delete;
+
+    ~ServerProcess() { stop(); }
+
+    /**
+     * @brief Starts the server and waits until it accepts connections on the port.
+     *
+     * @param command Binary path followed by its arguments.
+     * @return false if it could not be started or exited before it was ready.
+     */
+    bool start(const std::vector<std::string> &command, int port)
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+        {
+            return false;
+        }
+        pid = fork();
+        if (pid == 0)
+        {
+            int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            dup2(fds[0], STDIN_FILENO);
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+            std::vector<char *> argv;
+            for (const std::string &arg : command)
+            {
+                argv.push_back(const_cast<char *>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+        close(fds[0]);
+        stdinPipe = fds[1];
+        if (pid < 0)
+        {
+            return false;
+        }
+
+        for (int attempt = 0; attempt < 100; ++attempt)
+        {
+            int status;
+            if (waitpid(pid, &status, WNOHANG) == pid)
+            {
+                pid = -1; // Exited, e.g. the port is still in use
+                return false;
+            }
+            if (accepting(port))
+            {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return false;
+    }
+
+    /**
+     * @brief Kills the server and reaps it.
+     */
+    void stop()
+    {
+        if (pid > 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+            pid = -1;
+        }
+        if (stdinPipe >= 0)
+        {
+            close(stdinPipe);
+            stdinPipe = -1;
+        }
+    }
+
+    /**
+     * @brief Resident memory of the server in KiB, or 0 if unknown.
+     */
+    uint64_t residentKiB() const
+    {
+        std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 6, "VmRSS:") == 0)
+            {
+                return std::stoull(line.substr(6));
+            }
+        }
+        return 0;
+    }
+
+private:
+    static bool accepting(int port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        bool connected = connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+        close(fd);
+        return connected;
+    }
+};
@@ -0,0 +1,50 @@
+// backoff.hpp
+// Delays between reconnect attempts.
+//
+// When a server restarts, every client notices within moments of the others. If
+// they all retried after the same fixed delay, they would reconnect in one storm,
+// and plain exponential backoff only moves the storms further apart. Full jitter
+// draws each delay uniformly between zero and the exponential bound instead, so
+// the attempts spread evenly over the window while the window keeps growing.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+class Backoff
+{
+private:
+    std::chrono::milliseconds base;    // Bound of the first delay
+    std::chrono::milliseconds ceiling; // Largest bound
+    unsigned attempt = 0;              // Delays drawn since the last reset
+    std::mt19937_64 random{std::random_device{}()};
+
+public:
+    /**
+     * @param base Bound of the first delay; it doubles with every attempt.
+     * @param ceiling Largest bound, however many attempts fail.
+     */
+    Backoff(std::chrono::milliseconds base, std::chrono::milliseconds ceiling) : base(base), ceiling(ceiling) {}
+
+    /**
+     * @brief The delay before the next attempt: uniform between zero and
+     * min(ceiling, base * 2^attempt).
+     */
+    std::chrono::milliseconds next()
+    {
+        uint64_t bound = static_cast<uint64_t>(base.count()) << std::min(attempt, 32u);
+        bound = std::min(bound, static_cast<uint64_t>(ceiling.count()));
+        ++attempt;
+        return std::chrono::milliseconds(std::uniform_int_distribution<uint64_t>(0, bound)(random));
+    }
+
+    /**
+     * @brief Starts over after a successful attempt.
+     */
+    void reset() { attempt = 0; }
+
+    unsigned attempts() const { return attempt; }
+};
@@ -4,12 +4,23 @@
 #include <iostream>
 #include <cstring>
 #include <atomic>
+#include <mutex>        // Serializing writes of the send and receive threads
+#include <condition_variable> // Waiting for pool calls to complete and for reconnect delays
+#include <map>          // Messages held while a session resumes
+#include <vector>       // Subscriptions renewed after a reconnect
+#include <iomanip>      // Formatting the benchmark report
+#include <string>       // Command line option values
 #include <sys/socket.h> // Socket functions
 #include <netinet/in.h> // Internet address structures
 #include <arpa/inet.h>  // IP address conversion functions
 #include <unistd.h>     // POSIX API for closing sockets
 #include <thread>       // Multi-threading support
 
+#include "../common/framing.hpp" // Length-prefixed message framing
+#include "load_generator.hpp"    // Headless benchmark mode
+#include "connection_pool.hpp"   // Pooled, pipelined calls
+#include "backoff.hpp"           // Delays between reconnect attempts
+
 using namespace std;
 
 class SimpleClient
@@ -20,6 +31,22 @@ private:
     string serverIp;        // Server IP address
     int port;               // Server port number
     atomic<bool> running;   // Atomic flag to control the communication loop
+    mutex sendMutex;        // Keeps pongs from the receive thread out of the middle of a message, and guards the socket swap
+    condition_variable quit; // Cuts a reconnect delay short when the user quits
+    bool connected = false;  // The socket is usable (guarded by sendMutex)
+    vector<string> subscriptions; // Patterns subscribed to, renewed after a reconnect (guarded by sendMutex)
+    bool reconnect;          // Reconnect when the server goes away instead of exiting
+    Backoff backoff;         // Delays between reconnect attempts
+    uint64_t backlog;        // Recent messages to ask for on connecting
+
+    // Session state, kept by the receive thread across reconnects
+    uint64_t stream = 0;          // The server's stream ID; 0 until the server tells it
+    uint64_t lastSequence = 0;    // Highest sequence number seen on the stream
+    uint64_t duplicatesThrough = 0; // Numbered messages up to this one were shown already
+    uint64_t pendingSequence = 0; // Number of the message frame that follows; 0 = not numbered
+    bool resuming = false;        // A Resume is outstanding; numbered messages are held
+    uint64_t resumedAfter = 0;    // lastSequence when the Resume was sent
+    map<uint64_t, string> held;   // Numbered messages received while resuming, by number
 
 public:
     /**
@@ -27,9 +54,12 @@ public:
      *
      * @param serverIp IP address of the server to connect to.
      * @param port Port number of the server.
+     * @param reconnect Reconnect with backoff when the connection is lost.
+     * @param backoff Delays between reconnect attempts.
+     * @param backlog Recent messages the server should replay on connecting.
      */
-    SimpleClient(const string &serverIp, int port)
-        : serverIp(serverIp), port(port), running(true), clientSocket(-1) {}
+    SimpleClient(const string &serverIp, int port, bool reconnect, const Backoff &backoff, uint64_t backlog = 0)
+        : clientSocket(-1), serverIp(serverIp), port(port), running(true), reconnect(reconnect), backoff(backoff), backlog(backlog) {}
 
     /**
      * @brief Establishes a connection to the server.
@@ -38,29 +68,76 @@ public:
      */
     bool connectToServer()
     {
-        // Create a TCP socket
-        clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+        clientSocket = openSocket();
         if (clientSocket < 0)
         {
-            cerr << "Couldn't create socket." << endl;
             return false;
         }
+        connected = true;
+        cout << "Connected to server." << endl;
 
-        // Configure server address structure
-        serverAddr.sin_family = AF_INET;                            // IPv4
-        serverAddr.sin_port = htons(port);                          // Convert port to network byte order
-        inet_pton(AF_INET, serverIp.c_str(), &serverAddr.sin_addr); // Convert IP from text to binary
+        // Learn the server's stream ID, so that a reconnect can resume the stream, and
+        // get the backlog, held like a replay so that live copies are not shown twice
+        resuming = backlog > 0;
+        string hello;
+        appendVarintFrame(hello, FrameType::Resume, {0, backlog});
+        return sendFrame(hello);
+    }
 
-        // Attempt to connect to the server
-        if (connect(clientSocket, (sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+    /**
+     * @brief Encodes a line typed by the user: a topic command becomes a Subscribe,
+     * Unsubscribe or Publish frame, anything else a Text frame.
+     */
+    static string encodeMessage(const string &line)
+    {
+        FrameType type;
+        string_view topic, message;
+        if (!parseTopicCommand(line, type, topic, message))
         {
-            cerr << "Couldn't connect to server." << endl;
-            close(clientSocket);
-            return false;
+            return encodeFrame(FrameType::Text, line);
         }
+        if (type != FrameType::Publish)
+        {
+            return encodeFrame(type, topic);
+        }
+        string frame;
+        appendPublishFrame(frame, topic, message);
+        return frame;
+    }
 
-        cout << "Connected to server." << endl;
-        return true;
+    /**
+     * @brief Writes one encoded frame; safe to call from both threads.
+     *
+     * @return false if the frame could not be sent, as while reconnecting.
+     */
+    bool sendFrame(const string &frame)
+    {
+        lock_guard<mutex> lock(sendMutex);
+        return connected && send(clientSocket, frame.data(), frame.size(), MSG_NOSIGNAL) >= 0;
+    }
+
+    /**
+     * @brief Remembers subscriptions made from the console, so that a reconnect can
+     * renew them.
+     */
+    void rememberSubscription(const string &line)
+    {
+        FrameType type;
+        string_view topic, message;
+        if (!parseTopicCommand(line, type, topic, message) || type == FrameType::Publish)
+        {
+            return;
+        }
+        lock_guard<mutex> lock(sendMutex);
+        auto it = find(subscriptions.begin(), subscriptions.end(), topic);
+        if (type == FrameType::Subscribe && it == subscriptions.end())
+        {
+            subscriptions.emplace_back(topic);
+        }
+        else if (type == FrameType::Unsubscribe && it != subscriptions.end())
+        {
+            subscriptions.erase(it);
+        }
     }
 
     /**
@@ -78,12 +155,21 @@ public:
             if (message == "quit()" || message == "exit()")
             {
                 cout << "Closing connection." << endl;
+                lock_guard<mutex> lock(sendMutex);
                 running = false;
+                quit.notify_all(); // Stop waiting to reconnect
             }
+            rememberSubscription(message);
 
-            // Send the message to the server
-            if (send(clientSocket, message.c_str(), message.size(), 0) < 0)
+            // Send the message, or a close frame for the exit commands, to the server
+            string frame = running ? encodeMessage(message) : encodeFrame(FrameType::Close);
+            if (!sendFrame(frame) && running)
             {
+                if (reconnect)
+                {
+                    cerr << "Not connected; message not sent." << endl;
+                    continue;
+                }
                 cerr << "Failed to send message." << endl;
                 running = false;
                 break;
@@ -103,32 +189,236 @@ public:
     void receiveMessages()
     {
         char buffer[1024];
+        FrameParser parser; // Reassembles frames split across reads
         while (running)
         {
-            memset(buffer, 0, sizeof(buffer));                              // Clear the buffer
-            int bytesRead = read(clientSocket, buffer, sizeof(buffer) - 1); // Receive data
+            int bytesRead = read(clientSocket, buffer, sizeof(buffer)); // Receive data
+            bool lost = false; // The connection is gone
 
             if (bytesRead > 0)
             {
-                buffer[bytesRead] = '\0'; // Null-terminate the received string
-                cout << buffer << endl;   // Display server message
-                fflush(stdout);           // Ensure output is displayed immediately
+                // A read may hold part of a frame or several frames
+                bool valid = parser.feed(string_view(buffer, bytesRead), [&](const Frame &frame)
+                                         {
+                    if (lost)
+                    {
+                        return;
+                    }
+                    if (frame.type == FrameType::Close)
+                    {
+                        cout << "Server closed the connection." << endl;
+                        lost = true;
+                    }
+                    else if (frame.type == FrameType::Text && running)
+                    {
+                        show(string(frame.payload)); // Display server message
+                    }
+                    else if (frame.type == FrameType::Publish && running)
+                    {
+                        string_view topic, message;
+                        if (splitPublish(frame.payload, topic, message))
+                        {
+                            show("[" + string(topic) + "] " + string(message)); // Display topic message
+                        }
+                    }
+                    else if (frame.type == FrameType::Ping && running)
+                    {
+                        sendFrame(encodeFrame(FrameType::Pong, frame.payload)); // Heartbeat: show we are alive
+                    }
+                    else if (frame.type == FrameType::Sequence)
+                    {
+                        uint64_t sequence[1];
+                        pendingSequence = splitVarints(frame.payload, sequence) ? sequence[0] : 0;
+                    }
+                    else if (frame.type == FrameType::Resumed)
+                    {
+                        uint64_t resumed[3]; // Stream ID, last sequence number, messages lost
+                        if (splitVarints(frame.payload, resumed))
+                        {
+                            finishResume(resumed[0], resumed[1], resumed[2]);
+                        }
+                    } });
+                fflush(stdout); // Ensure output is displayed immediately
+
+                if (!valid)
+                {
+                    cerr << "Malformed frame from server." << endl;
+                    running = false; // Stop communication loop
+                }
             }
             else if (bytesRead == 0)
             {
                 cout << "Server disconnected." << endl;
-                running = false; // Stop communication loop
-                break;
+                lost = true;
             }
             else
             {
                 cerr << "Error receiving data." << endl;
+                lost = true;
+            }
+
+            if (lost && (!running || !reconnect))
+            {
                 running = false; // Stop communication loop
-                break;
             }
+            else if (lost)
+            {
+                parser = FrameParser(); // A frame cut off by the disconnect is not continued
+                if (!reconnectToServer())
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Displays a message from the server. A numbered message is skipped if it was
+     * shown already, and held while a Resume is outstanding. Receive thread only.
+     */
+    void show(string line)
+    {
+        uint64_t sequence = pendingSequence;
+        pendingSequence = 0;
+        if (sequence == 0)
+        {
+            cout << line << endl;
+            return;
+        }
+        if (resuming)
+        {
+            held.emplace(sequence, move(line)); // Live and replayed copies collapse here
+            return;
+        }
+        if (sequence <= duplicatesThrough)
+        {
+            return; // Replayed already
+        }
+        lastSequence = max(lastSequence, sequence);
+        cout << line << endl;
+    }
+
+    /**
+     * @brief Handles the server's answer to a Resume: shows the held messages in order,
+     * once each, and reports any the server could no longer replay. Receive thread only.
+     *
+     * @param serverStream The server's stream ID; 0 if it cannot resume sessions.
+     * @param through The last sequence number when the server replied.
+     * @param missed Messages the server no longer held.
+     */
+    void finishResume(uint64_t serverStream, uint64_t through, uint64_t missed)
+    {
+        bool wasResuming = resuming;
+        resuming = false;
+        if (wasResuming && stream != 0 && serverStream != stream)
+        {
+            cout << "The server restarted; messages sent while disconnected may be lost." << endl;
+            resumedAfter = 0;
+            lastSequence = 0;
+        }
+        stream = serverStream;
+        for (auto &entry : held)
+        {
+            if (entry.first > resumedAfter)
+            {
+                cout << entry.second << endl;
+            }
+            lastSequence = max(lastSequence, entry.first);
+        }
+        held.clear();
+        lastSequence = max(lastSequence, through);
+        if (!wasResuming)
+        {
+            return; // A new session: numbered messages still on their way are new too
+        }
+        duplicatesThrough = lastSequence;
+        if (missed > 0)
+        {
+            cout << missed << " message(s) were missed while disconnected." << endl;
         }
     }
 
+    /**
+     * @brief Connects again after the connection was lost, waiting a growing, jittered
+     * delay before each attempt, then renews the subscriptions and resumes the stream.
+     *
+     * @return false if the user quit meanwhile.
+     */
+    bool reconnectToServer()
+    {
+        {
+            lock_guard<mutex> lock(sendMutex);
+            connected = false;
+        }
+        while (running)
+        {
+            chrono::milliseconds delay = backoff.next();
+            cout << "Reconnecting in " << delay.count() << " ms." << endl;
+            {
+                unique_lock<mutex> lock(sendMutex);
+                if (quit.wait_for(lock, delay, [this]
+                                  { return !running; }))
+                {
+                    return false;
+                }
+            }
+            int fd = openSocket();
+            if (fd < 0)
+            {
+                continue;
+            }
+
+            resuming = stream != 0;
+            resumedAfter = lastSequence;
+            pendingSequence = 0;
+            held.clear();
+            string hello; // Subscriptions first, so that the replay includes their topics
+            lock_guard<mutex> lock(sendMutex);
+            for (const string &pattern : subscriptions)
+            {
+                appendFrame(hello, FrameType::Subscribe, pattern);
+            }
+            appendVarintFrame(hello, FrameType::Resume, {stream, lastSequence});
+            close(clientSocket);
+            clientSocket = fd;
+            connected = send(clientSocket, hello.data(), hello.size(), MSG_NOSIGNAL) >= 0;
+            backoff.reset();
+            cout << "Reconnected to server." << endl;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Opens a connection to the server.
+     *
+     * @return The socket, or -1 on failure.
+     */
+    int openSocket()
+    {
+        // Create a TCP socket
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            cerr << "Couldn't create socket." << endl;
+            return -1;
+        }
+
+        // Configure server address structure
+        serverAddr.sin_family = AF_INET;                            // IPv4
+        serverAddr.sin_port = htons(port);                          // Convert port to network byte order
+        inet_pton(AF_INET, serverIp.c_str(), &serverAddr.sin_addr); // Convert IP from text to binary
+
+        // Attempt to connect to the server
+        if (connect(fd, (sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+        {
+            cerr << "Couldn't connect to server." << endl;
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
     /**
      * @brief Initiates communication by starting send and receive threads.
      */
@@ -165,10 +455,292 @@ public:
     }
 };
 
-int main()
+/**
+ * @brief How the client runs.
+ */
+enum class ClientMode
+{
+    Interactive, // Send lines typed on the console, print what the server sends
+    Bench,       // Generate load and report round-trip latency and throughput
+    Pool,        // Make concurrent calls through a ConnectionPool and report the same
+};
+
+/**
+ * @brief Prints the supported command line options.
+ */
+void printUsage(const char *program)
+{
+    cerr << "Usage: " << program << " [--host IP] [--port N] [--mode interactive|bench|pool]"
+         << " [--connections N] [--threads N] [--size BYTES] [--rate MESSAGES_PER_SECOND]"
+         << " [--pipeline N] [--senders N] [--warmup SECONDS] [--duration SECONDS]"
+         << " [--reconnect on|off] [--backoff-base MS] [--backoff-max MS] [--backlog N]" << endl;
+}
+
+/**
+ * @brief Converts a non-negative numeric option value, exiting with a usage message on bad input.
+ */
+int parseNumber(const string &value, const char *program)
 {
+    try
+    {
+        int number = stoi(value);
+        if (number >= 0)
+        {
+            return number;
+        }
+    }
+    catch (const exception &)
+    {
+    }
+    printUsage(program);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Runs the benchmark and prints its results.
+ *
+ * @return Process exit status: failure if no echo was measured.
+ */
+int runBenchmark(const LoadOptions &options)
+{
+    cout << "Benchmarking " << options.host << ":" << options.port << " with " << options.connections
+         << " connection(s) on " << options.threads << " thread(s), " << max(options.messageSize, LoadGenerator::stampSize)
+         << " byte messages, ";
+    if (options.rate > 0)
+    {
+        cout << options.rate << " messages/s." << endl;
+    }
+    else
+    {
+        cout << "closed loop with " << max(1u, options.pipeline) << " in flight per connection." << endl;
+    }
+
+    LoadResult result = LoadGenerator(options).run();
+    const LatencyHistogram &latency = result.latency;
+    double seconds = result.seconds > 0 ? result.seconds : 1;
+    auto micros = [](uint64_t nanos)
+    { return static_cast<double>(nanos) / 1000.0; };
+
+    cout << fixed << setprecision(0) << "Measured " << result.seconds << " s after " << options.warmup
+         << " s warmup: " << result.messages << " messages, " << result.messages / seconds << " messages/s, "
+         << setprecision(2) << result.bytes / seconds / 1e6 << " MB/s" << endl;
+    cout << setprecision(1) << "Latency (us): min " << micros(latency.min()) << "  p50 " << micros(latency.valueAt(50))
+         << "  p90 " << micros(latency.valueAt(90)) << "  p99 " << micros(latency.valueAt(99))
+         << "  p99.9 " << micros(latency.valueAt(99.9)) << "  max " << micros(latency.max())
+         << "  mean " << latency.mean() / 1000.0 << endl;
+    cout << "Unanswered: " << result.unanswered << "  Errors: " << result.errors << endl;
+    return result.messages > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Benchmarks the connection pool: every caller thread keeps --pipeline calls in
+ * flight, and all of them share --connections persistent connections.
+ *
+ * @return Process exit status: failure if no call completed.
+ */
+int runPoolBenchmark(const LoadOptions &options)
+{
+    using Clock = chrono::steady_clock;
+
+    /**
+     * @brief One caller thread's calls, completed on the pool's reader thread.
+     */
+    struct Caller
+    {
+        mutex lock;
+        condition_variable done;
+        unsigned inFlight = 0;
+        LatencyHistogram latency;
+        uint64_t completed = 0;
+        uint64_t failed = 0;
+    };
+
+    cout << "Benchmarking " << options.host << ":" << options.port << " through a pool of " << options.connections
+         << " connection(s) with " << options.threads << " caller thread(s), " << options.messageSize
+         << " byte requests, " << max(1u, options.pipeline) << " in flight per caller." << endl;
+
+    ConnectionPool pool(PoolOptions{options.host, options.port, options.connections});
+    if (pool.start() == 0)
+    {
+        cerr << "Failed to connect to the server." << endl;
+        return EXIT_FAILURE;
+    }
+
+    Clock::time_point measureFrom = Clock::now() + chrono::seconds(options.warmup);
+    Clock::time_point end = measureFrom + chrono::seconds(options.duration);
+    unsigned pipeline = max(1u, options.pipeline);
+    string payload(options.messageSize, 'x');
+    vector<unique_ptr<Caller>> callers;
+    vector<thread> threads;
+    for (unsigned t = 0; t < options.threads; ++t)
+    {
+        callers.push_back(make_unique<Caller>());
+        threads.emplace_back([&, caller = callers.back().get()]
+                             {
+            unique_lock<mutex> lock(caller->lock);
+            while (true)
+            {
+                caller->done.wait(lock, [&] { return caller->inFlight < pipeline; });
+                Clock::time_point now = Clock::now();
+                if (now >= end)
+                {
+                    break;
+                }
+                ++caller->inFlight;
+                lock.unlock();
+                bool measured = now >= measureFrom;
+                pool.call(payload, [caller, now, measured](bool ok, string_view)
+                          {
+                    uint64_t nanos = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - now).count());
+                    lock_guard<mutex> guard(caller->lock);
+                    --caller->inFlight;
+                    if (!ok)
+                    {
+                        ++caller->failed;
+                    }
+                    else if (measured)
+                    {
+                        caller->latency.record(nanos);
+                        ++caller->completed;
+                    }
+                    caller->done.notify_one(); });
+                lock.lock();
+            }
+            caller->done.wait(lock, [&] { return caller->inFlight == 0; }); });
+    }
+    for (thread &caller : threads)
+    {
+        caller.join();
+    }
+    ConnectionPool::Stats stats = pool.stats();
+    pool.stop();
+
+    LatencyHistogram latency;
+    uint64_t completed = 0, failed = 0;
+    for (auto &caller : callers)
+    {
+        latency.merge(caller->latency);
+        completed += caller->completed;
+        failed += caller->failed;
+    }
+    auto micros = [](uint64_t nanos)
+    { return static_cast<double>(nanos) / 1000.0; };
+    double seconds = options.duration;
+    cout << fixed << setprecision(0) << "Measured " << seconds << " s after " << options.warmup << " s warmup: "
+         << completed << " calls, " << completed / seconds << " calls/s" << endl;
+    cout << setprecision(1) << "Latency (us): min " << micros(latency.min()) << "  p50 " << micros(latency.valueAt(50))
+         << "  p90 " << micros(latency.valueAt(90)) << "  p99 " << micros(latency.valueAt(99))
+         << "  p99.9 " << micros(latency.valueAt(99.9)) << "  max " << micros(latency.max())
+         << "  mean " << latency.mean() / 1000.0 << endl;
+    cout << setprecision(2) << "Calls per write: " << (stats.writes > 0 ? static_cast<double>(stats.calls) / stats.writes : 0)
+         << "  Failed: " << failed << endl;
+    return completed > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+    ClientMode mode = ClientMode::Interactive;
+    LoadOptions options;
+    bool reconnect = true;                           // Interactive mode only
+    uint64_t backlog = 0;                            // Interactive mode only
+    chrono::milliseconds backoffBase{100}, backoffMax{30000};
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        string value = argv[++i];
+
+        if (arg == "--host")
+        {
+            options.host = value;
+        }
+        else if (arg == "--port")
+        {
+            options.port = parseNumber(value, argv[0]);
+        }
+        else if (arg == "--mode" && value == "interactive")
+        {
+            mode = ClientMode::Interactive;
+        }
+        else if (arg == "--mode" && value == "bench")
+        {
+            mode = ClientMode::Bench;
+        }
+        else if (arg == "--mode" && value == "pool")
+        {
+            mode = ClientMode::Pool;
+        }
+        else if (arg == "--connections")
+        {
+            options.connections = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--threads")
+        {
+            options.threads = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--size")
+        {
+            options.messageSize = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--rate")
+        {
+            options.rate = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--pipeline")
+        {
+            options.pipeline = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--senders")
+        {
+            options.senders = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--warmup")
+        {
+            options.warmup = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--duration")
+        {
+            options.duration = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--reconnect" && (value == "on" || value == "off"))
+        {
+            reconnect = value == "on";
+        }
+        else if (arg == "--backoff-base")
+        {
+            backoffBase = chrono::milliseconds(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--backoff-max")
+        {
+            backoffMax = chrono::milliseconds(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--backlog")
+        {
+            backlog = static_cast<uint64_t>(parseNumber(value, argv[0]));
+        }
+        else
+        {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (mode == ClientMode::Bench || mode == ClientMode::Pool)
+    {
+        if (options.connections == 0 || options.threads == 0 || options.duration == 0)
+        {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return mode == ClientMode::Bench ? runBenchmark(options) : runPoolBenchmark(options);
+    }
+
     // Initialize client with server IP and port
-    SimpleClient client("127.0.0.1", 9999);
+    SimpleClient client(options.host, options.port, reconnect, Backoff(backoffBase, backoffMax), backlog);
 
     // Attempt to connect to the server
     if (client.connectToServer())
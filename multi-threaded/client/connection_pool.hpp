@@ -0,0 +1,557 @@
+// connection_pool.hpp
+// Persistent connections for making many concurrent calls to the server.
+//
+// Every call is a Request frame tagged with a correlation ID that is unique on its
+// connection, and the server answers it with a Response carrying the same ID, so
+// any number of calls can be in flight on one connection and their responses can
+// come back in any order. A single reader thread waits on all connections with
+// epoll and hands each response to the callback registered under its ID.
+//
+// Callers never wait for each other to write. A call appends its encoded frame to
+// its connection's outbox; the caller that finds no write in progress becomes the
+// writer and sends the whole outbox with one writev, including the frames other
+// callers append meanwhile, until the outbox is empty. Under load a single system
+// call thus carries the requests of many callers.
+//
+// The reader thread serves every connection, so it must never block on one. It
+// answers the server's pings by queueing the Pong; if no caller is writing, it
+// sends what the socket takes at once and leaves the rest for EPOLLOUT.
+
+#pragma once
+
+#include <sys/epoll.h>   // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h> // Waking the reader thread on stop
+#include <sys/socket.h>  // Socket functions
+#include <sys/uio.h>     // iovec, IOV_MAX
+#include <netinet/in.h>  // Internet address structures
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <arpa/inet.h>   // IP address conversion functions
+#include <unistd.h>      // close, read, write
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../common/framing.hpp" // Length-prefixed message framing
+
+/**
+ * @brief Where the pool connects and how many connections it keeps.
+ */
+struct PoolOptions
+{
+    std::string host = "127.0.0.1"; // Server address
+    int port = 9999;                 // Server port
+    unsigned connections = 4;        // Persistent connections calls are spread over
+};
+
+class ConnectionPool
+{
+public:
+    /**
+     * @brief Receives the outcome of one call on the reader thread, so it must not
+     * block.
+     *
+     * @param ok false if the connection was lost or the pool stopped before the
+     * response arrived.
+     * @param reply The response's message; only valid during the callback.
+     */
+    using Callback = std::function<void(bool ok, std::string_view reply)>;
+
+    /**
+     * @brief What the pool has sent since it started.
+     */
+    struct Stats
+    {
+        uint64_t calls = 0;  // Requests written
+        uint64_t writes = 0; // System calls that wrote them
+    };
+
+private:
+    static constexpr size_t readBufferSize = 64 * 1024;
+    static constexpr size_t maxSpare = 64; // Emptied frame buffers kept per connection for reuse
+
+    /**
+     * @brief One persistent connection.
+     */
+    struct Link
+    {
+        int fd = -1;
+        uint64_t index = 0; // Position in links, which tags its epoll events
+        std::atomic<bool> alive{false};
+        std::atomic<uint64_t> nextId{0};
+        std::mutex mutex;                                 // Guards everything below
+        std::vector<std::string> outbox;                  // Encoded frames waiting for the writer
+        std::vector<std::string> spare;                   // Written frames whose buffers are reused
+        bool writing = false;                             // A caller is sending the outbox
+        bool awaitingWritable = false;                    // The reader waits for EPOLLOUT to send the rest
+        std::unordered_map<uint64_t, Callback> inFlight;  // Calls awaiting their response, by ID
+        FrameParser parser;                               // Reassembles responses; reader thread only
+    };
+
+    PoolOptions options;
+    std::vector<std::unique_ptr<Link>> links;
+    std::atomic<size_t> nextLink{0}; // Round-robin cursor
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> writes{0};
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::thread reader;
+    std::atomic<bool> running{false};
+
+public:
+    explicit ConnectionPool(const PoolOptions &options) : options(options) {}
+
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+    ~ConnectionPool() { stop(); }
+
+    /**
+     * @brief Opens the connections and starts the reader thread.
+     *
+     * @return The number of connections opened; calls fail at once if it is zero.
+     */
+    unsigned start()
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = UINT64_MAX;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+        unsigned opened = 0;
+        for (unsigned i = 0; i < options.connections; ++i)
+        {
+            links.push_back(std::make_unique<Link>());
+            Link &link = *links.back();
+            link.index = i;
+            link.fd = connectOne();
+            if (link.fd < 0)
+            {
+                continue;
+            }
+            event.data.u64 = i;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, link.fd, &event);
+            link.alive = true;
+            ++opened;
+        }
+        running = true;
+        reader = std::thread(&ConnectionPool::readResponses, this);
+        return opened;
+    }
+
+    /**
+     * @brief Sends a request on the next live connection. The callback runs once, with
+     * the response or with a failure.
+     */
+    void call(std::string_view message, Callback callback)
+    {
+        Link *link = pick();
+        if (link == nullptr)
+        {
+            callback(false, {});
+            return;
+        }
+        uint64_t id = link->nextId.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(link->mutex);
+        if (!link->alive)
+        {
+            lock.unlock();
+            callback(false, {});
+            return;
+        }
+        link->inFlight.emplace(id, std::move(callback));
+        calls.fetch_add(1, std::memory_order_relaxed);
+        enqueue(*link, lock, [&](std::string &frame)
+                { appendCorrelatedFrame(frame, FrameType::Request, id, message); });
+    }
+
+    /**
+     * @brief Sends a request and returns its response as a future, which throws if the
+     * call fails.
+     */
+    std::future<std::string> call(std::string_view message)
+    {
+        auto promise = std::make_shared<std::promise<std::string>>();
+        std::future<std::string> result = promise->get_future();
+        call(message, [promise](bool ok, std::string_view reply)
+             {
+            if (ok)
+            {
+                promise->set_value(std::string(reply));
+            }
+            else
+            {
+                promise->set_exception(std::make_exception_ptr(std::runtime_error("connection lost")));
+            } });
+        return result;
+    }
+
+    Stats stats() const
+    {
+        return Stats{calls.load(std::memory_order_relaxed), writes.load(std::memory_order_relaxed)};
+    }
+
+    /**
+     * @brief Stops the reader thread, closes the connections and fails every call still
+     * in flight. Callers must have stopped calling.
+     */
+    void stop()
+    {
+        if (!running.exchange(false))
+        {
+            return;
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+        reader.join();
+        for (auto &link : links)
+        {
+            failLink(*link);
+            if (link->fd >= 0)
+            {
+                close(link->fd);
+            }
+        }
+        close(wakeFd);
+        close(epollFd);
+    }
+
+private:
+    int connectOne() const
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(options.port);
+        inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr);
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)); // Batches are written whole already
+        if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /**
+     * @brief The next live connection in round-robin order, or nullptr if none is left.
+     */
+    Link *pick()
+    {
+        for (size_t tried = 0; tried < links.size(); ++tried)
+        {
+            Link &link = *links[nextLink.fetch_add(1, std::memory_order_relaxed) % links.size()];
+            if (link.alive.load(std::memory_order_relaxed))
+            {
+                return &link;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Appends a frame built by encode to the outbox and, unless another caller is
+     * writing, writes the outbox until it is empty.
+     *
+     * @param lock Holds the link's mutex; released before writing.
+     */
+    template <typename Encode>
+    void enqueue(Link &link, std::unique_lock<std::mutex> &lock, Encode &&encode)
+    {
+        queue(link, encode);
+        if (link.writing)
+        {
+            return; // The writer sends it with the rest
+        }
+        link.writing = true;
+
+        std::vector<std::string> batch;
+        while (!link.outbox.empty())
+        {
+            batch.swap(link.outbox);
+            lock.unlock();
+            bool written = writeAll(link.fd, batch);
+            lock.lock();
+            for (std::string &sent : batch)
+            {
+                if (link.spare.size() < maxSpare)
+                {
+                    sent.clear();
+                    link.spare.push_back(std::move(sent));
+                }
+            }
+            batch.clear();
+            if (!written)
+            {
+                link.outbox.clear(); // The link is failing; its calls fail with it
+                break;
+            }
+        }
+        link.writing = false;
+    }
+
+    /**
+     * @brief Appends a frame built by encode to the outbox, in a spare buffer if any.
+     * Holds the link's mutex.
+     */
+    template <typename Encode>
+    void queue(Link &link, Encode &&encode)
+    {
+        std::string frame;
+        if (!link.spare.empty())
+        {
+            frame = std::move(link.spare.back());
+            link.spare.pop_back();
+        }
+        encode(frame);
+        link.outbox.push_back(std::move(frame));
+    }
+
+    /**
+     * @brief Sends what the socket takes of the outbox without blocking; reader thread
+     * only, holding the link's mutex. Does nothing while a caller is writing, since
+     * that caller sends the outbox anyway. Whatever is left stays at the front of the
+     * outbox, and EPOLLOUT brings the reader back for it.
+     */
+    void flushFromReader(Link &link)
+    {
+        size_t done = 0;
+        if (!link.writing)
+        {
+            iovec iov[64];
+            size_t count = 0;
+            for (; count < link.outbox.size() && count < 64; ++count)
+            {
+                iov[count] = iovec{const_cast<char *>(link.outbox[count].data()), link.outbox[count].size()};
+            }
+            msghdr header{};
+            header.msg_iov = iov;
+            header.msg_iovlen = count;
+            ssize_t sent = count > 0 ? sendmsg(link.fd, &header, MSG_NOSIGNAL | MSG_DONTWAIT) : 0;
+            if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                shutdown(link.fd, SHUT_RDWR); // The reader fails the link on its next read
+                link.outbox.clear();
+                return;
+            }
+            if (sent > 0)
+            {
+                writes.fetch_add(1, std::memory_order_relaxed);
+            }
+            size_t remaining = sent > 0 ? static_cast<size_t>(sent) : 0;
+            while (done < count && remaining >= link.outbox[done].size())
+            {
+                remaining -= link.outbox[done].size();
+                ++done;
+            }
+            if (remaining > 0)
+            {
+                link.outbox[done].erase(0, remaining); // Part of a frame went out
+            }
+            for (size_t i = 0; i < done; ++i)
+            {
+                if (link.spare.size() < maxSpare)
+                {
+                    link.outbox[i].clear();
+                    link.spare.push_back(std::move(link.outbox[i]));
+                }
+            }
+            link.outbox.erase(link.outbox.begin(), link.outbox.begin() + static_cast<std::ptrdiff_t>(done));
+        }
+
+        bool waiting = !link.writing && !link.outbox.empty();
+        if (waiting != link.awaitingWritable)
+        {
+            link.awaitingWritable = waiting;
+            epoll_event event{};
+            event.events = EPOLLIN | (waiting ? EPOLLOUT : 0u);
+            event.data.u64 = link.index;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, link.fd, &event);
+        }
+    }
+
+    /**
+     * @brief Writes a batch of frames with as few writev calls as the iovec limit allows.
+     *
+     * @return false if the connection failed; the reader thread then fails its calls.
+     */
+    bool writeAll(int fd, const std::vector<std::string> &batch)
+    {
+        std::vector<iovec> iov;
+        iov.reserve(batch.size() < IOV_MAX ? batch.size() : IOV_MAX);
+        size_t next = 0; // First frame not yet in iov
+        while (next < batch.size() || !iov.empty())
+        {
+            while (next < batch.size() && iov.size() < IOV_MAX)
+            {
+                iov.push_back(iovec{const_cast<char *>(batch[next].data()), batch[next].size()});
+                ++next;
+            }
+            msghdr header{};
+            header.msg_iov = iov.data();
+            header.msg_iovlen = iov.size();
+            ssize_t sent = sendmsg(fd, &header, MSG_NOSIGNAL); // writev that cannot raise SIGPIPE
+            if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (sent <= 0)
+            {
+                shutdown(fd, SHUT_RDWR); // Lets the reader thread notice and fail the link
+                return false;
+            }
+            writes.fetch_add(1, std::memory_order_relaxed);
+            size_t remaining = static_cast<size_t>(sent);
+            size_t done = 0;
+            while (done < iov.size() && remaining >= iov[done].iov_len)
+            {
+                remaining -= iov[done].iov_len;
+                ++done;
+            }
+            iov.erase(iov.begin(), iov.begin() + static_cast<std::ptrdiff_t>(done));
+            if (remaining > 0)
+            {
+                iov.front().iov_base = static_cast<char *>(iov.front().iov_base) + remaining;
+                iov.front().iov_len -= remaining;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Marks a connection dead and fails every call in flight on it.
+     */
+    void failLink(Link &link)
+    {
+        std::unordered_map<uint64_t, Callback> failed;
+        {
+            std::lock_guard<std::mutex> lock(link.mutex);
+            if (link.alive.exchange(false) && link.fd >= 0)
+            {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, link.fd, nullptr);
+                shutdown(link.fd, SHUT_RDWR); // Unblocks a writer; the descriptor is closed by stop()
+            }
+            failed.swap(link.inFlight);
+        }
+        for (auto &entry : failed)
+        {
+            entry.second(false, {});
+        }
+    }
+
+    /**
+     * @brief The reader thread: reads every connection and completes calls by ID.
+     */
+    void readResponses()
+    {
+        std::vector<char> buffer(readBufferSize);
+        epoll_event events[64];
+        while (running)
+        {
+            int ready = epoll_wait(epollFd, events, 64, -1);
+            for (int i = 0; i < ready; ++i)
+            {
+                if (events[i].data.u64 == UINT64_MAX)
+                {
+                    continue; // Woken by stop()
+                }
+                Link &link = *links[events[i].data.u64];
+                if (events[i].events & EPOLLOUT)
+                {
+                    std::lock_guard<std::mutex> lock(link.mutex);
+                    if (link.alive)
+                    {
+                        flushFromReader(link);
+                    }
+                }
+                while (link.alive)
+                {
+                    ssize_t received = recv(link.fd, buffer.data(), buffer.size(), MSG_DONTWAIT);
+                    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    {
+                        break;
+                    }
+                    if (received < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (received <= 0 || !handleData(link, std::string_view(buffer.data(), static_cast<size_t>(received))))
+                    {
+                        failLink(link);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Handles the frames of one read.
+     *
+     * @return false if the connection must be given up.
+     */
+    bool handleData(Link &link, std::string_view data)
+    {
+        bool open = true;
+        bool valid = link.parser.feed(data, [&](const Frame &frame)
+                                      {
+            if (!open)
+            {
+                return;
+            }
+            if (frame.type == FrameType::Response)
+            {
+                uint64_t id;
+                std::string_view reply;
+                if (!splitCorrelated(frame.payload, id, reply))
+                {
+                    open = false;
+                    return;
+                }
+                Callback callback;
+                {
+                    std::lock_guard<std::mutex> lock(link.mutex);
+                    auto found = link.inFlight.find(id);
+                    if (found == link.inFlight.end())
+                    {
+                        return; // Not ours, or failed already
+                    }
+                    callback = std::move(found->second);
+                    link.inFlight.erase(found);
+                }
+                callback(true, reply);
+            }
+            else if (frame.type == FrameType::Ping)
+            {
+                // Never written with a blocking send here: a server that stopped reading
+                // would stall every connection's responses
+                std::lock_guard<std::mutex> lock(link.mutex);
+                queue(link, [&](std::string &pong)
+                      { appendFrame(pong, FrameType::Pong, frame.payload); });
+                flushFromReader(link);
+            }
+            else if (frame.type == FrameType::Close)
+            {
+                open = false;
+            } });
+        return valid && open;
+    }
+};
@@ -0,0 +1,486 @@
+// load_generator.hpp
+// Headless load for SimpleClient's benchmark mode.
+//
+// Opens a number of connections to the server, spreads them over worker threads
+// and has every worker drive its share with epoll. Each message is a Text frame
+// whose payload starts with its send time; the server echoes it back unchanged,
+// so the round trip is measured from the echo alone, with no per-message state
+// on the client.
+//
+// Two load models are supported. In the closed loop each connection keeps a fixed
+// number of messages in flight and sends the next one as soon as an echo
+// arrives, which finds the server's throughput. At a fixed rate, messages are
+// stamped with the time they were scheduled rather than the time they were
+// written, so a stalled server or a generator that falls behind shows up as
+// latency instead of silently lowering the load. Every connection also remembers
+// the stamps it is still waiting for, and messages left unanswered when the run
+// ends are recorded with the time they have waited so far: a server that stops
+// answering cannot hide its worst latencies by never replying.
+
+#pragma once
+
+#include <sys/epoll.h>    // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/resource.h> // File descriptor limits
+#include <sys/socket.h>   // Socket functions
+#include <sys/timerfd.h>  // Scheduling fixed-rate sends
+#include <netinet/in.h>   // Internet address structures
+#include <netinet/tcp.h>  // TCP_NODELAY
+#include <arpa/inet.h>    // IP address conversion functions
+#include <fcntl.h>        // O_NONBLOCK
+#include <unistd.h>       // close, read
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../common/framing.hpp"           // Length-prefixed message framing
+#include "../common/latency_histogram.hpp" // Round-trip time recording
+
+/**
+ * @brief Shape of the generated load.
+ */
+struct LoadOptions
+{
+    std::string host = "127.0.0.1"; // Server address
+    int port = 9999;                 // Server port
+    unsigned connections = 1;        // Connections opened in total
+    unsigned threads = 1;            // Worker threads sharing the connections
+    size_t messageSize = 64;         // Payload bytes per message; at least the timestamp
+    unsigned rate = 0;               // Messages per second across all connections; 0 = closed loop
+    unsigned pipeline = 1;           // Messages in flight per connection in the closed loop
+    unsigned senders = 0;            // Connections that send; the others only receive (0 = all)
+    unsigned warmup = 1;             // Seconds run before measuring
+    unsigned duration = 10;          // Seconds measured
+};
+
+/**
+ * @brief What one run measured.
+ */
+struct LoadResult
+{
+    LatencyHistogram latency; // Round-trip time of each echo, in nanoseconds
+    uint64_t messages = 0;    // Echoes received while measuring
+    uint64_t unanswered = 0;  // Messages sent while measuring that got no echo; in latency with their wait so far
+    uint64_t bytes = 0;       // Payload bytes of those echoes
+    uint64_t errors = 0;      // Connections refused or lost
+    double seconds = 0;       // Length of the measurement
+
+    void merge(const LoadResult &other)
+    {
+        latency.merge(other.latency);
+        messages += other.messages;
+        unanswered += other.unanswered;
+        bytes += other.bytes;
+        errors += other.errors;
+    }
+};
+
+class LoadGenerator
+{
+public:
+    static constexpr size_t stampSize = 16; // Hex digits of the send time at the start of each payload
+
+private:
+    using Clock = std::chrono::steady_clock; // CLOCK_MONOTONIC, which the fixed-rate timer also uses
+
+    static constexpr size_t readBufferSize = 64 * 1024;
+
+    /**
+     * @brief One connection of a worker.
+     */
+    struct Stream
+    {
+        int fd = -1;
+        FrameParser parser;  // Reassembles echoes split across reads
+        std::string output;  // Frames the socket has not taken yet
+        size_t written = 0;  // Bytes of output already sent
+        bool sender = true;  // Sends messages rather than only receiving
+        bool open = true;
+        std::deque<uint64_t> inFlight; // Stamps of messages awaiting their echo, oldest first
+    };
+
+    /**
+     * @brief Per-worker buffers for building messages.
+     */
+    struct Scratch
+    {
+        std::string payload; // Message template; the stamp is written over its first bytes
+        std::string message; // Encoded frame
+    };
+
+    LoadOptions options;
+
+public:
+    explicit LoadGenerator(const LoadOptions &options) : options(options) {}
+
+    /**
+     * @brief Connects, runs the warmup and the measurement, and returns the merged results.
+     */
+    LoadResult run()
+    {
+        raiseFileLimit();
+        unsigned threadCount = std::max(1u, std::min(options.threads, options.connections));
+        unsigned senderCount = options.senders > 0 ? std::min(options.senders, options.connections) : options.connections;
+        std::vector<std::vector<std::pair<int, bool>>> sockets(threadCount); // fd and whether it sends
+        LoadResult result;
+        for (unsigned i = 0; i < options.connections; ++i)
+        {
+            int fd = connectOne();
+            if (fd < 0)
+            {
+                ++result.errors;
+                continue;
+            }
+            sockets[i % threadCount].emplace_back(fd, i < senderCount);
+        }
+
+        Clock::time_point start = Clock::now();
+        Clock::time_point measureFrom = start + std::chrono::seconds(options.warmup);
+        Clock::time_point end = measureFrom + std::chrono::seconds(options.duration);
+
+        std::vector<LoadResult> partial(threadCount);
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threadCount; ++t)
+        {
+            workers.emplace_back([&, t]
+                                 { work(t, threadCount, senderCount, sockets[t], measureFrom, end, partial[t]); });
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+
+        for (const LoadResult &part : partial)
+        {
+            result.merge(part);
+        }
+        result.seconds = static_cast<double>(options.duration);
+        return result;
+    }
+
+private:
+    static uint64_t nanoseconds(Clock::time_point time)
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count());
+    }
+
+    static void writeStamp(char *out, uint64_t value)
+    {
+        static const char digits[] = "0123456789abcdef";
+        for (size_t i = stampSize; i-- > 0; value >>= 4)
+        {
+            out[i] = digits[value & 0xf];
+        }
+    }
+
+    static bool readStamp(std::string_view payload, uint64_t &value)
+    {
+        if (payload.size() < stampSize)
+        {
+            return false;
+        }
+        value = 0;
+        for (size_t i = 0; i < stampSize; ++i)
+        {
+            char c = payload[i];
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if (digit < 0)
+            {
+                return false; // Not one of ours, e.g. another client's broadcast
+            }
+            value = (value << 4) | static_cast<uint64_t>(digit);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Raises the open file soft limit to the hard limit for large connection counts.
+     */
+    static void raiseFileLimit()
+    {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    /**
+     * @brief Opens one blocking connection, then makes it non-blocking for the workers.
+     *
+     * @return The socket, or -1 on failure.
+     */
+    int connectOne() const
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(options.port);
+        inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr);
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)); // Don't let Nagle add latency
+        int flags = 0;
+        if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+            (flags = fcntl(fd, F_GETFL, 0)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /**
+     * @brief Drives one worker's connections until the end of the run.
+     */
+    void work(unsigned index, unsigned threadCount, unsigned senderCount, const std::vector<std::pair<int, bool>> &sockets,
+              Clock::time_point measureFrom, Clock::time_point end, LoadResult &result)
+    {
+        if (sockets.empty())
+        {
+            return;
+        }
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        std::vector<Stream> streams;
+        std::vector<Stream *> senders;
+        streams.reserve(sockets.size()); // Stable addresses for epoll's data.ptr
+        for (const auto &socket : sockets)
+        {
+            int fd = socket.first;
+            streams.emplace_back();
+            streams.back().fd = fd;
+            streams.back().sender = socket.second;
+            if (socket.second)
+            {
+                senders.push_back(&streams.back());
+            }
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = &streams.back();
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+        }
+
+        // Fixed rate: this worker's share of the rate, sent round-robin over its
+        // senders and offset so the workers don't all send at the same instant
+        int timerFd = -1;
+        uint64_t interval = 0;
+        uint64_t nextSend = 0;
+        size_t cursor = 0;
+        Scratch scratch{std::string(std::max(options.messageSize, stampSize), 'x'), std::string()};
+        if (options.rate > 0 && !senders.empty())
+        {
+            double share = static_cast<double>(options.rate) * static_cast<double>(senders.size()) / senderCount;
+            interval = std::max<uint64_t>(1, static_cast<uint64_t>(1e9 / share));
+            nextSend = nanoseconds(Clock::now()) + interval * index / threadCount;
+            timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.ptr = nullptr; // Marks the timer
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+            armTimer(timerFd, nextSend);
+        }
+        else if (options.rate == 0)
+        {
+            for (Stream *stream : senders)
+            {
+                for (unsigned i = 0; i < std::max(1u, options.pipeline); ++i)
+                {
+                    sendMessage(*stream, nanoseconds(Clock::now()), scratch, result);
+                }
+            }
+        }
+
+        uint64_t measureStart = nanoseconds(measureFrom);
+        uint64_t stop = nanoseconds(end);
+        std::vector<epoll_event> events(256);
+        std::vector<char> buffer(readBufferSize);
+        while (true)
+        {
+            uint64_t now = nanoseconds(Clock::now());
+            if (now >= stop)
+            {
+                break;
+            }
+            int timeout = static_cast<int>(std::min<uint64_t>((stop - now) / 1000000 + 1, 100));
+            int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), timeout);
+            for (int i = 0; i < ready; ++i)
+            {
+                auto *stream = static_cast<Stream *>(events[i].data.ptr);
+                if (stream == nullptr)
+                {
+                    uint64_t expirations;
+                    ssize_t ignored = read(timerFd, &expirations, sizeof(expirations));
+                    (void)ignored;
+                    // Every send that is due goes out now, stamped with its scheduled time
+                    for (now = nanoseconds(Clock::now()); nextSend <= now && nextSend < stop; nextSend += interval)
+                    {
+                        Stream &target = *senders[cursor++ % senders.size()];
+                        sendMessage(target, nextSend, scratch, result);
+                    }
+                    armTimer(timerFd, nextSend);
+                    continue;
+                }
+                if (!stream->open)
+                {
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                {
+                    receive(*stream, buffer, measureStart, stop, scratch, result);
+                }
+                if (stream->open && (events[i].events & EPOLLOUT))
+                {
+                    flush(*stream, result);
+                }
+            }
+        }
+
+        for (Stream &stream : streams)
+        {
+            for (uint64_t stamp : stream.inFlight)
+            {
+                if (stamp >= measureStart && stamp < stop)
+                {
+                    result.latency.record(stop - stamp); // A lower bound, but never an omission
+                    ++result.unanswered;
+                }
+            }
+            close(stream.fd);
+        }
+        if (timerFd >= 0)
+        {
+            close(timerFd);
+        }
+        close(epollFd);
+    }
+
+    static void armTimer(int timerFd, uint64_t at)
+    {
+        itimerspec spec{};
+        spec.it_value.tv_sec = static_cast<time_t>(at / 1000000000);
+        spec.it_value.tv_nsec = static_cast<long>(at % 1000000000);
+        timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    /**
+     * @brief Queues one stamped message on a connection and writes what the socket takes.
+     */
+    void sendMessage(Stream &stream, uint64_t stamp, Scratch &scratch, LoadResult &result)
+    {
+        if (!stream.open)
+        {
+            return;
+        }
+        writeStamp(&scratch.payload[0], stamp);
+        scratch.message.clear();
+        appendFrame(scratch.message, FrameType::Text, scratch.payload);
+        stream.output.append(scratch.message);
+        stream.inFlight.push_back(stamp);
+        flush(stream, result);
+    }
+
+    /**
+     * @brief Reads until EAGAIN and records the round trip of every stamped message; in
+     * the closed loop each echo of the connection's own messages is answered with the
+     * next one.
+     */
+    void receive(Stream &stream, std::vector<char> &buffer, uint64_t measureStart, uint64_t stop,
+                 Scratch &scratch, LoadResult &result)
+    {
+        while (stream.open)
+        {
+            ssize_t bytesRead = read(stream.fd, buffer.data(), buffer.size());
+            if (bytesRead > 0)
+            {
+                uint64_t now = nanoseconds(Clock::now());
+                unsigned replies = 0;
+                bool valid = stream.parser.feed(std::string_view(buffer.data(), static_cast<size_t>(bytesRead)), [&](const Frame &frame)
+                                                {
+                    uint64_t stamp;
+                    if (frame.type != FrameType::Text || !readStamp(frame.payload, stamp))
+                    {
+                        return;
+                    }
+                    if (now >= measureStart && now < stop)
+                    {
+                        result.latency.record(now >= stamp ? now - stamp : 0);
+                        ++result.messages;
+                        result.bytes += frame.payload.size();
+                    }
+                    if (!stream.inFlight.empty() && stream.inFlight.front() == stamp)
+                    {
+                        stream.inFlight.pop_front(); // Echoes come back in order; others may be broadcasts
+                        ++replies;
+                    } });
+                if (!valid)
+                {
+                    fail(stream, result);
+                    return;
+                }
+                for (; options.rate == 0 && replies > 0; --replies)
+                {
+                    sendMessage(stream, now, scratch, result);
+                }
+            }
+            else if (bytesRead == 0)
+            {
+                fail(stream, result);
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            else if (errno != EINTR)
+            {
+                fail(stream, result);
+            }
+        }
+    }
+
+    void flush(Stream &stream, LoadResult &result)
+    {
+        while (stream.written < stream.output.size())
+        {
+            ssize_t sent = ::send(stream.fd, stream.output.data() + stream.written,
+                                  stream.output.size() - stream.written, MSG_NOSIGNAL);
+            if (sent > 0)
+            {
+                stream.written += static_cast<size_t>(sent);
+            }
+            else if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return; // Finished on the next EPOLLOUT edge
+            }
+            else
+            {
+                fail(stream, result);
+                return;
+            }
+        }
+        stream.output.clear();
+        stream.written = 0;
+    }
+
+    static void fail(Stream &stream, LoadResult &result)
+    {
+        if (stream.open)
+        {
+            stream.open = false;
+            ++result.errors;
+        }
+    }
+};
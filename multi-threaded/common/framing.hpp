@@ -0,0 +1,522 @@
+// framing.hpp
+// Length-prefixed binary framing shared by SimpleClient and SimpleServer.
+//
+// Wire format of a frame:
+//
+//   +----------------------+-----------+-------------------+
+//   | payload length       | type      | payload           |
+//   | unsigned LEB128,     | 1 byte    | length bytes      |
+//   | 1 to 5 bytes         |           |                   |
+//   +----------------------+-----------+-------------------+
+//
+// TCP delivers a byte stream, so one recv may return part of a frame or several
+// frames at once. FrameParser accepts whatever each read returns and hands out
+// complete frames; frames that lie entirely inside one read are passed on as views
+// into that read's buffer, and only a frame split across reads is copied.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Kinds of frames exchanged between client and server.
+ */
+enum class FrameType : uint8_t
+{
+    Text = 0x01,        // Chat message; payload is the text
+    Close = 0x02,       // Sender is closing the connection; payload is empty
+    Subscribe = 0x03,   // Client joins a topic, or a prefix pattern ending in '*'; payload is the pattern
+    Unsubscribe = 0x04, // Client leaves a subscription; payload is the pattern
+    Publish = 0x05,     // Message on a topic; payload is the topic, a NUL byte, then the message
+    Ping = 0x06,        // Heartbeat; the receiver answers with a Pong carrying the same payload
+    Pong = 0x07,        // Answer to a Ping
+    Request = 0x08,     // Call answered by one Response; payload is a varint correlation ID, then the message
+    Response = 0x09,    // Answer to a Request; payload is the request's correlation ID, then the reply
+    Resume = 0x0a,      // Client rejoins a stream; payload is varints: stream ID and last sequence number seen
+    Sequence = 0x0b,    // Numbers the broadcast or publish frame that follows; payload is a varint
+    Resumed = 0x0c,     // Answer to a Resume, after the replay; payload is varints: stream ID, last sequence number, messages lost
+};
+
+/**
+ * @brief A complete frame. The payload view is only valid inside the parser callback.
+ */
+struct Frame
+{
+    FrameType type;
+    std::string_view payload;
+};
+
+constexpr size_t maxFrameHeaderSize = 6;                 // 5 length bytes plus the type byte
+constexpr uint32_t defaultMaxFramePayload = 16u << 20; // Largest payload accepted by default (16 MiB)
+
+/**
+ * @brief Appends the frame header (length prefix and type) for a payload of the given size.
+ */
+inline void appendFrameHeader(std::string &out, FrameType type, size_t payloadLength)
+{
+    uint32_t remaining = static_cast<uint32_t>(payloadLength);
+    while (remaining >= 0x80)
+    {
+        out.push_back(static_cast<char>((remaining & 0x7f) | 0x80)); // Low 7 bits, more to follow
+        remaining >>= 7;
+    }
+    out.push_back(static_cast<char>(remaining));
+    out.push_back(static_cast<char>(type));
+}
+
+/**
+ * @brief Appends a complete frame to a buffer.
+ */
+inline void appendFrame(std::string &out, FrameType type, std::string_view payload)
+{
+    appendFrameHeader(out, type, payload.size());
+    out.append(payload.data(), payload.size());
+}
+
+/**
+ * @brief Encodes a complete frame into a new string.
+ */
+inline std::string encodeFrame(FrameType type, std::string_view payload = {})
+{
+    std::string frame;
+    frame.reserve(maxFrameHeaderSize + payload.size());
+    appendFrame(frame, type, payload);
+    return frame;
+}
+
+/**
+ * @brief Appends a Publish frame carrying a message on a topic.
+ */
+inline void appendPublishFrame(std::string &out, std::string_view topic, std::string_view message)
+{
+    appendFrameHeader(out, FrameType::Publish, topic.size() + 1 + message.size());
+    out.append(topic.data(), topic.size());
+    out.push_back('\0');
+    out.append(message.data(), message.size());
+}
+
+constexpr size_t maxVarintSize = 10; // Bytes of a 64-bit unsigned LEB128 value
+
+/**
+ * @brief Encodes a 64-bit value as unsigned LEB128.
+ *
+ * @return The number of bytes written.
+ */
+inline size_t encodeVarint(uint64_t value, char (&encoded)[maxVarintSize])
+{
+    size_t length = 0;
+    do
+    {
+        encoded[length++] = static_cast<char>((value & 0x7f) | (value >= 0x80 ? 0x80 : 0));
+        value >>= 7;
+    } while (value != 0);
+    return length;
+}
+
+/**
+ * @brief Decodes an unsigned LEB128 value at the start of a buffer.
+ *
+ * @return The number of bytes read, or 0 if the buffer does not start with a complete value.
+ */
+inline size_t decodeVarint(std::string_view data, uint64_t &value)
+{
+    value = 0;
+    for (size_t i = 0; i < data.size() && i < maxVarintSize; ++i)
+    {
+        uint8_t byte = static_cast<uint8_t>(data[i]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80))
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends a Request or Response frame: the correlation ID as a varint, then the message.
+ */
+inline void appendCorrelatedFrame(std::string &out, FrameType type, uint64_t id, std::string_view message)
+{
+    char encoded[maxVarintSize];
+    size_t length = encodeVarint(id, encoded);
+    appendFrameHeader(out, type, length + message.size());
+    out.append(encoded, length);
+    out.append(message.data(), message.size());
+}
+
+/**
+ * @brief Splits a Request or Response payload into correlation ID and message.
+ *
+ * @return false if the payload does not start with a complete ID.
+ */
+inline bool splitCorrelated(std::string_view payload, uint64_t &id, std::string_view &message)
+{
+    size_t length = decodeVarint(payload, id);
+    if (length == 0)
+    {
+        return false;
+    }
+    message = payload.substr(length);
+    return true;
+}
+
+/**
+ * @brief Appends a frame whose payload is a list of varints: a Resume, Sequence or
+ * Resumed frame.
+ */
+template <size_t Count>
+void appendVarintFrame(std::string &out, FrameType type, const uint64_t (&values)[Count])
+{
+    char encoded[Count][maxVarintSize];
+    size_t lengths[Count];
+    size_t total = 0;
+    for (size_t i = 0; i < Count; ++i)
+    {
+        lengths[i] = encodeVarint(values[i], encoded[i]);
+        total += lengths[i];
+    }
+    appendFrameHeader(out, type, total);
+    for (size_t i = 0; i < Count; ++i)
+    {
+        out.append(encoded[i], lengths[i]);
+    }
+}
+
+/**
+ * @brief Reads the varints of a Resume, Sequence or Resumed payload.
+ *
+ * @return false if the payload does not hold exactly that many values.
+ */
+template <size_t Count>
+bool splitVarints(std::string_view payload, uint64_t (&values)[Count])
+{
+    for (size_t i = 0; i < Count; ++i)
+    {
+        size_t length = decodeVarint(payload, values[i]);
+        if (length == 0)
+        {
+            return false;
+        }
+        payload.remove_prefix(length);
+    }
+    return payload.empty();
+}
+
+/**
+ * @brief Splits a Publish payload into topic and message.
+ *
+ * @return false if the payload has no topic separator.
+ */
+inline bool splitPublish(std::string_view payload, std::string_view &topic, std::string_view &message)
+{
+    size_t separator = payload.find('\0');
+    if (separator == std::string_view::npos)
+    {
+        return false;
+    }
+    topic = payload.substr(0, separator);
+    message = payload.substr(separator + 1);
+    return true;
+}
+
+/**
+ * @brief Recognises the text commands "/subscribe PATTERN", "/unsubscribe PATTERN" and
+ * "/publish TOPIC MESSAGE", which SimpleClient turns into frames and WebSocket
+ * clients send as text messages.
+ *
+ * @param type Set to Subscribe, Unsubscribe or Publish.
+ * @param topic Set to the pattern or topic.
+ * @param message Set to the message of a publish command.
+ * @return false if the line is not a well-formed topic command.
+ */
+inline bool parseTopicCommand(std::string_view line, FrameType &type, std::string_view &topic, std::string_view &message)
+{
+    size_t space = line.find(' ');
+    std::string_view command = line.substr(0, space);
+    if (space == std::string_view::npos || space + 1 == line.size())
+    {
+        return false;
+    }
+    std::string_view rest = line.substr(space + 1);
+
+    if (command == "/subscribe" || command == "/unsubscribe")
+    {
+        type = command == "/subscribe" ? FrameType::Subscribe : FrameType::Unsubscribe;
+        topic = rest;
+        message = {};
+    }
+    else if (command == "/publish")
+    {
+        size_t separator = rest.find(' ');
+        type = FrameType::Publish;
+        topic = rest.substr(0, separator);
+        message = separator == std::string_view::npos ? std::string_view() : rest.substr(separator + 1);
+    }
+    else
+    {
+        return false;
+    }
+    return topic.find('\0') == std::string_view::npos;
+}
+
+/**
+ * @brief Incremental frame decoder for one byte stream.
+ */
+class FrameParser
+{
+public:
+    /**
+     * @brief Outcome of decoding a frame header.
+     */
+    enum class HeaderStatus
+    {
+        Complete,   // Header decoded
+        Incomplete, // More bytes are needed
+        Invalid,    // Malformed length prefix or payload above the limit
+    };
+
+private:
+    struct FreeBytes
+    {
+        void operator()(char *bytes) const { std::free(bytes); }
+    };
+
+    std::unique_ptr<char[], FreeBytes> partial; // Bytes of a frame that started in an earlier read; never zeroed
+    size_t held = 0;                 // Bytes in partial
+    size_t capacity = 0;             // Size of partial
+    uint32_t maxPayload;             // Frames with larger payloads are rejected
+    bool failed = false;             // Set after a protocol error; the stream cannot be resynchronised
+
+    static constexpr size_t releaseThreshold = 4096; // Larger carry-over buffers are freed once used
+    static constexpr size_t reserveAhead = 64 << 10;  // Most room made for a frame beyond the bytes that arrived
+
+public:
+    explicit FrameParser(uint32_t maxPayload = defaultMaxFramePayload) : maxPayload(maxPayload) {}
+
+    /**
+     * @brief Decodes a frame header at the start of a buffer.
+     *
+     * @param headerSize Set to the header length (prefix plus type byte) when complete.
+     * @param payloadSize Set to the payload length when complete.
+     */
+    HeaderStatus decodeHeader(std::string_view data, size_t &headerSize, uint32_t &payloadSize) const
+    {
+        uint32_t length = 0;
+        for (size_t i = 0; i < data.size() && i < maxFrameHeaderSize - 1; ++i)
+        {
+            uint8_t byte = static_cast<uint8_t>(data[i]);
+            if (i == maxFrameHeaderSize - 2 && byte > 0x0f)
+            {
+                return HeaderStatus::Invalid; // More than 32 bits of length
+            }
+            length |= static_cast<uint32_t>(byte & 0x7f) << (7 * i);
+            if ((byte & 0x80) == 0)
+            {
+                if (length > maxPayload)
+                {
+                    return HeaderStatus::Invalid;
+                }
+                if (i + 1 >= data.size())
+                {
+                    return HeaderStatus::Incomplete; // Type byte not received yet
+                }
+                headerSize = i + 2;
+                payloadSize = length;
+                return HeaderStatus::Complete;
+            }
+        }
+        return data.size() >= maxFrameHeaderSize - 1 ? HeaderStatus::Invalid : HeaderStatus::Incomplete;
+    }
+
+    /**
+     * @brief Consumes the bytes from one read and calls onFrame(const Frame &) for every
+     * frame they complete.
+     *
+     * @return false on a protocol error; the connection should then be closed.
+     */
+    template <typename Callback>
+    bool feed(std::string_view data, Callback &&onFrame)
+    {
+        if (failed)
+        {
+            return false;
+        }
+
+        // Finish a frame carried over from the previous read, copying only what it still needs
+        while (held > 0)
+        {
+            size_t headerSize = 0;
+            uint32_t payloadSize = 0;
+            HeaderStatus status = decodeHeader(carried(), headerSize, payloadSize);
+            if (status == HeaderStatus::Invalid)
+            {
+                return fail();
+            }
+            if (status == HeaderStatus::Incomplete)
+            {
+                if (data.empty())
+                {
+                    return true;
+                }
+                hold(data.substr(0, 1), maxFrameHeaderSize); // Headers are tiny; grow them a byte at a time
+                data.remove_prefix(1);
+                continue;
+            }
+
+            size_t missing = headerSize + payloadSize - held;
+            size_t take = missing < data.size() ? missing : data.size();
+            hold(data.substr(0, take), headerSize + payloadSize);
+            data.remove_prefix(take);
+            if (take < missing)
+            {
+                return true; // Still incomplete; wait for the next read
+            }
+            deliver(carried(), headerSize, payloadSize, onFrame);
+            held = 0;
+            if (capacity > releaseThreshold)
+            {
+                release(); // Don't keep a large message's buffer on an idle connection
+            }
+        }
+
+        // Frames wholly inside this read are delivered in place
+        while (!data.empty())
+        {
+            size_t headerSize = 0;
+            uint32_t payloadSize = 0;
+            HeaderStatus status = decodeHeader(data, headerSize, payloadSize);
+            if (status == HeaderStatus::Invalid)
+            {
+                return fail();
+            }
+            if (status == HeaderStatus::Incomplete || data.size() < headerSize + payloadSize)
+            {
+                hold(data, status == HeaderStatus::Complete ? headerSize + payloadSize : maxFrameHeaderSize);
+                break;
+            }
+            deliver(data, headerSize, payloadSize, onFrame);
+            data.remove_prefix(headerSize + payloadSize);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Bytes of an incomplete frame held between reads.
+     */
+    size_t buffered() const { return held; }
+
+    /**
+     * @brief Where a read can put the rest of an incomplete frame, so that a large frame
+     * is received in place rather than into a scratch buffer and copied over. Once the
+     * header is in, the carry-over buffer grows with the frame, by up to reserveAhead
+     * bytes at a time. Passing feed() bytes read there adds them without a copy.
+     *
+     * @param room Set to the room for the frame's next bytes, no more than it still lacks.
+     * @return Null unless a frame whose header is complete is being carried over.
+     */
+    char *pendingTail(size_t &room)
+    {
+        size_t headerSize = 0;
+        uint32_t payloadSize = 0;
+        if (held == 0 || decodeHeader(carried(), headerSize, payloadSize) != HeaderStatus::Complete)
+        {
+            return nullptr;
+        }
+        size_t frameSize = headerSize + payloadSize;
+        size_t missing = frameSize - held;
+        grow(held + (missing < reserveAhead ? missing : reserveAhead), frameSize);
+        room = (capacity < frameSize ? capacity : frameSize) - held;
+        return partial.get() + held;
+    }
+
+private:
+    std::string_view carried() const { return std::string_view(partial.get(), held); }
+
+    /**
+     * @brief Makes the carry-over buffer at least size bytes, keeping what it holds.
+     */
+    void reserve(size_t size)
+    {
+        if (size <= capacity)
+        {
+            return;
+        }
+        // Uninitialised: every byte is read into first. A large buffer is grown in place
+        // by realloc, without copying what it holds.
+        char *grown = static_cast<char *>(std::realloc(partial.get(), size));
+        if (grown == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        partial.release();
+        partial.reset(grown);
+        capacity = size;
+    }
+
+    /**
+     * @brief Makes the carry-over buffer at least needed bytes for a frame of frameSize.
+     *
+     * The header alone does not prove the payload will come: the buffer grows to at most
+     * reserveAhead beyond what it holds, or to double its size once that is more, and
+     * never past the frame.
+     */
+    void grow(size_t needed, size_t frameSize)
+    {
+        if (needed <= capacity)
+        {
+            return;
+        }
+        size_t size = held + reserveAhead > capacity * 2 ? held + reserveAhead : capacity * 2;
+        size = size < frameSize ? size : frameSize;
+        reserve(size > needed ? size : needed);
+    }
+
+    /**
+     * @brief Appends to the carry-over buffer, grown toward the frame being assembled.
+     * Bytes already read into place by way of pendingTail() are only counted.
+     */
+    void hold(std::string_view data, size_t frameSize)
+    {
+        if (data.empty())
+        {
+            return;
+        }
+        if (partial && data.data() == partial.get() + held)
+        {
+            held += data.size();
+            return;
+        }
+        grow(held + data.size(), frameSize);
+        memcpy(partial.get() + held, data.data(), data.size());
+        held += data.size();
+    }
+
+    void release()
+    {
+        partial.reset();
+        held = 0;
+        capacity = 0;
+    }
+
+    bool fail()
+    {
+        failed = true;
+        release();
+        return false;
+    }
+
+    template <typename Callback>
+    static void deliver(std::string_view bytes, size_t headerSize, uint32_t payloadSize, Callback &onFrame)
+    {
+        Frame frame{static_cast<FrameType>(bytes[headerSize - 1]), bytes.substr(headerSize, payloadSize)};
+        onFrame(frame);
+    }
+};
@@ -0,0 +1,110 @@
+// latency_histogram.hpp
+// Latency recording in the style of HdrHistogram.
+//
+// Values are counted in buckets whose width grows with the value: each power of
+// two is split into 128 linear sub-buckets, so any recorded value is kept to
+// within 1% (better than two significant decimal digits) over the whole 64-bit
+// range, in a fixed array of counters. Recording is a bit scan, a shift and an
+// increment, cheap enough to do for every message. Each thread records into its
+// own histogram and the results are merged at the end.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class LatencyHistogram
+{
+private:
+    static constexpr unsigned subBucketBits = 8;                  // 256 sub-buckets in the first bucket, 128 after
+    static constexpr uint64_t subBucketCount = 1ull << subBucketBits;
+    static constexpr uint64_t subBucketHalf = subBucketCount / 2;
+    static constexpr size_t bucketCount = 64 - subBucketBits + 1; // Enough for every uint64_t value
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t minimum = UINT64_MAX;
+    uint64_t maximum = 0;
+    long double sum = 0;
+
+public:
+    LatencyHistogram() : counts((bucketCount + 1) * subBucketHalf, 0) {}
+
+    void record(uint64_t value)
+    {
+        ++counts[indexOf(value)];
+        ++total;
+        minimum = std::min(minimum, value);
+        maximum = std::max(maximum, value);
+        sum += static_cast<long double>(value);
+    }
+
+    /**
+     * @brief Adds every value recorded by another histogram.
+     */
+    void merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+        sum += other.sum;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total == 0 ? 0 : minimum; }
+    uint64_t max() const { return maximum; }
+    double mean() const { return total == 0 ? 0 : static_cast<double>(sum / total); }
+
+    /**
+     * @brief The value at or below which the given percentage of recorded values fall.
+     *
+     * @param percentile Between 0 and 100, e.g. 99.9.
+     * @return The highest value equivalent to the bucket holding that rank, capped at the
+     *         largest value recorded, or 0 if nothing was recorded.
+     */
+    uint64_t valueAt(double percentile) const
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        double fraction = std::min(std::max(percentile, 0.0), 100.0) / 100.0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(total))));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+            {
+                return std::min(highestEquivalent(i), maximum);
+            }
+        }
+        return maximum;
+    }
+
+private:
+    static size_t indexOf(uint64_t value)
+    {
+        unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(value | 1));
+        unsigned bucket = msb < subBucketBits ? 0 : msb - (subBucketBits - 1);
+        return (static_cast<size_t>(bucket) << (subBucketBits - 1)) + static_cast<size_t>(value >> bucket);
+    }
+
+    static uint64_t highestEquivalent(size_t index)
+    {
+        if (index < subBucketCount)
+        {
+            return index; // The first bucket is exact
+        }
+        unsigned bucket = static_cast<unsigned>(index >> (subBucketBits - 1)) - 1;
+        uint64_t sub = index - (static_cast<uint64_t>(bucket) << (subBucketBits - 1));
+        return ((sub + 1) << bucket) - 1;
+    }
+};
@@ -0,0 +1,213 @@
+// admission.hpp
+// Deciding at accept time which clients the server takes on.
+//
+// After a restart, every client of the server reconnects within a second or two.
+// Accepting them is cheap; serving more than the server can hold, or a host that
+// reconnects in a tight loop, is not. Two limits are applied to each accepted
+// socket before it costs a loop anything:
+//
+// - A cap on open connections. A client beyond it is turned away at once with a
+//   reset (SO_LINGER of zero): it fails fast and backs off, rather than waiting on
+//   a connection that will not be served, and no TIME_WAIT is left behind.
+// - A token bucket per client IP address, which refills at a fixed rate of new
+//   connections per second and holds at most a burst of them.
+//
+// The buckets live in a fixed table of 16-byte slots, grouped four to a 64-byte
+// cache line. An address hashes to one group and is only looked for there, so a
+// lookup touches one line and the table never allocates. When the group is full
+// of other addresses, the slot updated longest ago is taken over. That bucket has
+// most likely refilled, so forgetting it rarely admits a client the limit would
+// have refused.
+//
+// Loops accepting on SO_REUSEPORT sockets share the table, since the kernel
+// spreads one address's connections over all of them. Each group is guarded by one
+// of a set of striped locks, so two loops only wait for each other when their
+// clients hash to the same stripe.
+
+#pragma once
+
+#include <sys/socket.h> // getpeername, SO_LINGER
+#include <netinet/in.h> // sockaddr_in
+#include <unistd.h>     // close
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+/**
+ * @brief Limits on new connections; zero turns a limit off.
+ */
+struct AdmissionLimits
+{
+    size_t maxConnections = 0; // Open connections the server holds at most
+    unsigned ratePerIp = 0;    // New connections per second each client address may open
+    unsigned burstPerIp = 0;   // Connections an address may open at once; 0 = the rate
+};
+
+class Admission
+{
+public:
+    enum class Verdict
+    {
+        Admitted,
+        Full,    // The connection cap is reached
+        Limited, // The client's address used up its bucket
+    };
+
+private:
+    /**
+     * @brief One address's token bucket, padded so that no slot straddles a cache line.
+     */
+    struct alignas(16) Slot
+    {
+        uint32_t address; // IPv4 address in network order; 0 = free
+        uint32_t updated; // Milliseconds since the table was created when tokens was computed
+        float tokens;
+    };
+
+    static constexpr unsigned slotsPerGroup = 4;
+    static constexpr unsigned groupBits = 10; // 1024 groups of 4 slots, 64 KiB
+    static constexpr unsigned stripeCount = 64;
+
+    /**
+     * @brief The slots an address can occupy: one cache line.
+     */
+    struct alignas(64) Group
+    {
+        Slot slots[slotsPerGroup];
+    };
+
+    struct alignas(64) Stripe
+    {
+        std::mutex mutex; // Guards the groups whose index is the stripe's modulo stripeCount
+    };
+
+    static_assert(sizeof(Slot) == 16 && sizeof(Group) == 64, "a group must fill one cache line");
+
+    AdmissionLimits limits;
+    std::atomic<size_t> open{0};
+    std::atomic<uint64_t> turnedAway[3] = {}; // By verdict
+    std::unique_ptr<Group[]> table;
+    std::unique_ptr<Stripe[]> stripes;
+    std::chrono::steady_clock::time_point created = std::chrono::steady_clock::now();
+
+public:
+    explicit Admission(const AdmissionLimits &limits)
+        : limits(limits),
+          table(limits.ratePerIp > 0 ? new Group[size_t{1} << groupBits]() : nullptr),
+          stripes(limits.ratePerIp > 0 ? new Stripe[stripeCount] : nullptr) {}
+
+    Admission(const Admission &) = delete;
+    Admission &operator=(const Admission &) = delete;
+
+    /**
+     * @brief Decides on a client just accepted. A client turned away is reset and its
+     * socket closed; an admitted one holds a slot until release().
+     *
+     * @param peer The client's address, or null to look it up if the rate limit needs it.
+     * @return true if the client was admitted.
+     */
+    bool admit(int fd, const sockaddr_in *peer)
+    {
+        sockaddr_in address{};
+        if (peer == nullptr && table)
+        {
+            socklen_t length = sizeof(address);
+            getpeername(fd, reinterpret_cast<sockaddr *>(&address), &length);
+            peer = &address;
+        }
+        Verdict verdict = decide(peer != nullptr ? peer->sin_addr.s_addr : 0);
+        if (verdict == Verdict::Admitted)
+        {
+            return true;
+        }
+        turnedAway[static_cast<int>(verdict)].fetch_add(1, std::memory_order_relaxed);
+        linger reset{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(fd);
+        return false;
+    }
+
+    /**
+     * @brief Frees the slot of an admitted client whose connection closed.
+     */
+    void release() { open.fetch_sub(1, std::memory_order_relaxed); }
+
+    size_t connections() const { return open.load(std::memory_order_relaxed); }
+    uint64_t rejected(Verdict verdict) const { return turnedAway[static_cast<int>(verdict)].load(std::memory_order_relaxed); }
+
+private:
+    Verdict decide(uint32_t address)
+    {
+        if (limits.maxConnections > 0)
+        {
+            size_t current = open.load(std::memory_order_relaxed);
+            do
+            {
+                if (current >= limits.maxConnections)
+                {
+                    return Verdict::Full; // Checked first: costs no lock and no token
+                }
+            } while (!open.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+        }
+        else
+        {
+            open.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (table && address != 0 && !take(address))
+        {
+            open.fetch_sub(1, std::memory_order_relaxed);
+            return Verdict::Limited;
+        }
+        return Verdict::Admitted;
+    }
+
+    /**
+     * @brief Takes a token from the address's bucket.
+     *
+     * @return false if the bucket is empty.
+     */
+    bool take(uint32_t address)
+    {
+        uint32_t now = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                 std::chrono::steady_clock::now() - created)
+                                                 .count());
+        float burst = static_cast<float>(limits.burstPerIp > 0 ? limits.burstPerIp : limits.ratePerIp);
+        size_t index = (address * 0x9e3779b1u) >> (32 - groupBits); // Fibonacci hashing spreads nearby addresses
+        Group &group = table[index];
+
+        std::lock_guard<std::mutex> lock(stripes[index % stripeCount].mutex);
+        Slot *slot = nullptr;
+        Slot *stalest = &group.slots[0];
+        for (Slot &candidate : group.slots)
+        {
+            if (candidate.address == address || candidate.address == 0)
+            {
+                slot = &candidate;
+                break;
+            }
+            if (now - candidate.updated > now - stalest->updated)
+            {
+                stalest = &candidate;
+            }
+        }
+        if (slot == nullptr || slot->address != address)
+        {
+            slot = slot != nullptr ? slot : stalest;
+            *slot = Slot{address, now, burst};
+        }
+        else
+        {
+            float refilled = slot->tokens + static_cast<float>(now - slot->updated) * static_cast<float>(limits.ratePerIp) / 1000.0f;
+            slot->tokens = refilled < burst ? refilled : burst;
+            slot->updated = now;
+        }
+        if (slot->tokens < 1.0f)
+        {
+            return false;
+        }
+        slot->tokens -= 1.0f;
+        return true;
+    }
+};
@@ -0,0 +1,267 @@
+// coroutine.hpp
+// C++20 coroutine API for connection handlers on the event loops.
+//
+// The threaded mode reads like a script, one blocking call after another, but
+// pays for it with a thread per client. The event loops serve thousands of
+// clients from a few threads, but their handlers are callbacks that see whatever
+// bytes one read produced. A coroutine handler gets both: it is written as a
+// plain loop over the connection's frames,
+//
+//     while (std::optional<Frame> frame = co_await stream.readFrame())
+//     {
+//         co_await stream.write(reply);
+//     }
+//
+// and suspends whenever it waits for input, which costs only its frame.
+//
+// The connection's FrameStream owns the coroutine. The data handler feeds it the
+// frames the parser completes, and each frame resumes the suspended coroutine
+// directly on the loop thread. The frame is passed as a view, so nothing is
+// copied. write() queues output through the loop and never suspends: a client that
+// does not read its replies is throttled by the loop, which stops reading it, so
+// its handler simply waits longer in readFrame(). A client that disconnects
+// destroys the stream, and with it the suspended coroutine; its locals are
+// destroyed as usual.
+//
+// Coroutine frames come from the loop's BufferPool through the promise's
+// operator new, so a connection costs no trip to the heap once the pool is warm.
+//
+// Everything here needs C++20; CONNECTION_COROUTINES is defined when it is
+// available.
+
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#define CONNECTION_COROUTINES 1
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#include "../common/framing.hpp" // Frames read by the handler
+#include "io_loop.hpp"           // Output goes through the owning loop
+#include "pool.hpp"              // Coroutine frames come from the loop's pool
+
+/**
+ * @brief The coroutine type of a connection handler. Started and owned by a FrameStream.
+ */
+class ConnectionTask
+{
+public:
+    struct promise_type
+    {
+        std::exception_ptr exception; // Thrown by the handler; reported by the stream
+
+        ConnectionTask get_return_object()
+        {
+            return ConnectionTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; } // Started once the stream holds it
+        std::suspend_always final_suspend() noexcept { return {}; }   // Destroyed by the stream
+        void return_void() {}
+        void unhandled_exception() { exception = std::current_exception(); }
+
+        static void *operator new(size_t size) { return BufferPool::allocate(size); }
+        static void operator delete(void *pointer, size_t size) { BufferPool::deallocate(pointer, size); }
+    };
+
+    ConnectionTask() = default;
+    ConnectionTask(ConnectionTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    ConnectionTask &operator=(ConnectionTask &&other) noexcept
+    {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    ~ConnectionTask()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    bool done() const { return !handle || handle.done(); }
+
+    /**
+     * @brief Runs the coroutine until it next suspends or returns.
+     */
+    void resume()
+    {
+        if (!done())
+        {
+            handle.resume();
+        }
+    }
+
+    std::exception_ptr exception() const { return handle ? handle.promise().exception : nullptr; }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit ConnectionTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+};
+
+/**
+ * @brief A connection as seen by its coroutine handler. Lives on the loop thread that
+ * owns the connection; every member must be called there.
+ */
+class FrameStream
+{
+private:
+    IoLoop &loop;
+    Connection &conn;
+    ConnectionTask task;
+    std::coroutine_handle<> reader;    // The handler, while it waits in readFrame()
+    const Frame *incoming = nullptr;   // Frame handed to the waiting reader, null at the end
+    bool ended = false;                // No more frames will be delivered
+
+public:
+    FrameStream(IoLoop &loop, Connection &conn) : loop(loop), conn(conn) {}
+
+    FrameStream(const FrameStream &) = delete;
+    FrameStream &operator=(const FrameStream &) = delete;
+
+    /**
+     * @brief Starts the handler; it runs until it first waits for a frame.
+     *
+     * @param handler A coroutine, typically started with this stream as an argument.
+     */
+    void start(ConnectionTask handler)
+    {
+        task = std::move(handler);
+        resume();
+    }
+
+    /**
+     * @brief Passes a frame completed by the parser to the handler. The payload only has
+     * to stay valid for the duration of the call.
+     *
+     * Frames that arrive after the handler has returned or closed the stream are ignored.
+     */
+    void deliver(const Frame &frame)
+    {
+        if (ended || !reader)
+        {
+            return;
+        }
+        incoming = &frame;
+        resume();
+        incoming = nullptr;
+    }
+
+    /**
+     * @brief Tells the handler that no more frames will arrive, such as after malformed
+     * input; its pending readFrame() returns nothing.
+     */
+    void end()
+    {
+        if (!ended)
+        {
+            ended = true;
+            resume();
+        }
+    }
+
+    /**
+     * @brief Awaits the next frame.
+     *
+     * @return The frame, or nothing once the stream has ended. The payload view is
+     *         valid until the handler next suspends.
+     */
+    auto readFrame()
+    {
+        struct Awaiter
+        {
+            FrameStream &stream;
+
+            bool await_ready() const noexcept { return stream.ended; }
+            void await_suspend(std::coroutine_handle<> handle) noexcept { stream.reader = handle; }
+            std::optional<Frame> await_resume() const noexcept
+            {
+                if (stream.incoming == nullptr)
+                {
+                    return std::nullopt;
+                }
+                return *stream.incoming;
+            }
+        };
+        return Awaiter{*this};
+    }
+
+    /**
+     * @brief Queues encoded output for the client.
+     *
+     * Completes at once: the loop owns the data from here on, and throttles a client
+     * whose output piles up by no longer reading from it.
+     *
+     * @return false if the stream has ended or the connection is closing, in which
+     *         case nothing was queued.
+     */
+    auto write(std::string_view data)
+    {
+        bool accepted = !ended && !conn.closing && !conn.failed;
+        if (accepted && !data.empty())
+        {
+            loop.send(conn, data.data(), data.size());
+        }
+        return ReadyAwaiter<bool>{accepted};
+    }
+
+    /**
+     * @brief Closes the connection once its output has been flushed, and ends the stream.
+     */
+    void close()
+    {
+        ended = true;
+        loop.closeAfterFlush(conn);
+    }
+
+private:
+    /**
+     * @brief An awaitable that never suspends, for operations that complete at once.
+     */
+    template <typename T>
+    struct ReadyAwaiter
+    {
+        T value;
+
+        bool await_ready() const noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+        T await_resume() const noexcept { return value; }
+    };
+
+    void resume()
+    {
+        reader = nullptr;
+        task.resume();
+        if (!task.done())
+        {
+            return;
+        }
+        if (std::exception_ptr error = task.exception())
+        {
+            try
+            {
+                std::rethrow_exception(error);
+            }
+            catch (const std::exception &e)
+            {
+                logError() << "Handler of client [" << conn.fd << "] failed: " << e.what();
+            }
+            catch (...)
+            {
+                logError() << "Handler of client [" << conn.fd << "] failed.";
+            }
+        }
+        if (!ended)
+        {
+            close(); // A handler that returns is done with the connection
+        }
+    }
+};
+
+#endif
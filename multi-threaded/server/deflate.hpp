@@ -0,0 +1,469 @@
+// deflate.hpp
+// permessage-deflate (RFC 7692) for SimpleServer's WebSocket mode.
+//
+// Negotiation picks the first acceptable offer from the client's
+// Sec-WebSocket-Extensions header. zlib contexts are large (a deflater with a
+// 32 KiB window and memLevel 8 needs about 256 KiB), so they come from a pool
+// owned by each event loop thread: connections that keep compression context
+// across messages hold theirs for life and count against a per-loop cap, while
+// no-context-takeover connections borrow one only for the duration of a message.
+
+#pragma once
+
+#include <zlib.h> // Raw deflate streams
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Server-side permessage-deflate settings.
+ */
+struct DeflateOptions
+{
+    bool enabled = false;       // Accept permessage-deflate offers at all
+    int windowBits = 15;        // Largest LZ77 window the server compresses with (9-15)
+    int memLevel = 8;           // zlib memLevel for deflaters (1-9); lower uses less memory
+    bool contextTakeover = true; // Keep compression context between messages (both directions)
+    size_t threshold = 256;     // Messages shorter than this are sent uncompressed
+    size_t maxContexts = 256;   // zlib contexts connections may hold between messages, per loop
+};
+
+/**
+ * @brief Parameters agreed with one client.
+ */
+struct DeflateParams
+{
+    int serverWindowBits = 15;           // Window the server compresses with
+    int clientWindowBits = 15;           // Window the client compresses with (server inflates with it)
+    bool serverNoContextTakeover = false; // Server resets its deflater after every message
+    bool clientNoContextTakeover = false; // Client resets its deflater after every message
+};
+
+/**
+ * @brief RAII wrapper for a raw deflate or inflate z_stream.
+ */
+class ZStream
+{
+public:
+    enum Kind
+    {
+        Deflater,
+        Inflater,
+    };
+
+private:
+    z_stream stream{};
+    Kind kind;
+    int windowBits;
+    bool ready;
+
+public:
+    ZStream(Kind kind, int windowBits, int memLevel) : kind(kind), windowBits(windowBits)
+    {
+        // Negative window bits select raw deflate data without zlib headers
+        int status = kind == Deflater
+                         ? deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, memLevel, Z_DEFAULT_STRATEGY)
+                         : inflateInit2(&stream, -windowBits);
+        ready = status == Z_OK;
+    }
+
+    ZStream(const ZStream &) = delete;
+    ZStream &operator=(const ZStream &) = delete;
+
+    ~ZStream()
+    {
+        if (ready)
+        {
+            kind == Deflater ? deflateEnd(&stream) : inflateEnd(&stream);
+        }
+    }
+
+    bool valid() const { return ready; }
+    int bits() const { return windowBits; }
+    z_stream *get() { return &stream; }
+
+    void reset()
+    {
+        kind == Deflater ? deflateReset(&stream) : inflateReset(&stream);
+    }
+};
+
+/**
+ * @brief Per-thread pool of zlib contexts, bounded both in idle and in held contexts.
+ */
+class DeflateContextPool
+{
+private:
+    static constexpr size_t maxIdlePerSize = 16; // Idle contexts kept per kind and window size
+
+    std::array<std::vector<std::unique_ptr<ZStream>>, 16> idleDeflaters; // Indexed by window bits
+    std::array<std::vector<std::unique_ptr<ZStream>>, 16> idleInflaters;
+    size_t held = 0; // Contexts reserved by connections with context takeover
+
+public:
+    /**
+     * @brief The pool of the calling event loop thread.
+     */
+    static DeflateContextPool &local()
+    {
+        static thread_local DeflateContextPool pool;
+        return pool;
+    }
+
+    /**
+     * @brief Reserves room for contexts a connection will hold between messages.
+     *
+     * @return false if the loop is at its limit; the extension should then be declined.
+     */
+    bool reserve(size_t count, size_t limit)
+    {
+        if (held + count > limit)
+        {
+            return false;
+        }
+        held += count;
+        return true;
+    }
+
+    void unreserve(size_t count) { held -= count; }
+
+    std::unique_ptr<ZStream> acquire(ZStream::Kind kind, int windowBits, int memLevel)
+    {
+        auto &idle = (kind == ZStream::Deflater ? idleDeflaters : idleInflaters)[windowBits];
+        if (!idle.empty())
+        {
+            std::unique_ptr<ZStream> stream = std::move(idle.back());
+            idle.pop_back();
+            return stream;
+        }
+        auto stream = std::make_unique<ZStream>(kind, windowBits, memLevel);
+        return stream->valid() ? std::move(stream) : nullptr;
+    }
+
+    /**
+     * @brief Resets a context and keeps it for reuse, or frees it if enough are idle.
+     */
+    void release(ZStream::Kind kind, std::unique_ptr<ZStream> stream)
+    {
+        if (!stream)
+        {
+            return;
+        }
+        auto &idle = (kind == ZStream::Deflater ? idleDeflaters : idleInflaters)[stream->bits()];
+        if (idle.size() < maxIdlePerSize)
+        {
+            stream->reset();
+            idle.push_back(std::move(stream));
+        }
+    }
+};
+
+/**
+ * @brief Parses the client's Sec-WebSocket-Extensions offers and accepts the first usable
+ * permessage-deflate offer.
+ *
+ * @param header Value of the Sec-WebSocket-Extensions header (offers separated by commas).
+ * @param options Server settings.
+ * @param params Set to the agreed parameters on success.
+ * @param response Set to the Sec-WebSocket-Extensions response value on success.
+ * @return true if an offer was accepted.
+ */
+inline bool negotiateDeflate(std::string_view header, const DeflateOptions &options, DeflateParams &params, std::string &response)
+{
+    auto trim = [](std::string_view s)
+    {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        {
+            s.remove_suffix(1);
+        }
+        return s;
+    };
+    auto parseBits = [](std::string_view value, int &bits)
+    {
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+        {
+            value = value.substr(1, value.size() - 2);
+        }
+        if (value.size() < 1 || value.size() > 2)
+        {
+            return false;
+        }
+        bits = 0;
+        for (char c : value)
+        {
+            if (c < '0' || c > '9')
+            {
+                return false;
+            }
+            bits = bits * 10 + (c - '0');
+        }
+        return bits >= 8 && bits <= 15;
+    };
+
+    while (!header.empty())
+    {
+        size_t comma = header.find(',');
+        std::string_view offer = trim(header.substr(0, comma));
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+
+        size_t semicolon = offer.find(';');
+        if (trim(offer.substr(0, semicolon)) != "permessage-deflate")
+        {
+            continue;
+        }
+        std::string_view rest = semicolon == std::string_view::npos ? std::string_view() : offer.substr(semicolon + 1);
+
+        DeflateParams agreed;
+        agreed.serverNoContextTakeover = !options.contextTakeover;
+        agreed.clientNoContextTakeover = !options.contextTakeover;
+        agreed.serverWindowBits = options.windowBits;
+        bool clientBitsAllowed = false, seenServerTakeover = false, seenClientTakeover = false;
+        bool seenServerBits = false, seenClientBits = false, acceptable = true;
+        int clientBitsOffered = 15;
+
+        while (!rest.empty() && acceptable)
+        {
+            size_t next = rest.find(';');
+            std::string_view param = trim(rest.substr(0, next));
+            rest = next == std::string_view::npos ? std::string_view() : rest.substr(next + 1);
+            size_t equals = param.find('=');
+            std::string_view name = trim(param.substr(0, equals));
+            std::string_view value = equals == std::string_view::npos ? std::string_view() : trim(param.substr(equals + 1));
+            int bits = 0;
+
+            if (name == "server_no_context_takeover" && value.empty() && !seenServerTakeover)
+            {
+                seenServerTakeover = true;
+                agreed.serverNoContextTakeover = true;
+            }
+            else if (name == "client_no_context_takeover" && value.empty() && !seenClientTakeover)
+            {
+                seenClientTakeover = true;
+                agreed.clientNoContextTakeover = true;
+            }
+            else if (name == "server_max_window_bits" && !seenServerBits && parseBits(value, bits))
+            {
+                seenServerBits = true;
+                // zlib cannot produce an 8-bit window, so such offers are declined
+                acceptable = bits >= 9;
+                agreed.serverWindowBits = std::min(bits, options.windowBits);
+            }
+            else if (name == "client_max_window_bits" && !seenClientBits && (value.empty() || parseBits(value, bits)))
+            {
+                seenClientBits = true;
+                clientBitsAllowed = true;
+                clientBitsOffered = value.empty() ? 15 : bits;
+            }
+            else
+            {
+                acceptable = false; // Unknown, duplicate or malformed parameter
+            }
+        }
+        if (!acceptable)
+        {
+            continue;
+        }
+
+        // The client's window can only be limited if it offered client_max_window_bits
+        agreed.clientWindowBits = clientBitsAllowed ? std::max(9, std::min(clientBitsOffered, options.windowBits)) : 15;
+
+        response = "permessage-deflate";
+        if (agreed.serverNoContextTakeover)
+        {
+            response += "; server_no_context_takeover";
+        }
+        if (agreed.clientNoContextTakeover)
+        {
+            response += "; client_no_context_takeover";
+        }
+        if (agreed.serverWindowBits < 15 || seenServerBits)
+        {
+            response += "; server_max_window_bits=" + std::to_string(agreed.serverWindowBits);
+        }
+        if (clientBitsAllowed && agreed.clientWindowBits < 15)
+        {
+            response += "; client_max_window_bits=" + std::to_string(agreed.clientWindowBits);
+        }
+        params = agreed;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Compression state of one WebSocket connection.
+ */
+class PerMessageDeflate
+{
+public:
+    /**
+     * @brief Outcome of decompressing a message.
+     */
+    enum class InflateStatus
+    {
+        Ok,
+        Corrupt, // Not valid deflate data
+        TooBig,  // Larger than the allowed message size once decompressed
+    };
+
+private:
+    DeflateParams params;
+    int memLevel;
+    size_t threshold;
+    size_t reserved;                    // Contexts reserved in the pool for this connection
+    std::unique_ptr<ZStream> deflater; // Held for life with context takeover, else per message
+    std::unique_ptr<ZStream> inflater;
+
+public:
+    /**
+     * @brief Reserves the contexts the agreed parameters require in the thread's pool.
+     *
+     * @return nullptr if the pool is full, in which case the extension must be declined.
+     */
+    static std::unique_ptr<PerMessageDeflate> create(const DeflateParams &params, const DeflateOptions &options)
+    {
+        size_t needed = (params.serverNoContextTakeover ? 0 : 1) + (params.clientNoContextTakeover ? 0 : 1);
+        if (!DeflateContextPool::local().reserve(needed, options.maxContexts))
+        {
+            return nullptr;
+        }
+        return std::unique_ptr<PerMessageDeflate>(new PerMessageDeflate(params, options, needed));
+    }
+
+    PerMessageDeflate(const PerMessageDeflate &) = delete;
+    PerMessageDeflate &operator=(const PerMessageDeflate &) = delete;
+
+    ~PerMessageDeflate()
+    {
+        DeflateContextPool &pool = DeflateContextPool::local();
+        pool.release(ZStream::Deflater, std::move(deflater));
+        pool.release(ZStream::Inflater, std::move(inflater));
+        pool.unreserve(reserved);
+    }
+
+    /**
+     * @brief Compresses a message payload for sending with RSV1 set.
+     *
+     * @return false if the message should be sent uncompressed instead.
+     */
+    bool compress(std::string_view input, std::string &output)
+    {
+        if (input.size() < threshold)
+        {
+            return false;
+        }
+        if (!deflater)
+        {
+            deflater = DeflateContextPool::local().acquire(ZStream::Deflater, params.serverWindowBits, memLevel);
+            if (!deflater)
+            {
+                return false;
+            }
+        }
+
+        z_stream *z = deflater->get();
+        output.resize(deflateBound(z, input.size()) + 16);
+        z->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+        z->avail_in = static_cast<uInt>(input.size());
+        size_t produced = 0;
+        do
+        {
+            if (produced == output.size())
+            {
+                output.resize(output.size() * 2);
+            }
+            z->next_out = reinterpret_cast<Bytef *>(&output[produced]);
+            z->avail_out = static_cast<uInt>(output.size() - produced);
+            deflate(z, Z_SYNC_FLUSH);
+            produced = output.size() - z->avail_out;
+        } while (z->avail_out == 0);
+
+        // A sync flush ends with an empty stored block (00 00 ff ff) that the extension omits
+        output.resize(produced >= 4 ? produced - 4 : 0);
+
+        if (params.serverNoContextTakeover)
+        {
+            DeflateContextPool::local().release(ZStream::Deflater, std::move(deflater));
+            // Without shared context the peer doesn't care whether this message was compressed
+            return output.size() < input.size();
+        }
+        return true; // The client's window must see every message the deflater consumed
+    }
+
+    /**
+     * @brief Decompresses a message received with RSV1 set.
+     */
+    InflateStatus decompress(std::string_view input, std::string &output, size_t maxSize)
+    {
+        output.clear();
+        if (!inflater)
+        {
+            inflater = DeflateContextPool::local().acquire(ZStream::Inflater, params.clientWindowBits, memLevel);
+            if (!inflater)
+            {
+                return InflateStatus::Corrupt;
+            }
+        }
+
+        static const unsigned char trailer[4] = {0x00, 0x00, 0xff, 0xff};
+        InflateStatus status = inflateChunk(reinterpret_cast<const unsigned char *>(input.data()), input.size(), output, maxSize);
+        if (status == InflateStatus::Ok)
+        {
+            status = inflateChunk(trailer, sizeof(trailer), output, maxSize);
+        }
+
+        if (params.clientNoContextTakeover || status != InflateStatus::Ok)
+        {
+            DeflateContextPool::local().release(ZStream::Inflater, std::move(inflater));
+        }
+        return status;
+    }
+
+private:
+    PerMessageDeflate(const DeflateParams &params, const DeflateOptions &options, size_t reserved)
+        : params(params), memLevel(options.memLevel), threshold(options.threshold), reserved(reserved) {}
+
+    InflateStatus inflateChunk(const unsigned char *data, size_t length, std::string &output, size_t maxSize)
+    {
+        z_stream *z = inflater->get();
+        z->next_in = const_cast<Bytef *>(data);
+        z->avail_in = static_cast<uInt>(length);
+        do
+        {
+            size_t used = output.size();
+            if (used > maxSize)
+            {
+                return InflateStatus::TooBig;
+            }
+            size_t chunk = std::min<size_t>(std::max<size_t>(length * 2, 4096), maxSize + 1 - used);
+            output.resize(used + chunk);
+            z->next_out = reinterpret_cast<Bytef *>(&output[used]);
+            z->avail_out = static_cast<uInt>(chunk);
+            int status = inflate(z, Z_SYNC_FLUSH);
+            output.resize(used + chunk - z->avail_out);
+
+            if (status == Z_STREAM_END)
+            {
+                inflater->reset(); // Client ended the deflate stream; the next message starts fresh
+                break;
+            }
+            else if (status != Z_OK && status != Z_BUF_ERROR)
+            {
+                return InflateStatus::Corrupt;
+            }
+            else if (status == Z_BUF_ERROR && z->avail_out != 0)
+            {
+                break; // No progress possible without more input
+            }
+        } while (z->avail_in > 0 || z->avail_out == 0); // A full buffer may leave output pending
+        return output.size() > maxSize ? InflateStatus::TooBig : InflateStatus::Ok;
+    }
+};
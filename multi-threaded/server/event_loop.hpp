@@ -0,0 +1,842 @@
+// event_loop.hpp
+// Edge-triggered epoll reactor used by SimpleServer's event-driven modes.
+//
+// Every EventLoop runs on exactly one thread and owns the connections registered
+// with it for their whole life. Sockets are non-blocking and registered with
+// EPOLLET, so each readiness notification is drained until EAGAIN. Incoming data
+// is read into a single per-loop scratch buffer; a connection only holds memory
+// for bytes it could not send yet, which keeps idle connections cheap. That
+// memory, like the connection itself, comes from the loop's pool, and the work
+// lists below keep their capacity between wakeups.
+//
+// A loop either receives sockets accepted elsewhere through adoptConnection(), or
+// accepts on a listening socket of its own (see addListener()), in which case no
+// other thread ever touches its connections. Broadcasts and topic publications
+// arrive the same way as adopted sockets: posted to a lock-free per-loop mailbox
+// and picked up after an eventfd wakeup, one per burst.
+//
+// File regions in an outbound queue go out with sendfile. With a zero-copy
+// threshold set, large shared buffers go out with MSG_ZEROCOPY instead of
+// sendmsg. The kernel reports on the socket's error queue when it is done with
+// them, which raises EPOLLERR, and a closing connection waits for those reports
+// before it closes.
+
+#pragma once
+
+#include <sys/epoll.h>       // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h>     // eventfd for cross-thread wakeups
+#include <sys/sendfile.h>    // Sending file regions
+#include <sys/socket.h>      // recv, send, sendmsg
+#include <ctime>             // timespec, used by linux/errqueue.h
+#include <linux/errqueue.h>  // Zero-copy completion reports
+#include <unistd.h>          // close, read, write
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "io_loop.hpp"    // Connection and the IoLoop interface
+#include "mpsc_queue.hpp" // Mailbox for work posted by other threads
+
+class EventLoop : public IoLoop
+{
+private:
+    static constexpr int maxEvents = 256;              // Events fetched per epoll_wait call
+    static constexpr size_t readBufferSize = 64 * 1024; // Shared scratch buffer for recv
+    static constexpr size_t inPlaceRead = 16 * 1024;     // Rest of a frame at least this large is read into its own buffer
+    static constexpr size_t maxIov = 64;                 // Queue segments written per sendmsg call
+    static constexpr size_t mailboxCapacity = 1024;      // Posted items held before a mailbox overflows
+    static constexpr size_t mailboxOverflow = 15 * 1024; // Items held behind a full ring before posts fail
+
+    int id;                  // Loop index, used in log output
+    int epollFd;             // epoll instance driving this loop
+    int wakeFd;              // eventfd used to interrupt epoll_wait from other threads
+    int listenFd = -1;       // Optional listening socket accepted on by this loop (not owned)
+    std::atomic<bool> running;
+    DataHandler onData;
+    ConnectionHandler onOpen;
+
+    Mailbox<int> pendingFds;                 // Sockets handed over by other threads, not yet registered
+    Mailbox<Publication> pendingMessages;    // Broadcasts and publications not yet queued
+
+    ConnectionTable<Connection> connections; // Owned connections by fd
+    std::unique_ptr<char[]> readBuffer;      // Scratch space reused for every recv; never zeroed
+    std::vector<int> resumed;                // Throttled connections to read again
+
+    // Work lists of the loop thread, cleared after use rather than freed
+    std::vector<Publication> delivering; // Taken from pendingMessages
+    std::vector<Connection *> touched;   // Connections whose queue was empty before a delivery batch
+    std::vector<int> failedFds;          // Failed or finished closing during a delivery batch
+    std::vector<int> resuming;           // Taken from resumed
+
+public:
+    /**
+     * @brief Creates the epoll instance and wakeup eventfd for a loop.
+     *
+     * @param id Index of this loop, used to tag log messages.
+     * @param onData Callback receiving data read from connections.
+     * @param onOpen Optional callback for newly registered connections.
+     */
+    EventLoop(int id, DataHandler onData, ConnectionHandler onOpen = nullptr)
+        : id(id), running(true), onData(std::move(onData)), onOpen(std::move(onOpen)),
+          pendingFds(mailboxCapacity, mailboxOverflow), pendingMessages(mailboxCapacity, mailboxOverflow), readBuffer(new char[readBufferSize])
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0)
+        {
+            std::cerr << "Failed to create event loop " << id << "." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    /**
+     * @brief Closes every owned connection along with the loop's descriptors.
+     */
+    ~EventLoop()
+    {
+        for (auto &entry : connections)
+        {
+            close(entry.first);
+        }
+        pendingFds.drain([](int fd)
+                         { close(fd); });
+        close(wakeFd);
+        close(epollFd);
+    }
+
+    bool adoptConnection(int fd) override
+    {
+        PostResult result = pendingFds.post(fd);
+        if (result == PostResult::WakeUp)
+        {
+            wakeup();
+        }
+        return result != PostResult::Full;
+    }
+
+    void broadcast(SharedBuffer message) override
+    {
+        Publication publication{PooledString(), std::move(message), true};
+        if (!post(publication))
+        {
+            shed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void publish(std::string_view topic, SharedBuffer message) override
+    {
+        Publication publication{PooledString(topic), std::move(message), false};
+        if (!post(publication))
+        {
+            shed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void reply(int fd, uint64_t serial, SharedBuffer message, bool close) override
+    {
+        Publication publication{PooledString(), std::move(message), false, fd, serial, close};
+        while (!post(publication) && running.load(std::memory_order_relaxed))
+        {
+            std::this_thread::yield(); // The loop is already due to drain its mailbox
+        }
+    }
+
+    void addListener(int fd) override
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        if (!setNonBlocking(fd) || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            std::cerr << "Failed to register listening socket with loop " << id << "." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        listenFd = fd;
+    }
+
+    void stop() override
+    {
+        running = false;
+        wakeup();
+    }
+
+    void drain() override
+    {
+        drainRequested = true;
+        wakeup();
+    }
+
+    /**
+     * @brief Number of connections currently owned by the loop (loop thread only).
+     */
+    size_t connectionCount() const { return connections.size(); }
+
+    /**
+     * @brief Queues data for a connection, writing as much as possible immediately.
+     *
+     * Bytes the kernel does not accept are kept in the connection's outbound queue
+     * and flushed on the next EPOLLOUT edge.
+     */
+    void send(Connection &conn, const char *data, size_t length) override
+    {
+        if (conn.failed || !admit(conn, conn.outbound.size(), length))
+        {
+            return;
+        }
+        bool started = false;
+        if (conn.outbound.empty())
+        {
+            size_t sent = writeSome(conn, data, length);
+            data += sent;
+            length -= sent;
+            started = sent > 0;
+        }
+        if (!conn.failed)
+        {
+            conn.outbound.append(data, length, started); // The rest of a message already started is never dropped
+            updateThrottle(conn);
+        }
+    }
+
+    void send(Connection &conn, SharedBuffer message) override
+    {
+        if (conn.failed || !admit(conn, conn.outbound.size(), message->size()))
+        {
+            return;
+        }
+        bool idle = conn.outbound.empty();
+        conn.outbound.append(std::move(message));
+        if (idle)
+        {
+            flush(conn); // Otherwise the next EPOLLOUT edge picks it up behind earlier output
+        }
+        updateThrottle(conn);
+    }
+
+    void send(Connection &conn, SharedFile file, size_t offset, size_t length, std::string_view header = {}) override
+    {
+        if (conn.failed || !admit(conn, conn.outbound.size(), header.size() + length))
+        {
+            return;
+        }
+        bool idle = conn.outbound.empty();
+        conn.outbound.append(header.data(), header.size());
+        conn.outbound.append(std::move(file), offset, length, !header.empty());
+        if (idle)
+        {
+            flush(conn);
+        }
+        updateThrottle(conn);
+    }
+
+    void run() override
+    {
+        attachThread();
+        if (openTicker())
+        {
+            epoll_event ev{};
+            ev.events = EPOLLIN; // Level-triggered: read once per wakeup
+            ev.data.fd = tickFd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, tickFd, &ev);
+        }
+        std::vector<epoll_event> events(maxEvents);
+        while (running)
+        {
+            int ready = epoll_wait(epollFd, events.data(), maxEvents, -1);
+            if (ready < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                logError() << "epoll_wait failed on loop " << id << ".";
+                break;
+            }
+
+            for (int i = 0; i < ready; ++i)
+            {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd)
+                {
+                    drainWakeups();
+                    continue;
+                }
+                if (fd == listenFd)
+                {
+                    acceptPending();
+                    continue;
+                }
+                if (fd == tickFd)
+                {
+                    uint64_t expirations;
+                    ssize_t ignored = read(tickFd, &expirations, sizeof(expirations));
+                    (void)ignored;
+                    expireIdleTimers([this](Connection &timedOut)
+                                     { closeConnection(timedOut.fd); });
+                    continue;
+                }
+
+                auto it = connections.find(fd);
+                if (it == connections.end())
+                {
+                    continue; // Closed earlier in this batch
+                }
+                Connection &conn = *it->second;
+
+                uint32_t flags = events[i].events;
+                if ((flags & EPOLLERR) && !conn.zeroCopy.empty())
+                {
+                    readZeroCopyCompletions(conn);
+                    if (finishIfClosing(conn))
+                    {
+                        continue;
+                    }
+                }
+                if ((flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !conn.throttled)
+                {
+                    if (!handleReadable(conn, (flags & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0))
+                    {
+                        continue; // Connection was closed
+                    }
+                }
+                if (flags & EPOLLOUT)
+                {
+                    handleWritable(conn);
+                }
+            }
+            resumeReading();
+        }
+        detachThread();
+    }
+
+private:
+    /**
+     * @return false if the mailbox is full; the publication is left with the caller.
+     */
+    bool post(Publication &publication)
+    {
+        PostResult result = pendingMessages.post(publication);
+        if (result == PostResult::WakeUp)
+        {
+            wakeup();
+        }
+        return result != PostResult::Full;
+    }
+
+    void wakeup()
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    /**
+     * @brief Clears the eventfd counter and registers sockets handed over by other threads.
+     */
+    void drainWakeups()
+    {
+        uint64_t count;
+        while (read(wakeFd, &count, sizeof(count)) > 0)
+        {
+        }
+
+        pendingFds.drain([this](int fd)
+                         { registerConnection(fd); });
+        pendingMessages.drain([this](Publication &publication)
+                              { delivering.push_back(std::move(publication)); });
+        if (!delivering.empty())
+        {
+            deliverMessages(delivering);
+            delivering.clear(); // Drops the shared references
+        }
+        if (drainRequested && !draining)
+        {
+            beginDrain();
+        }
+    }
+
+    /**
+     * @brief Stops accepting and says goodbye to every connection; each one is closed
+     * once the goodbye and the output before it are flushed.
+     */
+    void beginDrain()
+    {
+        draining = true;
+        if (listenFd >= 0)
+        {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, nullptr);
+            listenFd = -1;
+        }
+        std::vector<int> fds;
+        fds.reserve(connections.size());
+        for (auto &entry : connections)
+        {
+            fds.push_back(entry.first);
+        }
+        for (int fd : fds)
+        {
+            auto it = connections.find(fd);
+            if (it != connections.end())
+            {
+                sayGoodbye(*it->second);
+                finishIfClosing(*it->second);
+            }
+        }
+    }
+
+    /**
+     * @brief Queues posted messages on their recipients, then writes each connection
+     * whose queue was idle with a single sendmsg where the socket allows.
+     */
+    void deliverMessages(const std::vector<Publication> &messages)
+    {
+        auto enqueue = [&](Connection &conn, const SharedBuffer &message)
+        {
+            if (!conn.joined || conn.closing || conn.failed)
+            {
+                return;
+            }
+            if (conn.outbound.size() + message->size() > limits.maxBytes)
+            {
+                flush(conn); // Make room first; a large batch alone must not look like a slow consumer
+                if (conn.failed)
+                {
+                    failedFds.push_back(conn.fd); // Its queue is gone, so admit() would take anything
+                    return;
+                }
+            }
+            if (!admit(conn, conn.outbound.size(), message->size()))
+            {
+                if (conn.failed)
+                {
+                    failedFds.push_back(conn.fd);
+                }
+                return;
+            }
+            if (conn.outbound.empty())
+            {
+                touched.push_back(&conn);
+            }
+            conn.outbound.append(message);
+            updateThrottle(conn);
+        };
+
+        for (const Publication &publication : messages)
+        {
+            if (publication.fd >= 0)
+            {
+                auto it = connections.find(publication.fd);
+                if (it == connections.end() || it->second->serial != publication.serial)
+                {
+                    continue; // Closed since the reply was produced
+                }
+                Connection &conn = *it->second;
+                if (publication.message)
+                {
+                    enqueue(conn, publication.message);
+                }
+                if (publication.close && !conn.closing)
+                {
+                    conn.closing = true;
+                    if (conn.outbound.empty())
+                    {
+                        touched.push_back(&conn); // Nothing left to flush; closed below
+                    }
+                }
+            }
+            else if (publication.everyone)
+            {
+                for (auto &entry : connections)
+                {
+                    enqueue(*entry.second, publication.message);
+                }
+            }
+            else
+            {
+                topics.forEachSubscriber(publication.topic, [&](Connection &conn)
+                                         { enqueue(conn, publication.message); });
+            }
+        }
+
+        for (Connection *conn : touched)
+        {
+            if (!conn->failed)
+            {
+                flush(*conn);
+                updateThrottle(*conn);
+            }
+            if (conn->failed || (conn->closing && conn->outbound.empty() && conn->zeroCopy.empty()))
+            {
+                failedFds.push_back(conn->fd); // Closed afterwards so the pointers stay valid
+            }
+        }
+        touched.clear();
+        // A connection that failed while queueing can also be listed from touched
+        std::sort(failedFds.begin(), failedFds.end());
+        failedFds.erase(std::unique(failedFds.begin(), failedFds.end()), failedFds.end());
+        for (int fd : failedFds)
+        {
+            closeConnection(fd);
+        }
+        failedFds.clear();
+    }
+
+    /**
+     * @brief Accepts every queued client on the loop's own listening socket.
+     */
+    void acceptPending()
+    {
+        while (running)
+        {
+            sockaddr_in peer;
+            socklen_t length = sizeof(peer);
+            int fd = accept4(listenFd, reinterpret_cast<sockaddr *>(&peer), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd >= 0)
+            {
+                if (admitClient(fd, &peer))
+                {
+                    registerConnection(fd);
+                }
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            else
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    logError() << "Error accepting client on loop " << id << ".";
+                }
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief Registers a non-blocking client socket with epoll and takes ownership of it.
+     */
+    void registerConnection(int fd)
+    {
+        if (draining)
+        {
+            discard(fd);
+            return;
+        }
+
+        setNoDelay(fd);
+        int enabled = 1;
+        bool zeroCopy = zeroCopyThreshold > 0 && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enabled, sizeof(enabled)) == 0;
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET; // Edge-triggered, both directions
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            logError() << "Failed to register client [" << fd << "] with loop " << id << ".";
+            discard(fd);
+            return;
+        }
+
+        Connection &conn = *connections.emplace(fd, std::make_unique<Connection>(fd)).first->second;
+        conn.serial = ++serials;
+        conn.zeroCopy.enabled = zeroCopy;
+        countOpen();
+        startIdleTimer(conn);
+        if (onOpen)
+        {
+            onOpen(*this, conn);
+        }
+    }
+
+    /**
+     * @brief Drains the socket, passing each chunk to the data handler.
+     *
+     * The rest of a large frame is read straight into the parser's buffer for it, which
+     * is sized from the frame's header, rather than into the scratch buffer and copied.
+     * A read that returns less than it asked for has emptied the socket, and data that
+     * arrives later raises a new edge, so the loop stops there instead of paying for a
+     * recv that fails with EAGAIN.
+     *
+     * @param untilAgain Read until EAGAIN regardless: the peer hung up, so the end of the
+     * stream may raise no further edge, or the connection was throttled.
+     * @return false if the connection was closed while reading.
+     */
+    bool handleReadable(Connection &conn, bool untilAgain)
+    {
+        int fd = conn.fd;
+        while (true)
+        {
+            size_t room = 0;
+            char *buffer = conn.parser.pendingTail(room);
+            if (buffer == nullptr || room < inPlaceRead)
+            {
+                buffer = readBuffer.get();
+                room = readBufferSize;
+            }
+            ssize_t bytesRead = recv(fd, buffer, room, 0);
+            if (bytesRead > 0)
+            {
+                dispatchRead(onData, conn, std::string_view(buffer, static_cast<size_t>(bytesRead)));
+                if (finishIfClosing(conn))
+                {
+                    return false;
+                }
+                if (conn.closing || conn.throttled)
+                {
+                    return true; // Ignore further input while the close is flushing or output is backed up
+                }
+                if (static_cast<size_t>(bytesRead) < room && !untilAgain)
+                {
+                    return true;
+                }
+            }
+            else if (bytesRead == 0)
+            {
+                logInfo() << "Client [" << fd << "] disconnected.";
+                closeConnection(fd);
+                return false;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            else if (errno != EINTR)
+            {
+                logError() << "Error reading from client [" << fd << "].";
+                countReadError();
+                closeConnection(fd);
+                return false;
+            }
+        }
+    }
+
+    void handleWritable(Connection &conn)
+    {
+        flush(conn);
+        updateThrottle(conn);
+        finishIfClosing(conn);
+    }
+
+    /**
+     * @brief Pauses reading above the high watermark and schedules a resume once the
+     * queue drains to the low watermark.
+     *
+     * Reading stops for a client that does not read its replies, so its queue cannot
+     * grow without bound and it cannot hold up the loop's other connections.
+     */
+    void updateThrottle(Connection &conn)
+    {
+        size_t queued = conn.outbound.size();
+        trackQueue(conn, queued);
+        if (!conn.throttled && queued > limits.highWatermark)
+        {
+            conn.throttled = true;
+        }
+        else if (conn.throttled && queued <= limits.lowWatermark)
+        {
+            conn.throttled = false;
+            resumed.push_back(conn.fd); // Its input edge was already consumed, so read it explicitly
+        }
+    }
+
+    /**
+     * @brief Drains input that arrived while connections were throttled.
+     */
+    void resumeReading()
+    {
+        while (!resumed.empty())
+        {
+            resuming.swap(resumed);
+            for (int fd : resuming)
+            {
+                auto it = connections.find(fd);
+                if (it != connections.end() && !it->second->throttled)
+                {
+                    handleReadable(*it->second, true);
+                }
+            }
+            resuming.clear();
+        }
+    }
+
+    /**
+     * @brief Writes the outbound queue until it is empty or the socket would block: file
+     * regions with sendfile, large shared buffers with MSG_ZEROCOPY, everything else
+     * with sendmsg. The queue frees its memory once it drains.
+     */
+    void flush(Connection &conn)
+    {
+        iovec iov[maxIov];
+        while (!conn.outbound.empty() && !conn.failed)
+        {
+            OutboundQueue::Run run = conn.outbound.gatherRun(iov, maxIov, conn.zeroCopy.enabled ? zeroCopyThreshold : 0);
+            ssize_t sent;
+            if (run.file)
+            {
+                sent = sendfile(conn.fd, run.file->descriptor(), &run.fileOffset, iov[0].iov_len);
+            }
+            else
+            {
+                msghdr message{};
+                message.msg_iov = iov;
+                message.msg_iovlen = run.count;
+                sent = run.buffer ? sendmsg(conn.fd, &message, MSG_NOSIGNAL | MSG_ZEROCOPY) : -1;
+                if (run.buffer && sent >= 0)
+                {
+                    conn.zeroCopy.pin(std::move(run.buffer)); // Every successful call takes a sequence number
+                }
+                else if (!run.buffer || errno == ENOBUFS)
+                {
+                    sent = sendmsg(conn.fd, &message, MSG_NOSIGNAL); // ENOBUFS: out of pinned-page budget, copy
+                }
+            }
+            if (sent > 0)
+            {
+                conn.outbound.consume(static_cast<size_t>(sent));
+                countSent(static_cast<size_t>(sent));
+            }
+            else if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break; // Remainder goes out on the next EPOLLOUT edge
+            }
+            else
+            {
+                failSend(conn);
+            }
+        }
+    }
+
+    /**
+     * @brief Closes the connection if it failed or finished flushing after closeAfterFlush().
+     *
+     * @return true if the connection was closed.
+     */
+    bool finishIfClosing(Connection &conn)
+    {
+        if (conn.failed || (conn.closing && conn.outbound.empty() && conn.zeroCopy.empty()))
+        {
+            closeConnection(conn.fd);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Releases the buffers of zero-copy sends the kernel has finished with, as
+     * reported on the socket's error queue.
+     */
+    void readZeroCopyCompletions(Connection &conn)
+    {
+        alignas(cmsghdr) char control[128];
+        while (true)
+        {
+            msghdr message{};
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            if (recvmsg(conn.fd, &message, MSG_ERRQUEUE) < 0)
+            {
+                return; // EAGAIN once the queue is empty
+            }
+            for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+            {
+                bool recvErr = (header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                               (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR);
+                if (!recvErr)
+                {
+                    continue;
+                }
+                sock_extended_err report;
+                memcpy(&report, CMSG_DATA(header), sizeof(report));
+                if (report.ee_errno != 0 || report.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                {
+                    continue;
+                }
+                conn.zeroCopy.release(report.ee_info, report.ee_data); // An inclusive range of sends
+                countZeroCopy(report.ee_data - report.ee_info + 1, report.ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+        }
+    }
+
+    /**
+     * @brief Writes until the data is exhausted or the socket would block.
+     *
+     * On a hard error the connection is marked failed and its pending output dropped;
+     * the loop closes it once control returns from the current callback.
+     *
+     * @return Bytes written.
+     */
+    size_t writeSome(Connection &conn, const char *data, size_t length)
+    {
+        size_t written = 0;
+        while (written < length)
+        {
+            ssize_t sent = ::send(conn.fd, data + written, length - written, MSG_NOSIGNAL);
+            if (sent > 0)
+            {
+                written += static_cast<size_t>(sent);
+                countSent(static_cast<size_t>(sent));
+            }
+            else if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break; // Remainder goes out on the next EPOLLOUT edge
+            }
+            else
+            {
+                failSend(conn);
+                break;
+            }
+        }
+        return written;
+    }
+
+    /**
+     * @brief Marks the connection failed after a hard write error and drops its output;
+     * the loop closes it once control returns from the current callback.
+     */
+    void failSend(Connection &conn)
+    {
+        logWarning() << "Failed to send message to client [" << conn.fd << "].";
+        countSendError();
+        conn.failed = true;
+        conn.outbound.clear();
+    }
+
+    void closeConnection(int fd)
+    {
+        auto it = connections.find(fd);
+        if (it != connections.end())
+        {
+            forgetSubscriptions(*it->second);
+            countClose(*it->second);
+        }
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(fd);
+    }
+};
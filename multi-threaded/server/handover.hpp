@@ -0,0 +1,164 @@
+// handover.hpp
+// Handing listening sockets to a new server process over a Unix socket.
+//
+// A new binary is deployed by starting it while the old one still runs. The new
+// process connects to the old one's upgrade socket and receives its listening
+// sockets as SCM_RIGHTS ancillary data, so the two share the very same accept
+// queues: no connection is refused, and none waiting in a queue is reset, as
+// happens when one of several SO_REUSEPORT sockets closes. Once the new process
+// serves, it acknowledges with one byte, and the old process drains its
+// connections and exits. Without the acknowledgement the old process keeps
+// serving.
+
+#pragma once
+
+#include <sys/socket.h> // sendmsg, recvmsg, SCM_RIGHTS
+#include <sys/time.h>   // timeval for the acknowledgement timeout
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // close, unlink
+#include <cstring>
+#include <string>
+#include <vector>
+
+constexpr size_t maxHandedOver = 253; // SCM_MAX_FD: descriptors the kernel passes per message
+
+/**
+ * @brief Fills in the address of a Unix socket path.
+ *
+ * @return false if the path does not fit.
+ */
+inline bool unixAddress(const std::string &path, sockaddr_un &address)
+{
+    address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    memcpy(address.sun_path, path.data(), path.size());
+    return true;
+}
+
+/**
+ * @brief Connects to the upgrade socket of a running server.
+ *
+ * @return The connected socket, or -1 if no server listens on the path.
+ */
+inline int connectUpgradeSocket(const std::string &path)
+{
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Listens on the upgrade socket path, replacing whatever is bound there: a
+ * stale socket left by a crash, or the one of the server being taken over.
+ *
+ * @return The listening socket, or -1 on failure.
+ */
+inline int listenUpgradeSocket(const std::string &path)
+{
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(fd, 1) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Sends listening sockets to the new process and waits for it to acknowledge
+ * that it serves them.
+ *
+ * @param timeoutSeconds How long the new process has to start serving.
+ * @return true if the new process took over.
+ */
+inline bool handOverListeners(int socket, const std::vector<int> &listeners, int timeoutSeconds)
+{
+    size_t count = listeners.size() < maxHandedOver ? listeners.size() : maxHandedOver;
+    char byte = 'L';
+    iovec iov{&byte, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), listeners.data(), sizeof(int) * count);
+    if (sendmsg(socket, &message, MSG_NOSIGNAL) != 1)
+    {
+        return false;
+    }
+
+    timeval timeout{timeoutSeconds, 0};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char ack;
+    return recv(socket, &ack, 1, 0) == 1;
+}
+
+/**
+ * @brief Receives the listening sockets of the server being taken over.
+ *
+ * @return The sockets in the order they were sent; empty on failure.
+ */
+inline std::vector<int> receiveListeners(int socket)
+{
+    char byte;
+    iovec iov{&byte, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * maxHandedOver));
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    std::vector<int> listeners;
+    if (recvmsg(socket, &message, MSG_CMSG_CLOEXEC) != 1)
+    {
+        return listeners;
+    }
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+        {
+            size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            listeners.resize(count);
+            memcpy(listeners.data(), CMSG_DATA(header), sizeof(int) * count);
+        }
+    }
+    return listeners;
+}
+
+/**
+ * @brief Tells the old process that the new one serves the listeners it sent.
+ */
+inline void acknowledgeHandover(int socket)
+{
+    char ack = 'A';
+    ssize_t ignored = send(socket, &ack, 1, MSG_NOSIGNAL);
+    (void)ignored;
+}
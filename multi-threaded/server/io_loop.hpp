@@ -0,0 +1,748 @@
+// io_loop.hpp
+// Interface shared by SimpleServer's event loop backends (epoll and io_uring).
+//
+// A loop runs on one thread and owns every connection registered with it. The
+// server's message handling only talks to this interface, so it does not care
+// which backend moves the bytes. Other threads reach a loop's connections only
+// through adoptConnection(), broadcast() and publish(), which hand work to the
+// loop thread.
+//
+// Every loop also owns a BufferPool that its thread allocates connection state
+// and buffers from, counts the heap allocations the thread still makes, and
+// keeps the LoopMetrics served by --metrics-port.
+
+#pragma once
+
+#include <netinet/in.h>  // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <sys/socket.h>  // setsockopt
+#include <sys/timerfd.h> // Periodic tick driving the connection timers
+#include <fcntl.h>       // fcntl for O_NONBLOCK
+#include <unistd.h>      // close for the timerfd
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "../common/framing.hpp" // Frame parser kept per connection
+#include "admission.hpp"           // Connection cap and per-address rate limit
+#include "logger.hpp"              // Runtime events of the loops
+#include "metrics.hpp"             // Per-loop counters and latency histograms
+#include "outbound_queue.hpp"      // Pending output and shared broadcast buffers
+#include "pool.hpp"                // Per-loop memory pool and allocation counter
+#include "timer_wheel.hpp"         // Idle timeouts and heartbeats
+#include "topic_index.hpp"         // Per-loop topic subscriptions
+#include "websocket.hpp"          // WebSocket session state
+
+class Strand;      // worker_pool.hpp
+class FrameStream; // coroutine.hpp
+
+/**
+ * @brief Per-connection state owned by a single loop.
+ */
+struct Connection
+{
+    int fd;                     // Client socket descriptor
+    uint64_t serial = 0;        // Set by the loop; tells this connection apart from earlier ones on the same fd
+    FrameParser parser;         // Reassembles frames across reads
+    std::unique_ptr<WebSocketSession> websocket; // Created when the connection opens in WebSocket mode
+    std::shared_ptr<Strand> strand; // Created on first use when handlers run on a worker pool
+    std::shared_ptr<FrameStream> stream; // Runs the connection's coroutine handler, with --handlers coroutine
+    OutboundQueue outbound;     // Output accepted by send() that the kernel could not take yet
+    ZeroCopyPins zeroCopy;      // Sent buffers the kernel may still read from
+    bool joined = false;        // Receives broadcasts; set once the client can parse server messages
+    bool throttled = false;     // Reading paused because outbound is above the high watermark
+    uint64_t droppedBytes = 0;  // Output discarded by the slow-consumer policy
+    size_t reportedQueue = 0;   // Queued bytes last added to the loop's queuedBytes gauge
+    WheelTimer idleTimer{this}; // Next idle check, with --idle-timeout or --heartbeat
+    uint64_t lastHeard = 0;     // Timer tick of the last read from the client
+    bool pinged = false;        // A heartbeat went out since lastHeard
+    uint64_t queuedSince = 0;   // When output started waiting in the queue, while timing; 0 = empty
+    bool closing = false;       // Set once the connection should be closed after flushing
+    bool failed = false;        // Set when a write error makes the remaining output undeliverable
+
+    explicit Connection(int fd) : fd(fd) {}
+    virtual ~Connection() = default;
+
+    // Allocated from the owning loop's pool, including derived backend state
+    static void *operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void *pointer, size_t size) { BufferPool::deallocate(pointer, size); }
+};
+
+/**
+ * @brief A loop's connections by fd, with nodes drawn from the loop's pool.
+ */
+template <typename T>
+using ConnectionTable = std::unordered_map<int, std::unique_ptr<T>, std::hash<int>, std::equal_to<int>,
+                                           PoolAllocator<std::pair<const int, std::unique_ptr<T>>>>;
+
+/**
+ * @brief When silent connections are pinged and closed.
+ */
+struct ConnectionTimeouts
+{
+    unsigned idleSeconds = 0;      // Close a connection that sent nothing for this long; 0 = never
+    unsigned heartbeatSeconds = 0; // Ping a connection that sent nothing for this long; 0 = never
+
+    bool enabled() const { return idleSeconds > 0 || heartbeatSeconds > 0; }
+    uint64_t idleTicks() const { return uint64_t{idleSeconds} * 1000 / timerTickMilliseconds; }
+    uint64_t heartbeatTicks() const { return uint64_t{heartbeatSeconds} * 1000 / timerTickMilliseconds; }
+
+    bool idleExpired(uint64_t now, uint64_t lastHeard) const
+    {
+        return idleSeconds > 0 && now >= lastHeard + idleTicks();
+    }
+
+    bool heartbeatDue(uint64_t now, uint64_t lastHeard, bool pinged) const
+    {
+        return heartbeatSeconds > 0 && !pinged && now >= lastHeard + heartbeatTicks();
+    }
+
+    /**
+     * @brief The tick of the next check of a connection: the heartbeat, unless it has
+     * been sent, or else the timeout, measured from when the client was last heard.
+     *
+     * @return UINT64_MAX if neither applies.
+     */
+    uint64_t nextCheck(uint64_t lastHeard, bool pinged) const
+    {
+        uint64_t deadline = UINT64_MAX;
+        if (heartbeatSeconds > 0 && !pinged)
+        {
+            deadline = lastHeard + heartbeatTicks();
+        }
+        if (idleSeconds > 0 && lastHeard + idleTicks() < deadline)
+        {
+            deadline = lastHeard + idleTicks();
+        }
+        return deadline;
+    }
+};
+
+/**
+ * @brief A shared message posted to a loop by another thread.
+ */
+struct Publication
+{
+    PooledString topic;   // Subscribers of this topic receive the message, unless everyone or fd is set
+    SharedBuffer message; // Encoded once for all recipients; may be null for a reply that only closes
+    bool everyone;        // Broadcast to every joined connection
+    int fd = -1;          // Reply to this connection alone, if it still has the serial below
+    uint64_t serial = 0;
+    bool close = false;   // Close the reply's connection once its output is flushed
+};
+
+/**
+ * @brief Puts a socket into non-blocking mode.
+ *
+ * @return true on success, false if fcntl failed.
+ */
+inline bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/**
+ * @brief Turns off Nagle's algorithm on a client socket. Replies are written as soon as
+ * they are ready, so holding a small one back until the previous one is acknowledged
+ * only delays it, by up to the peer's delayed ACK.
+ */
+inline void setNoDelay(int fd)
+{
+    int enabled = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+}
+
+class IoLoop
+{
+public:
+    /**
+     * @brief Invoked on the loop thread for every chunk of data read from a connection.
+     */
+    using DataHandler = std::function<void(IoLoop &, Connection &, std::string_view)>;
+
+    /**
+     * @brief Invoked on the loop thread when a connection is registered with the loop.
+     */
+    using ConnectionHandler = std::function<void(IoLoop &, Connection &)>;
+
+    virtual ~IoLoop()
+    {
+        if (tickFd >= 0)
+        {
+            close(tickFd);
+        }
+    }
+
+    /**
+     * @brief Hands an accepted socket to this loop. Safe to call from any thread.
+     *
+     * @param fd The accepted client socket, created non-blocking (accept4 with
+     *        SOCK_NONBLOCK); ownership moves to the loop unless it is turned down.
+     * @return false if the loop's mailbox is full; the socket is left with the caller.
+     */
+    virtual bool adoptConnection(int fd) = 0;
+
+    /**
+     * @brief Sets the bounds for every connection's outbound queue. Call before run().
+     */
+    void setOutboundLimits(const OutboundLimits &outboundLimits)
+    {
+        limits = outboundLimits;
+    }
+
+    /**
+     * @brief Sends shared buffers of at least this many bytes with zero-copy sends; 0
+     * turns zero-copy off. Call before run().
+     *
+     * Bytes passed to send() as a pointer are always copied: making a buffer of them
+     * for a zero-copy send would copy them anyway, and then pay for the pinning.
+     */
+    void setZeroCopyThreshold(size_t threshold)
+    {
+        zeroCopyThreshold = threshold;
+    }
+
+    /**
+     * @brief Times the data handler and queued output for the latency histograms.
+     * Call before run().
+     */
+    void setTiming(bool enabled)
+    {
+        timing = enabled;
+    }
+
+    /**
+     * @brief Closes connections that stay silent and pings them first. Call before run().
+     *
+     * @param heartbeat Sends a ping to a connection that has been silent for the
+     *        heartbeat interval; any data the client sends back keeps it open.
+     */
+    void setTimeouts(const ConnectionTimeouts &connectionTimeouts, ConnectionHandler heartbeat)
+    {
+        timeouts = connectionTimeouts;
+        onHeartbeat = std::move(heartbeat);
+    }
+
+    /**
+     * @brief Says goodbye to a connection when the loop drains. Call before run().
+     *
+     * @param goodbye Sends the connection its last message and arranges for it to be
+     *        closed once its output is flushed, typically with closeAfterFlush().
+     */
+    void setGoodbye(ConnectionHandler goodbye)
+    {
+        onGoodbye = std::move(goodbye);
+    }
+
+    /**
+     * @brief Applies the admission limits to the clients the loop accepts itself, and
+     * frees a client's slot when its connection closes, including those accepted
+     * elsewhere and adopted. Call before run().
+     */
+    void setAdmission(Admission *gate)
+    {
+        admission = gate;
+    }
+
+    /**
+     * @brief Makes the loop accept clients itself from a listening socket.
+     *
+     * Call before run(). The socket is not closed by the loop.
+     *
+     * @param fd A listening socket, typically one of several bound with SO_REUSEPORT.
+     */
+    virtual void addListener(int fd) = 0;
+
+    /**
+     * @brief Runs the loop on the calling thread until stop() is called.
+     */
+    virtual void run() = 0;
+
+    /**
+     * @brief Asks the loop to exit its run() call. Safe to call from any thread.
+     */
+    virtual void stop() = 0;
+
+    /**
+     * @brief Asks the loop to stop accepting, say goodbye to every connection and close
+     * each one once its output is flushed. Safe to call from any thread.
+     *
+     * The loop keeps running, so the caller can wait for openConnections() to reach
+     * zero, or for a deadline, before calling stop(). Connections handed to a draining
+     * loop are closed at once.
+     */
+    virtual void drain() = 0;
+
+    /**
+     * @brief Connections registered and not yet closed. Safe to call from any thread.
+     */
+    uint64_t openConnections() const
+    {
+        return loopMetrics.connectionsOpened.load() - loopMetrics.connectionsClosed.load();
+    }
+
+    /**
+     * @brief Queues data for a connection. Must be called on the loop thread.
+     */
+    virtual void send(Connection &conn, const char *data, size_t length) = 0;
+
+    /**
+     * @brief Queues a shared, already encoded message without copying it. Must be
+     * called on the loop thread.
+     */
+    virtual void send(Connection &conn, SharedBuffer message) = 0;
+
+    /**
+     * @brief Queues a region of a mapped file, sent from the page cache without being
+     * copied into user space. Must be called on the loop thread.
+     *
+     * @param header Bytes sent just before the region, such as its frame header; the
+     *        two are queued, or dropped, as one message.
+     */
+    virtual void send(Connection &conn, SharedFile file, size_t offset, size_t length, std::string_view header = {}) = 0;
+
+    /**
+     * @brief Sends a shared message to every joined connection of this loop. Safe to
+     * call from any thread.
+     *
+     * The loop thread queues the message on its own connections, so the caller never
+     * iterates them or holds a lock while data is written. A loop whose mailbox is full
+     * has fallen far behind; the message is then shed for its connections and counted
+     * in shedPublications(), and the caller does not wait.
+     */
+    virtual void broadcast(SharedBuffer message) = 0;
+
+    /**
+     * @brief Sends a shared message to this loop's connections subscribed to the topic.
+     * Safe to call from any thread; shed like a broadcast if the mailbox is full.
+     */
+    virtual void publish(std::string_view topic, SharedBuffer message) = 0;
+
+    /**
+     * @brief Sends a reply produced on another thread to one connection of this loop.
+     * Must not be called on a loop thread.
+     *
+     * Replies posted by one thread are queued in the order they were posted. A reply
+     * whose connection has closed since, even if a new one reused the fd, is dropped.
+     * A reply is never shed: while the mailbox is full the caller waits for the loop,
+     * which is safe because loops never wait on the worker threads that reply.
+     *
+     * @param message Encoded output, or null to send nothing.
+     * @param close Close the connection once everything queued before has been flushed.
+     */
+    virtual void reply(int fd, uint64_t serial, SharedBuffer message, bool close) = 0;
+
+    /**
+     * @brief Subscribes a connection to a topic, or to every topic starting with a prefix
+     * when the pattern ends in '*'. Must be called on the loop thread.
+     *
+     * @return false if the connection already had this subscription.
+     */
+    bool subscribe(Connection &conn, std::string_view pattern)
+    {
+        bool added = topics.subscribe(conn, pattern);
+        subscriptions.store(topics.size(), std::memory_order_relaxed);
+        return added;
+    }
+
+    /**
+     * @brief Drops one subscription of a connection. Must be called on the loop thread.
+     *
+     * @return false if the connection had no such subscription.
+     */
+    bool unsubscribe(Connection &conn, std::string_view pattern)
+    {
+        bool removed = topics.unsubscribe(conn, pattern);
+        subscriptions.store(topics.size(), std::memory_order_relaxed);
+        return removed;
+    }
+
+    /**
+     * @brief Whether any connection of this loop has a subscription. Safe to call from
+     * any thread; publishers use it to skip loops with nobody to deliver to.
+     */
+    bool hasSubscriptions() const
+    {
+        return subscriptions.load(std::memory_order_relaxed) > 0;
+    }
+
+    /**
+     * @brief Whether a publication on the topic would reach the connection. Must be
+     * called on the loop thread.
+     */
+    bool subscribedTo(const Connection &conn, std::string_view topic)
+    {
+        bool found = false;
+        topics.forEachSubscriber(topic, [&](Connection &subscriber)
+                                 { found = found || &subscriber == &conn; });
+        return found;
+    }
+
+    /**
+     * @brief Allocation counters of the loop thread, for --stats.
+     */
+    struct Stats
+    {
+        uint64_t reads;           // Chunks of data passed to the data handler
+        uint64_t heapAllocations; // Heap allocations made on the loop thread, pool misses included
+        uint64_t poolHits;        // Allocations served by the loop's pool
+        uint64_t poolMisses;      // Allocations the pool passed on to the heap
+        uint64_t zeroCopySends;   // Sends whose completion the kernel reported for a zero-copy buffer
+        uint64_t zeroCopyCopied;  // Of those, sends the kernel copied after all, as it does on loopback
+    };
+
+    /**
+     * @brief Current counter values. Safe to call from any thread.
+     */
+    Stats stats() const
+    {
+        return Stats{reads.load(std::memory_order_relaxed), heap.count.load(std::memory_order_relaxed),
+                     pool.hits(), pool.misses(), zeroCopySends.load(std::memory_order_relaxed),
+                     zeroCopyCopied.load(std::memory_order_relaxed)};
+    }
+
+    /**
+     * @brief Counters and histograms of the loop thread. Readable from any thread; only
+     * the loop thread updates them, apart from countMessage() and countProtocolError().
+     */
+    const LoopMetrics &metrics() const { return loopMetrics; }
+
+    /**
+     * @brief Broadcasts and publications shed because this loop's mailbox was full.
+     * Safe to call from any thread.
+     */
+    uint64_t shedPublications() const { return shed.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Counts a message parsed by the data handler. Must be called on the loop thread.
+     */
+    void countMessage() { loopMetrics.messagesReceived.add(); }
+
+    /**
+     * @brief Counts malformed input that closes a connection. Must be called on the loop thread.
+     */
+    void countProtocolError() { loopMetrics.protocolErrors.add(); }
+
+    /**
+     * @brief Counts messages sent again to a resuming client. Must be called on the loop thread.
+     */
+    void countReplayed(uint64_t messages) { loopMetrics.messagesReplayed.add(messages); }
+
+    /**
+     * @brief Closes the connection once its pending output has been flushed.
+     *
+     * The connection stays valid until control returns to the loop, so handlers may
+     * keep using it after calling this.
+     */
+    void closeAfterFlush(Connection &conn)
+    {
+        conn.closing = true;
+    }
+
+protected:
+    OutboundLimits limits;                 // Bounds for outbound queues
+    TopicIndex topics;                     // Subscriptions of this loop's connections (loop thread only)
+    std::atomic<size_t> subscriptions{0}; // topics.size(), readable from other threads
+    BufferPool pool;                       // Memory for this loop's connections and buffers
+    AllocationCounter heap;                // Heap allocations made by the loop thread
+    std::atomic<uint64_t> reads{0};        // Chunks of data handed to the data handler
+    std::atomic<uint64_t> zeroCopySends{0};  // Completed zero-copy sends
+    std::atomic<uint64_t> zeroCopyCopied{0}; // Completed zero-copy sends the kernel copied anyway
+    size_t zeroCopyThreshold = 0;          // Size from which output is sent zero-copy; 0 = never
+    LoopMetrics loopMetrics;               // Served by --metrics-port
+    std::atomic<uint64_t> shed{0};         // Publications a full mailbox turned down; counted by their posters
+    bool timing = false;                   // Record the latency histograms
+    ConnectionTimeouts timeouts;           // Idle timeout and heartbeat interval
+    ConnectionHandler onHeartbeat;         // Pings a silent connection
+    ConnectionHandler onGoodbye;           // Ends a connection when the loop drains
+    Admission *admission = nullptr;        // Limits on new connections, shared by the loops; null = none
+    std::atomic<bool> drainRequested{false}; // Set by drain(), acted on by the loop thread
+    bool draining = false;                 // The loop has stopped accepting (loop thread only)
+    TimerWheel timers{currentTimerTick()}; // Idle timers of the connections (loop thread only)
+    int tickFd = -1;                       // timerfd that fires every timer tick, while timeouts are on
+    static constexpr uint64_t handlerSampling = 8; // Reads per timed read
+    uint64_t serials = 0;                  // Last serial number given to a connection
+
+    /**
+     * @brief Makes the calling thread allocate from this loop's pool and count its
+     * heap allocations. Called at the start of run().
+     */
+    void attachThread()
+    {
+        BufferPool::current() = &pool;
+        AllocationCounter::current() = &heap;
+    }
+
+    /**
+     * @brief Undoes attachThread() when run() returns.
+     */
+    void detachThread()
+    {
+        BufferPool::current() = nullptr;
+        AllocationCounter::current() = nullptr;
+    }
+
+    /**
+     * @brief Passes a chunk of data read from a connection to the data handler, counting
+     * it and, while timing, how long the handler takes.
+     *
+     * Only one read in handlerSampling is timed: a clock read costs about as much as
+     * handling a short message, so timing every read would show up in the message rate.
+     */
+    void dispatchRead(const DataHandler &onData, Connection &conn, std::string_view data)
+    {
+        conn.lastHeard = timers.current(); // Picked up by the idle timer when it next fires
+        conn.pinged = false;
+        uint64_t count = reads.load(std::memory_order_relaxed) + 1;
+        reads.store(count, std::memory_order_relaxed);
+        loopMetrics.bytesReceived.add(data.size());
+        if (!timing || count % handlerSampling != 0)
+        {
+            onData(*this, conn, data);
+            return;
+        }
+        uint64_t started = monotonicNanoseconds();
+        onData(*this, conn, data);
+        loopMetrics.handlerTime.record(monotonicNanoseconds() - started);
+    }
+
+    void countOpen() { loopMetrics.connectionsOpened.add(); }
+
+    /**
+     * @brief Applies the admission limits to a client the loop accepted itself.
+     *
+     * @param peer The client's address, or null if it was not returned by the accept.
+     * @return false if the client was turned away; its socket is closed.
+     */
+    bool admitClient(int fd, const sockaddr_in *peer)
+    {
+        return admission == nullptr || admission->admit(fd, peer);
+    }
+
+    /**
+     * @brief Closes an admitted client's socket that never became a connection.
+     */
+    void discard(int fd)
+    {
+        close(fd);
+        if (admission != nullptr)
+        {
+            admission->release();
+        }
+    }
+
+    /**
+     * @brief Opens the timerfd that drives the connection timers, if timeouts are on.
+     * Called at the start of run(); the backend then waits for it to become readable.
+     *
+     * @return false if timeouts are off or the timerfd cannot be created.
+     */
+    bool openTicker()
+    {
+        if (!timeouts.enabled())
+        {
+            return false;
+        }
+        tickFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        itimerspec interval{};
+        interval.it_interval.tv_nsec = static_cast<long>(timerTickMilliseconds * 1000000);
+        interval.it_value = interval.it_interval;
+        if (tickFd < 0 || timerfd_settime(tickFd, 0, &interval, nullptr) < 0)
+        {
+            logError() << "Failed to start the connection timers of a loop; idle timeouts are off.";
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Says goodbye to a connection of a draining loop; the backend then closes
+     * it once the goodbye is flushed.
+     */
+    void sayGoodbye(Connection &conn)
+    {
+        if (conn.closing || conn.failed)
+        {
+            return;
+        }
+        if (onGoodbye)
+        {
+            onGoodbye(*this, conn);
+        }
+        else
+        {
+            closeAfterFlush(conn);
+        }
+    }
+
+    /**
+     * @brief Starts a new connection's idle timer. Must be called on the loop thread.
+     */
+    void startIdleTimer(Connection &conn)
+    {
+        if (timeouts.enabled())
+        {
+            conn.lastHeard = timers.current();
+            scheduleIdleTimer(conn);
+        }
+    }
+
+    void scheduleIdleTimer(Connection &conn)
+    {
+        uint64_t deadline = timeouts.nextCheck(conn.lastHeard, conn.pinged);
+        if (deadline != UINT64_MAX)
+        {
+            timers.schedule(conn.idleTimer, deadline);
+        }
+    }
+
+    /**
+     * @brief Runs the idle checks that came due, after the backend has read the ticker.
+     *
+     * Reads only record when the client was heard from, so a busy connection costs
+     * nothing until its timer comes round; the timer then finds the newer time and is
+     * scheduled again from it.
+     *
+     * @param close Closes a connection that timed out, or failed while being pinged.
+     */
+    template <typename Close>
+    void expireIdleTimers(Close &&close)
+    {
+        timers.advance(currentTimerTick(), [&](WheelTimer &timer)
+                       {
+            Connection &conn = *static_cast<Connection *>(timer.owner);
+            uint64_t now = timers.current();
+            if (timeouts.idleExpired(now, conn.lastHeard))
+            {
+                logInfo() << "Client [" << conn.fd << "] timed out.";
+                loopMetrics.idleTimeouts.add();
+                close(conn);
+                return;
+            }
+            if (timeouts.heartbeatDue(now, conn.lastHeard, conn.pinged))
+            {
+                conn.pinged = true;
+                loopMetrics.heartbeats.add();
+                onHeartbeat(*this, conn);
+                if (conn.failed)
+                {
+                    close(conn);
+                    return;
+                }
+            }
+            scheduleIdleTimer(conn); });
+    }
+
+    /**
+     * @brief Counts a connection's close, frees its admission slot and takes its output off
+     * the queued bytes gauge.
+     */
+    void countClose(Connection &conn)
+    {
+        if (admission != nullptr)
+        {
+            admission->release();
+        }
+        timers.cancel(conn.idleTimer);
+        loopMetrics.connectionsClosed.add();
+        loopMetrics.queuedBytes.add(-static_cast<int64_t>(conn.reportedQueue));
+        conn.reportedQueue = 0;
+    }
+
+    void countSent(size_t bytes) { loopMetrics.bytesSent.add(bytes); }
+    void countReadError() { loopMetrics.readErrors.add(); }
+    void countSendError() { loopMetrics.sendErrors.add(); }
+
+    /**
+     * @brief Brings the queued bytes gauge up to date after the connection's queue
+     * changed and, while timing, records how long output waited once the queue drains.
+     *
+     * @param queued Bytes the connection has waiting, including any in flight.
+     */
+    void trackQueue(Connection &conn, size_t queued)
+    {
+        loopMetrics.queuedBytes.add(static_cast<int64_t>(queued) - static_cast<int64_t>(conn.reportedQueue));
+        conn.reportedQueue = queued;
+        if (!timing)
+        {
+            return;
+        }
+        if (queued > 0 && conn.queuedSince == 0)
+        {
+            conn.queuedSince = monotonicNanoseconds();
+        }
+        else if (queued == 0 && conn.queuedSince != 0)
+        {
+            loopMetrics.queueTime.record(monotonicNanoseconds() - conn.queuedSince);
+            conn.queuedSince = 0;
+        }
+    }
+
+    /**
+     * @brief Counts zero-copy sends whose completion the kernel reported.
+     */
+    void countZeroCopy(uint64_t sends, bool copied)
+    {
+        zeroCopySends.store(zeroCopySends.load(std::memory_order_relaxed) + sends, std::memory_order_relaxed);
+        if (copied)
+        {
+            zeroCopyCopied.store(zeroCopyCopied.load(std::memory_order_relaxed) + sends, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Applies the slow-consumer policy before queueing a message.
+     *
+     * @param queued Bytes the connection already has waiting, including any in flight.
+     * @param length Size of the message to queue.
+     * @return false if the message must not be queued; with the Disconnect policy the
+     *         connection has then been marked failed.
+     */
+    bool admit(Connection &conn, size_t queued, size_t length)
+    {
+        if (queued == 0 || queued + length <= limits.maxBytes)
+        {
+            return true;
+        }
+        switch (limits.policy)
+        {
+        case SlowConsumerPolicy::DropOldest:
+        {
+            size_t freed = conn.outbound.dropOldest(queued + length - limits.maxBytes);
+            conn.droppedBytes += freed;
+            loopMetrics.droppedBytes.add(freed);
+            if (queued - freed + length <= limits.maxBytes)
+            {
+                return true;
+            }
+            conn.droppedBytes += length; // Only output already being sent is left
+            loopMetrics.droppedBytes.add(length);
+            return false;
+        }
+        case SlowConsumerPolicy::DropNewest:
+            conn.droppedBytes += length;
+            loopMetrics.droppedBytes.add(length);
+            return false;
+        case SlowConsumerPolicy::Disconnect:
+        default:
+            logWarning() << "Client [" << conn.fd << "] is not reading; disconnecting.";
+            loopMetrics.slowConsumers.add();
+            conn.failed = true;
+            conn.outbound.clear();
+            return false;
+        }
+    }
+
+    /**
+     * @brief Removes a closing connection's subscriptions.
+     */
+    void forgetSubscriptions(Connection &conn)
+    {
+        topics.unsubscribeAll(conn);
+        subscriptions.store(topics.size(), std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,573 @@
+// logger.hpp
+// Asynchronous logging for SimpleServer's runtime events.
+//
+// Writing a line with cout from many threads takes the stream's lock and, with
+// endl, makes a system call per line, so at volume every client thread and loop
+// waits on the terminal. Here a thread that logs only formats the line into its
+// own ring of fixed-size records and publishes it with one release store; it
+// never takes a lock and never makes a system call. A background writer takes
+// the records of all rings, puts them in time order, formats them as text or
+// JSON lines and writes them to stdout or a file in large batches.
+//
+// A ring that is full drops the line and counts it instead of making the thread
+// wait; the writer reports the count in the log. Lines longer than a record are
+// cut short, which also keeps a large chat message from flooding the log.
+//
+// Usage: logInfo() << "Client [" << fd << "]: " << message;
+// Lines below the configured level cost a comparison. Before start() and after
+// stop() lines are written directly, one write call each.
+
+#pragma once
+
+#include <fcntl.h>  // open
+#include <unistd.h> // write
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+enum class LogLevel : uint8_t
+{
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off, // Only as a threshold: log nothing
+};
+
+/**
+ * @brief Logger settings chosen on the command line.
+ */
+struct LogOptions
+{
+    LogLevel level = LogLevel::Info;
+    std::string path;          // Log file, appended to; empty = stdout
+    bool json = false;         // One JSON object per line instead of plain text
+    size_t ringRecords = 1024; // Records per thread before lines are dropped; a power of two
+};
+
+/**
+ * @brief One log line as produced by a thread, waiting for the writer.
+ */
+struct LogRecord
+{
+    static constexpr size_t size = 256;
+
+    int64_t time;    // Nanoseconds since the epoch
+    uint32_t thread; // Small number of the logging thread
+    LogLevel level;
+    bool truncated;
+    uint16_t length;
+    char text[size - 16];
+};
+
+static_assert(sizeof(LogRecord) == LogRecord::size, "LogRecord is meant to fill one slot exactly");
+
+/**
+ * @brief Single-producer, single-consumer ring of records owned by one thread.
+ */
+class LogRing
+{
+private:
+    static constexpr size_t cacheLine = 64;
+
+    std::unique_ptr<LogRecord[]> records;
+    size_t mask;
+    alignas(cacheLine) std::atomic<size_t> tail{0}; // Next record the owner fills
+    alignas(cacheLine) std::atomic<size_t> head{0}; // Next record the writer takes
+
+public:
+    const uint32_t thread;                  // Number printed with the thread's lines
+    std::atomic<uint64_t> dropped{0};       // Lines lost to a full ring, not yet reported
+    std::atomic<bool> retired{false};       // The owning thread has exited
+
+    LogRing(size_t capacity, uint32_t thread) : records(new LogRecord[capacity]), mask(capacity - 1), thread(thread) {}
+
+    /**
+     * @brief The record the owner fills next, or null if the ring is full. Owner only.
+     *
+     * @param half Set to true when this claim makes the ring half full.
+     */
+    LogRecord *claim(bool &half)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t used = t - head.load(std::memory_order_acquire);
+        if (used > mask)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        half = used == (mask + 1) / 2;
+        return &records[t & mask];
+    }
+
+    /**
+     * @brief Publishes the record returned by claim(). Owner only.
+     */
+    void commit()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Appends every published record to out. Writer only.
+     */
+    void drain(std::vector<LogRecord> &out)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        for (; h != t; ++h)
+        {
+            out.push_back(records[h & mask]);
+        }
+        head.store(h, std::memory_order_release);
+    }
+
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
+
+class Logger
+{
+private:
+    static constexpr auto flushInterval = std::chrono::milliseconds(10); // Longest a line waits for the writer
+    static constexpr size_t batchBytes = 64 * 1024;                      // Written in one call when reached
+
+    LogOptions options;
+    std::atomic<LogLevel> threshold{LogLevel::Info};
+    std::atomic<bool> running{false};
+    int fd = STDOUT_FILENO;
+
+    std::mutex ringsMutex; // Protects rings; taken by the writer and by threads logging for the first time
+    std::vector<std::shared_ptr<LogRing>> rings;
+    uint32_t nextThread = 0;
+
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::thread writer;
+    std::atomic<uint64_t> totalDropped{0};
+
+    /**
+     * @brief Keeps the calling thread's ring, and retires it when the thread exits.
+     */
+    struct RingHandle
+    {
+        std::shared_ptr<LogRing> ring;
+
+        ~RingHandle()
+        {
+            if (ring)
+            {
+                ring->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    Logger() = default;
+
+public:
+    /**
+     * @brief The process-wide logger. Never destroyed, so threads still running at exit
+     * may keep logging.
+     */
+    static Logger &instance()
+    {
+        static Logger *logger = new Logger();
+        return *logger;
+    }
+
+    /**
+     * @brief Opens the output and starts the writer thread.
+     *
+     * @return false if the log file cannot be opened.
+     */
+    bool start(const LogOptions &logOptions)
+    {
+        options = logOptions;
+        size_t capacity = 1;
+        while (capacity < options.ringRecords)
+        {
+            capacity <<= 1;
+        }
+        options.ringRecords = capacity;
+        threshold.store(options.level, std::memory_order_relaxed);
+        if (!options.path.empty())
+        {
+            fd = open(options.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                fd = STDOUT_FILENO;
+                return false;
+            }
+        }
+        running.store(true, std::memory_order_release);
+        writer = std::thread(&Logger::write, this);
+        return true;
+    }
+
+    /**
+     * @brief Writes out every published line and stops the writer. Lines logged later
+     * are written directly.
+     */
+    void stop()
+    {
+        if (!running.exchange(false))
+        {
+            return;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+
+    bool enabled(LogLevel level) const
+    {
+        return level >= threshold.load(std::memory_order_relaxed) && level != LogLevel::Off;
+    }
+
+    bool started() const { return running.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Lines dropped because a ring was full, since start().
+     */
+    uint64_t dropped() const { return totalDropped.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief The calling thread's ring, created on its first line.
+     */
+    LogRing &ring()
+    {
+        static thread_local RingHandle handle;
+        if (!handle.ring)
+        {
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            handle.ring = std::make_shared<LogRing>(options.ringRecords, ++nextThread);
+            rings.push_back(handle.ring);
+        }
+        return *handle.ring;
+    }
+
+    /**
+     * @brief Asks the writer not to wait out its interval; never blocks.
+     */
+    void nudge() { wake.notify_one(); }
+
+    /**
+     * @brief Formats and writes one record on the calling thread, for lines logged
+     * while the writer is not running.
+     */
+    void writeDirect(const LogRecord &record)
+    {
+        std::string line;
+        format(line, record);
+        writeAll(line);
+    }
+
+private:
+    /**
+     * @brief The writer thread: collects records from every ring, orders them by time
+     * and writes them in batches.
+     */
+    void write()
+    {
+        std::vector<LogRecord> pending;
+        std::string batch;
+        batch.reserve(batchBytes * 2);
+        while (true)
+        {
+            bool stopping = !running.load(std::memory_order_acquire);
+            uint64_t lost = 0;
+            {
+                std::lock_guard<std::mutex> lock(ringsMutex);
+                for (auto &ring : rings)
+                {
+                    ring->drain(pending);
+                    lost += ring->dropped.exchange(0, std::memory_order_relaxed);
+                }
+                // A retired ring's thread is gone, so nothing is published to it any more
+                rings.erase(std::remove_if(rings.begin(), rings.end(), [](const std::shared_ptr<LogRing> &ring)
+                                           { return ring->retired.load(std::memory_order_acquire) && ring->empty(); }),
+                            rings.end());
+            }
+
+            std::stable_sort(pending.begin(), pending.end(), [](const LogRecord &a, const LogRecord &b)
+                             { return a.time < b.time; });
+            for (const LogRecord &record : pending)
+            {
+                format(batch, record);
+                if (batch.size() >= batchBytes)
+                {
+                    writeAll(batch);
+                    batch.clear();
+                }
+            }
+            if (lost > 0)
+            {
+                totalDropped.fetch_add(lost, std::memory_order_relaxed);
+                LogRecord note;
+                stamp(note, LogLevel::Warning, 0);
+                appendText(note, "Logger dropped ");
+                appendNumber(note, lost);
+                appendText(note, " line(s): log rings were full.");
+                format(batch, note);
+            }
+            if (!batch.empty())
+            {
+                writeAll(batch);
+                batch.clear();
+            }
+
+            bool idle = pending.empty();
+            pending.clear();
+            if (stopping)
+            {
+                return; // Lines logged from now on are written directly
+            }
+            if (idle)
+            {
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                wake.wait_for(lock, flushInterval);
+            }
+        }
+    }
+
+    void writeAll(std::string_view data)
+    {
+        while (!data.empty())
+        {
+            ssize_t written = ::write(fd, data.data(), data.size());
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return; // Nowhere left to report it
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+    }
+
+    static const char *levelName(LogLevel level)
+    {
+        switch (level)
+        {
+        case LogLevel::Debug:
+            return "DEBUG";
+        case LogLevel::Info:
+            return "INFO";
+        case LogLevel::Warning:
+            return "WARN";
+        case LogLevel::Error:
+        default:
+            return "ERROR";
+        }
+    }
+
+    /**
+     * @brief Appends the record's UTC time as 2024-01-31T12:34:56.123456Z.
+     */
+    static void appendTime(std::string &out, int64_t nanoseconds)
+    {
+        time_t seconds = static_cast<time_t>(nanoseconds / 1000000000);
+        tm utc;
+        gmtime_r(&seconds, &utc);
+        char text[40];
+        size_t length = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+        length += static_cast<size_t>(snprintf(text + length, sizeof(text) - length, ".%06dZ",
+                                               static_cast<int>(nanoseconds % 1000000000 / 1000)));
+        out.append(text, length);
+    }
+
+    static void appendJsonString(std::string &out, std::string_view text)
+    {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                out += "\\u00";
+                out += hex[(c >> 4) & 0xf];
+                out += hex[c & 0xf];
+            }
+            else
+            {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    void format(std::string &out, const LogRecord &record) const
+    {
+        std::string_view text(record.text, record.length);
+        if (options.json)
+        {
+            out += "{\"time\":\"";
+            appendTime(out, record.time);
+            out += "\",\"level\":\"";
+            out += levelName(record.level);
+            out += "\",\"thread\":";
+            out += std::to_string(record.thread);
+            out += ",\"message\":";
+            appendJsonString(out, text);
+            if (record.truncated)
+            {
+                out += ",\"truncated\":true";
+            }
+            out += "}\n";
+            return;
+        }
+        appendTime(out, record.time);
+        out += ' ';
+        out += levelName(record.level);
+        out += " [";
+        out += std::to_string(record.thread);
+        out += "] ";
+        out += text;
+        if (record.truncated)
+        {
+            out += "...";
+        }
+        out += '\n';
+    }
+
+public:
+    /**
+     * @brief Starts a record: sets its time, level and thread and empties its text.
+     */
+    static void stamp(LogRecord &record, LogLevel level, uint32_t thread)
+    {
+        record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+        record.thread = thread;
+        record.level = level;
+        record.truncated = false;
+        record.length = 0;
+    }
+
+    static void appendText(LogRecord &record, std::string_view text)
+    {
+        size_t room = sizeof(record.text) - record.length;
+        if (text.size() > room)
+        {
+            text = text.substr(0, room);
+            record.truncated = true;
+        }
+        memcpy(record.text + record.length, text.data(), text.size());
+        record.length = static_cast<uint16_t>(record.length + text.size());
+    }
+
+    template <typename T>
+    static void appendNumber(LogRecord &record, T value)
+    {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        appendText(record, std::string_view(digits, static_cast<size_t>(result.ptr - digits)));
+    }
+};
+
+/**
+ * @brief One line being logged; the line is published when the object is destroyed,
+ * at the end of the full expression that created it.
+ */
+class LogLine
+{
+private:
+    LogRecord *record = nullptr; // Slot in the thread's ring, or direct below
+    LogRing *ring = nullptr;
+    bool half = false;           // Publishing this line makes the ring half full
+    LogRecord direct;            // Used while the writer is not running
+
+public:
+    explicit LogLine(LogLevel level)
+    {
+        Logger &logger = Logger::instance();
+        if (!logger.enabled(level))
+        {
+            return;
+        }
+        if (!logger.started())
+        {
+            Logger::stamp(direct, level, 0);
+            record = &direct;
+            return;
+        }
+        ring = &logger.ring();
+        record = ring->claim(half);
+        if (record != nullptr)
+        {
+            Logger::stamp(*record, level, ring->thread);
+        }
+    }
+
+    LogLine(const LogLine &) = delete;
+    LogLine &operator=(const LogLine &) = delete;
+
+    ~LogLine()
+    {
+        if (record == nullptr)
+        {
+            return;
+        }
+        if (record == &direct)
+        {
+            Logger::instance().writeDirect(direct);
+            return;
+        }
+        ring->commit();
+        if (half)
+        {
+            Logger::instance().nudge(); // Wake the writer before the ring fills up
+        }
+    }
+
+    LogLine &operator<<(std::string_view text)
+    {
+        if (record != nullptr)
+        {
+            Logger::appendText(*record, text);
+        }
+        return *this;
+    }
+
+    LogLine &operator<<(const char *text) { return *this << std::string_view(text); }
+    LogLine &operator<<(const std::string &text) { return *this << std::string_view(text); }
+    LogLine &operator<<(char c) { return *this << std::string_view(&c, 1); }
+
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, char> && !std::is_same_v<T, bool>>>
+    LogLine &operator<<(T value)
+    {
+        if (record != nullptr)
+        {
+            Logger::appendNumber(*record, value);
+        }
+        return *this;
+    }
+};
+
+inline LogLine logDebug() { return LogLine(LogLevel::Debug); }
+inline LogLine logInfo() { return LogLine(LogLevel::Info); }
+inline LogLine logWarning() { return LogLine(LogLevel::Warning); }
+inline LogLine logError() { return LogLine(LogLevel::Error); }
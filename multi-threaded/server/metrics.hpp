@@ -0,0 +1,348 @@
+// metrics.hpp
+// Counters and latency histograms of the event loops, and the endpoint that serves
+// them in the Prometheus text format.
+//
+// Every loop thread updates its own LoopMetrics and nothing else, so a counter
+// is a relaxed load and store with no locked instruction and no shared cache
+// line. The endpoint thread reads all loops when it is scraped, and the loop
+// label keeps them apart; Prometheus sums them where a total is wanted.
+//
+// Histograms have fixed power-of-two buckets from 1 µs to about one second, so
+// recording is a bit scan and one store. A clock read is what costs: timing is
+// only done while the endpoint is enabled, and the handler histogram samples
+// one read in eight.
+
+#pragma once
+
+#include <arpa/inet.h>   // htonl, htons
+#include <netinet/in.h>  // sockaddr_in
+#include <sys/socket.h>  // socket, bind, listen, accept
+#include <sys/time.h>    // timeval for the request timeout
+#include <unistd.h>      // read, write, close
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+/**
+ * @brief Nanoseconds on the monotonic clock, for latency measurements.
+ */
+inline uint64_t monotonicNanoseconds()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+/**
+ * @brief A counter written by one thread and read by any.
+ */
+class Counter
+{
+private:
+    std::atomic<uint64_t> value{0};
+
+public:
+    void add(uint64_t amount = 1)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    uint64_t load() const { return value.load(std::memory_order_relaxed); }
+};
+
+/**
+ * @brief A value that goes up and down, written by one thread and read by any.
+ */
+class Gauge
+{
+private:
+    std::atomic<int64_t> value{0};
+
+public:
+    void add(int64_t amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    int64_t load() const { return value.load(std::memory_order_relaxed); }
+};
+
+/**
+ * @brief Distribution of durations in power-of-two buckets, written by one thread and
+ * read by any.
+ */
+class BucketHistogram
+{
+public:
+    static constexpr size_t bounds = 21; // Upper bounds 1 µs, 2 µs, ... 2^20 µs; then +Inf
+
+    struct Snapshot
+    {
+        uint64_t buckets[bounds + 1]; // Not cumulative; the last one is above every bound
+        uint64_t count;
+        uint64_t sumNanoseconds;
+    };
+
+    /**
+     * @return The upper bound of bucket i in nanoseconds.
+     */
+    static constexpr uint64_t bound(size_t i) { return uint64_t{1000} << i; }
+
+    void record(uint64_t nanoseconds)
+    {
+        uint64_t micros = (nanoseconds + 999) / 1000;
+        size_t i = micros <= 1 ? 0 : static_cast<size_t>(64 - __builtin_clzll(micros - 1));
+        std::atomic<uint64_t> &bucket = buckets[i < bounds ? i : bounds];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + nanoseconds, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Current values. The count is taken from the buckets, so the two agree
+     * even while the owner keeps recording.
+     */
+    Snapshot snapshot() const
+    {
+        Snapshot result{};
+        for (size_t i = 0; i <= bounds; ++i)
+        {
+            result.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+            result.count += result.buckets[i];
+        }
+        result.sumNanoseconds = sum.load(std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[bounds + 1] = {};
+    std::atomic<uint64_t> sum{0};
+};
+
+/**
+ * @brief What one loop thread has done since it started.
+ */
+struct LoopMetrics
+{
+    Counter connectionsOpened;
+    Counter connectionsClosed;
+    Counter bytesReceived;
+    Counter bytesSent;
+    Counter messagesReceived;     // Frames and WebSocket messages parsed, counted by the handlers
+    Counter protocolErrors;       // Malformed frames or handshakes that closed a connection
+    Counter readErrors;
+    Counter sendErrors;
+    Counter slowConsumers;        // Connections the Disconnect policy closed
+    Counter droppedBytes;         // Output discarded by the drop-oldest and drop-newest policies
+    Counter idleTimeouts;         // Connections closed for staying silent
+    Counter heartbeats;           // Pings sent to silent connections
+    Counter messagesReplayed;     // Broadcasts and publications sent again to resuming clients
+    Gauge queuedBytes;            // Output waiting in the connections' queues
+    BucketHistogram handlerTime; // Time in the data handler per sampled read
+    BucketHistogram queueTime;   // From output waiting in a connection's queue until the queue drains
+};
+
+/**
+ * @brief Builds a Prometheus text exposition, one metric family at a time.
+ */
+class MetricsText
+{
+private:
+    std::string &out;
+
+public:
+    explicit MetricsText(std::string &out) : out(out) {}
+
+    /**
+     * @brief Starts a family; its samples must follow before the next family starts.
+     *
+     * @param type "counter", "gauge" or "histogram".
+     */
+    void family(std::string_view name, std::string_view type, std::string_view help)
+    {
+        out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    void sample(std::string_view name, std::string_view labels, uint64_t value)
+    {
+        line(name, labels, std::to_string(value));
+    }
+
+    void sample(std::string_view name, std::string_view labels, int64_t value)
+    {
+        line(name, labels, std::to_string(value));
+    }
+
+    /**
+     * @brief Writes a histogram's cumulative buckets, sum and count in seconds.
+     */
+    void histogram(std::string_view name, std::string_view labels, const BucketHistogram::Snapshot &snapshot)
+    {
+        std::string bucket = std::string(name) + "_bucket";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i <= BucketHistogram::bounds; ++i)
+        {
+            cumulative += snapshot.buckets[i];
+            std::string le = i < BucketHistogram::bounds ? seconds(BucketHistogram::bound(i)) : "+Inf";
+            std::string withLe = std::string(labels) + (labels.empty() ? "" : ",") + "le=\"" + le + "\"";
+            line(bucket, withLe, std::to_string(cumulative));
+        }
+        line(std::string(name) + "_sum", labels, seconds(snapshot.sumNanoseconds));
+        line(std::string(name) + "_count", labels, std::to_string(snapshot.count));
+    }
+
+private:
+    void line(std::string_view name, std::string_view labels, const std::string &value)
+    {
+        out.append(name);
+        if (!labels.empty())
+        {
+            out.append("{").append(labels).append("}");
+        }
+        out.append(" ").append(value).append("\n");
+    }
+
+    static std::string seconds(uint64_t nanoseconds)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%.9g", static_cast<double>(nanoseconds) / 1e9);
+        return text;
+    }
+};
+
+/**
+ * @brief Serves GET /metrics on a local port from a thread of its own, so a scrape
+ * never runs on a loop thread.
+ */
+class MetricsEndpoint
+{
+public:
+    /**
+     * @brief Appends the current exposition. Runs on the endpoint thread.
+     */
+    using Render = std::function<void(std::string &)>;
+
+private:
+    static constexpr size_t maxRequest = 8192;
+
+    int listenFd = -1;
+    Render render;
+    std::thread thread;
+    std::atomic<bool> running{false};
+
+public:
+    MetricsEndpoint() = default;
+    MetricsEndpoint(const MetricsEndpoint &) = delete;
+    MetricsEndpoint &operator=(const MetricsEndpoint &) = delete;
+
+    ~MetricsEndpoint() { stop(); }
+
+    /**
+     * @brief Listens on 127.0.0.1 and starts serving.
+     *
+     * @return false if the port cannot be bound.
+     */
+    bool start(int port, Render renderer)
+    {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0)
+        {
+            return false;
+        }
+        int enabled = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listenFd, 16) < 0)
+        {
+            close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        render = std::move(renderer);
+        running = true;
+        thread = std::thread(&MetricsEndpoint::serve, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (!running.exchange(false))
+        {
+            return;
+        }
+        shutdown(listenFd, SHUT_RDWR); // Wakes the blocked accept()
+        thread.join();
+        close(listenFd);
+        listenFd = -1;
+    }
+
+private:
+    void serve()
+    {
+        std::string request, body;
+        while (running)
+        {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                continue; // EINTR, ECONNABORTED, or shut down by stop()
+            }
+            timeval timeout{1, 0}; // A scraper that stalls must not hold up the next one
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            request.clear();
+            char buffer[1024];
+            while (request.find("\r\n\r\n") == std::string::npos && request.size() < maxRequest)
+            {
+                ssize_t received = read(fd, buffer, sizeof(buffer));
+                if (received <= 0)
+                {
+                    break;
+                }
+                request.append(buffer, static_cast<size_t>(received));
+            }
+
+            body.clear();
+            const char *status = "404 Not Found";
+            const char *type = "text/plain";
+            std::string_view line = std::string_view(request).substr(0, request.find("\r\n"));
+            if (line.substr(0, 13) == "GET /metrics " || line.substr(0, 13) == "GET /metrics?")
+            {
+                status = "200 OK";
+                type = "text/plain; version=0.0.4; charset=utf-8";
+                render(body);
+            }
+            else
+            {
+                body = "Not found; try /metrics\n";
+            }
+            std::string response = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + type +
+                                   "\r\nContent-Length: " + std::to_string(body.size()) +
+                                   "\r\nConnection: close\r\n\r\n" + body;
+            writeAll(fd, response);
+            close(fd);
+        }
+    }
+
+    static void writeAll(int fd, std::string_view data)
+    {
+        while (!data.empty())
+        {
+            ssize_t written = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+            if (written <= 0)
+            {
+                return;
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+    }
+};
@@ -0,0 +1,217 @@
+// mpsc_queue.hpp
+// Lock-free handoff of work from any thread to one event loop.
+//
+// MpscQueue is a bounded ring in the style of Dmitry Vyukov's queue: every cell
+// carries a sequence number that says whether it is free for the producer whose
+// ticket matches it or filled for the consumer. Producers claim a ticket with a
+// compare-and-swap on the tail and publish the cell with a release store; the
+// single consumer reads cells in order without any read-modify-write at all.
+// Neither side ever blocks, and head and tail sit on separate cache lines.
+//
+// Mailbox puts the two things around it that a loop needs. A burst that fills
+// the ring goes to a mutex-protected overflow list, and later posts follow it
+// there until the consumer has caught up, so items from one producer are still
+// taken in the order they were posted. The overflow list has a fixed limit too:
+// once it is reached, posting fails and the item stays with the producer, which
+// decides whether to wait, shed it or push back on its own source. Posting never
+// blocks, so a loop that posts to another loop's full mailbox never waits on it,
+// which rules out two loops stalling on each other. Posting also tells the
+// producer whether the consumer still needs waking; one eventfd write covers a
+// whole burst instead of one write per item.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class MpscQueue
+{
+private:
+    static constexpr size_t cacheLine = 64;
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence; // Equals the ticket when free, ticket + 1 once filled
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(cacheLine) std::atomic<size_t> tail{0}; // Next ticket handed to a producer
+    alignas(cacheLine) size_t head = 0;             // Next ticket read by the consumer
+
+public:
+    /**
+     * @param capacity Number of cells, rounded up to a power of two.
+     */
+    explicit MpscQueue(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i)
+        {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    size_t capacity() const { return mask + 1; }
+
+    /**
+     * @brief Moves the item into the queue; safe to call from any number of threads.
+     *
+     * @return false if the queue is full, in which case the item is left untouched.
+     */
+    bool tryPush(T &item)
+    {
+        size_t ticket = tail.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true)
+        {
+            cell = &cells[ticket & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(ticket);
+            if (lag == 0)
+            {
+                if (tail.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (lag < 0)
+            {
+                return false; // The cell still holds an item from one lap ago
+            }
+            else
+            {
+                ticket = tail.load(std::memory_order_relaxed); // Another producer took it
+            }
+        }
+        cell->value = std::move(item);
+        cell->sequence.store(ticket + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Moves the oldest item out of the queue; consumer thread only.
+     *
+     * @return false if the queue is empty, or the next item's producer has claimed its
+     *         cell but not finished writing it yet.
+     */
+    bool tryPop(T &out)
+    {
+        Cell &cell = cells[head & mask];
+        if (cell.sequence.load(std::memory_order_acquire) != head + 1)
+        {
+            return false;
+        }
+        out = std::move(cell.value);
+        cell.value = T();                                                   // Drop what the moved-from value still holds
+        cell.sequence.store(head + mask + 1, std::memory_order_release); // Free for the next lap
+        ++head;
+        return true;
+    }
+
+    /**
+     * @brief Whether every ticket handed out so far has been popped; consumer thread only.
+     */
+    bool empty() const { return tail.load(std::memory_order_acquire) == head; }
+};
+
+/**
+ * @brief Outcome of Mailbox::post().
+ */
+enum class PostResult
+{
+    Queued, // Taken; an earlier post has already woken the consumer
+    WakeUp, // Taken; the caller has to wake the consumer
+    Full,   // Not taken: the ring and the overflow list are both full
+};
+
+template <typename T>
+class Mailbox
+{
+private:
+    MpscQueue<T> queue;
+    const size_t overflowLimit;           // Items the overflow list holds at most
+    std::atomic<bool> signalled{false};   // A wakeup is pending that the consumer has not acted on
+    std::atomic<bool> overflowing{false}; // overflow holds items; posts must queue behind them
+    std::mutex overflowMutex;             // Protects overflow
+    std::vector<T> overflow;              // Items posted while the ring was full, in order
+    std::vector<T> spare;                 // Consumer's swap partner for overflow, kept for its capacity
+    T scratch{};                          // Consumer's landing slot for tryPop
+
+public:
+    /**
+     * @param capacity Cells of the lock-free ring, rounded up to a power of two.
+     * @param overflowLimit Items held behind a full ring before posts fail.
+     */
+    Mailbox(size_t capacity, size_t overflowLimit) : queue(capacity), overflowLimit(overflowLimit) {}
+
+    /**
+     * @brief Hands an item to the consumer; never blocks on the consumer.
+     *
+     * @return Full if the mailbox holds as much as it may; the item is then left
+     *         untouched. Otherwise whether the consumer has to be woken up: WakeUp,
+     *         or Queued if an earlier post has already done so and the consumer has
+     *         not drained since. A full mailbox is always already due to be drained.
+     */
+    PostResult post(T &item)
+    {
+        if (overflowing.load(std::memory_order_acquire) || !queue.tryPush(item))
+        {
+            std::lock_guard<std::mutex> lock(overflowMutex);
+            if (overflow.size() >= overflowLimit)
+            {
+                return PostResult::Full;
+            }
+            overflow.push_back(std::move(item));
+            overflowing.store(true, std::memory_order_release);
+        }
+        return signalled.exchange(true, std::memory_order_acq_rel) ? PostResult::Queued : PostResult::WakeUp;
+    }
+
+    /**
+     * @brief Passes every posted item to handle(T &), oldest first; consumer thread only.
+     *
+     * The wakeup flag is cleared before looking at the queue, so an item posted while
+     * this runs either is seen here or wakes the consumer again. Overflowed items are
+     * only taken once the ring is empty, since they were posted after everything in it.
+     */
+    template <typename Handler>
+    void drain(Handler &&handle)
+    {
+        signalled.exchange(false, std::memory_order_acq_rel);
+        while (queue.tryPop(scratch))
+        {
+            handle(scratch);
+        }
+        if (!overflowing.load(std::memory_order_acquire) || !queue.empty())
+        {
+            return; // Newer ring items came in meanwhile; their posts wake the consumer again
+        }
+        {
+            std::lock_guard<std::mutex> lock(overflowMutex);
+            spare.swap(overflow);
+            overflowing.store(false, std::memory_order_release);
+        }
+        for (T &item : spare)
+        {
+            handle(item);
+        }
+        spare.clear();
+    }
+};
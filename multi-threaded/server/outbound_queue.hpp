@@ -0,0 +1,466 @@
+// outbound_queue.hpp
+// Per-connection output waiting for the socket.
+//
+// Replies are private to one connection and are copied in, but a broadcast is
+// framed once into an immutable SharedBuffer that every recipient's queue merely
+// references. The queue keeps both kinds in order and hands them to the kernel
+// as an iovec array, so fanning a message out never copies its bytes.
+//
+// Queues are bounded by OutboundLimits, which the event loops enforce: above the
+// high watermark a loop stops reading from the connection until the queue drains
+// below the low watermark, and a queue that would exceed its cap is handled by
+// the slow-consumer policy.
+//
+// Segments and the bytes they own come from the loop thread's BufferPool, so a
+// queue that fills and drains over and over does not touch the heap.
+//
+// Large payloads can skip even the copy into the kernel. A queue also holds
+// regions of read-only mapped files, which the loops send with sendfile or a
+// zero-copy send straight from the page cache, and gatherRun() sets large shared
+// buffers apart so that a loop can send them with MSG_ZEROCOPY. The kernel then
+// reads the buffer after the send call has returned, so the loop keeps a
+// reference in the connection's ZeroCopyPins until the kernel reports that it is
+// done with it.
+
+#pragma once
+
+#include <sys/mman.h> // Mapping files read-only
+#include <sys/stat.h> // File size
+#include <sys/uio.h>  // iovec
+#include <fcntl.h>    // open
+#include <unistd.h>   // close
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "pool.hpp" // Per-thread size-classed memory
+
+/**
+ * @brief An encoded message shared read-only by every connection it is sent to.
+ */
+using SharedBuffer = std::shared_ptr<const PooledString>;
+
+/**
+ * @brief Copies an encoded message into a pooled shared buffer.
+ */
+inline SharedBuffer makeSharedBuffer(std::string_view bytes)
+{
+    return std::allocate_shared<PooledString>(PoolAllocator<PooledString>(), bytes.data(), bytes.size());
+}
+
+/**
+ * @brief A read-only file mapped into memory, sent to any number of connections.
+ *
+ * The loops send it with sendfile or a zero-copy send from the mapping, so its
+ * bytes go from the page cache to the socket without a copy in user space. The
+ * file must not shrink while it is being served.
+ */
+class MappedFile
+{
+private:
+    int fd;
+    const char *data;
+    size_t length;
+
+    MappedFile(int fd, const char *data, size_t length) : fd(fd), data(data), length(length) {}
+
+public:
+    /**
+     * @brief Opens and maps a file.
+     *
+     * @return The mapped file, or null if it cannot be opened, is empty or is not a
+     *         regular file.
+     */
+    static std::shared_ptr<const MappedFile> open(const char *path)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        struct stat info;
+        if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size <= 0)
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        size_t length = static_cast<size_t>(info.st_size);
+        void *data = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        return std::shared_ptr<const MappedFile>(new MappedFile(fd, static_cast<const char *>(data), length));
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        munmap(const_cast<char *>(data), length);
+        ::close(fd);
+    }
+
+    int descriptor() const { return fd; }
+    size_t size() const { return length; }
+    std::string_view bytes() const { return std::string_view(data, length); }
+};
+
+using SharedFile = std::shared_ptr<const MappedFile>;
+
+/**
+ * @brief Buffers that zero-copy sends of one connection still reference, kept alive
+ * until the kernel reports that it no longer reads them.
+ *
+ * Each zero-copy send pins its buffer under the next sequence number, which is
+ * the number the kernel reports it under on the socket's error queue.
+ */
+class ZeroCopyPins
+{
+private:
+    using Pin = std::pair<uint32_t, std::shared_ptr<const void>>;
+
+    std::vector<Pin, PoolAllocator<Pin>> pins; // Oldest first
+    uint32_t next = 0;                         // Sequence number of the next zero-copy send
+
+public:
+    bool enabled = false; // The socket accepts zero-copy sends
+
+    bool empty() const { return pins.empty(); }
+
+    /**
+     * @brief Keeps a buffer alive for the zero-copy send about to be made or just made.
+     */
+    void pin(std::shared_ptr<const void> buffer)
+    {
+        pins.emplace_back(next++, std::move(buffer));
+    }
+
+    /**
+     * @brief Releases the buffers of the sends numbered first to last, inclusive.
+     */
+    void release(uint32_t first, uint32_t last)
+    {
+        uint32_t span = last - first; // Sequence numbers wrap around
+        pins.erase(std::remove_if(pins.begin(), pins.end(), [&](const Pin &pin)
+                                  { return pin.first - first <= span; }),
+                   pins.end());
+    }
+
+    /**
+     * @brief Releases the buffer of the oldest send still pinned.
+     */
+    void releaseOldest()
+    {
+        if (!pins.empty())
+        {
+            pins.erase(pins.begin());
+        }
+    }
+
+    /**
+     * @brief Releases the buffer of the latest send, whose request failed before the
+     * kernel took a reference to it.
+     */
+    void releaseNewest()
+    {
+        if (!pins.empty())
+        {
+            pins.pop_back();
+        }
+    }
+};
+
+/**
+ * @brief What to do with a message for a connection whose queue is full.
+ */
+enum class SlowConsumerPolicy
+{
+    DropOldest, // Discard queued messages that have not started sending to make room
+    DropNewest, // Discard the new message
+    Disconnect, // Close the connection
+};
+
+/**
+ * @brief Bounds applied to every connection's outbound queue.
+ */
+struct OutboundLimits
+{
+    size_t maxBytes = 8u << 20;       // Cap on queued bytes; a message is always accepted by an empty queue
+    size_t highWatermark = 1u << 20;  // Stop reading from the connection above this many queued bytes
+    size_t lowWatermark = 256u << 10; // Resume reading once the queue drains to this
+    SlowConsumerPolicy policy = SlowConsumerPolicy::Disconnect;
+};
+
+/**
+ * @brief Ordered output of one connection: private bytes and shared buffers.
+ */
+class OutboundQueue
+{
+private:
+    struct Segment
+    {
+        SharedBuffer shared;   // Broadcast message, or null for private bytes
+        SharedFile file;       // File region, when set
+        size_t fileOffset = 0; // Start of the region in the file
+        size_t fileLength = 0;
+        PooledString owned;    // Private bytes when shared and file are null
+        bool continues = false; // Starts partway through a message: goes with the segment before it
+
+        std::string_view view() const
+        {
+            if (shared)
+            {
+                return *shared;
+            }
+            return file ? file->bytes().substr(fileOffset, fileLength) : std::string_view(owned);
+        }
+    };
+
+    using SegmentList = std::vector<Segment, PoolAllocator<Segment>>;
+
+    SegmentList segments; // Pending output, oldest first, starting at head
+    size_t head = 0;      // First unsent segment
+    size_t offset = 0;    // Bytes of segments[head] already sent
+    size_t bytes = 0;     // Unsent bytes across all segments
+
+public:
+    bool empty() const { return bytes == 0; }
+
+    /**
+     * @brief Unsent bytes in the queue.
+     */
+    size_t size() const { return bytes; }
+
+    /**
+     * @brief Copies private bytes in, extending the last segment when it is private too.
+     *
+     * @param continues The bytes continue a message: the one queued just before, or
+     *        one whose start was written to the socket already.
+     */
+    void append(const char *data, size_t length, bool continues = false)
+    {
+        if (length == 0)
+        {
+            return;
+        }
+        if (!extendsLast(continues))
+        {
+            segments.emplace_back();
+            segments.back().continues = continues;
+        }
+        segments.back().owned.append(data, length);
+        bytes += length;
+    }
+
+    /**
+     * @brief Queues a reference to a shared buffer without copying it.
+     */
+    void append(SharedBuffer buffer)
+    {
+        if (!buffer || buffer->empty())
+        {
+            return;
+        }
+        bytes += buffer->size();
+        segments.emplace_back();
+        segments.back().shared = std::move(buffer);
+    }
+
+    /**
+     * @brief Queues a region of a mapped file without copying it.
+     *
+     * @param continues The region continues the message queued just before it, such
+     *        as the frame header of a file sent as one frame.
+     */
+    void append(SharedFile file, size_t offset, size_t length, bool continues = false)
+    {
+        if (!file || length == 0)
+        {
+            return;
+        }
+        bytes += length;
+        segments.emplace_back();
+        segments.back().file = std::move(file);
+        segments.back().fileOffset = offset;
+        segments.back().fileLength = length;
+        segments.back().continues = continues;
+    }
+
+    /**
+     * @brief Describes the unsent bytes from the front of the queue.
+     *
+     * The iovecs stay valid until the queue is next modified.
+     *
+     * @return Number of entries filled, at most count.
+     */
+    size_t gather(iovec *iov, size_t count) const
+    {
+        size_t filled = 0;
+        for (size_t i = head; i < segments.size() && filled < count; ++i)
+        {
+            std::string_view data = segments[i].view();
+            if (i == head)
+            {
+                data.remove_prefix(offset);
+            }
+            iov[filled].iov_base = const_cast<char *>(data.data());
+            iov[filled].iov_len = data.size();
+            ++filled;
+        }
+        return filled;
+    }
+
+    /**
+     * @brief Unsent bytes from the front of the queue that can go out in one send call.
+     */
+    struct Run
+    {
+        size_t count = 0;     // iovecs filled
+        SharedBuffer buffer;  // Set when the run is one large shared segment
+        SharedFile file;      // Set when the run is one file region
+        off_t fileOffset = 0; // Where the region's unsent bytes start in the file
+    };
+
+    /**
+     * @brief Like gather(), but describes a file region or a shared segment of at least
+     * threshold bytes on its own, so that it can take a zero-copy path; an ordinary
+     * run stops short of one.
+     *
+     * @param threshold Size from which shared segments count as large; 0 for none.
+     */
+    Run gatherRun(iovec *iov, size_t count, size_t threshold) const
+    {
+        Run run;
+        for (size_t i = head; i < segments.size() && run.count < count; ++i)
+        {
+            const Segment &segment = segments[i];
+            bool alone = segment.file || (threshold > 0 && segment.shared && segment.shared->size() >= threshold);
+            if (alone && run.count > 0)
+            {
+                break;
+            }
+            std::string_view data = segment.view();
+            size_t skipped = i == head ? offset : 0;
+            data.remove_prefix(skipped);
+            iov[run.count].iov_base = const_cast<char *>(data.data());
+            iov[run.count].iov_len = data.size();
+            ++run.count;
+            if (alone)
+            {
+                run.buffer = segment.shared;
+                run.file = segment.file;
+                run.fileOffset = static_cast<off_t>(segment.fileOffset + skipped);
+                break;
+            }
+        }
+        return run;
+    }
+
+    /**
+     * @brief Drops bytes the kernel accepted, releasing finished segments.
+     */
+    void consume(size_t length)
+    {
+        bytes -= length;
+        while (length > 0)
+        {
+            size_t remaining = segments[head].view().size() - offset;
+            if (length < remaining)
+            {
+                offset += length;
+                return;
+            }
+            length -= remaining;
+            segments[head] = Segment{}; // Drop the shared reference as soon as it is sent
+            ++head;
+            offset = 0;
+        }
+        if (bytes == 0)
+        {
+            clear();
+        }
+        else if (head > 16 && head * 2 > segments.size())
+        {
+            segments.erase(segments.begin(), segments.begin() + static_cast<std::ptrdiff_t>(head));
+            head = 0;
+        }
+    }
+
+    /**
+     * @brief Discards the oldest messages that have not started sending until at least
+     * needed bytes are freed or none are left.
+     *
+     * Segments start on message boundaries unless marked as continuing the one before,
+     * so a segment is dropped together with its continuations, and the rest of a
+     * message that has started sending is kept. The stream stays aligned on frames.
+     *
+     * @return Bytes freed.
+     */
+    size_t dropOldest(size_t needed)
+    {
+        size_t first = head + (offset > 0 ? 1 : 0); // A partly sent segment must be finished
+        while (first < segments.size() && segments[first].continues)
+        {
+            ++first; // And so must the rest of its message
+        }
+        size_t last = first;
+        size_t freed = 0;
+        while (last < segments.size() && (freed < needed || segments[last].continues))
+        {
+            freed += segments[last].view().size();
+            ++last;
+        }
+        segments.erase(segments.begin() + static_cast<std::ptrdiff_t>(first),
+                       segments.begin() + static_cast<std::ptrdiff_t>(last));
+        bytes -= freed;
+        if (bytes == 0)
+        {
+            clear();
+        }
+        return freed;
+    }
+
+    /**
+     * @brief Discards everything and gives the memory back to the pool.
+     */
+    void clear()
+    {
+        SegmentList().swap(segments);
+        head = 0;
+        offset = 0;
+        bytes = 0;
+    }
+
+    /**
+     * @brief Exchanges contents with another queue without touching the buffered data.
+     */
+    void swap(OutboundQueue &other)
+    {
+        segments.swap(other.segments);
+        std::swap(head, other.head);
+        std::swap(offset, other.offset);
+        std::swap(bytes, other.bytes);
+    }
+
+private:
+    /**
+     * @brief Whether private bytes can be added to the last segment. A new message only
+     * joins a segment that can still be dropped on its own, so that it stays droppable.
+     */
+    bool extendsLast(bool continues) const
+    {
+        if (segments.size() == head || segments.back().shared || segments.back().file)
+        {
+            return false;
+        }
+        return continues || (!segments.back().continues && !(segments.size() == head + 1 && offset > 0));
+    }
+};
@@ -0,0 +1,229 @@
+// pool.hpp
+// Size-classed memory pools for the event loop threads.
+//
+// Each loop owns a BufferPool and attaches it to its thread when run() starts.
+// Connection state, outbound queue segments, shared broadcast buffers and the
+// parser's reassembly buffers are then served from per-size-class free lists,
+// so once the lists are warm a message costs no trip to the heap. The pool is
+// touched only by its own thread and needs no locks.
+//
+// Every block is one separate heap allocation of exactly its class size. A block
+// may therefore be released on a thread other than the one that allocated it,
+// which happens to broadcast buffers, and simply joins that thread's free list, or
+// goes back to the heap when the thread has no pool. Each free list keeps a
+// bounded number of idle blocks, so a burst does not pin its memory forever.
+//
+// AllocationCounter complements the pool: server.cpp replaces the global operator
+// new so that every heap allocation made by a loop thread is counted, which is how
+// the steady state is shown to be allocation free (see --stats).
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+
+/**
+ * @brief Heap allocations made by the thread it is attached to.
+ */
+struct AllocationCounter
+{
+    std::atomic<uint64_t> count{0}; // Written by the owning thread only, readable from any thread
+
+    /**
+     * @brief The counter attached to the calling thread, or null.
+     */
+    static AllocationCounter *&current()
+    {
+        static thread_local AllocationCounter *counter = nullptr;
+        return counter;
+    }
+
+    void record()
+    {
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+class BufferPool
+{
+public:
+    static constexpr size_t classCount = 9;
+    static constexpr size_t classSizes[classCount] = {32, 64, 128, 256, 512, 1024, 4096, 16384, 65536};
+
+    static constexpr size_t prefillBytes = 16u << 10; // Allocated up front per size class (at least one block)
+    static constexpr size_t maxIdleBytes = 1u << 20;  // Idle blocks kept per size class; the rest is freed
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    struct SizeClass
+    {
+        FreeBlock *head = nullptr; // Idle blocks
+        size_t idle = 0;           // Length of the list
+    };
+
+    SizeClass classes[classCount];
+    std::atomic<uint64_t> hitCount{0};  // Allocations served from a free list
+    std::atomic<uint64_t> missCount{0}; // Allocations that went to the heap
+
+public:
+    /**
+     * @brief Fills every size class with its initial blocks.
+     */
+    BufferPool()
+    {
+        for (size_t c = 0; c < classCount; ++c)
+        {
+            size_t blocks = prefillBytes > classSizes[c] ? prefillBytes / classSizes[c] : 1;
+            for (size_t i = 0; i < blocks; ++i)
+            {
+                push(c, ::operator new(classSizes[c]));
+            }
+        }
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    ~BufferPool()
+    {
+        for (SizeClass &sizeClass : classes)
+        {
+            while (sizeClass.head != nullptr)
+            {
+                FreeBlock *block = sizeClass.head;
+                sizeClass.head = block->next;
+                ::operator delete(block);
+            }
+        }
+    }
+
+    /**
+     * @brief The pool attached to the calling thread, or null.
+     */
+    static BufferPool *&current()
+    {
+        static thread_local BufferPool *pool = nullptr;
+        return pool;
+    }
+
+    /**
+     * @brief Allocations served from the free lists. Readable from any thread.
+     */
+    uint64_t hits() const { return hitCount.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Allocations the free lists could not serve. Readable from any thread.
+     */
+    uint64_t misses() const { return missCount.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Allocates from the calling thread's pool, or from the heap when the thread
+     * has none or the size is above the largest class.
+     */
+    static void *allocate(size_t size)
+    {
+        size_t c = classFor(size);
+        if (c == classCount)
+        {
+            if (BufferPool *pool = current())
+            {
+                pool->count(pool->missCount);
+            }
+            return ::operator new(size);
+        }
+        BufferPool *pool = current();
+        if (pool == nullptr)
+        {
+            return ::operator new(classSizes[c]); // Class sized, so any pool can take it back
+        }
+        SizeClass &sizeClass = pool->classes[c];
+        if (sizeClass.head == nullptr)
+        {
+            pool->count(pool->missCount);
+            return ::operator new(classSizes[c]);
+        }
+        FreeBlock *block = sizeClass.head;
+        sizeClass.head = block->next;
+        --sizeClass.idle;
+        pool->count(pool->hitCount);
+        return block;
+    }
+
+    /**
+     * @brief Returns memory from allocate() to the calling thread's pool.
+     *
+     * @param size The size passed to allocate().
+     */
+    static void deallocate(void *pointer, size_t size)
+    {
+        size_t c = classFor(size);
+        BufferPool *pool = current();
+        if (c == classCount || pool == nullptr || pool->classes[c].idle * classSizes[c] >= maxIdleBytes)
+        {
+            ::operator delete(pointer);
+            return;
+        }
+        pool->push(c, pointer);
+    }
+
+private:
+    /**
+     * @brief Index of the smallest class that fits, or classCount if none does.
+     */
+    static size_t classFor(size_t size)
+    {
+        size_t c = 0;
+        while (c < classCount && classSizes[c] < size)
+        {
+            ++c;
+        }
+        return c;
+    }
+
+    void push(size_t c, void *pointer)
+    {
+        auto *block = static_cast<FreeBlock *>(pointer);
+        block->next = classes[c].head;
+        classes[c].head = block;
+        ++classes[c].idle;
+    }
+
+    static void count(std::atomic<uint64_t> &counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * @brief Standard allocator drawing from the calling thread's BufferPool.
+ */
+template <typename T>
+struct PoolAllocator
+{
+    using value_type = T;
+
+    PoolAllocator() = default;
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(BufferPool::allocate(n * sizeof(T))); }
+    void deallocate(T *pointer, size_t n) { BufferPool::deallocate(pointer, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+/**
+ * @brief A string whose buffer comes from the pool.
+ */
+using PooledString = std::basic_string<char, std::char_traits<char>, PoolAllocator<char>>;
@@ -0,0 +1,63 @@
+// read_buffer.hpp
+// A receive buffer sized by what the reads actually return.
+//
+// A fixed buffer is either too small for a client sending bulk data, which then
+// costs a recv per kilobyte, or too large to give every one of thousands of quiet
+// clients. This one starts small, doubles whenever a read fills it, and halves
+// after a run of reads that used no more than a quarter of it. It is allocated
+// without being zeroed: every byte handed out was written by recv first.
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+class AdaptiveReadBuffer
+{
+private:
+    static constexpr unsigned shrinkAfter = 16; // Small reads in a row before halving
+
+    std::unique_ptr<char[]> storage;
+    size_t capacity;
+    size_t minimum;
+    size_t maximum;
+    unsigned smallReads = 0; // Consecutive reads that used a quarter of the buffer or less
+
+public:
+    /**
+     * @param minimum Initial and smallest size.
+     * @param maximum Largest size.
+     */
+    AdaptiveReadBuffer(size_t minimum, size_t maximum)
+        : storage(new char[minimum]), capacity(minimum), minimum(minimum), maximum(maximum) {}
+
+    char *data() { return storage.get(); }
+    size_t size() const { return capacity; }
+
+    /**
+     * @brief Adapts the size to a read of bytes, once its data has been consumed.
+     */
+    void observe(size_t bytes)
+    {
+        if (bytes == capacity && capacity < maximum)
+        {
+            resize(capacity * 2 < maximum ? capacity * 2 : maximum);
+        }
+        else if (bytes <= capacity / 4 && capacity > minimum && ++smallReads >= shrinkAfter)
+        {
+            resize(capacity / 2 > minimum ? capacity / 2 : minimum);
+        }
+        else if (bytes > capacity / 4)
+        {
+            smallReads = 0;
+        }
+    }
+
+private:
+    void resize(size_t size)
+    {
+        storage.reset(new char[size]); // Nothing is kept between reads
+        capacity = size;
+        smallReads = 0;
+    }
+};
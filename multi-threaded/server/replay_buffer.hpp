@@ -0,0 +1,232 @@
+// replay_buffer.hpp
+// Recent broadcasts and publications, numbered so that reconnecting clients can
+// resume where they left off.
+//
+// Every message the server fans out to framed clients gets the next sequence
+// number of the server's stream and goes out behind a Sequence frame. A copy of
+// the encoded frames is kept here, bounded by a message count and a byte budget.
+// A client that reconnects sends a Resume frame with the stream ID and the last
+// number it saw, and the server sends it whatever it missed that is still held,
+// then a Resumed frame saying how far the replay went and how many messages were
+// lost because they had already been evicted. The client does not have to fetch
+// its state again.
+//
+// Numbers are assigned and the message is handed to the loops under one lock, so
+// every loop receives the stream in sequence order. The lock covers posting to
+// the loops and queueing a replay, never a write that can block.
+//
+// With a replay log (replay_log.hpp) the frames are kept in its segment files
+// instead of memory, replays are sent from the page cache, and the stream and its
+// numbers survive a restart. The log's size then bounds the bytes kept.
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "../common/framing.hpp" // Sequence frames
+#include "outbound_queue.hpp"     // SharedBuffer, the unit of fan-out
+#include "pool.hpp"               // PooledString for topics
+#include "replay_log.hpp"         // Keeping the entries across restarts
+
+class ReplayBuffer
+{
+public:
+    /**
+     * @brief One numbered message.
+     */
+    struct Entry
+    {
+        uint64_t sequence;
+        PooledString topic;   // Topic of a publication; empty for a broadcast
+        bool everyone;        // A broadcast rather than a publication
+        SharedBuffer frames;  // Sequence frame followed by the message frame, as sent live; null if logged
+        SharedFile file;      // Log segment holding the frames instead
+        size_t offset;        // Where they start in the segment
+        size_t length;        // Size of the frames
+    };
+
+    /**
+     * @brief What a replay covered.
+     */
+    struct Resumption
+    {
+        uint64_t stream;  // This server's stream ID
+        uint64_t through; // Last sequence number assigned when the replay was taken
+        uint64_t missed;  // Messages after the client's last one that were no longer held
+    };
+
+private:
+    std::mutex mutex;
+    std::deque<Entry> entries; // Oldest first
+    size_t maxMessages;
+    size_t maxBytes;
+    size_t bytes = 0;          // Total size of the entries' frames
+    uint64_t streamId;         // Tells the client whether sequence numbers carry over
+    uint64_t last = 0;         // Last sequence number assigned
+    std::unique_ptr<ReplayLog> log;
+    bool suspended = false;    // The log was released to another process; messages go out unnumbered
+
+public:
+    /**
+     * @param maxMessages Messages kept for replay.
+     * @param maxBytes Encoded bytes kept for replay; the oldest go first when exceeded.
+     */
+    ReplayBuffer(size_t maxMessages, size_t maxBytes)
+        : maxMessages(maxMessages), maxBytes(maxBytes), streamId(newStreamId()) {}
+
+    ReplayBuffer(const ReplayBuffer &) = delete;
+    ReplayBuffer &operator=(const ReplayBuffer &) = delete;
+
+    /**
+     * @brief Numbers a message, keeps it, and passes the frames to send live to deliver,
+     * which runs under the buffer's lock and must only post them to the loops.
+     *
+     * @param topic Topic of a publication; empty for a broadcast.
+     * @param frame The encoded message frame.
+     */
+    template <typename Deliver>
+    void append(std::string_view topic, bool everyone, std::string_view frame, Deliver &&deliver)
+    {
+        static thread_local std::string framed; // Scratch, copied into the pooled shared buffer
+        std::lock_guard<std::mutex> lock(mutex);
+        if (suspended)
+        {
+            deliver(makeSharedBuffer(frame)); // The numbers are the new process's now
+            return;
+        }
+        uint64_t sequence = ++last;
+        framed.clear();
+        appendVarintFrame(framed, FrameType::Sequence, {sequence});
+        framed.append(frame.data(), frame.size());
+        SharedBuffer frames = makeSharedBuffer(framed);
+        deliver(frames);
+
+        if (log)
+        {
+            SharedFile file, retired;
+            size_t offset;
+            if (!log->append(framed, sequence, file, offset, retired))
+            {
+                entries.clear(); // Held numbers must stay consecutive
+                return;
+            }
+            while (retired && !entries.empty() && entries.front().file == retired)
+            {
+                entries.pop_front();
+            }
+            entries.push_back(Entry{sequence, PooledString(topic), everyone, nullptr, std::move(file), offset, framed.size()});
+        }
+        else
+        {
+            bytes += frames->size();
+            entries.push_back(Entry{sequence, PooledString(topic), everyone, std::move(frames), nullptr, 0, framed.size()});
+        }
+        while (entries.size() > maxMessages || (bytes > maxBytes && entries.size() > 1))
+        {
+            bytes -= entries.front().frames ? entries.front().length : 0;
+            entries.pop_front();
+        }
+    }
+
+    /**
+     * @brief Opens the replay log, or reopens it after a handover that failed, and takes
+     * the stream, its numbers and its entries from it.
+     *
+     * @param waitSeconds How long to wait for a process handing the log over.
+     * @return false, with the reason in error, if the log cannot be opened.
+     */
+    bool openLog(const ReplayLogOptions &options, int waitSeconds, std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        bytes = 0;
+        uint64_t recovered = 0;
+        log = ReplayLog::open(options, waitSeconds, error, [&](const ReplayLog::Record &record)
+                              {
+                                  entries.push_back(Entry{record.sequence, PooledString(record.topic), record.everyone, nullptr,
+                                                          record.file, record.offset, record.length});
+                                  recovered = record.sequence; });
+        while (entries.size() > maxMessages)
+        {
+            entries.pop_front();
+        }
+        if (!log)
+        {
+            return false;
+        }
+        streamId = log->stream();
+        last = recovered;
+        suspended = false;
+        return true;
+    }
+
+    /**
+     * @brief Releases the log for a process taking over. Until it is reopened, messages
+     * are sent without numbers, since the new process continues the stream.
+     */
+    void suspendLog()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (log)
+        {
+            log.reset();
+            suspended = true;
+        }
+    }
+
+    size_t held()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    /**
+     * @brief Passes visit every held entry a resuming client has not seen, oldest first.
+     * Runs under the buffer's lock, so visit must not block.
+     *
+     * @param stream The stream ID the client last saw; 0 for a new session. After a
+     * restart without a log the ID differs, and every held entry is replayed.
+     * @param after The last sequence number the client saw on that stream. For a new
+     * session, the number of recent entries it asks for as a backlog.
+     */
+    template <typename Visit>
+    Resumption replay(uint64_t stream, uint64_t after, Visit &&visit)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Resumption result{streamId, last, 0};
+        if (stream == 0)
+        {
+            after = entries.size() > after ? entries[entries.size() - after - 1].sequence : 0;
+        }
+        else if (stream != streamId || after > last)
+        {
+            after = 0; // Numbers of another stream mean nothing here
+        }
+        else
+        {
+            uint64_t oldest = entries.empty() ? last + 1 : entries.front().sequence;
+            result.missed = oldest > after + 1 ? oldest - after - 1 : 0;
+        }
+        // Held numbers are consecutive, so the first one to replay is found by offset
+        size_t first = entries.empty() || after < entries.front().sequence ? 0 : after - entries.front().sequence + 1;
+        for (size_t i = first; i < entries.size(); ++i)
+        {
+            visit(entries[i]);
+        }
+        return result;
+    }
+
+private:
+    static uint64_t newStreamId()
+    {
+        std::random_device random;
+        uint64_t id = (static_cast<uint64_t>(random()) << 32) ^ random();
+        return id != 0 ? id : 1; // 0 stands for a new session
+    }
+};
@@ -0,0 +1,491 @@
+// replay_log.hpp
+// Segment files that keep the replay buffer's messages across restarts.
+//
+// The log is a ring of fixed-size segment files in one directory. A message is
+// appended by copying the bytes it was sent with, its Sequence frame and its
+// message frame, into the mapping of the newest segment: no system call and no
+// fsync per message. A flusher thread writes the dirty pages back with one msync
+// per interval. If the process dies nothing is lost, since the pages are in the
+// page cache; if the machine dies, at most one interval is.
+//
+// Replays are sent from the segment files with sendfile, straight from the page
+// cache. When the ring is full, the oldest segment is retired by unlinking it
+// rather than overwritten in place: a replay still queued for a slow client holds
+// the file open and is sent intact, and the space is freed with the last such
+// reference.
+//
+// A segment holds nothing but frames, so recovery after a restart reads it the
+// way a client would: pairs of a Sequence frame and a Text or Publish frame with
+// consecutive numbers, up to the first pair that is incomplete.
+//
+// One process at a time owns the directory, through an flock on its lock file. A
+// server handing its listeners to a new process releases the log first, so the
+// new process continues the same stream.
+
+#pragma once
+
+#include <sys/file.h> // flock
+#include <sys/mman.h> // mmap, msync
+#include <sys/stat.h> // mkdir, fstat
+#include <dirent.h>   // Listing the segments
+#include <fcntl.h>    // open
+#include <unistd.h>   // ftruncate, unlink, close
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../common/framing.hpp" // Records are frames
+#include "outbound_queue.hpp"     // SharedFile, the unit replays are sent in
+
+/**
+ * @brief Where the log lives and how large it grows.
+ */
+struct ReplayLogOptions
+{
+    std::string directory;               // Holds the segments, the stream ID and the lock; empty = no log
+    size_t bytes = 64u << 20;            // Total size of the segments
+    size_t segments = 8;                 // Segments the size is split into; the oldest is retired when full
+    unsigned syncMilliseconds = 1000;    // Interval between msync calls
+};
+
+class ReplayLog
+{
+public:
+    /**
+     * @brief A message found in the log, in the form the replay buffer indexes it.
+     */
+    struct Record
+    {
+        uint64_t sequence;
+        bool everyone;          // A broadcast (Text frame) rather than a publication
+        std::string_view topic; // Topic of a publication; valid during the visit
+        SharedFile file;
+        size_t offset;          // Where the record's frames start in the file
+        size_t length;
+    };
+
+private:
+    /**
+     * @brief One segment file, mapped for writing and, separately, for sending.
+     */
+    struct Segment
+    {
+        std::string path;
+        int fd = -1;
+        char *data = nullptr;         // Writable mapping
+        size_t size = 0;
+        std::atomic<size_t> used{0};  // Bytes holding records; published after they are written
+        size_t flushed = 0;           // Bytes written back (flusher thread only)
+        SharedFile file;              // Read-only mapping that replays are sent from
+
+        ~Segment()
+        {
+            if (data != nullptr)
+            {
+                munmap(data, size);
+            }
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+    };
+
+    ReplayLogOptions options;
+    size_t segmentBytes;
+    int lockFd = -1;
+    uint64_t streamId = 0;
+    std::deque<std::shared_ptr<Segment>> segments; // Oldest first; records are appended to the last
+    std::mutex segmentsMutex;                      // Lets the flusher read segments while a roll changes it
+    std::condition_variable flushWake;
+    bool stopping = false;
+    std::thread flusher;
+
+    explicit ReplayLog(const ReplayLogOptions &options)
+        : options(options), segmentBytes(pageAligned(std::max<size_t>(options.bytes / std::max<size_t>(options.segments, 1), 1))) {}
+
+public:
+    ReplayLog(const ReplayLog &) = delete;
+    ReplayLog &operator=(const ReplayLog &) = delete;
+
+    /**
+     * @brief Opens or creates the log and passes every record it recovers to visit,
+     * oldest first and with consecutive numbers.
+     *
+     * @param waitSeconds How long to wait for another process to release the log.
+     * @param error Set to the reason when the log cannot be opened.
+     * @return The log, or null.
+     */
+    template <typename Visit>
+    static std::unique_ptr<ReplayLog> open(const ReplayLogOptions &options, int waitSeconds, std::string &error, Visit &&visit)
+    {
+        std::unique_ptr<ReplayLog> log(new ReplayLog(options));
+        if (!log->lock(waitSeconds, error))
+        {
+            return nullptr;
+        }
+        // Without a record, numbers would restart on the old stream and clients would
+        // take the new messages for ones they have seen; a new stream tells them apart
+        std::vector<Record> records;
+        if ((log->readStream() && !log->recover(records, error)) || (records.empty() && !log->newStream(error)))
+        {
+            return nullptr;
+        }
+        for (const Record &record : records)
+        {
+            visit(record);
+        }
+        uint64_t next = records.empty() ? 1 : records.back().sequence + 1;
+        if (log->segments.empty() && !log->addSegment(next, error))
+        {
+            return nullptr;
+        }
+        log->flusher = std::thread(&ReplayLog::flush, log.get());
+        return log;
+    }
+
+    /**
+     * @brief Writes the remaining dirty pages back and releases the directory.
+     */
+    ~ReplayLog()
+    {
+        {
+            std::lock_guard<std::mutex> lock(segmentsMutex);
+            stopping = true;
+        }
+        flushWake.notify_all();
+        if (flusher.joinable())
+        {
+            flusher.join();
+        }
+        segments.clear();
+        if (lockFd >= 0)
+        {
+            ::close(lockFd); // Releases the flock
+        }
+    }
+
+    uint64_t stream() const { return streamId; }
+
+    /**
+     * @brief Appends the frames of one message. Not thread-safe; the replay buffer
+     * serialises appends.
+     *
+     * @param sequence The message's number; names a segment that it starts.
+     * @param file Set to the segment the record went to.
+     * @param offset Set to where the record starts in it.
+     * @param retired Set to the segment retired to make room, if any; its records are
+     * no longer in the log.
+     * @return false if the record does not fit in a segment, or a new segment cannot
+     * be created; the record is then not kept.
+     */
+    bool append(std::string_view frames, uint64_t sequence, SharedFile &file, size_t &offset, SharedFile &retired)
+    {
+        std::string error;
+        Segment *active = segments.back().get();
+        size_t used = active->used.load(std::memory_order_relaxed);
+        if (frames.size() > active->size - used)
+        {
+            if (frames.size() > segmentBytes || !addSegment(sequence, error))
+            {
+                return false;
+            }
+            if (segments.size() > options.segments)
+            {
+                retired = segments.front()->file;
+                unlink(segments.front()->path.c_str());
+                std::lock_guard<std::mutex> lock(segmentsMutex);
+                segments.pop_front();
+            }
+            active = segments.back().get();
+            used = 0;
+        }
+        memcpy(active->data + used, frames.data(), frames.size());
+        active->used.store(used + frames.size(), std::memory_order_release);
+        file = active->file;
+        offset = used;
+        return true;
+    }
+
+private:
+    static size_t pageAligned(size_t bytes)
+    {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return (bytes + page - 1) / page * page;
+    }
+
+    std::string pathOf(const char *name) const { return options.directory + "/" + name; }
+
+    /**
+     * @brief Takes the directory's lock, waiting for a process handing it over.
+     */
+    bool lock(int waitSeconds, std::string &error)
+    {
+        if (mkdir(options.directory.c_str(), 0755) < 0 && errno != EEXIST)
+        {
+            error = "cannot create " + options.directory + ": " + strerror(errno);
+            return false;
+        }
+        lockFd = ::open(pathOf("lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lockFd < 0)
+        {
+            error = "cannot open " + pathOf("lock") + ": " + strerror(errno);
+            return false;
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(waitSeconds);
+        while (flock(lockFd, LOCK_EX | LOCK_NB) < 0)
+        {
+            if (errno != EWOULDBLOCK || std::chrono::steady_clock::now() >= deadline)
+            {
+                error = options.directory + " is in use by another server";
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Reads the stream ID the segments were numbered in.
+     *
+     * @return false if there is none.
+     */
+    bool readStream()
+    {
+        FILE *in = fopen(pathOf("stream").c_str(), "r");
+        if (in == nullptr)
+        {
+            return false;
+        }
+        unsigned long long id = 0;
+        bool valid = fscanf(in, "%llu", &id) == 1 && id != 0;
+        fclose(in);
+        streamId = valid ? id : 0;
+        return valid;
+    }
+
+    /**
+     * @brief Starts a new stream, discarding the segments of the old one.
+     */
+    bool newStream(std::string &error)
+    {
+        segments.clear();
+        for (const std::string &name : segmentNames())
+        {
+            unlink(pathOf(name.c_str()).c_str());
+        }
+        std::random_device random;
+        streamId = ((static_cast<uint64_t>(random()) << 32) ^ random()) | 1; // 0 stands for a new session
+        std::string temporary = pathOf("stream.new");
+        FILE *out = fopen(temporary.c_str(), "w");
+        if (out == nullptr || fprintf(out, "%llu\n", static_cast<unsigned long long>(streamId)) < 0 ||
+            fclose(out) != 0 || rename(temporary.c_str(), pathOf("stream").c_str()) < 0)
+        {
+            error = "cannot write " + pathOf("stream") + ": " + strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Segment file names, oldest first; each is the first number it holds.
+     */
+    std::vector<std::string> segmentNames() const
+    {
+        std::vector<std::string> names;
+        if (DIR *dir = opendir(options.directory.c_str()))
+        {
+            while (dirent *entry = readdir(dir))
+            {
+                std::string_view name(entry->d_name);
+                if (name.size() > 4 && name.substr(name.size() - 4) == ".seg")
+                {
+                    names.emplace_back(name);
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(names.begin(), names.end()); // Names are zero-padded numbers
+        return names;
+    }
+
+    /**
+     * @brief Maps the existing segments and collects their records.
+     */
+    bool recover(std::vector<Record> &records, std::string &error)
+    {
+        for (const std::string &name : segmentNames())
+        {
+            auto segment = std::make_shared<Segment>();
+            segment->path = pathOf(name.c_str());
+            segment->fd = ::open(segment->path.c_str(), O_RDWR | O_CLOEXEC);
+            struct stat info;
+            if (segment->fd < 0 || fstat(segment->fd, &info) < 0 || info.st_size <= 0 || !map(*segment, static_cast<size_t>(info.st_size), error))
+            {
+                unlink(segment->path.c_str()); // Unusable; nothing in it can be replayed
+                continue;
+            }
+
+            size_t used = parse(*segment, records);
+            // Zero whatever follows the records, so that a torn write is never read
+            if (ftruncate(segment->fd, static_cast<off_t>(used)) < 0 || ftruncate(segment->fd, static_cast<off_t>(segment->size)) < 0)
+            {
+                error = "cannot truncate " + segment->path + ": " + strerror(errno);
+                return false;
+            }
+            segment->used.store(used, std::memory_order_relaxed);
+            segment->flushed = used;
+            segments.push_back(std::move(segment));
+        }
+        while (segments.size() > options.segments)
+        {
+            SharedFile oldest = segments.front()->file;
+            unlink(segments.front()->path.c_str());
+            segments.pop_front();
+            records.erase(records.begin(), std::find_if(records.begin(), records.end(), [&](const Record &record)
+                                                        { return record.file != oldest; }));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Reads the records at the start of a segment. A gap in the numbers, left by
+     * a message too large to keep, drops the records before it: they could not be
+     * replayed in order.
+     *
+     * @return The length of the records read.
+     */
+    static size_t parse(const Segment &segment, std::vector<Record> &records)
+    {
+        uint64_t last = records.empty() ? 0 : records.back().sequence;
+        std::string_view data(segment.data, segment.size);
+        FrameParser parser;
+        size_t offset = 0;
+        while (true)
+        {
+            size_t headerSize;
+            uint32_t payloadSize;
+            uint64_t number[1];
+            std::string_view rest = data.substr(offset);
+            if (parser.decodeHeader(rest, headerSize, payloadSize) != FrameParser::HeaderStatus::Complete ||
+                static_cast<FrameType>(rest[headerSize - 1]) != FrameType::Sequence || headerSize + payloadSize > rest.size() ||
+                !splitVarints(rest.substr(headerSize, payloadSize), number))
+            {
+                return offset;
+            }
+            size_t sequenceSize = headerSize + payloadSize;
+            rest = rest.substr(sequenceSize);
+            if (parser.decodeHeader(rest, headerSize, payloadSize) != FrameParser::HeaderStatus::Complete ||
+                headerSize + payloadSize > rest.size())
+            {
+                return offset;
+            }
+            FrameType type = static_cast<FrameType>(rest[headerSize - 1]);
+            std::string_view payload = rest.substr(headerSize, payloadSize), topic, message;
+            if (type != FrameType::Text && (type != FrameType::Publish || !splitPublish(payload, topic, message)))
+            {
+                return offset;
+            }
+            if (last != 0 && number[0] != last + 1)
+            {
+                records.clear();
+            }
+            size_t length = sequenceSize + headerSize + payloadSize;
+            records.push_back(Record{number[0], type == FrameType::Text, topic, segment.file, offset, length});
+            last = number[0];
+            offset += length;
+        }
+    }
+
+    /**
+     * @brief Maps a segment file for writing and for sending.
+     */
+    static bool map(Segment &segment, size_t size, std::string &error)
+    {
+        void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+        segment.file = data == MAP_FAILED ? nullptr : MappedFile::open(segment.path.c_str());
+        if (!segment.file)
+        {
+            if (data != MAP_FAILED)
+            {
+                munmap(data, size);
+            }
+            error = "cannot map " + segment.path + ": " + strerror(errno);
+            return false;
+        }
+        segment.data = static_cast<char *>(data);
+        segment.size = size;
+        return true;
+    }
+
+    /**
+     * @brief Creates an empty segment whose first record will have the given number,
+     * and makes it the one appended to.
+     */
+    bool addSegment(uint64_t first, std::string &error)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.seg", static_cast<unsigned long long>(first));
+        auto segment = std::make_shared<Segment>();
+        segment->path = pathOf(name);
+        segment->fd = ::open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (segment->fd < 0 || ftruncate(segment->fd, static_cast<off_t>(segmentBytes)) < 0)
+        {
+            error = "cannot create " + segment->path + ": " + strerror(errno);
+            return false;
+        }
+        if (!map(*segment, segmentBytes, error))
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(segmentsMutex);
+        segments.push_back(std::move(segment));
+        return true;
+    }
+
+    /**
+     * @brief The flusher thread: every interval, writes back what was appended since the
+     * last one, then once more on close.
+     */
+    void flush()
+    {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        std::vector<std::shared_ptr<Segment>> dirty;
+        bool last = false;
+        while (!last)
+        {
+            {
+                std::unique_lock<std::mutex> lock(segmentsMutex);
+                flushWake.wait_for(lock, std::chrono::milliseconds(options.syncMilliseconds), [this]
+                                   { return stopping; });
+                last = stopping;
+                dirty.assign(segments.begin(), segments.end());
+            }
+            for (auto &segment : dirty)
+            {
+                size_t used = segment->used.load(std::memory_order_acquire);
+                if (used > segment->flushed)
+                {
+                    size_t from = segment->flushed / page * page;
+                    msync(segment->data + from, used - from, MS_SYNC);
+                    segment->flushed = used;
+                }
+            }
+            dirty.clear();
+        }
+    }
+};
@@ -2,18 +2,153 @@
 // A C++ server program enabling simultaneous communication with multiple clients.
 
 #include <iostream>
-#include <sys/socket.h> // Socket functions
-#include <netinet/in.h> // Internet address structures
-#include <arpa/inet.h>  // IP address conversion functions
-#include <unistd.h>     // POSIX API for closing sockets
-#include <atomic>       // Atomic variables for thread-safe operations
-#include <cstring>      // String manipulation functions
-#include <mutex>        // Mutex for synchronizing access to shared resources
-#include <thread>       // Multi-threading support
-#include <vector>       // Dynamic array for managing client sockets
+#include <pthread.h>      // Pinning event loop threads to CPUs
+#include <poll.h>         // Waiting for clients or a stop request
+#include <sys/eventfd.h>  // Stop request shared by the accepting threads
+#include <sys/signalfd.h> // SIGINT and SIGTERM as a readable descriptor
+#include <sys/socket.h>   // Socket functions
+#include <sys/resource.h> // File descriptor limits
+#include <netinet/in.h>   // Internet address structures
+#include <arpa/inet.h>    // IP address conversion functions
+#include <unistd.h>       // POSIX API for closing sockets
+#include <algorithm>      // Removing closed clients from clientSockets
+#include <atomic>         // Atomic variables for thread-safe operations
+#include <chrono>         // Interval between --stats reports
+#include <condition_variable> // Waking the stats reporter on shutdown
+#include <csignal>        // Ignoring SIGPIPE on broken connections
+#include <cstdio>         // Reading net.core.somaxconn
+#include <cstdlib>        // malloc and free for the counting operator new
+#include <cstring>        // String manipulation functions
+#include <new>            // Replacing the global operator new
+#include <memory>         // Smart pointers for event loops
+#include <mutex>          // Mutex for synchronizing access to shared resources
+#include <string>         // Command line option values
+#include <thread>         // Multi-threading support
+#include <vector>         // Dynamic array for managing client sockets
+
+#include "../common/framing.hpp" // Length-prefixed message framing
+#include "event_loop.hpp"          // Edge-triggered epoll reactor
+#include "handover.hpp"            // Passing the listeners to a new process
+#include "read_buffer.hpp"         // Receive buffers of threaded-mode clients
+#include "replay_buffer.hpp"       // Resuming sessions after a reconnect
+#include "logger.hpp"              // Asynchronous logging of runtime events
+#include "websocket.hpp"           // WebSocket handshake and frame codec
+#include "uring_loop.hpp"          // io_uring backend for the event loops
+#include "worker_pool.hpp"         // Running message handlers off the loop threads
+#include "coroutine.hpp"           // Coroutine connection handlers (C++20)
 
 using namespace std;
 
+// Heap allocations made by event loop threads are counted here, so --stats can
+// show that handling a message does not allocate once the pools are warm. The
+// array and nothrow forms forward to these by default. The deletes are kept out of
+// line so the compiler does not pair an inlined free() with its builtin new.
+void *operator new(size_t size)
+{
+    if (AllocationCounter *counter = AllocationCounter::current())
+    {
+        counter->record();
+    }
+    void *pointer = malloc(size > 0 ? size : 1);
+    if (pointer == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return pointer;
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept
+{
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+/**
+ * @brief How the server drives client connections.
+ */
+enum class ServerMode
+{
+    Threaded,  // One thread per client plus recv/send threads (interactive console)
+    Epoll,     // Fixed pool of edge-triggered epoll loops, one acceptor thread
+    ReusePort, // One loop per core, each accepting on its own SO_REUSEPORT socket
+};
+
+/**
+ * @brief Kernel interface used by the event loops.
+ */
+enum class IoBackend
+{
+    Epoll, // Readiness notifications plus recv/send system calls
+    Uring, // io_uring completions; falls back to Epoll if the kernel lacks support
+};
+
+/**
+ * @brief Wire protocol spoken by the event loop modes.
+ */
+enum class Protocol
+{
+    Framed,    // Length-prefixed frames from common/framing.hpp (SimpleClient)
+    WebSocket, // RFC 6455 WebSocket, for browsers and standard clients
+};
+
+/**
+ * @brief How the event loops run the framed protocol's per-connection logic.
+ */
+enum class HandlerStyle
+{
+    Callback,  // handleData() sees the bytes of each read
+    Coroutine, // serveConnection() awaits one frame at a time (needs C++20)
+};
+
+/**
+ * @brief Settings chosen on the command line.
+ */
+struct ServerOptions
+{
+    int port = 9999;                                       // Port to listen on
+    int backlog = 4096;                                    // Accept queue length asked of listen(); capped by net.core.somaxconn
+    AdmissionLimits admission;                             // Connection cap and per-address rate of new connections
+    ServerMode mode = ServerMode::Threaded;                 // Connection handling strategy
+    IoBackend io = IoBackend::Epoll;                        // Backend used by event loops
+    Protocol protocol = Protocol::Framed;                   // Wire protocol used by event loops
+    HandlerStyle handlers = HandlerStyle::Callback;         // How framed connections are handled
+    size_t zeroCopyThreshold = 0;                           // Send output this large zero-copy; 0 = off
+    string motdPath;                                        // File sent to every framed client on connect
+    DeflateOptions deflate;                                 // permessage-deflate settings (WebSocket only)
+    LogOptions log;                                         // Level, destination and format of the runtime log
+    bool broadcast = false;                                 // Relay each client message to every client instead of echoing it
+    OutboundLimits outbound;                                // Per-connection output bounds and slow-consumer policy
+    unsigned statsInterval = 0;                             // Seconds between allocation reports; 0 = off
+    int metricsPort = 0;                                    // Local port serving Prometheus metrics; 0 = off
+    ConnectionTimeouts timeouts;                            // Idle timeout and heartbeat interval
+    unsigned drainSeconds = 10;                             // Longest wait for clients to close on shutdown
+    string upgradeSocket;                                   // Unix socket for handing the listeners to a new process
+    size_t replayMessages = 1024;                           // Broadcasts and publications kept for resuming clients; 0 = off
+    size_t replayBytes = 16u << 20;                         // Encoded bytes kept for resuming clients
+    ReplayLogOptions replayLog;                             // Segment files keeping them across restarts; no directory = memory only
+    unsigned loopThreads = thread::hardware_concurrency(); // Event loops in epoll/reuseport mode
+    unsigned workerThreads = 0;                            // Handler threads; 0 = handle messages on the loops
+    vector<int> cpus;                                      // CPUs to pin loop i to (cpus[i % size]); empty = no pinning
+};
+
+/**
+ * @brief A client of the threaded mode, shared by its threads and the timeout reaper.
+ */
+struct ThreadedClient
+{
+    int fd;
+    WheelTimer timer{this};           // Next idle check, linked into the server's wheel
+    atomic<uint64_t> lastHeard{0};    // Timer tick of the last read from the client
+    atomic<bool> pinged{false};       // A heartbeat went out since lastHeard
+    mutex sendMutex;                  // Keeps console messages and pings from interleaving
+
+    explicit ThreadedClient(int fd) : fd(fd) {}
+};
+
 class SimpleServer
 {
 private:
@@ -21,16 +156,55 @@ private:
     sockaddr_in serverAddr;    // Structure to hold server address information
     atomic<bool> running;      // Flag to control the server's running state
     vector<int> clientSockets; // List of connected client socket descriptors
-    mutex clientsMutex;        // Mutex to protect access to clientSockets
+    mutex clientsMutex;        // Mutex to protect access to clientSockets and clientThreads
+    size_t clientThreads = 0;  // handleClient() calls still running; the server outlives them
+    condition_variable clientsDone; // Signalled when clientThreads drops
+    mutex consoleMutex;        // Lets one threaded client at a time take console input
+    string consoleInput;       // Console bytes read but not yet taken as a line
+    atomic<bool> consoleOpen{true}; // Cleared at the end of the console input
+
+    static constexpr int takeoverTimeoutSeconds = 10; // For a new process to serve the handed-over listeners
+    static constexpr size_t acceptBatch = 64;         // Clients accepted per wakeup of the accepting thread
+
+    ServerOptions options;                // Mode and tuning selected at startup
+    Admission admission;                  // Turns clients away at accept time; shared with the loops
+    Strand::Handler messageHandler;       // handleMessage() or handleRequest(), as run by the worker pool
+    vector<unique_ptr<IoLoop>> loops;     // Event loops used in epoll and reuseport modes
+    MetricsEndpoint metrics;              // Serves the loops' metrics with --metrics-port; stopped before the loops go
+    unique_ptr<ReplayBuffer> replay;      // Numbers fanned-out messages for resuming framed clients
+    SharedFile motd;                      // Message of the day, sent from the page cache
+    unique_ptr<WorkerPool> workers;       // Runs message handlers with --workers; stopped before the loops go
+    vector<thread> loopThreads;           // One thread per event loop
+    vector<int> extraListeners;           // SO_REUSEPORT sockets owned by loops other than the first
+    size_t nextLoop = 0;                  // Round-robin cursor for handing out connections
+    thread statsThread;                   // Prints loop allocation counters with --stats
+    mutex statsMutex;                     // Lets shutdown wake the stats and reaper threads
+    condition_variable statsWake;
+    thread reaperThread;                  // Pings and times out threaded clients
+    TimerWheel clientTimers{currentTimerTick()}; // Idle timers of the threaded clients
+    mutex timersMutex;                    // Protects clientTimers
+    atomic<bool> accepting{true};         // Cleared when the server starts draining
+    int stopFd;                           // eventfd, readable once the server stops accepting
+    int signalFd;                         // SIGINT and SIGTERM, blocked in every thread by main()
+    thread controlThread;                 // Waits for a shutdown signal or an upgrade request
+    int upgradeListener = -1;             // Where a new process asks for the listeners, with --upgrade-socket
+    bool handedOver = false;              // A new process took the listeners and the upgrade socket
+    int takeoverSocket = -1;              // Connection to the process whose listeners were taken over
+    vector<int> inheritedListeners;       // Taken-over SO_REUSEPORT sockets after the first
 
 public:
     /**
-     * @brief Constructor to initialize the server with the specified port.
+     * @brief Constructor to initialize the server with the specified options.
      *
-     * @param port The port number on which the server will listen for connections.
+     * @param options Port, connection handling mode and loop count.
      */
-    SimpleServer(int port) : running(true)
+    SimpleServer(const ServerOptions &options) : running(true), options(options), admission(options.admission)
     {
+        messageHandler = [this](int fd, FrameType type, string_view message, string &reply)
+        { handleCall(fd, type, message, reply); };
+
+        int port = options.port;
+
         // Create a TCP socket
         serverSocket = socket(AF_INET, SOCK_STREAM, 0);
         if (serverSocket < 0)
@@ -43,6 +217,149 @@ public:
         serverAddr.sin_family = AF_INET;         // IPv4
         serverAddr.sin_addr.s_addr = INADDR_ANY; // Bind to all available interfaces
         serverAddr.sin_port = htons(port);       // Convert port to network byte order
+
+        sigset_t signals = shutdownSignals();
+        stopFd = eventfd(0, EFD_CLOEXEC);
+        signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+        if (stopFd < 0 || signalFd < 0)
+        {
+            cerr << "Failed to set up shutdown handling." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /**
+     * @brief The signals that start a graceful shutdown. main() blocks them in every
+     * thread, and the control thread reads them from a signalfd.
+     */
+    static sigset_t shutdownSignals()
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        return signals;
+    }
+
+    /**
+     * @brief With --upgrade-socket, takes the listening sockets over from the server
+     * running there, if any, instead of binding new ones.
+     *
+     * @return true if the listeners were taken over; bindSocket() and startListening()
+     *         must then be skipped.
+     */
+    bool takeOverListeners()
+    {
+        if (options.upgradeSocket.empty())
+        {
+            return false;
+        }
+        int socket = connectUpgradeSocket(options.upgradeSocket);
+        if (socket < 0)
+        {
+            return false; // No server to take over from
+        }
+        vector<int> listeners = receiveListeners(socket);
+        if (listeners.empty())
+        {
+            cerr << "Failed to take over the listeners of the server on " << options.upgradeSocket << "." << endl;
+            exit(EXIT_FAILURE);
+        }
+        close(serverSocket);
+        serverSocket = listeners[0];
+        inheritedListeners.assign(listeners.begin() + 1, listeners.end());
+        socklen_t length = sizeof(serverAddr);
+        getsockname(serverSocket, reinterpret_cast<sockaddr *>(&serverAddr), &length);
+        takeoverSocket = socket;
+        logInfo() << "Took over " << listeners.size() << " listening socket(s) on port "
+                  << ntohs(serverAddr.sin_port) << " from the running server.";
+        return true;
+    }
+
+    /**
+     * @brief Starts the control thread, which starts a graceful shutdown on SIGINT or
+     * SIGTERM and, with --upgrade-socket, hands the listeners to a new process.
+     */
+    void startControl()
+    {
+        if (!options.upgradeSocket.empty())
+        {
+            upgradeListener = listenUpgradeSocket(options.upgradeSocket);
+            if (upgradeListener < 0)
+            {
+                cerr << "Failed to listen on upgrade socket " << options.upgradeSocket << "." << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        controlThread = thread(&SimpleServer::handleControl, this);
+    }
+
+    /**
+     * @brief Drains the event loops: each stops accepting, sends every client a close
+     * frame and closes the connection once its output is flushed. Waits until all
+     * connections are closed, --drain-timeout passes, or another signal arrives.
+     *
+     * In the threaded mode, each client's sender thread sees the stop, sends the close
+     * frame and shuts its socket down. Client threads still running at the deadline
+     * have their sockets shut down; they are waited for in any case, since they use
+     * the server.
+     */
+    void drainConnections()
+    {
+        for (auto &loop : loops)
+        {
+            loop->drain();
+        }
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(options.drainSeconds);
+        pollfd signal{signalFd, POLLIN, 0};
+        while (true)
+        {
+            uint64_t open = openConnections();
+            if (open == 0)
+            {
+                logInfo() << "All connections closed.";
+                return;
+            }
+            if (chrono::steady_clock::now() >= deadline)
+            {
+                logWarning() << "Closing " << open << " connection(s) still open after " << options.drainSeconds << " s.";
+                break;
+            }
+            if (poll(&signal, 1, 50) > 0)
+            {
+                logWarning() << "Interrupted again; closing " << open << " connection(s) now.";
+                break;
+            }
+        }
+
+        if (loops.empty())
+        {
+            unique_lock<mutex> lock(clientsMutex);
+            for (int client : clientSockets)
+            {
+                shutdown(client, SHUT_RDWR); // Ends the client's blocked recv()
+            }
+            clientsDone.wait(lock, [this]
+                             { return clientThreads == 0; });
+        }
+    }
+
+    /**
+     * @brief Connections not yet closed: the event loops' or the threaded clients'.
+     */
+    uint64_t openConnections()
+    {
+        if (loops.empty())
+        {
+            lock_guard<mutex> lock(clientsMutex);
+            return clientThreads;
+        }
+        uint64_t open = 0;
+        for (auto &loop : loops)
+        {
+            open += loop->openConnections();
+        }
+        return open;
     }
 
     /**
@@ -50,6 +367,14 @@ public:
      */
     void bindSocket()
     {
+        // Let every event loop bind its own socket to the same port
+        if (options.mode == ServerMode::ReusePort && !enableReusePort(serverSocket))
+        {
+            cerr << "Failed to enable SO_REUSEPORT." << endl;
+            close(serverSocket);
+            exit(EXIT_FAILURE);
+        }
+
         if (::bind(serverSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
         {
             cerr << "Failed to bind socket." << endl;
@@ -63,13 +388,24 @@ public:
      */
     void startListening()
     {
-        if (listen(serverSocket, 5) < 0)
-        { // Listen with a backlog of 5
+        if (listen(serverSocket, options.backlog) < 0)
+        {
             cerr << "Failed to listen on socket." << endl;
             close(serverSocket);
             exit(EXIT_FAILURE);
         }
-        cout << "Server listening on port " << ntohs(serverAddr.sin_port) << endl; // Display listening port
+        logInfo() << "Server listening on port " << ntohs(serverAddr.sin_port); // Display listening port
+
+        // The kernel shortens a longer queue without saying so
+        int limit = 0;
+        if (FILE *in = fopen("/proc/sys/net/core/somaxconn", "r"))
+        {
+            if (fscanf(in, "%d", &limit) == 1 && limit < options.backlog)
+            {
+                logWarning() << "net.core.somaxconn caps the accept queue at " << limit << " instead of " << options.backlog << ".";
+            }
+            fclose(in);
+        }
     }
 
     /**
@@ -82,6 +418,15 @@ public:
         // Local flag to control this client's communication
         atomic<bool> clientRunning(true);
 
+        // Lets the reaper ping the client and shut the socket down if it goes silent
+        ThreadedClient client(clientSocket);
+        if (options.timeouts.enabled())
+        {
+            lock_guard<mutex> lock(timersMutex);
+            client.lastHeard = clientTimers.current();
+            clientTimers.schedule(client.timer, options.timeouts.nextCheck(client.lastHeard, false));
+        }
+
         /**
          * @brief Lambda function to receive messages from the client.
          *
@@ -89,34 +434,93 @@ public:
          */
         auto receiveMessages = [&](int socket)
         {
-            char buffer[1024]; // Buffer to store incoming messages
+            AdaptiveReadBuffer buffer(1024, 64 * 1024); // Grows for clients that send bulk data
+            FrameParser parser;                         // Reassembles frames split across reads
             while (clientRunning)
             {
-                memset(buffer, 0, sizeof(buffer));                           // Clear the buffer
-                int bytesRead = recv(socket, buffer, sizeof(buffer) - 1, 0); // Receive data
+                size_t room = 0;
+                char *target = parser.pendingTail(room); // The rest of a frame goes straight into its buffer
+                bool inPlace = target != nullptr;
+                if (!inPlace)
+                {
+                    target = buffer.data();
+                    room = buffer.size();
+                }
+                int bytesRead = recv(socket, target, room, 0); // Receive data
 
                 if (bytesRead > 0)
                 {
-                    buffer[bytesRead] = '\0';                                // Null-terminate the received string
-                    cout << "Client [" << socket << "]: " << buffer << endl; // Display client message
+                    client.lastHeard.store(currentTimerTick(), memory_order_relaxed);
+                    client.pinged.store(false, memory_order_relaxed);
 
-                    // Check for exit commands
-                    if (strcmp(buffer, "quit()") == 0 || strcmp(buffer, "exit()") == 0)
+                    // A read may hold part of a frame or several frames
+                    bool valid = parser.feed(string_view(target, bytesRead), [&](const Frame &frame)
+                                             {
+                        if (!clientRunning)
+                        {
+                            return; // Ignore anything after a close request
+                        }
+                        if (frame.type == FrameType::Close)
+                        {
+                            logInfo() << "Client [" << socket << "] requested to close the connection.";
+                            clientRunning = false; // Stop communication loop
+                        }
+                        else if (frame.type == FrameType::Text)
+                        {
+                            logInfo() << "Client [" << socket << "]: " << frame.payload; // Display client message
+                        }
+                        else if (frame.type == FrameType::Request)
+                        {
+                            uint64_t id;
+                            string_view message;
+                            if (!splitCorrelated(frame.payload, id, message))
+                            {
+                                logWarning() << "Malformed request from client [" << socket << "].";
+                                clientRunning = false;
+                                return;
+                            }
+                            string response;
+                            handleRequest(socket, frame.payload, response);
+                            lock_guard<mutex> lock(client.sendMutex);
+                            send(socket, response.data(), response.size(), MSG_NOSIGNAL);
+                        }
+                        else if (frame.type == FrameType::Resume)
+                        {
+                            string resumed; // Stream 0: nothing is numbered in this mode
+                            appendVarintFrame(resumed, FrameType::Resumed, {0, 0, 0});
+                            lock_guard<mutex> lock(client.sendMutex);
+                            send(socket, resumed.data(), resumed.size(), MSG_NOSIGNAL);
+                        }
+                        else if (frame.type == FrameType::Ping)
+                        {
+                            string pong = encodeFrame(FrameType::Pong, frame.payload);
+                            lock_guard<mutex> lock(client.sendMutex);
+                            send(socket, pong.data(), pong.size(), MSG_NOSIGNAL);
+                        } });
+
+                    if (!valid)
                     {
-                        cout << "Client [" << socket << "] requested to close the connection." << endl;
+                        logWarning() << "Malformed frame from client [" << socket << "].";
                         clientRunning = false; // Stop communication loop
+                    }
+                    if (!clientRunning)
+                    {
                         break;
                     }
+                    if (!inPlace)
+                    {
+                        buffer.observe(static_cast<size_t>(bytesRead));
+                    }
                 }
                 else if (bytesRead == 0)
                 {
-                    cout << "Client [" << socket << "] disconnected." << endl;
+                    logInfo() << "Client [" << socket << "] disconnected.";
                     clientRunning = false; // Stop communication loop
                     break;
                 }
                 else
                 {
-                    cerr << "Error reading from client [" << socket << "]." << endl;
+                    logError() << "Error reading from client [" << socket << "].";
                     clientRunning = false; // Stop communication loop
                     break;
                 }
@@ -133,8 +537,11 @@ public:
             string message;
             while (clientRunning)
             {
-                cout << ">>> ";        // Prompt for server input
-                getline(cin, message); // Read server input
+                cout << ">>> " << flush; // Prompt for server input
+                if (!readConsoleLine(message, clientRunning))
+                {
+                    break;
+                }
 
                 // Check for exit commands
                 if (message == "quit()")
@@ -142,10 +549,12 @@ public:
                     clientRunning = false; // Stop communication loop
                 }
 
-                // Send the message to the client
-                if (send(socket, message.c_str(), message.length(), 0) < 0)
+                // Send the message, or a close frame for the exit command, to the client
+                string frame = clientRunning ? encodeFrame(FrameType::Text, message) : encodeFrame(FrameType::Close);
+                unique_lock<mutex> lock(client.sendMutex);
+                if (send(socket, frame.data(), frame.size(), MSG_NOSIGNAL) < 0)
                 {
-                    cerr << "Failed to send message to client [" << socket << "]." << endl;
+                    logWarning() << "Failed to send message to client [" << socket << "].";
                     clientRunning = false; // Stop communication loop
                     break;
                 }
@@ -156,6 +565,17 @@ public:
                     break;
                 }
             }
+
+            // The server is draining: say goodbye as the event loops do, and end the recv()
+            if (clientRunning)
+            {
+                string goodbye = encodeFrame(FrameType::Close);
+                {
+                    lock_guard<mutex> lock(client.sendMutex);
+                    send(socket, goodbye.data(), goodbye.size(), MSG_NOSIGNAL);
+                }
+                shutdown(socket, SHUT_RDWR);
+            }
         };
 
         // Launch separate threads for sending and receiving messages concurrently
@@ -166,77 +586,1751 @@ public:
         recvThread.join();
         sendThread.join();
 
-        // Close the client socket after communication ends
+        // Forget the client before its descriptor can be reused, then close it
+        {
+            lock_guard<mutex> lock(timersMutex);
+            clientTimers.cancel(client.timer);
+        }
+        {
+            lock_guard<mutex> lock(clientsMutex);
+            clientSockets.erase(remove(clientSockets.begin(), clientSockets.end(), clientSocket), clientSockets.end());
+        }
         close(clientSocket);
-        cout << "Client [" << clientSocket << "] disconnected." << endl;
+        admission.release();
+        logInfo() << "Client [" << clientSocket << "] disconnected.";
+
+        // Last: once the count drops, the server may be destroyed
+        lock_guard<mutex> lock(clientsMutex);
+        --clientThreads;
+        clientsDone.notify_all();
     };
 
     /**
-     * @brief Continuously accepts incoming client connections and spawns a thread for each client.
+     * @brief Waits for a line typed on the server console, for a threaded client's
+     * sender thread. Stdin is only read once poll() reports input, so the wait ends
+     * as soon as the client closes or the server stops.
+     *
+     * @return false if the client or the server stopped first.
      */
-    void acceptConnections()
+    bool readConsoleLine(string &line, const atomic<bool> &clientRunning)
     {
-        while (running)
+        pollfd watched[2] = {{stopFd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        while (clientRunning)
         {
-            cout << "Waiting for client connections..." << endl;
-            sockaddr_in clientAddr;                   // Structure to hold client address
-            socklen_t clientLen = sizeof(clientAddr); // Size of client address structure
-
-            // Accept a new client connection
-            int clientSocket = accept(serverSocket, (sockaddr *)&clientAddr, &clientLen);
-            if (clientSocket < 0)
             {
-                cerr << "Error accepting client." << endl;
+                lock_guard<mutex> lock(consoleMutex);
+                size_t end = consoleInput.find('\n');
+                if (end != string::npos)
+                {
+                    line.assign(consoleInput, 0, end);
+                    consoleInput.erase(0, end + 1);
+                    return true;
+                }
+            }
+            // Woken every 100 ms to notice a client that closed
+            if (poll(watched, consoleOpen ? 2 : 1, 100) <= 0)
+            {
                 continue;
             }
+            if (watched[0].revents & POLLIN)
+            {
+                return false;
+            }
+            if (watched[1].revents != 0)
+            {
+                // Another client's thread may have taken the input since
+                lock_guard<mutex> lock(consoleMutex);
+                pollfd input{STDIN_FILENO, POLLIN, 0};
+                if (poll(&input, 1, 0) <= 0)
+                {
+                    continue;
+                }
+                char chunk[4096];
+                ssize_t length = (input.revents & POLLIN) ? read(STDIN_FILENO, chunk, sizeof(chunk)) : 0;
+                if (length > 0)
+                {
+                    consoleInput.append(chunk, static_cast<size_t>(length));
+                }
+                else if (consoleOpen.exchange(false) && !consoleInput.empty())
+                {
+                    consoleInput += '\n'; // End of input; the last line had no newline
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Pings threaded clients that go silent and shuts down the sockets of those
+     * that stay silent, every timer tick until the server shuts down.
+     *
+     * A shut-down socket makes the client's blocked recv() return, so its threads end
+     * as if the client had disconnected. Pings are skipped while the console is
+     * sending to the client, as the reaper must not block.
+     */
+    void reapIdleClients()
+    {
+        string ping = encodeFrame(FrameType::Ping);
+        unique_lock<mutex> lock(statsMutex);
+        while (!statsWake.wait_for(lock, chrono::milliseconds(timerTickMilliseconds), [this]
+                                   { return !running; }))
+        {
+            lock_guard<mutex> timersLock(timersMutex);
+            clientTimers.advance(currentTimerTick(), [&](WheelTimer &timer)
+                                 {
+                ThreadedClient &client = *static_cast<ThreadedClient *>(timer.owner);
+                uint64_t now = clientTimers.current();
+                uint64_t heard = client.lastHeard.load(memory_order_relaxed);
+                bool pinged = client.pinged.load(memory_order_relaxed);
+                if (options.timeouts.idleExpired(now, heard))
+                {
+                    logInfo() << "Client [" << client.fd << "] timed out.";
+                    shutdown(client.fd, SHUT_RDWR);
+                    return;
+                }
+                if (options.timeouts.heartbeatDue(now, heard, pinged))
+                {
+                    pinged = true;
+                    client.pinged.store(true, memory_order_relaxed);
+                    if (client.sendMutex.try_lock())
+                    {
+                        send(client.fd, ping.data(), ping.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                        client.sendMutex.unlock();
+                    }
+                }
+                clientTimers.schedule(timer, options.timeouts.nextCheck(heard, pinged)); });
+        }
+    }
+
+    /**
+     * @brief Sends a message to every connected client of the event loop modes.
+     *
+     * The message is framed once into an immutable shared buffer that each loop queues
+     * on its own connections by reference. Safe to call from any thread; no lock is held
+     * while the loops write.
+     *
+     * @param message Payload to send.
+     * @param binary In WebSocket mode, send a binary rather than a text message.
+     */
+    void broadcast(string_view message, bool binary = false)
+    {
+        static thread_local string frame; // Scratch, copied into the pooled shared buffer
+        frame.clear();
+        if (options.protocol == Protocol::WebSocket)
+        {
+            // Sent uncompressed, since one buffer serves clients with different deflate state
+            appendWebSocketFrame(frame, binary ? WsOpcode::Binary : WsOpcode::Text, message);
+        }
+        else
+        {
+            appendFrame(frame, FrameType::Text, message);
+        }
+
+        auto deliver = [this](const SharedBuffer &shared)
+        {
+            for (auto &loop : loops)
+            {
+                loop->broadcast(shared);
+            }
+        };
+        if (replay)
+        {
+            replay->append({}, true, frame, deliver);
+            return;
+        }
+        deliver(makeSharedBuffer(frame));
+    }
 
-            // Display client connection details
-            cout << "Client connected from " << inet_ntoa(clientAddr.sin_addr)
-                 << ":" << ntohs(clientAddr.sin_port) << endl;
+    /**
+     * @brief Sends a message to every client subscribed to the topic, directly or through
+     * a prefix pattern.
+     *
+     * The message is encoded once and posted only to loops that hold subscriptions;
+     * each loop looks the topic up in its own index. Safe to call from any thread.
+     */
+    void publish(string_view topic, string_view message)
+    {
+        static thread_local string frame, text; // Scratch, copied into the pooled shared buffer
+        frame.clear();
+        if (options.protocol == Protocol::WebSocket)
+        {
+            text.clear();
+            text.append(topic).append(1, ' ').append(message); // Topics contain no spaces
+            appendWebSocketFrame(frame, WsOpcode::Text, text);
+        }
+        else
+        {
+            appendPublishFrame(frame, topic, message);
+        }
 
-            // Add the new client socket to the list of active clients
+        auto deliver = [&](const SharedBuffer &shared)
+        {
+            for (auto &loop : loops)
             {
-                lock_guard<mutex> lock(clientsMutex);
-                clientSockets.push_back(clientSocket);
+                if (loop->hasSubscriptions())
+                {
+                    loop->publish(topic, shared);
+                }
             }
+        };
+        if (replay)
+        {
+            replay->append(topic, false, frame, deliver); // Kept even with no subscriber yet
+            return;
+        }
+        deliver(makeSharedBuffer(frame));
+    }
 
-            // Create a detached thread to handle client communication
-            thread clientThread(&SimpleServer::handleClient, this, clientSocket);
-            clientThread.detach();
+    /**
+     * @brief Answers a Resume frame: sends the connection the held broadcasts, and the
+     * publications its current subscriptions match, that it has not seen, then a
+     * Resumed frame. Without a replay buffer the Resumed frame carries stream 0.
+     *
+     * Runs on the loop thread that owns the connection.
+     *
+     * @return false if the payload is malformed.
+     */
+    bool resume(IoLoop &loop, Connection &conn, string_view payload)
+    {
+        uint64_t position[2]; // Stream ID and last sequence number
+        if (!splitVarints(payload, position))
+        {
+            logWarning() << "Malformed resume from client [" << conn.fd << "].";
+            loop.countProtocolError();
+            return false;
+        }
+        ReplayBuffer::Resumption result{0, 0, 0};
+        uint64_t replayed = 0;
+        SharedFile run; // Logged entries adjacent in one segment go out as one region
+        size_t runOffset = 0, runLength = 0;
+        if (replay)
+        {
+            result = replay->replay(position[0], position[1], [&](const ReplayBuffer::Entry &entry)
+                                    {
+                if (!entry.everyone && !loop.subscribedTo(conn, entry.topic))
+                {
+                    return;
+                }
+                ++replayed;
+                if (run && (entry.file != run || entry.offset != runOffset + runLength))
+                {
+                    loop.send(conn, std::move(run), runOffset, runLength);
+                    run = nullptr;
+                }
+                if (!entry.file)
+                {
+                    loop.send(conn, entry.frames);
+                }
+                else if (run)
+                {
+                    runLength += entry.length;
+                }
+                else
+                {
+                    run = entry.file;
+                    runOffset = entry.offset;
+                    runLength = entry.length;
+                } });
+        }
+        if (run)
+        {
+            loop.send(conn, std::move(run), runOffset, runLength);
+        }
+        loop.countReplayed(replayed);
+        if (position[0] == 0 && position[1] != 0)
+        {
+            logInfo() << "Client [" << conn.fd << "] asked for a backlog of " << position[1] << ": " << replayed
+                      << " message(s) replayed.";
+        }
+        else if (position[0] != 0)
+        {
+            logInfo() << "Client [" << conn.fd << "] resumed after " << position[1] << ": " << replayed
+                      << " message(s) replayed, " << result.missed << " lost.";
         }
+        static thread_local string resumed;
+        resumed.clear();
+        appendVarintFrame(resumed, FrameType::Resumed, {result.stream, result.through, result.missed});
+        loop.send(conn, resumed.data(), resumed.size());
+        return true;
     }
 
     /**
-     * @brief Shuts down the server by stopping the accept loop and closing the server socket.
+     * @brief Applies a subscribe, unsubscribe or publish request from a client.
+     *
+     * Runs on the loop thread that owns the connection.
      */
-    void serverShutdown()
+    void handleTopicRequest(IoLoop &loop, Connection &conn, FrameType type, string_view topic, string_view message)
     {
-        running = false;     // Stop the server loop
-        close(serverSocket); // Close the server socket
-        cout << "Server shutdown." << endl;
+        if (type == FrameType::Subscribe)
+        {
+            logInfo() << "Client [" << conn.fd << "] subscribed to " << topic << ".";
+            loop.subscribe(conn, topic);
+        }
+        else if (type == FrameType::Unsubscribe)
+        {
+            logInfo() << "Client [" << conn.fd << "] unsubscribed from " << topic << ".";
+            loop.unsubscribe(conn, topic);
+        }
+        else
+        {
+            logInfo() << "Client [" << conn.fd << "] on " << topic << ": " << message;
+            publish(topic, message);
+        }
     }
 
     /**
-     * @brief Destructor to ensure all client sockets and the server socket are closed.
+     * @brief The application's handling of one text message: logs it, then echoes it
+     * back, or relays it to every client with --broadcast on.
+     *
+     * Runs on the loop thread, or on a worker with --workers; either way, messages of
+     * one connection are handled one at a time and in order.
+     *
+     * @param reply Frames to send back to the client are appended here.
      */
-    ~SimpleServer()
+    void handleMessage(int fd, string_view message, string &reply)
     {
-        for (int client : clientSockets)
+        logInfo() << "Client [" << fd << "]: " << message;
+        if (options.broadcast)
         {
-            close(client); // Close each client socket
+            broadcast(message);
+            return;
         }
-        close(serverSocket); // Close the server socket
+        appendFrame(reply, FrameType::Text, message);
     }
-};
 
-int main()
-{
-    SimpleServer server(9999); // Initialize server on port 9999
+    /**
+     * @brief The application's handling of one request: answers it with a Response
+     * that carries the request's correlation ID and echoes its message. Requests are
+     * answered to the caller alone, with --broadcast on as well.
+     *
+     * @param payload A Request payload that splitCorrelated() accepts.
+     * @param reply The Response frame is appended here.
+     */
+    void handleRequest(int fd, string_view payload, string &reply)
+    {
+        uint64_t id;
+        string_view message;
+        splitCorrelated(payload, id, message);
+        logDebug() << "Client [" << fd << "] request " << id << ": " << message;
+        appendCorrelatedFrame(reply, FrameType::Response, id, message);
+    }
+
+    /**
+     * @brief Passes a Text or Request frame's payload to its handler.
+     */
+    void handleCall(int fd, FrameType type, string_view payload, string &reply)
+    {
+        if (type == FrameType::Request)
+        {
+            handleRequest(fd, payload, reply);
+            return;
+        }
+        handleMessage(fd, payload, reply);
+    }
 
-    server.bindSocket();        // Bind the server socket to the address
-    server.startListening();    // Start listening for connections
-    server.acceptConnections(); // Begin accepting client connections
-    server.serverShutdown();    // Shutdown server (unreachable in current setup)
+    /**
+     * @brief Sends the message of the day, if any, to a framed client that just
+     * connected: a frame header followed by the file, which goes out with sendfile or a
+     * zero-copy send rather than through a buffer.
+     */
+    void greet(IoLoop &loop, Connection &conn)
+    {
+        if (!motd)
+        {
+            return;
+        }
+        static thread_local string header;
+        header.clear();
+        appendFrameHeader(header, FrameType::Text, motd->size());
+        loop.send(conn, motd, 0, motd->size(), header);
+    }
+
+    /**
+     * @brief The connection's strand on the worker pool, created on first use.
+     */
+    Strand &strandFor(IoLoop &loop, Connection &conn)
+    {
+        if (!conn.strand)
+        {
+            conn.strand = allocate_shared<Strand>(PoolAllocator<Strand>(), *workers, loop, conn, messageHandler);
+        }
+        return *conn.strand;
+    }
+
+    /**
+     * @brief Handles data read by an event loop: parses frames, passes text messages and
+     * requests to their handlers directly or through the worker pool, and applies topic
+     * requests.
+     *
+     * Runs on the loop thread that owns the connection, so it must never block.
+     */
+    void handleData(IoLoop &loop, Connection &conn, string_view data)
+    {
+        bool valid = conn.parser.feed(data, [&](const Frame &frame)
+                                      {
+            loop.countMessage();
+            if (conn.closing || (conn.strand && conn.strand->closeRequested))
+            {
+                return; // Ignore anything after a close request
+            }
+            if (frame.type == FrameType::Close)
+            {
+                logInfo() << "Client [" << conn.fd << "] requested to close the connection.";
+                if (conn.strand && conn.strand->postClose())
+                {
+                    return; // Closes after the replies still being worked on
+                }
+                loop.closeAfterFlush(conn);
+            }
+            else if (frame.type == FrameType::Text || frame.type == FrameType::Request)
+            {
+                uint64_t id;
+                string_view message;
+                if (frame.type == FrameType::Request && !splitCorrelated(frame.payload, id, message))
+                {
+                    logWarning() << "Malformed request from client [" << conn.fd << "].";
+                    loop.countProtocolError();
+                    loop.closeAfterFlush(conn);
+                    return;
+                }
+                if (workers)
+                {
+                    if (!strandFor(loop, conn).post(frame.payload, frame.type))
+                    {
+                        logWarning() << "Client [" << conn.fd << "] is too far ahead of the workers; closing the connection.";
+                        loop.closeAfterFlush(conn);
+                    }
+                    return;
+                }
+                static thread_local string reply; // Reused, so echoing does not allocate
+                reply.clear();
+                handleCall(conn.fd, frame.type, frame.payload, reply);
+                if (!reply.empty())
+                {
+                    loop.send(conn, reply.data(), reply.size());
+                }
+            }
+            else if (frame.type == FrameType::Publish)
+            {
+                string_view topic, message;
+                if (!splitPublish(frame.payload, topic, message) || topic.empty())
+                {
+                    logWarning() << "Malformed publish from client [" << conn.fd << "].";
+                    loop.countProtocolError();
+                    loop.closeAfterFlush(conn);
+                    return;
+                }
+                handleTopicRequest(loop, conn, frame.type, topic, message);
+            }
+            else if ((frame.type == FrameType::Subscribe || frame.type == FrameType::Unsubscribe) && !frame.payload.empty())
+            {
+                handleTopicRequest(loop, conn, frame.type, frame.payload, {});
+            }
+            else if (frame.type == FrameType::Ping)
+            {
+                static thread_local string pong;
+                pong.clear();
+                appendFrame(pong, FrameType::Pong, frame.payload);
+                loop.send(conn, pong.data(), pong.size());
+            }
+            else if (frame.type == FrameType::Resume && !resume(loop, conn, frame.payload))
+            {
+                loop.closeAfterFlush(conn);
+            } });
+
+        if (!valid)
+        {
+            logWarning() << "Malformed frame from client [" << conn.fd << "].";
+            loop.countProtocolError();
+            loop.closeAfterFlush(conn);
+        }
+    }
+
+#ifdef CONNECTION_COROUTINES
+    /**
+     * @brief Handles data read by an event loop with --handlers coroutine: passes each
+     * complete frame to the connection's handler coroutine.
+     */
+    static void feedStream(IoLoop &loop, Connection &conn, string_view data)
+    {
+        FrameStream &stream = *conn.stream;
+        bool valid = conn.parser.feed(data, [&](const Frame &frame)
+                                      {
+            loop.countMessage();
+            stream.deliver(frame); });
+        if (!valid)
+        {
+            logWarning() << "Malformed frame from client [" << conn.fd << "].";
+            loop.countProtocolError();
+            stream.end();
+            loop.closeAfterFlush(conn);
+        }
+    }
+
+    /**
+     * @brief The framed protocol as a coroutine: the same behaviour as handleData(),
+     * written as one sequential loop over the connection's frames.
+     */
+    ConnectionTask serveConnection(IoLoop &loop, Connection &conn, FrameStream &stream)
+    {
+        static thread_local string reply; // Filled and written without suspending in between
+        while (optional<Frame> frame = co_await stream.readFrame())
+        {
+            if (frame->type == FrameType::Close)
+            {
+                logInfo() << "Client [" << conn.fd << "] requested to close the connection.";
+                co_return; // The stream closes the connection after flushing
+            }
+            else if (frame->type == FrameType::Text || frame->type == FrameType::Request)
+            {
+                uint64_t id;
+                string_view message;
+                if (frame->type == FrameType::Request && !splitCorrelated(frame->payload, id, message))
+                {
+                    logWarning() << "Malformed request from client [" << conn.fd << "].";
+                    loop.countProtocolError();
+                    co_return;
+                }
+                reply.clear();
+                handleCall(conn.fd, frame->type, frame->payload, reply);
+                if (!reply.empty())
+                {
+                    co_await stream.write(reply);
+                }
+            }
+            else if (frame->type == FrameType::Publish)
+            {
+                string_view topic, message;
+                if (!splitPublish(frame->payload, topic, message) || topic.empty())
+                {
+                    logWarning() << "Malformed publish from client [" << conn.fd << "].";
+                    loop.countProtocolError();
+                    co_return;
+                }
+                handleTopicRequest(loop, conn, frame->type, topic, message);
+            }
+            else if ((frame->type == FrameType::Subscribe || frame->type == FrameType::Unsubscribe) && !frame->payload.empty())
+            {
+                handleTopicRequest(loop, conn, frame->type, frame->payload, {});
+            }
+            else if (frame->type == FrameType::Ping)
+            {
+                reply.clear();
+                appendFrame(reply, FrameType::Pong, frame->payload);
+                co_await stream.write(reply);
+            }
+            else if (frame->type == FrameType::Resume && !resume(loop, conn, frame->payload))
+            {
+                co_return;
+            }
+        }
+    }
+#endif
+
+    /**
+     * @brief Handles data read by an event loop in WebSocket mode: completes the Upgrade
+     * handshake, then logs and echoes (or broadcasts) each message and answers pings and
+     * close frames.
+     *
+     * Runs on the loop thread that owns the connection, so it must never block.
+     */
+    void handleWebSocketData(IoLoop &loop, Connection &conn, string_view data)
+    {
+        WebSocketSession &session = *conn.websocket;
+
+        if (!session.upgraded)
+        {
+            string response;
+            HandshakeStatus status = session.handshake.feed(data, response, options.deflate, session.deflate);
+            if (status == HandshakeStatus::Incomplete)
+            {
+                return;
+            }
+            loop.send(conn, response.data(), response.size());
+            if (status == HandshakeStatus::Rejected)
+            {
+                logWarning() << "Rejected WebSocket handshake from client [" << conn.fd << "].";
+                loop.countProtocolError();
+                loop.closeAfterFlush(conn);
+                return;
+            }
+            session.upgraded = true;
+            conn.joined = true; // Broadcasts can be framed for this client from now on
+            if (session.deflate)
+            {
+                session.parser.allowCompression();
+            }
+            logInfo() << "Client [" << conn.fd << "] upgraded to WebSocket"
+                      << (session.deflate ? " with permessage-deflate." : ".");
+        }
+
+        // Scratch buffers reused by every connection of this loop thread
+        static thread_local string inflated, deflated, reply;
+        reply.clear();
+        uint16_t error = 0;
+
+        // Appends a data message, compressed when the extension is on and it pays off
+        auto appendMessage = [&](WsOpcode opcode, string_view payload)
+        {
+            if (session.deflate && session.deflate->compress(payload, deflated))
+            {
+                appendWebSocketFrame(reply, opcode, deflated, true);
+            }
+            else
+            {
+                appendWebSocketFrame(reply, opcode, payload);
+            }
+        };
+
+        uint16_t parseError = session.parser.feed(data, [&](const WsMessage &message)
+                                                  {
+            if (conn.closing || error != 0)
+            {
+                return; // Ignore anything after the close handshake started
+            }
+            loop.countMessage();
+            string_view payload = message.payload;
+            if (message.compressed)
+            {
+                auto status = session.deflate->decompress(payload, inflated, maxWebSocketMessage);
+                if (status != PerMessageDeflate::InflateStatus::Ok)
+                {
+                    error = status == PerMessageDeflate::InflateStatus::TooBig ? WsCloseTooBig : WsCloseInvalidData;
+                    return;
+                }
+                payload = inflated;
+                if (message.opcode == WsOpcode::Text && !isValidUtf8(payload))
+                {
+                    error = WsCloseInvalidData;
+                    return;
+                }
+            }
+
+            switch (message.opcode)
+            {
+            case WsOpcode::Text:
+            {
+                FrameType type;
+                string_view topic, body;
+                if (parseTopicCommand(payload, type, topic, body))
+                {
+                    handleTopicRequest(loop, conn, type, topic, body);
+                    break;
+                }
+                logInfo() << "Client [" << conn.fd << "]: " << payload;
+                options.broadcast ? broadcast(payload) : appendMessage(WsOpcode::Text, payload);
+                break;
+            }
+            case WsOpcode::Binary:
+                logInfo() << "Client [" << conn.fd << "]: " << payload.size() << " byte binary message";
+                options.broadcast ? broadcast(payload, true) : appendMessage(WsOpcode::Binary, payload);
+                break;
+            case WsOpcode::Ping:
+                appendWebSocketFrame(reply, WsOpcode::Pong, payload);
+                break;
+            case WsOpcode::Close:
+                logInfo() << "Client [" << conn.fd << "] requested to close the connection.";
+                appendWebSocketFrame(reply, WsOpcode::Close, payload.substr(0, 2)); // Echo the status code
+                session.closeSent = true;
+                loop.closeAfterFlush(conn);
+                break;
+            default:
+                break; // Unsolicited pongs need no answer
+            } });
+
+        if (error == 0)
+        {
+            error = parseError;
+        }
+        if (error != 0 && !session.closeSent)
+        {
+            logWarning() << "WebSocket protocol error from client [" << conn.fd << "], closing with " << error << ".";
+            loop.countProtocolError();
+            appendWebSocketClose(reply, error);
+            session.closeSent = true;
+            loop.closeAfterFlush(conn);
+        }
+        if (!reply.empty())
+        {
+            loop.send(conn, reply.data(), reply.size()); // All replies to this read in one write
+        }
+    }
+
+    /**
+     * @brief Accepts incoming client connections using the configured mode.
+     */
+    void acceptConnections()
+    {
+        setNonBlocking(serverSocket); // Lets acceptClients() empty the queue without blocking
+        if (options.mode == ServerMode::Epoll)
+        {
+            acceptIntoEventLoops();
+        }
+        else if (options.mode == ServerMode::ReusePort)
+        {
+            acceptInEachLoop();
+        }
+        else
+        {
+            acceptIntoThreads();
+        }
+    }
+
+    /**
+     * @brief Creates the event loops and starts one thread for each.
+     *
+     * @param listenEach If true, every loop accepts on its own SO_REUSEPORT socket.
+     */
+    void startEventLoops(bool listenEach)
+    {
+        raiseFileLimit();
+
+        bool useUring = options.io == IoBackend::Uring;
+        if (useUring && !UringLoop::supported())
+        {
+            logWarning() << "io_uring is not available, falling back to epoll.";
+            useUring = false;
+        }
+
+        // Framed clients can take broadcasts at once, WebSocket clients after the upgrade
+        IoLoop::DataHandler handler = [this](IoLoop &loop, Connection &conn, string_view data)
+        { handleData(loop, conn, data); };
+        IoLoop::ConnectionHandler onOpen = [this](IoLoop &loop, Connection &conn)
+        {
+            conn.joined = true;
+            greet(loop, conn);
+        };
+        if (options.protocol == Protocol::WebSocket)
+        {
+            handler = [this](IoLoop &loop, Connection &conn, string_view data)
+            { handleWebSocketData(loop, conn, data); };
+            onOpen = [](IoLoop &, Connection &conn)
+            { conn.websocket = make_unique<WebSocketSession>(); };
+        }
+#ifdef CONNECTION_COROUTINES
+        else if (options.handlers == HandlerStyle::Coroutine)
+        {
+            handler = [](IoLoop &loop, Connection &conn, string_view data)
+            { feedStream(loop, conn, data); };
+            onOpen = [this](IoLoop &loop, Connection &conn)
+            {
+                conn.joined = true;
+                greet(loop, conn);
+                conn.stream = allocate_shared<FrameStream>(PoolAllocator<FrameStream>(), loop, conn);
+                conn.stream->start(serveConnection(loop, conn, *conn.stream));
+            };
+        }
+#endif
+        if (options.workerThreads > 0)
+        {
+            workers = make_unique<WorkerPool>(options.workerThreads);
+        }
+        if (options.protocol == Protocol::Framed && options.replayMessages > 0)
+        {
+            replay = make_unique<ReplayBuffer>(options.replayMessages, options.replayBytes);
+            string error;
+            if (!options.replayLog.directory.empty() && !replay->openLog(options.replayLog, takeoverTimeoutSeconds, error))
+            {
+                cerr << "Failed to open replay log: " << error << "." << endl;
+                exit(EXIT_FAILURE);
+            }
+            if (!options.replayLog.directory.empty())
+            {
+                logInfo() << "Replay log " << options.replayLog.directory << " holds " << replay->held() << " message(s).";
+            }
+        }
+        if (!options.motdPath.empty())
+        {
+            motd = MappedFile::open(options.motdPath.c_str());
+            if (!motd || motd->size() > defaultMaxFramePayload)
+            {
+                cerr << "Cannot serve " << options.motdPath << " as the message of the day." << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        unsigned count = options.loopThreads > 0 ? options.loopThreads : 1;
+        for (unsigned i = 0; i < count; ++i)
+        {
+            int id = static_cast<int>(i);
+            if (useUring)
+            {
+                loops.push_back(make_unique<UringLoop>(id, handler, onOpen));
+            }
+            else
+            {
+                loops.push_back(make_unique<EventLoop>(id, handler, onOpen));
+            }
+            loops.back()->setOutboundLimits(options.outbound);
+            loops.back()->setZeroCopyThreshold(options.zeroCopyThreshold);
+            loops.back()->setTiming(options.metricsPort > 0);
+            loops.back()->setTimeouts(options.timeouts, [this](IoLoop &loop, Connection &conn)
+                                      { sendHeartbeat(loop, conn); });
+            loops.back()->setGoodbye(sendGoodbye);
+            loops.back()->setAdmission(&admission);
+            if (listenEach)
+            {
+                // The first loop reuses the socket bound in bindSocket()
+                loops.back()->addListener(i == 0 ? serverSocket : openReusePortListener());
+            }
+        }
+        for (size_t i = 0; i < loops.size(); ++i)
+        {
+            loopThreads.emplace_back(&IoLoop::run, loops[i].get());
+            if (!options.cpus.empty())
+            {
+                pinThread(loopThreads.back(), options.cpus[i % options.cpus.size()]);
+            }
+        }
+        {
+            LogLine line = logInfo();
+            line << "Serving clients from " << count << (useUring ? " io_uring" : " epoll")
+                 << " event loop thread(s)";
+            if (workers)
+            {
+                line << " with " << workers->size() << " worker thread(s)";
+            }
+            line << ".";
+        }
+        if (options.statsInterval > 0)
+        {
+            statsThread = thread(&SimpleServer::reportStats, this);
+        }
+        if (options.metricsPort > 0)
+        {
+            if (!metrics.start(options.metricsPort, [this](string &out)
+                               { writeMetrics(out); }))
+            {
+                cerr << "Failed to serve metrics on port " << options.metricsPort << "." << endl;
+                exit(EXIT_FAILURE);
+            }
+            logInfo() << "Serving metrics on http://127.0.0.1:" << options.metricsPort << "/metrics.";
+        }
+        confirmTakeover();
+    }
+
+    /**
+     * @brief Lets the server whose listeners were taken over start draining, now that
+     * this one serves them, and closes the taken-over sockets this one has no loop for.
+     */
+    void confirmTakeover()
+    {
+        for (int listener : inheritedListeners)
+        {
+            close(listener);
+        }
+        inheritedListeners.clear();
+        if (takeoverSocket >= 0)
+        {
+            acknowledgeHandover(takeoverSocket);
+            close(takeoverSocket);
+            takeoverSocket = -1;
+        }
+    }
+
+    /**
+     * @brief Pings a connection that has been silent for the heartbeat interval, in the
+     * connection's protocol. A WebSocket client is only pinged once upgraded.
+     */
+    static void sendHeartbeat(IoLoop &loop, Connection &conn)
+    {
+        static thread_local string ping;
+        ping.clear();
+        if (conn.websocket)
+        {
+            if (!conn.websocket->upgraded || conn.websocket->closeSent)
+            {
+                return;
+            }
+            appendWebSocketFrame(ping, WsOpcode::Ping, {});
+        }
+        else
+        {
+            appendFrame(ping, FrameType::Ping, {});
+        }
+        loop.send(conn, ping.data(), ping.size());
+    }
+
+    /**
+     * @brief Ends a connection when its loop drains: a close frame after any replies
+     * still being worked on, then a close once the output is flushed.
+     */
+    static void sendGoodbye(IoLoop &loop, Connection &conn)
+    {
+        static thread_local string goodbye;
+        goodbye.clear();
+        if (conn.websocket)
+        {
+            WebSocketSession &session = *conn.websocket;
+            if (session.upgraded && !session.closeSent)
+            {
+                appendWebSocketClose(goodbye, WsCloseGoingAway);
+                session.closeSent = true;
+                loop.send(conn, goodbye.data(), goodbye.size());
+            }
+            loop.closeAfterFlush(conn);
+            return;
+        }
+        appendFrame(goodbye, FrameType::Close, {});
+        if (conn.strand)
+        {
+            if (!conn.strand->closeRequested && !conn.strand->postClose(goodbye))
+            {
+                loop.closeAfterFlush(conn);
+            }
+            return;
+        }
+        loop.send(conn, goodbye.data(), goodbye.size());
+#ifdef CONNECTION_COROUTINES
+        if (conn.stream)
+        {
+            conn.stream->end(); // The handler's pending readFrame() returns nothing
+        }
+#endif
+        loop.closeAfterFlush(conn);
+    }
+
+    /**
+     * @brief Renders every loop's counters and histograms in the Prometheus text format,
+     * one family at a time with a loop label per sample. Runs on the metrics thread.
+     */
+    void writeMetrics(string &out)
+    {
+        MetricsText text(out);
+        vector<string> labels;
+        for (size_t i = 0; i < loops.size(); ++i)
+        {
+            labels.push_back("loop=\"" + to_string(i) + "\"");
+        }
+        auto family = [&](const char *name, const char *type, const char *help, auto value)
+        {
+            text.family(name, type, help);
+            for (size_t i = 0; i < loops.size(); ++i)
+            {
+                text.sample(name, labels[i], value(*loops[i]));
+            }
+        };
+        auto histogram = [&](const char *name, const char *help, const BucketHistogram LoopMetrics::*member)
+        {
+            text.family(name, "histogram", help);
+            for (size_t i = 0; i < loops.size(); ++i)
+            {
+                text.histogram(name, labels[i], (loops[i]->metrics().*member).snapshot());
+            }
+        };
+
+        family("simple_server_connections", "gauge", "Connections open on the loop.", [](const IoLoop &loop)
+               { return static_cast<int64_t>(loop.metrics().connectionsOpened.load() - loop.metrics().connectionsClosed.load()); });
+        family("simple_server_connections_opened_total", "counter", "Connections registered with the loop.", [](const IoLoop &loop)
+               { return loop.metrics().connectionsOpened.load(); });
+        family("simple_server_connections_closed_total", "counter", "Connections closed by the loop.", [](const IoLoop &loop)
+               { return loop.metrics().connectionsClosed.load(); });
+        text.family("simple_server_connections_rejected_total", "counter", "Clients turned away at accept time, by the limit that applied.");
+        text.sample("simple_server_connections_rejected_total", "reason=\"max_connections\"", admission.rejected(Admission::Verdict::Full));
+        text.sample("simple_server_connections_rejected_total", "reason=\"rate\"", admission.rejected(Admission::Verdict::Limited));
+        family("simple_server_received_bytes_total", "counter", "Bytes read from clients.", [](const IoLoop &loop)
+               { return loop.metrics().bytesReceived.load(); });
+        family("simple_server_sent_bytes_total", "counter", "Bytes written to clients.", [](const IoLoop &loop)
+               { return loop.metrics().bytesSent.load(); });
+        family("simple_server_reads_total", "counter", "Reads passed to the data handler.", [](const IoLoop &loop)
+               { return loop.stats().reads; });
+        family("simple_server_messages_received_total", "counter", "Frames or WebSocket messages parsed.", [](const IoLoop &loop)
+               { return loop.metrics().messagesReceived.load(); });
+        family("simple_server_protocol_errors_total", "counter", "Connections closed for malformed input.", [](const IoLoop &loop)
+               { return loop.metrics().protocolErrors.load(); });
+        family("simple_server_read_errors_total", "counter", "Failed reads.", [](const IoLoop &loop)
+               { return loop.metrics().readErrors.load(); });
+        family("simple_server_send_errors_total", "counter", "Failed sends.", [](const IoLoop &loop)
+               { return loop.metrics().sendErrors.load(); });
+        family("simple_server_slow_consumers_total", "counter", "Connections closed by the disconnect slow-consumer policy.", [](const IoLoop &loop)
+               { return loop.metrics().slowConsumers.load(); });
+        family("simple_server_dropped_bytes_total", "counter", "Output discarded by the drop slow-consumer policies.", [](const IoLoop &loop)
+               { return loop.metrics().droppedBytes.load(); });
+        family("simple_server_shed_publications_total", "counter", "Broadcasts and publications not delivered because the loop's mailbox was full.", [](const IoLoop &loop)
+               { return loop.shedPublications(); });
+        family("simple_server_idle_timeouts_total", "counter", "Connections closed for staying silent past --idle-timeout.", [](const IoLoop &loop)
+               { return loop.metrics().idleTimeouts.load(); });
+        family("simple_server_heartbeats_total", "counter", "Pings sent to connections silent for --heartbeat.", [](const IoLoop &loop)
+               { return loop.metrics().heartbeats.load(); });
+        family("simple_server_replayed_messages_total", "counter", "Messages sent again to clients resuming a session.", [](const IoLoop &loop)
+               { return loop.metrics().messagesReplayed.load(); });
+        family("simple_server_queued_bytes", "gauge", "Output waiting in connection queues.", [](const IoLoop &loop)
+               { return loop.metrics().queuedBytes.load(); });
+        family("simple_server_heap_allocations_total", "counter", "Heap allocations made on the loop thread.", [](const IoLoop &loop)
+               { return loop.stats().heapAllocations; });
+        histogram("simple_server_handler_seconds", "Time the data handler took per read, sampled one read in eight.", &LoopMetrics::handlerTime);
+        histogram("simple_server_queue_seconds", "Time output waited in a connection queue until the queue drained.", &LoopMetrics::queueTime);
+    }
+
+    /**
+     * @brief Prints, every --stats interval, what each loop thread handled and allocated
+     * since the previous report, until the server shuts down.
+     *
+     * Heap allocations include pool misses; with a warm pool the count stays at zero
+     * however many reads were handled.
+     */
+    void reportStats()
+    {
+        vector<IoLoop::Stats> previous(loops.size(), IoLoop::Stats{});
+        unique_lock<mutex> lock(statsMutex);
+        while (!statsWake.wait_for(lock, chrono::seconds(options.statsInterval), [this]
+                                   { return !running; }))
+        {
+            for (size_t i = 0; i < loops.size(); ++i)
+            {
+                IoLoop::Stats now = loops[i]->stats();
+                cout << "Loop " << i << ": " << now.reads - previous[i].reads << " reads, "
+                     << now.heapAllocations - previous[i].heapAllocations << " heap allocations, "
+                     << now.poolHits - previous[i].poolHits << " pool hits, "
+                     << now.poolMisses - previous[i].poolMisses << " pool misses";
+                if (options.zeroCopyThreshold > 0)
+                {
+                    cout << ", " << now.zeroCopySends - previous[i].zeroCopySends << " zero-copy sends ("
+                         << now.zeroCopyCopied - previous[i].zeroCopyCopied << " copied by the kernel)";
+                }
+                cout << "." << endl;
+                previous[i] = now;
+            }
+        }
+    }
+
+    /**
+     * @brief Wakes the stats and reaper threads, if any, and waits for them to exit.
+     */
+    void stopHelperThreads()
+    {
+        {
+            lock_guard<mutex> lock(statsMutex);
+            running = false;
+        }
+        statsWake.notify_all();
+        if (statsThread.joinable())
+        {
+            statsThread.join();
+        }
+        if (reaperThread.joinable())
+        {
+            reaperThread.join();
+        }
+    }
+
+    /**
+     * @brief Runs one loop per thread where each loop accepts its own clients.
+     *
+     * The kernel spreads incoming connections across the SO_REUSEPORT sockets, and a
+     * connection never leaves the loop that accepted it, so there is no shared accept
+     * queue and no cross-thread handoff.
+     */
+    void acceptInEachLoop()
+    {
+        startEventLoops(true);
+        pollfd stop{stopFd, POLLIN, 0};
+        while (poll(&stop, 1, -1) < 0 && errno == EINTR)
+        {
+        }
+    }
+
+    /**
+     * @brief Opens an additional listening socket on the server port for one event loop.
+     *
+     * @return The listening socket descriptor.
+     */
+    int openReusePortListener()
+    {
+        if (!inheritedListeners.empty())
+        {
+            int listener = inheritedListeners.front();
+            inheritedListeners.erase(inheritedListeners.begin());
+            extraListeners.push_back(listener);
+            return listener;
+        }
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener < 0 || !enableReusePort(listener) ||
+            ::bind(listener, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0 ||
+            listen(listener, options.backlog) < 0)
+        {
+            cerr << "Failed to open SO_REUSEPORT listener." << endl;
+            exit(EXIT_FAILURE);
+        }
+        extraListeners.push_back(listener);
+        return listener;
+    }
+
+    static bool enableReusePort(int socket)
+    {
+        int enable = 1;
+        return setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == 0;
+    }
+
+    /**
+     * @brief Restricts a thread to a single CPU.
+     */
+    static void pinThread(thread &t, int cpu)
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        if (pthread_setaffinity_np(t.native_handle(), sizeof(cpuSet), &cpuSet) != 0)
+        {
+            logWarning() << "Failed to pin event loop thread to CPU " << cpu << ".";
+        }
+    }
+
+    /**
+     * @brief Starts the event loops and hands each accepted client to one of them in turn.
+     *
+     * Connections never leave the loop they were given, so a fixed number of threads
+     * serves every client regardless of how many are connected.
+     */
+    void acceptIntoEventLoops()
+    {
+        startEventLoops(false);
+
+        while (accepting)
+        {
+            acceptClients(SOCK_NONBLOCK | SOCK_CLOEXEC, [this](int clientSocket, const sockaddr_in &)
+                          {
+                // A loop a whole mailbox behind makes the acceptor wait, and new clients
+                // wait in the kernel's accept queue meanwhile
+                while (!loops[nextLoop]->adoptConnection(clientSocket))
+                {
+                    if (!accepting)
+                    {
+                        close(clientSocket);
+                        return;
+                    }
+                    this_thread::yield();
+                }
+                nextLoop = (nextLoop + 1) % loops.size(); });
+        }
+    }
+
+    /**
+     * @brief Waits for clients on the server socket, or for the server to stop accepting,
+     * then accepts every queued client, up to acceptBatch, and passes the admitted ones
+     * to onClient(int fd, const sockaddr_in &address).
+     *
+     * Emptying the accept queue on each wakeup keeps it from overflowing in a reconnect
+     * storm, where every dropped SYN costs its client a retry a second or more later.
+     * The socket is non-blocking, so the accept after the last client fails with EAGAIN;
+     * so does one whose client another process, sharing the socket after a takeover,
+     * took first.
+     *
+     * @param flags accept4 flags for the client sockets.
+     */
+    template <typename OnClient>
+    void acceptClients(int flags, OnClient &&onClient)
+    {
+        pollfd ready[2] = {{serverSocket, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        if (poll(ready, 2, -1) < 0 || ready[1].revents != 0)
+        {
+            return;
+        }
+        for (size_t i = 0; i < acceptBatch; ++i)
+        {
+            sockaddr_in clientAddr; // Structure to hold client address
+            socklen_t clientLen = sizeof(clientAddr);
+            int clientSocket = accept4(serverSocket, (sockaddr *)&clientAddr, &clientLen, flags);
+            if (clientSocket < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                {
+                    continue;
+                }
+                if (accepting && errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    logError() << "Error accepting client.";
+                }
+                return;
+            }
+            if (admission.admit(clientSocket, &clientAddr))
+            {
+                onClient(clientSocket, clientAddr);
+            }
+        }
+    }
+
+    /**
+     * @brief Raises the open file soft limit to the hard limit so one process can hold
+     * tens of thousands of sockets.
+     */
+    static void raiseFileLimit()
+    {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    /**
+     * @brief Continuously accepts incoming client connections and spawns a thread for each client.
+     */
+    void acceptIntoThreads()
+    {
+        if (options.timeouts.enabled())
+        {
+            reaperThread = thread(&SimpleServer::reapIdleClients, this);
+        }
+        confirmTakeover();
+        logInfo() << "Waiting for client connections...";
+        while (accepting)
+        {
+            acceptClients(SOCK_CLOEXEC, [this](int clientSocket, const sockaddr_in &clientAddr)
+                          {
+                // Display client connection details
+                logDebug() << "Client connected from " << inet_ntoa(clientAddr.sin_addr)
+                           << ":" << ntohs(clientAddr.sin_port);
+
+                // Add the new client socket to the list of active clients
+                {
+                    lock_guard<mutex> lock(clientsMutex);
+                    clientSockets.push_back(clientSocket);
+                    ++clientThreads;
+                }
+
+                // Create a detached thread to handle client communication; drainConnections()
+                // waits for it through clientThreads
+                thread clientThread(&SimpleServer::handleClient, this, clientSocket);
+                clientThread.detach(); });
+        }
+    }
+
+    /**
+     * @brief Stops the accepting threads and the control thread. Safe to call from any
+     * thread, more than once.
+     */
+    void requestStop()
+    {
+        if (accepting.exchange(false))
+        {
+            uint64_t one = 1;
+            ssize_t ignored = write(stopFd, &one, sizeof(one)); // Stays readable for every poller
+            (void)ignored;
+        }
+    }
+
+    /**
+     * @brief Runs on the control thread until the server stops accepting: turns the
+     * first SIGINT or SIGTERM into a graceful shutdown and serves upgrade requests.
+     */
+    void handleControl()
+    {
+        pollfd ready[3] = {{stopFd, POLLIN, 0}, {signalFd, POLLIN, 0}, {upgradeListener, POLLIN, 0}};
+        nfds_t count = upgradeListener >= 0 ? 3 : 2;
+        while (true)
+        {
+            if (poll(ready, count, -1) < 0)
+            {
+                continue; // EINTR
+            }
+            if (ready[0].revents != 0)
+            {
+                return;
+            }
+            if (ready[1].revents != 0)
+            {
+                signalfd_siginfo info;
+                if (read(signalFd, &info, sizeof(info)) == sizeof(info))
+                {
+                    logInfo() << "Received " << strsignal(static_cast<int>(info.ssi_signo))
+                              << "; draining connections for up to " << options.drainSeconds << " s.";
+                }
+                requestStop();
+                return;
+            }
+            if (ready[2].revents != 0)
+            {
+                int socket = accept4(upgradeListener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (socket < 0)
+                {
+                    continue;
+                }
+                vector<int> listeners{serverSocket};
+                listeners.insert(listeners.end(), extraListeners.begin(), extraListeners.end());
+                if (replay)
+                {
+                    replay->suspendLog(); // The new process opens it once it has the listeners
+                }
+                bool done = handOverListeners(socket, listeners, takeoverTimeoutSeconds);
+                close(socket);
+                string error;
+                if (!done && replay && !options.replayLog.directory.empty() && !replay->openLog(options.replayLog, 0, error))
+                {
+                    logWarning() << "Cannot reopen the replay log (" << error << "); messages go out unnumbered.";
+                }
+                if (done)
+                {
+                    logInfo() << "A new server took over the listeners; draining connections for up to "
+                              << options.drainSeconds << " s.";
+                    handedOver = true;
+                    requestStop();
+                    return;
+                }
+                logWarning() << "A new server failed to take over the listeners; still serving.";
+            }
+        }
+    }
+
+    /**
+     * @brief Shuts down the server by stopping the accept loop and closing the server socket.
+     */
+    void serverShutdown()
+    {
+        requestStop();
+        if (controlThread.joinable())
+        {
+            controlThread.join();
+        }
+        closeUpgradeSocket();
+        running = false;     // Stop the server loop
+        close(serverSocket); // Close the server socket
+        stopHelperThreads();
+        metrics.stop();
+
+        // Stop the event loops, if any, and wait for their threads
+        for (auto &loop : loops)
+        {
+            loop->stop();
+        }
+        for (auto &loopThread : loopThreads)
+        {
+            loopThread.join();
+        }
+        loopThreads.clear();
+        for (int listener : extraListeners)
+        {
+            close(listener);
+        }
+        extraListeners.clear();
+        logInfo() << "Server shutdown.";
+    }
+
+    /**
+     * @brief Stops listening for upgrade requests. The path is left alone once a new
+     * server has taken it over.
+     */
+    void closeUpgradeSocket()
+    {
+        if (upgradeListener >= 0)
+        {
+            close(upgradeListener);
+            upgradeListener = -1;
+            if (!handedOver)
+            {
+                unlink(options.upgradeSocket.c_str());
+            }
+        }
+    }
+
+    /**
+     * @brief Destructor to ensure all client sockets and the server socket are closed.
+     *
+     * Connections owned by event loops are closed when the loops are destroyed.
+     */
+    ~SimpleServer()
+    {
+        requestStop();
+        if (controlThread.joinable())
+        {
+            controlThread.join();
+        }
+        closeUpgradeSocket();
+        close(stopFd);
+        close(signalFd);
+        stopHelperThreads();
+        metrics.stop();
+        for (auto &loop : loops)
+        {
+            loop->stop();
+        }
+        for (auto &loopThread : loopThreads)
+        {
+            loopThread.join();
+        }
+
+        for (int client : clientSockets)
+        {
+            close(client); // Close each client socket
+        }
+        close(serverSocket); // Close the server socket
+    }
+};
+
+/**
+ * @brief Prints the supported command line options.
+ */
+void printUsage(const char *program)
+{
+    cerr << "Usage: " << program << " [--port N] [--mode threaded|epoll|reuseport] [--threads N]"
+         << " [--io epoll|uring] [--protocol framed|websocket] [--affinity auto|CPU,CPU,...] [--broadcast on|off]"
+         << " [--max-queue BYTES] [--high-watermark BYTES] [--low-watermark BYTES]"
+         << " [--slow-consumer drop-oldest|drop-newest|disconnect] [--stats SECONDS] [--workers N] [--handlers callback|coroutine] [--zerocopy-threshold BYTES] [--motd FILE]"
+         << " [--log-level debug|info|warning|error|off] [--log-file PATH] [--log-format text|json] [--metrics-port N]"
+         << " [--idle-timeout SECONDS] [--heartbeat SECONDS] [--drain-timeout SECONDS] [--upgrade-socket PATH]"
+         << " [--listen-backlog N] [--max-connections N] [--accept-rate N] [--accept-burst N]"
+         << " [--replay-messages N] [--replay-bytes BYTES] [--replay-log DIR] [--replay-log-bytes BYTES]"
+         << " [--replay-log-segments N] [--replay-log-sync MS]"
+         << " [--deflate on|off] [--deflate-threshold BYTES] [--deflate-window-bits 9-15]"
+         << " [--deflate-mem-level 1-9] [--deflate-context-takeover on|off] [--deflate-max-contexts N]" << endl;
+}
+
+/**
+ * @brief Converts a non-negative numeric option value, exiting with a usage message on bad input.
+ */
+int parseNumber(const string &value, const char *program)
+{
+    try
+    {
+        int number = stoi(value);
+        if (number >= 0)
+        {
+            return number;
+        }
+    }
+    catch (const exception &)
+    {
+    }
+    printUsage(program);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Parses an --affinity value: "auto" pins loop i to CPU i, otherwise a comma separated CPU list.
+ */
+vector<int> parseCpuList(const string &value, const char *program)
+{
+    vector<int> cpus;
+    if (value == "auto")
+    {
+        unsigned count = thread::hardware_concurrency();
+        for (unsigned cpu = 0; cpu < count; ++cpu)
+        {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+        return cpus;
+    }
+
+    size_t start = 0;
+    while (start <= value.size())
+    {
+        size_t end = value.find(',', start);
+        if (end == string::npos)
+        {
+            end = value.size();
+        }
+        cpus.push_back(parseNumber(value.substr(start, end - start), program));
+        start = end + 1;
+    }
+    return cpus;
+}
+
+/**
+ * @brief Parses command line options, exiting with a usage message on bad input.
+ */
+ServerOptions parseOptions(int argc, char *argv[])
+{
+    ServerOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        string value = argv[++i];
+
+        if (arg == "--port")
+        {
+            options.port = parseNumber(value, argv[0]);
+        }
+        else if (arg == "--mode" && value == "threaded")
+        {
+            options.mode = ServerMode::Threaded;
+        }
+        else if (arg == "--mode" && value == "epoll")
+        {
+            options.mode = ServerMode::Epoll;
+        }
+        else if (arg == "--mode" && value == "reuseport")
+        {
+            options.mode = ServerMode::ReusePort;
+        }
+        else if (arg == "--io" && value == "epoll")
+        {
+            options.io = IoBackend::Epoll;
+        }
+        else if (arg == "--io" && value == "uring")
+        {
+            options.io = IoBackend::Uring;
+        }
+        else if (arg == "--protocol" && value == "framed")
+        {
+            options.protocol = Protocol::Framed;
+        }
+        else if (arg == "--protocol" && value == "websocket")
+        {
+            options.protocol = Protocol::WebSocket;
+        }
+        else if (arg == "--handlers" && value == "callback")
+        {
+            options.handlers = HandlerStyle::Callback;
+        }
+        else if (arg == "--handlers" && value == "coroutine")
+        {
+            options.handlers = HandlerStyle::Coroutine;
+        }
+        else if (arg == "--broadcast" && (value == "on" || value == "off"))
+        {
+            options.broadcast = value == "on";
+        }
+        else if (arg == "--zerocopy-threshold")
+        {
+            options.zeroCopyThreshold = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--motd")
+        {
+            options.motdPath = value;
+        }
+        else if (arg == "--log-level" && value == "debug")
+        {
+            options.log.level = LogLevel::Debug;
+        }
+        else if (arg == "--log-level" && value == "info")
+        {
+            options.log.level = LogLevel::Info;
+        }
+        else if (arg == "--log-level" && value == "warning")
+        {
+            options.log.level = LogLevel::Warning;
+        }
+        else if (arg == "--log-level" && value == "error")
+        {
+            options.log.level = LogLevel::Error;
+        }
+        else if (arg == "--log-level" && value == "off")
+        {
+            options.log.level = LogLevel::Off;
+        }
+        else if (arg == "--log-file")
+        {
+            options.log.path = value;
+        }
+        else if (arg == "--log-format" && (value == "text" || value == "json"))
+        {
+            options.log.json = value == "json";
+        }
+        else if (arg == "--idle-timeout")
+        {
+            options.timeouts.idleSeconds = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--heartbeat")
+        {
+            options.timeouts.heartbeatSeconds = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--drain-timeout")
+        {
+            options.drainSeconds = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--upgrade-socket")
+        {
+            options.upgradeSocket = value;
+        }
+        else if (arg == "--listen-backlog")
+        {
+            options.backlog = max(parseNumber(value, argv[0]), 1);
+        }
+        else if (arg == "--max-connections")
+        {
+            options.admission.maxConnections = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--accept-rate")
+        {
+            options.admission.ratePerIp = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--accept-burst")
+        {
+            options.admission.burstPerIp = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--replay-messages")
+        {
+            options.replayMessages = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--replay-bytes")
+        {
+            options.replayBytes = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--replay-log")
+        {
+            options.replayLog.directory = value;
+        }
+        else if (arg == "--replay-log-bytes")
+        {
+            options.replayLog.bytes = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--replay-log-segments")
+        {
+            options.replayLog.segments = static_cast<size_t>(max(parseNumber(value, argv[0]), 1));
+        }
+        else if (arg == "--replay-log-sync")
+        {
+            options.replayLog.syncMilliseconds = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--max-queue")
+        {
+            options.outbound.maxBytes = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--high-watermark")
+        {
+            options.outbound.highWatermark = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--low-watermark")
+        {
+            options.outbound.lowWatermark = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--slow-consumer" && value == "drop-oldest")
+        {
+            options.outbound.policy = SlowConsumerPolicy::DropOldest;
+        }
+        else if (arg == "--slow-consumer" && value == "drop-newest")
+        {
+            options.outbound.policy = SlowConsumerPolicy::DropNewest;
+        }
+        else if (arg == "--slow-consumer" && value == "disconnect")
+        {
+            options.outbound.policy = SlowConsumerPolicy::Disconnect;
+        }
+        else if (arg == "--deflate" && (value == "on" || value == "off"))
+        {
+            options.deflate.enabled = value == "on";
+        }
+        else if (arg == "--deflate-threshold")
+        {
+            options.deflate.threshold = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--deflate-window-bits")
+        {
+            options.deflate.windowBits = parseNumber(value, argv[0]);
+        }
+        else if (arg == "--deflate-mem-level")
+        {
+            options.deflate.memLevel = parseNumber(value, argv[0]);
+        }
+        else if (arg == "--deflate-context-takeover" && (value == "on" || value == "off"))
+        {
+            options.deflate.contextTakeover = value == "on";
+        }
+        else if (arg == "--deflate-max-contexts")
+        {
+            options.deflate.maxContexts = static_cast<size_t>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--metrics-port")
+        {
+            options.metricsPort = parseNumber(value, argv[0]);
+        }
+        else if (arg == "--stats")
+        {
+            options.statsInterval = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--affinity")
+        {
+            options.cpus = parseCpuList(value, argv[0]);
+        }
+        else if (arg == "--threads")
+        {
+            options.loopThreads = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else if (arg == "--workers")
+        {
+            options.workerThreads = static_cast<unsigned>(parseNumber(value, argv[0]));
+        }
+        else
+        {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options.deflate.windowBits < 9 || options.deflate.windowBits > 15 ||
+        options.deflate.memLevel < 1 || options.deflate.memLevel > 9 ||
+        options.outbound.lowWatermark > options.outbound.highWatermark)
+    {
+        printUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (options.protocol == Protocol::WebSocket && options.mode == ServerMode::Threaded)
+    {
+        cerr << "The WebSocket protocol needs --mode epoll or --mode reuseport." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (options.broadcast && options.mode == ServerMode::Threaded)
+    {
+        cerr << "Broadcasting needs --mode epoll or --mode reuseport." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (options.workerThreads > 0 && (options.mode == ServerMode::Threaded || options.protocol != Protocol::Framed))
+    {
+        cerr << "Worker threads need --mode epoll or --mode reuseport with the framed protocol." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (options.metricsPort > 0 && options.mode == ServerMode::Threaded)
+    {
+        cerr << "Metrics need --mode epoll or --mode reuseport." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (options.timeouts.idleSeconds > 0 && options.timeouts.heartbeatSeconds >= options.timeouts.idleSeconds)
+    {
+        cerr << "The heartbeat interval must be shorter than the idle timeout." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!options.motdPath.empty() && (options.mode == ServerMode::Threaded || options.protocol != Protocol::Framed))
+    {
+        cerr << "A message of the day needs --mode epoll or --mode reuseport with the framed protocol." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (options.handlers == HandlerStyle::Coroutine)
+    {
+#ifndef CONNECTION_COROUTINES
+        cerr << "Coroutine handlers need a build with -std=c++20." << endl;
+        exit(EXIT_FAILURE);
+#endif
+        if (options.mode == ServerMode::Threaded || options.protocol != Protocol::Framed || options.workerThreads > 0)
+        {
+            cerr << "Coroutine handlers need --mode epoll or --mode reuseport with the framed protocol and no workers." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGPIPE, SIG_IGN); // Report broken connections through send() errors instead
+
+    // Every thread inherits the mask, so the signals only reach the control thread's signalfd
+    sigset_t shutdownSignals = SimpleServer::shutdownSignals();
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, nullptr);
+
+    ServerOptions options = parseOptions(argc, argv);
+    if (!Logger::instance().start(options.log))
+    {
+        cerr << "Failed to open log file " << options.log.path << "." << endl;
+        return EXIT_FAILURE;
+    }
+
+    SimpleServer server(options); // Initialize server, port 9999 by default
+
+    if (!server.takeOverListeners()) // Or inherit them from the server being upgraded
+    {
+        server.bindSocket();     // Bind the server socket to the address
+        server.startListening(); // Start listening for connections
+    }
+    server.startControl();      // Handle shutdown signals and upgrade requests
+    server.acceptConnections(); // Accept clients until a signal or an upgrade stops it
+    server.drainConnections();  // Say goodbye to the clients and let their output flush
+    server.serverShutdown();    // Stop the loops and close what is left
+    Logger::instance().stop();  // Write out the lines still queued
 
     return 0;
 }
@@ -0,0 +1,194 @@
+// timer_wheel.hpp
+// Hierarchical timing wheel for connection idle timeouts and heartbeats.
+//
+// Every connection needs a timer that is pushed back whenever the client is
+// heard from, and a server with 100k connections cannot afford a heap ordered
+// by deadline, let alone a thread per connection. A timing wheel keeps timers
+// in slots by deadline tick: level 0 has one slot per tick for the next 64
+// ticks, level 1 one slot per 64 ticks for the next 4096, and so on. Scheduling
+// and cancelling link or unlink the timer in one slot's list; each tick empties
+// one level-0 slot, and every 64 ticks the next higher slot is spread over the
+// level below.
+//
+// Timers are intrusive: the owner embeds a WheelTimer, so the wheel never
+// allocates. The wheel is not thread-safe; each loop has its own.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+constexpr uint64_t timerTickMilliseconds = 100; // Resolution of connection timers
+
+/**
+ * @brief The current tick on the monotonic clock, in timerTickMilliseconds.
+ */
+inline uint64_t currentTimerTick()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count()) /
+           timerTickMilliseconds;
+}
+
+/**
+ * @brief A timer embedded in the object it belongs to.
+ */
+struct WheelTimer
+{
+    WheelTimer *prev = nullptr; // Neighbours in the slot's list while scheduled
+    WheelTimer *next = nullptr;
+    uint64_t expires = 0;       // Deadline tick
+    void *owner = nullptr;      // Object the timer belongs to, for the expiry callback
+
+    WheelTimer() = default;
+    explicit WheelTimer(void *owner) : owner(owner) {}
+
+    // Linked into a wheel by address
+    WheelTimer(const WheelTimer &) = delete;
+    WheelTimer &operator=(const WheelTimer &) = delete;
+
+    bool scheduled() const { return next != nullptr; }
+};
+
+class TimerWheel
+{
+private:
+    static constexpr unsigned slotBits = 6;
+    static constexpr uint64_t slots = uint64_t{1} << slotBits; // Per level
+    static constexpr unsigned levels = 4;                      // 64^4 ticks ahead at most
+
+    WheelTimer heads[levels][slots]; // List sentinels, linked to themselves when empty
+    uint64_t now = 0;                // Last tick processed
+    size_t count = 0;                // Scheduled timers
+
+public:
+    /**
+     * @param start The current tick; deadlines are given on the same scale.
+     */
+    explicit TimerWheel(uint64_t start = 0) : now(start)
+    {
+        for (auto &level : heads)
+        {
+            for (WheelTimer &head : level)
+            {
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    /**
+     * @brief The last tick processed by advance().
+     */
+    uint64_t current() const { return now; }
+
+    size_t size() const { return count; }
+
+    /**
+     * @brief Schedules a timer, or moves it if it is already scheduled.
+     *
+     * @param tick Deadline; one in the past or present fires on the next tick.
+     */
+    void schedule(WheelTimer &timer, uint64_t tick)
+    {
+        cancel(timer);
+        timer.expires = tick > now ? tick : now + 1;
+        link(timer);
+        ++count;
+    }
+
+    /**
+     * @brief Unschedules a timer; does nothing if it is not scheduled.
+     */
+    void cancel(WheelTimer &timer)
+    {
+        if (!timer.scheduled())
+        {
+            return;
+        }
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        timer.prev = timer.next = nullptr;
+        --count;
+    }
+
+    /**
+     * @brief Processes every tick up to and including the given one, calling expire for
+     * each timer that comes due, in tick order.
+     *
+     * A timer is unscheduled before its callback runs, so the callback may schedule it
+     * again, cancel other timers or destroy the timer's owner.
+     */
+    template <typename Expire>
+    void advance(uint64_t tick, Expire &&expire)
+    {
+        while (now < tick)
+        {
+            if (count == 0)
+            {
+                now = tick; // Nothing to fire on the way
+                return;
+            }
+            ++now;
+            cascade(1);
+            WheelTimer &head = heads[0][now & (slots - 1)];
+            while (head.next != &head)
+            {
+                WheelTimer &timer = *head.next;
+                cancel(timer);
+                expire(timer);
+            }
+        }
+    }
+
+private:
+    /**
+     * @brief Spreads the slot of the given level that the current tick has reached over
+     * the levels below, starting at the highest level whose slot turned over.
+     */
+    void cascade(unsigned level)
+    {
+        if (level >= levels || (now & ((uint64_t{1} << (slotBits * level)) - 1)) != 0)
+        {
+            return;
+        }
+        cascade(level + 1);
+        WheelTimer &head = heads[level][(now >> (slotBits * level)) & (slots - 1)];
+        while (head.next != &head)
+        {
+            WheelTimer &timer = *head.next;
+            timer.prev->next = timer.next;
+            timer.next->prev = timer.prev;
+            link(timer);
+        }
+    }
+
+    /**
+     * @brief Links a timer into the slot its deadline falls in, relative to the current
+     * tick. Deadlines beyond the top level wait in its furthest slot and are placed
+     * again when that slot comes round.
+     */
+    void link(WheelTimer &timer)
+    {
+        uint64_t delta = timer.expires - now;
+        unsigned level = 0;
+        while (level + 1 < levels && delta >= (uint64_t{1} << (slotBits * (level + 1))))
+        {
+            ++level;
+        }
+        uint64_t tick = timer.expires;
+        if (delta >= (uint64_t{1} << (slotBits * levels)))
+        {
+            tick = now + (uint64_t{1} << (slotBits * levels)) - 1;
+        }
+        WheelTimer &head = heads[level][(tick >> (slotBits * level)) & (slots - 1)];
+        timer.prev = head.prev;
+        timer.next = &head;
+        head.prev->next = &timer;
+        head.prev = &timer;
+    }
+};
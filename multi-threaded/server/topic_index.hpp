@@ -0,0 +1,223 @@
+// topic_index.hpp
+// Topic subscriptions of the connections owned by one event loop.
+//
+// Every loop keeps its own index and is the only thread that touches it, so the
+// index is sharded by loop: subscribing and unsubscribing never take a lock, and
+// a publish only waits on the per-loop mailbox it is posted to. A subscription is
+// either an exact topic ("news.sports") or a prefix pattern ending in '*'
+// ("news.*", or "*" for every topic). Matching a topic costs one hash lookup for
+// exact subscribers plus one per distinct prefix length in use, and delivery then
+// visits only the subscribers that match.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct Connection;
+
+class TopicIndex
+{
+private:
+    /**
+     * @brief Subscriptions of one connection.
+     */
+    struct Subscriber
+    {
+        Connection *conn;
+        std::vector<std::string> patterns; // As given by the client, including any '*'
+        uint64_t lastMatch = 0;            // Last publication delivered, to avoid duplicates
+    };
+
+    using SubscriberList = std::vector<Subscriber *>;
+
+    std::unordered_map<Connection *, Subscriber> subscribers; // Node-based, so Subscriber pointers stay valid
+    std::unordered_map<std::string, SubscriberList> exact;    // Topic -> subscribers
+    std::unordered_map<std::string, SubscriberList> prefixes; // Prefix (pattern without '*') -> subscribers
+    std::map<size_t, size_t> prefixLengths;                   // Prefix length -> prefixes of that length
+    uint64_t publications = 0;                                // Sequence number for lastMatch
+    size_t count = 0;                                         // Subscriptions across all connections
+    std::string key;                                          // Lookup scratch, keeps its capacity between publications
+
+public:
+    /**
+     * @brief Number of subscriptions held by all connections.
+     */
+    size_t size() const { return count; }
+
+    /**
+     * @brief Adds a subscription for a connection.
+     *
+     * @return false if the connection already has this exact pattern.
+     */
+    bool subscribe(Connection &conn, std::string_view pattern)
+    {
+        Subscriber &subscriber = subscribers.try_emplace(&conn, Subscriber{&conn, {}}).first->second;
+        auto &patterns = subscriber.patterns;
+        if (std::find(patterns.begin(), patterns.end(), pattern) != patterns.end())
+        {
+            return false;
+        }
+        patterns.emplace_back(pattern);
+
+        std::string_view prefix;
+        if (isPrefix(pattern, prefix))
+        {
+            SubscriberList &list = prefixes[std::string(prefix)];
+            if (list.empty())
+            {
+                ++prefixLengths[prefix.size()];
+            }
+            list.push_back(&subscriber);
+        }
+        else
+        {
+            exact[std::string(pattern)].push_back(&subscriber);
+        }
+        ++count;
+        return true;
+    }
+
+    /**
+     * @brief Removes one subscription of a connection.
+     *
+     * @return false if the connection had no such subscription.
+     */
+    bool unsubscribe(Connection &conn, std::string_view pattern)
+    {
+        auto it = subscribers.find(&conn);
+        if (it == subscribers.end())
+        {
+            return false;
+        }
+        auto &patterns = it->second.patterns;
+        auto found = std::find(patterns.begin(), patterns.end(), pattern);
+        if (found == patterns.end())
+        {
+            return false;
+        }
+        detach(it->second, *found);
+        patterns.erase(found);
+        if (patterns.empty())
+        {
+            subscribers.erase(it);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Removes every subscription of a connection; called when it closes.
+     */
+    void unsubscribeAll(Connection &conn)
+    {
+        auto it = subscribers.find(&conn);
+        if (it == subscribers.end())
+        {
+            return;
+        }
+        for (const std::string &pattern : it->second.patterns)
+        {
+            detach(it->second, pattern);
+        }
+        subscribers.erase(it);
+    }
+
+    /**
+     * @brief Calls visit(Connection &) once for every connection subscribed to the topic,
+     * directly or through a prefix pattern.
+     *
+     * visit must not change the index.
+     */
+    template <typename Visitor>
+    void forEachSubscriber(std::string_view topic, Visitor &&visit)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        uint64_t publication = ++publications;
+        auto deliver = [&](const SubscriberList &list)
+        {
+            for (Subscriber *subscriber : list)
+            {
+                if (subscriber->lastMatch != publication)
+                {
+                    subscriber->lastMatch = publication;
+                    visit(*subscriber->conn);
+                }
+            }
+        };
+
+        key.assign(topic);
+        auto match = exact.find(key);
+        if (match != exact.end())
+        {
+            deliver(match->second);
+        }
+        for (const auto &entry : prefixLengths)
+        {
+            if (entry.first > topic.size())
+            {
+                break; // Lengths are ordered; no longer prefix can match
+            }
+            key.assign(topic, 0, entry.first);
+            auto prefix = prefixes.find(key);
+            if (prefix != prefixes.end())
+            {
+                deliver(prefix->second);
+            }
+        }
+    }
+
+private:
+    /**
+     * @brief Splits a pattern into its prefix if it ends in '*'.
+     */
+    static bool isPrefix(std::string_view pattern, std::string_view &prefix)
+    {
+        if (pattern.empty() || pattern.back() != '*')
+        {
+            return false;
+        }
+        prefix = pattern.substr(0, pattern.size() - 1);
+        return true;
+    }
+
+    /**
+     * @brief Removes a subscriber from the list behind one of its patterns.
+     */
+    void detach(Subscriber &subscriber, std::string_view pattern)
+    {
+        std::string_view prefix;
+        bool isPrefixPattern = isPrefix(pattern, prefix);
+        auto &table = isPrefixPattern ? prefixes : exact;
+        auto it = table.find(std::string(isPrefixPattern ? prefix : pattern));
+        if (it == table.end())
+        {
+            return;
+        }
+
+        SubscriberList &list = it->second;
+        auto found = std::find(list.begin(), list.end(), &subscriber);
+        if (found != list.end())
+        {
+            *found = list.back(); // Order within a topic does not matter
+            list.pop_back();
+            --count;
+        }
+        if (list.empty())
+        {
+            table.erase(it);
+            if (isPrefixPattern && --prefixLengths[prefix.size()] == 0)
+            {
+                prefixLengths.erase(prefix.size());
+            }
+        }
+    }
+};
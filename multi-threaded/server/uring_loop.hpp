@@ -0,0 +1,1088 @@
+// uring_loop.hpp
+// io_uring backend for SimpleServer's event loops.
+//
+// Talks to the kernel through the raw io_uring system calls, so no liburing is
+// needed. Each loop accepts with a multishot accept, receives with multishot recv
+// into a ring of kernel-selected provided buffers, and collects every reply
+// produced while handling one batch of completions into per-connection sendmsg
+// requests that go to the kernel in a single io_uring_enter call.
+//
+// Multishot recv needs Linux 6.0. UringLoop::supported() checks for it so the
+// server can fall back to the epoll backend on older kernels.
+//
+// With a zero-copy threshold set, large shared buffers and file regions go out
+// as IORING_OP_SENDMSG_ZC requests (Linux 6.1), straight from their memory or
+// the file's page cache; io_uring has no sendfile, and this takes its place. Such
+// a request completes twice: once with the bytes sent, and once with a
+// notification that the kernel no longer reads the buffer, which stays pinned
+// and keeps the connection alive until then. On older kernels these go out as
+// plain sendmsg requests.
+
+#pragma once
+
+#include <linux/io_uring.h> // io_uring ABI definitions
+#include <sys/eventfd.h>    // eventfd for cross-thread wakeups
+#include <sys/mman.h>       // Mapping the rings
+#include <sys/socket.h>     // shutdown, SOCK_* flags
+#include <sys/syscall.h>    // Raw io_uring system calls
+#include <unistd.h>         // close, write
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "io_loop.hpp"    // Connection and the IoLoop interface
+#include "mpsc_queue.hpp" // Mailbox for work posted by other threads
+
+/**
+ * @brief Minimal wrapper around one io_uring instance: setup, SQE allocation, submission
+ * and completion reaping.
+ */
+class IoUring
+{
+private:
+    int ringFd = -1;
+    unsigned sqEntries = 0;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    void *sqRing = MAP_FAILED, *cqRing = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+
+    unsigned localTail = 0; // SQEs handed out so far
+    unsigned unsubmitted = 0; // SQEs handed out but not yet passed to io_uring_enter
+
+    std::vector<io_uring_cqe> parked;   // Completions taken off a full CQ to let submissions through
+    std::vector<io_uring_cqe> visiting; // Parked completions being passed to reap's visitor
+    io_uring_sqe discarded{};           // Handed out once submission has failed for good
+    bool broken = false;                // io_uring_enter failed with an unrecoverable error
+
+public:
+    IoUring() = default;
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    ~IoUring()
+    {
+        if (sqes != nullptr)
+        {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+        {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED)
+        {
+            munmap(sqRing, sqRingSize);
+        }
+        if (ringFd >= 0)
+        {
+            close(ringFd);
+        }
+    }
+
+    /**
+     * @brief Creates the ring and maps its submission and completion queues.
+     *
+     * @param entries Submission queue size; the completion queue is four times larger
+     *                because multishot requests post many completions each.
+     * @return false if the kernel refused (no io_uring support, or blocked by policy).
+     */
+    bool init(unsigned entries)
+    {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ringFd < 0)
+        {
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMmap)
+        {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+        {
+            return false;
+        }
+        cqRing = singleMmap ? sqRing
+                            : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+        {
+            return false;
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqeMemory = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqeMemory == MAP_FAILED)
+        {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe *>(sqeMemory);
+
+        char *sq = static_cast<char *>(sqRing);
+        char *cq = static_cast<char *>(cqRing);
+        sqEntries = params.sq_entries;
+        sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        localTail = *sqTail;
+        return true;
+    }
+
+    int fd() const { return ringFd; }
+
+    /**
+     * @brief Returns a zeroed SQE, submitting queued ones first if the queue is full.
+     *
+     * The kernel refuses submissions (EBUSY) while the CQ is full, and only the caller
+     * frees it, so each retry parks the available completions for the next reap. Once
+     * submission has failed for good, a scratch SQE that is never submitted is returned
+     * and failed() reports it, so the caller can stop the loop.
+     */
+    io_uring_sqe *nextSqe()
+    {
+        while (!broken && localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+        {
+            broken = !submit(0);
+            park();
+        }
+        if (broken)
+        {
+            memset(&discarded, 0, sizeof(discarded));
+            return &discarded;
+        }
+        unsigned index = localTail & *sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        ++localTail;
+        ++unsubmitted;
+        return sqe;
+    }
+
+    /**
+     * @brief Passes all queued SQEs to the kernel in one call, optionally waiting for completions.
+     *
+     * @param waitFor Number of completions to wait for (0 to return immediately). Ignored
+     * while parked completions wait for the next reap.
+     * @return false on an unrecoverable error.
+     */
+    bool submit(unsigned waitFor)
+    {
+        if (!parked.empty())
+        {
+            waitFor = 0;
+        }
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int submitted = static_cast<int>(syscall(__NR_io_uring_enter, ringFd, unsubmitted, waitFor, flags, nullptr, 0));
+        if (submitted < 0)
+        {
+            return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+        }
+        unsubmitted -= static_cast<unsigned>(submitted);
+        return true;
+    }
+
+    /**
+     * @brief Calls visit(cqe) for every available completion and releases them to the kernel.
+     */
+    template <typename Visitor>
+    void reap(Visitor visit)
+    {
+        while (true)
+        {
+            if (!parked.empty()) // Older than anything still in the CQ
+            {
+                visiting.swap(parked); // The visitor may park more while these are visited
+                for (const io_uring_cqe &cqe : visiting)
+                {
+                    visit(cqe);
+                }
+                visiting.clear();
+                continue;
+            }
+            unsigned head = *cqHead; // Reloaded, since the visitor may have parked entries
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+            io_uring_cqe cqe = cqes[head & *cqMask]; // Copy so the slot can be released early
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            visit(cqe);
+        }
+    }
+
+    /**
+     * @return true once submission has failed for good and the ring can no longer be used.
+     */
+    bool failed() const { return broken; }
+
+    /**
+     * @brief Registers resources with the ring (io_uring_register).
+     */
+    int registerResource(unsigned opcode, void *arg, unsigned count)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_register, ringFd, opcode, arg, count));
+    }
+
+private:
+    /**
+     * @brief Moves every available completion off the CQ, in order, for the next reap.
+     */
+    void park()
+    {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            parked.push_back(cqes[head & *cqMask]);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+};
+
+/**
+ * @brief Connection state needed to keep io_uring requests alive while they are in flight.
+ */
+struct UringConnection : Connection
+{
+    static constexpr size_t maxIov = 16; // Queue segments submitted per sendmsg request
+
+    OutboundQueue inFlight;  // Output currently referenced by a submitted send request
+    iovec iov[maxIov];       // Gathered from inFlight for the submitted request
+    msghdr message{};        // Describes iov to the kernel while the request is in flight
+    bool sendingZeroCopy = false; // The submitted send request is a zero-copy one
+    int pendingOps = 0;      // Submitted requests that still reference this connection
+    bool receiving = false;  // A multishot recv request is active
+    bool sendQueued = false; // Already in the list of connections to flush this batch
+    bool closed = false;     // Shut down; freed once pendingOps reaches zero
+
+    explicit UringConnection(int fd) : Connection(fd) {}
+};
+
+class UringLoop : public IoLoop
+{
+private:
+    // Request kinds, stored in the low bits of each SQE's user_data next to the fd
+    enum Op : uint64_t
+    {
+        OpAccept = 1,
+        OpRecv = 2,
+        OpSend = 3,
+        OpWake = 4,
+        OpCancel = 5,
+        OpTick = 6,
+        OpStopAccept = 7,
+    };
+
+    static constexpr unsigned ringEntries = 1024; // Submission queue size
+    static constexpr unsigned bufferCount = 512;  // Provided receive buffers (power of two)
+    static constexpr unsigned bufferSize = 4096;  // Size of each provided buffer
+    static constexpr uint16_t bufferGroup = 0;    // Buffer group id used by recv requests
+    static constexpr size_t mailboxCapacity = 1024; // Posted items held before a mailbox overflows
+    static constexpr size_t mailboxOverflow = 15 * 1024; // Items held behind a full ring before posts fail
+
+    int id;      // Loop index, used in log output
+    int wakeFd;  // eventfd used to interrupt the loop from other threads
+    int listenFd = -1;
+    std::atomic<bool> running;
+    DataHandler onData;
+    ConnectionHandler onOpen;
+    bool zeroCopySupported = false; // The kernel has IORING_OP_SENDMSG_ZC
+
+    IoUring ring;
+    io_uring_buf *bufferRing = nullptr;      // Shared with the kernel: buffers available to recv
+    size_t bufferRingSize = 0;
+    std::vector<char> buffers;               // Backing memory for the provided buffers
+    uint16_t bufferTail = 0;                 // Local copy of the buffer ring tail
+    uint64_t wakeValue = 0;                  // Target of the eventfd read request
+    uint64_t tickValue = 0;                  // Target of the timerfd read request
+
+    Mailbox<int> pendingFds;                  // Sockets handed over by other threads, not yet registered
+    Mailbox<Publication> pendingMessages;     // Broadcasts and publications not yet queued
+
+    // Taken from pendingMessages, queued a slice per batch; blocks come from the loop's pool
+    std::deque<Publication, PoolAllocator<Publication>> backlog;
+
+    ConnectionTable<UringConnection> connections; // Owned connections by fd
+    std::vector<UringConnection *> sendQueue;     // Connections with output to submit
+
+public:
+    /**
+     * @brief Checks whether the running kernel supports everything this backend uses.
+     *
+     * Provided buffer rings and multishot accept arrived in Linux 5.19 and multishot
+     * recv in 6.0, together with IORING_OP_SEND_ZC, which serves as the probe for it.
+     */
+    static bool supported()
+    {
+        return supports({IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ, IORING_OP_SEND_ZC});
+    }
+
+    /**
+     * @brief Checks whether the running kernel supports every listed io_uring opcode.
+     */
+    static bool supports(std::initializer_list<unsigned> opcodes)
+    {
+        IoUring probeRing;
+        if (!probeRing.init(4))
+        {
+            return false;
+        }
+
+        size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        std::vector<char> probeMemory(probeSize, 0);
+        auto *probe = reinterpret_cast<io_uring_probe *>(probeMemory.data());
+        if (probeRing.registerResource(IORING_REGISTER_PROBE, probe, 256) < 0)
+        {
+            return false;
+        }
+        for (unsigned op : opcodes)
+        {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Creates the ring, registers the provided buffer ring and the wakeup eventfd.
+     *
+     * @param id Index of this loop, used to tag log messages.
+     * @param onData Callback receiving data read from connections.
+     * @param onOpen Optional callback for newly registered connections.
+     */
+    UringLoop(int id, DataHandler onData, ConnectionHandler onOpen = nullptr)
+        : id(id), running(true), onData(std::move(onData)), onOpen(std::move(onOpen)),
+          buffers(static_cast<size_t>(bufferCount) * bufferSize), pendingFds(mailboxCapacity, mailboxOverflow), pendingMessages(mailboxCapacity, mailboxOverflow)
+    {
+        wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (wakeFd < 0 || !ring.init(ringEntries) || !registerBuffers())
+        {
+            std::cerr << "Failed to create io_uring loop " << id << "." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        armWakeup();
+        zeroCopySupported = supports({IORING_OP_SENDMSG_ZC});
+    }
+
+    UringLoop(const UringLoop &) = delete;
+    UringLoop &operator=(const UringLoop &) = delete;
+
+    /**
+     * @brief Closes every owned connection along with the loop's descriptors.
+     */
+    ~UringLoop()
+    {
+        for (auto &entry : connections)
+        {
+            close(entry.first);
+        }
+        pendingFds.drain([](int fd)
+                         { close(fd); });
+        if (bufferRing != nullptr)
+        {
+            munmap(bufferRing, bufferRingSize);
+        }
+        close(wakeFd);
+    }
+
+    bool adoptConnection(int fd) override
+    {
+        PostResult result = pendingFds.post(fd);
+        if (result == PostResult::WakeUp)
+        {
+            wakeup();
+        }
+        return result != PostResult::Full;
+    }
+
+    void broadcast(SharedBuffer message) override
+    {
+        Publication publication{PooledString(), std::move(message), true};
+        if (!post(publication))
+        {
+            shed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void publish(std::string_view topic, SharedBuffer message) override
+    {
+        Publication publication{PooledString(topic), std::move(message), false};
+        if (!post(publication))
+        {
+            shed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void reply(int fd, uint64_t serial, SharedBuffer message, bool close) override
+    {
+        Publication publication{PooledString(), std::move(message), false, fd, serial, close};
+        while (!post(publication) && running.load(std::memory_order_relaxed))
+        {
+            std::this_thread::yield(); // The loop is already due to drain its mailbox
+        }
+    }
+
+    void addListener(int fd) override
+    {
+        listenFd = fd;
+        armAccept();
+    }
+
+    void stop() override
+    {
+        running = false;
+        wakeup();
+    }
+
+    void drain() override
+    {
+        drainRequested = true;
+        wakeup();
+    }
+
+    /**
+     * @brief Appends data to the connection's output; it is submitted at the end of the
+     * current completion batch together with every other reply.
+     */
+    void send(Connection &base, const char *data, size_t length) override
+    {
+        auto &conn = static_cast<UringConnection &>(base);
+        if (conn.failed || conn.closed || !admit(conn, queued(conn), length))
+        {
+            return;
+        }
+        conn.outbound.append(data, length);
+        queueSend(conn);
+    }
+
+    void send(Connection &base, SharedBuffer message) override
+    {
+        auto &conn = static_cast<UringConnection &>(base);
+        if (conn.failed || conn.closed || !admit(conn, queued(conn), message->size()))
+        {
+            return;
+        }
+        conn.outbound.append(std::move(message));
+        queueSend(conn);
+    }
+
+    void send(Connection &base, SharedFile file, size_t offset, size_t length, std::string_view header = {}) override
+    {
+        auto &conn = static_cast<UringConnection &>(base);
+        if (conn.failed || conn.closed || !admit(conn, queued(conn), header.size() + length))
+        {
+            return;
+        }
+        conn.outbound.append(header.data(), header.size());
+        conn.outbound.append(std::move(file), offset, length, !header.empty());
+        queueSend(conn);
+    }
+
+    void run() override
+    {
+        attachThread();
+        if (openTicker())
+        {
+            armTick();
+        }
+        while (running)
+        {
+            // One system call submits this batch's sends and waits for more completions,
+            // unless posted messages are still waiting to be queued
+            if (ring.failed() || !ring.submit(backlog.empty() ? 1 : 0))
+            {
+                logError() << "io_uring_enter failed on loop " << id << ".";
+                break;
+            }
+            ring.reap([this](const io_uring_cqe &cqe) { handleCompletion(cqe); });
+            deliverBacklog();
+            flushSends();
+        }
+        detachThread();
+    }
+
+private:
+    static uint64_t encode(int fd, Op op) { return (static_cast<uint64_t>(fd) << 8) | op; }
+
+    /**
+     * @brief Allocates the provided buffer ring, registers it and fills it with every buffer.
+     */
+    bool registerBuffers()
+    {
+        bufferRingSize = bufferCount * sizeof(io_uring_buf);
+        void *memory = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        bufferRing = static_cast<io_uring_buf *>(memory);
+
+        io_uring_buf_reg registration{};
+        registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+        registration.ring_entries = bufferCount;
+        registration.bgid = bufferGroup;
+        if (ring.registerResource(IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+        {
+            return false;
+        }
+
+        for (unsigned bid = 0; bid < bufferCount; ++bid)
+        {
+            provideBuffer(static_cast<uint16_t>(bid));
+        }
+        publishBuffers();
+        return true;
+    }
+
+    void provideBuffer(uint16_t bid)
+    {
+        io_uring_buf &slot = bufferRing[bufferTail & (bufferCount - 1)];
+        slot.addr = reinterpret_cast<uint64_t>(buffers.data() + static_cast<size_t>(bid) * bufferSize);
+        slot.len = bufferSize;
+        slot.bid = bid;
+        ++bufferTail;
+    }
+
+    /**
+     * @brief Makes newly provided buffers visible to the kernel.
+     *
+     * The ring tail overlays the reserved field of the first entry. It is addressed
+     * directly because io_uring_buf_ring's flexible array member is laid out
+     * differently when the kernel header is compiled as C++.
+     */
+    void publishBuffers()
+    {
+        __atomic_store_n(&bufferRing[0].resv, bufferTail, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * @return false if the mailbox is full; the publication is left with the caller.
+     */
+    bool post(Publication &publication)
+    {
+        PostResult result = pendingMessages.post(publication);
+        if (result == PostResult::WakeUp)
+        {
+            wakeup();
+        }
+        return result != PostResult::Full;
+    }
+
+    void wakeup()
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void armWakeup()
+    {
+        io_uring_sqe *sqe = ring.nextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeFd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wakeValue);
+        sqe->len = sizeof(wakeValue);
+        sqe->user_data = encode(wakeFd, OpWake);
+    }
+
+    void armTick()
+    {
+        io_uring_sqe *sqe = ring.nextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = tickFd;
+        sqe->addr = reinterpret_cast<uint64_t>(&tickValue);
+        sqe->len = sizeof(tickValue);
+        sqe->user_data = encode(tickFd, OpTick);
+    }
+
+    void armAccept()
+    {
+        io_uring_sqe *sqe = ring.nextSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenFd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = encode(listenFd, OpAccept);
+    }
+
+    void armRecv(UringConnection &conn)
+    {
+        io_uring_sqe *sqe = ring.nextSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = bufferGroup;
+        sqe->user_data = encode(conn.fd, OpRecv);
+        ++conn.pendingOps;
+        conn.receiving = true;
+    }
+
+    /**
+     * @brief Bytes a connection has waiting, including those in flight.
+     */
+    static size_t queued(const UringConnection &conn)
+    {
+        return conn.outbound.size() + conn.inFlight.size();
+    }
+
+    /**
+     * @brief Pauses reading above the high watermark by cancelling the multishot recv,
+     * and rearms it once the queue drains to the low watermark.
+     *
+     * Reading stops for a client that does not read its replies, so its queue cannot
+     * grow without bound and it cannot hold up the loop's other connections.
+     */
+    void updateThrottle(UringConnection &conn)
+    {
+        if (conn.closed)
+        {
+            return;
+        }
+        size_t bytes = queued(conn);
+        trackQueue(conn, bytes);
+        if (!conn.throttled && bytes > limits.highWatermark)
+        {
+            conn.throttled = true;
+            if (conn.receiving)
+            {
+                io_uring_sqe *sqe = ring.nextSqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = encode(conn.fd, OpRecv);
+                sqe->user_data = encode(conn.fd, OpCancel);
+                ++conn.pendingOps; // Keeps the fd from being reused while the cancel is pending
+            }
+        }
+        else if (conn.throttled && bytes <= limits.lowWatermark)
+        {
+            conn.throttled = false;
+            if (!conn.receiving)
+            {
+                armRecv(conn);
+            }
+        }
+    }
+
+    void queueSend(UringConnection &conn)
+    {
+        if (!conn.closed)
+        {
+            trackQueue(conn, queued(conn)); // Starts the queue clock as soon as output waits
+        }
+        if (!conn.sendQueued)
+        {
+            conn.sendQueued = true;
+            sendQueue.push_back(&conn);
+        }
+    }
+
+    /**
+     * @brief Turns the output gathered during this batch into one send request per connection.
+     */
+    void flushSends()
+    {
+        for (UringConnection *conn : sendQueue)
+        {
+            conn->sendQueued = false;
+            updateThrottle(*conn);
+            if (conn->closed)
+            {
+                releaseIfDone(*conn);
+            }
+            else if (conn->inFlight.empty() && !conn->outbound.empty())
+            {
+                conn->inFlight.swap(conn->outbound);
+                submitSend(*conn);
+            }
+            else
+            {
+                finishIfClosing(*conn);
+            }
+        }
+        sendQueue.clear();
+    }
+
+    /**
+     * @brief Submits the in-flight queue as one sendmsg request, so replies and shared
+     * broadcast buffers go out together without being copied into one buffer.
+     *
+     * A large shared buffer or a file region goes in a request of its own, which is
+     * a zero-copy one when zero-copy is on.
+     */
+    void submitSend(UringConnection &conn)
+    {
+        bool zeroCopy = zeroCopyThreshold > 0 && zeroCopySupported;
+        OutboundQueue::Run run = conn.inFlight.gatherRun(conn.iov, UringConnection::maxIov, zeroCopy ? zeroCopyThreshold : 0);
+        conn.message = msghdr{};
+        conn.message.msg_iov = conn.iov;
+        conn.message.msg_iovlen = run.count;
+
+        io_uring_sqe *sqe = ring.nextSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&conn.message);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = encode(conn.fd, OpSend);
+        ++conn.pendingOps;
+
+        conn.sendingZeroCopy = zeroCopy && (run.buffer || run.file);
+        if (conn.sendingZeroCopy)
+        {
+            sqe->opcode = IORING_OP_SENDMSG_ZC;
+            if (run.buffer)
+            {
+                conn.zeroCopy.pin(std::move(run.buffer));
+            }
+            else
+            {
+                conn.zeroCopy.pin(std::move(run.file));
+            }
+        }
+    }
+
+    void handleCompletion(const io_uring_cqe &cqe)
+    {
+        int fd = static_cast<int>(cqe.user_data >> 8);
+        switch (static_cast<Op>(cqe.user_data & 0xff))
+        {
+        case OpWake:
+            drainWakeups();
+            armWakeup();
+            break;
+        case OpTick:
+            expireIdleTimers([this](Connection &timedOut)
+                             {
+                UringConnection &conn = static_cast<UringConnection &>(timedOut);
+                closeConnection(conn);
+                releaseIfDone(conn); });
+            if (running)
+            {
+                armTick();
+            }
+            break;
+        case OpAccept:
+            if (cqe.res >= 0)
+            {
+                if (admitClient(cqe.res, nullptr)) // Multishot accepts return no address
+                {
+                    registerConnection(cqe.res);
+                }
+            }
+            else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED && running && !draining)
+            {
+                logError() << "Error accepting client on loop " << id << ".";
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE) && running && !draining)
+            {
+                armAccept(); // The kernel ended the multishot request; start a new one
+            }
+            break;
+        case OpRecv:
+            handleRecv(fd, cqe);
+            break;
+        case OpSend:
+            handleSend(fd, cqe);
+            break;
+        case OpStopAccept:
+            break; // The accept request ends with -ECANCELED
+        case OpCancel:
+        {
+            UringConnection *conn = find(fd);
+            --conn->pendingOps;
+            releaseIfDone(*conn);
+            break;
+        }
+        }
+    }
+
+    void drainWakeups()
+    {
+        pendingFds.drain([this](int fd)
+                         { registerConnection(fd); });
+        pendingMessages.drain([this](Publication &publication)
+                              { backlog.push_back(std::move(publication)); });
+        if (drainRequested && !draining)
+        {
+            beginDrain();
+        }
+    }
+
+    /**
+     * @brief Cancels the accept request and says goodbye to every connection; each one
+     * is closed once the goodbye and the output before it are flushed.
+     */
+    void beginDrain()
+    {
+        draining = true;
+        if (listenFd >= 0)
+        {
+            io_uring_sqe *sqe = ring.nextSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = encode(listenFd, OpAccept);
+            sqe->user_data = encode(listenFd, OpStopAccept);
+        }
+        std::vector<int> fds;
+        fds.reserve(connections.size());
+        for (auto &entry : connections)
+        {
+            fds.push_back(entry.first);
+        }
+        for (int fd : fds)
+        {
+            UringConnection *conn = find(fd);
+            if (conn != nullptr && !conn->closed)
+            {
+                sayGoodbye(*conn);
+                queueSend(*conn); // Closes it once the output queued so far is flushed
+            }
+        }
+    }
+
+    /**
+     * @brief Queues posted messages on their recipients; they go out with this batch's sends.
+     *
+     * Sends only start once the batch is submitted, so a burst is queued in slices of
+     * half the queue cap per batch. Otherwise a burst larger than the cap would trip the
+     * slow-consumer policy for clients that keep up.
+     */
+    void deliverBacklog()
+    {
+        auto enqueue = [this](UringConnection &conn, const SharedBuffer &message)
+        {
+            if (!conn.joined || conn.closing || conn.failed || conn.closed)
+            {
+                return;
+            }
+            if (admit(conn, queued(conn), message->size()))
+            {
+                conn.outbound.append(message);
+            }
+            queueSend(conn); // Also closes the connection if the slow-consumer policy failed it
+        };
+        size_t budget = limits.maxBytes / 2;
+        while (!backlog.empty())
+        {
+            const Publication &publication = backlog.front();
+            if (publication.fd >= 0)
+            {
+                UringConnection *conn = find(publication.fd);
+                if (conn != nullptr && conn->serial == publication.serial && !conn->closed)
+                {
+                    if (publication.message)
+                    {
+                        enqueue(*conn, publication.message);
+                    }
+                    if (publication.close && !conn->closing)
+                    {
+                        conn->closing = true;
+                        queueSend(*conn); // Closes it once the output queued so far is flushed
+                    }
+                }
+            }
+            else if (publication.everyone)
+            {
+                for (auto &entry : connections)
+                {
+                    enqueue(*entry.second, publication.message);
+                }
+            }
+            else
+            {
+                topics.forEachSubscriber(publication.topic, [&](Connection &conn)
+                                         { enqueue(static_cast<UringConnection &>(conn), publication.message); });
+            }
+            size_t size = publication.message ? publication.message->size() : 0;
+            backlog.pop_front();
+            if (size >= budget)
+            {
+                break;
+            }
+            budget -= size;
+        }
+    }
+
+    void registerConnection(int fd)
+    {
+        if (draining)
+        {
+            discard(fd);
+            return;
+        }
+        setNoDelay(fd);
+        auto owned = std::make_unique<UringConnection>(fd);
+        UringConnection &conn = *owned;
+        conn.serial = ++serials;
+        countOpen();
+        startIdleTimer(conn);
+        armRecv(conn);
+        connections.emplace(fd, std::move(owned));
+        if (onOpen)
+        {
+            onOpen(*this, conn);
+        }
+    }
+
+    UringConnection *find(int fd)
+    {
+        auto it = connections.find(fd);
+        return it == connections.end() ? nullptr : it->second.get();
+    }
+
+    void handleRecv(int fd, const io_uring_cqe &cqe)
+    {
+        UringConnection *conn = find(fd);
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (!more)
+        {
+            --conn->pendingOps;
+            conn->receiving = false;
+        }
+
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+        {
+            uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (cqe.res > 0 && !conn->closed && !conn->closing)
+            {
+                const char *data = buffers.data() + static_cast<size_t>(bid) * bufferSize;
+                dispatchRead(onData, *conn, std::string_view(data, static_cast<size_t>(cqe.res)));
+            }
+            provideBuffer(bid); // Hand the buffer straight back to the kernel
+            publishBuffers();
+        }
+
+        if (cqe.res == 0 && !conn->closed)
+        {
+            logInfo() << "Client [" << fd << "] disconnected.";
+            closeConnection(*conn);
+        }
+        else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED && !conn->closed)
+        {
+            // ENOBUFS and our own throttling cancel just end the request; anything else is fatal
+            logError() << "Error reading from client [" << fd << "].";
+            countReadError();
+            closeConnection(*conn);
+        }
+        else if (!more && !conn->closed && !conn->throttled)
+        {
+            armRecv(*conn); // Ran out of buffers or the kernel ended the multishot request
+        }
+
+        if (!conn->closed && (conn->failed || conn->closing))
+        {
+            queueSend(*conn); // Close once the pending output is flushed
+        }
+        releaseIfDone(*conn);
+    }
+
+    void handleSend(int fd, const io_uring_cqe &cqe)
+    {
+        UringConnection *conn = find(fd);
+        --conn->pendingOps;
+
+        if (cqe.flags & IORING_CQE_F_NOTIF)
+        {
+            // The kernel is done with a zero-copy buffer; notifications arrive in send order
+            conn->zeroCopy.releaseOldest();
+            countZeroCopy(1, false);
+            releaseIfDone(*conn);
+            return;
+        }
+        if (conn->sendingZeroCopy)
+        {
+            conn->sendingZeroCopy = false;
+            if (cqe.flags & IORING_CQE_F_MORE)
+            {
+                ++conn->pendingOps; // The notification is still to come
+            }
+            else
+            {
+                conn->zeroCopy.releaseNewest(); // Failed without taking a reference
+            }
+        }
+
+        if (cqe.res < 0)
+        {
+            if (!conn->closed)
+            {
+                logWarning() << "Failed to send message to client [" << fd << "].";
+                countSendError();
+                conn->failed = true;
+                closeConnection(*conn);
+            }
+        }
+        else
+        {
+            conn->inFlight.consume(static_cast<size_t>(cqe.res));
+            countSent(static_cast<size_t>(cqe.res));
+            if (!conn->inFlight.empty() && !conn->closed)
+            {
+                submitSend(*conn); // Short send, or more segments than one request takes
+                updateThrottle(*conn);
+            }
+            else
+            {
+                queueSend(*conn); // Pick up output queued while this send was in flight
+            }
+        }
+        releaseIfDone(*conn);
+    }
+
+    void finishIfClosing(UringConnection &conn)
+    {
+        if (!conn.closed && (conn.failed || (conn.closing && conn.outbound.empty() && conn.inFlight.empty())))
+        {
+            closeConnection(conn);
+            releaseIfDone(conn);
+        }
+    }
+
+    /**
+     * @brief Shuts the socket down so in-flight requests complete; the descriptor is
+     * closed once none remain.
+     */
+    void closeConnection(UringConnection &conn)
+    {
+        forgetSubscriptions(conn);
+        countClose(conn);
+        conn.closed = true;
+        shutdown(conn.fd, SHUT_RDWR);
+    }
+
+    void releaseIfDone(UringConnection &conn)
+    {
+        if (conn.closed && conn.pendingOps == 0 && !conn.sendQueued)
+        {
+            int fd = conn.fd;
+            close(fd);
+            connections.erase(fd);
+        }
+    }
+};
@@ -0,0 +1,827 @@
+// websocket.hpp
+// RFC 6455 WebSocket support for SimpleServer: the HTTP Upgrade handshake, an
+// incremental frame decoder and the server-side frame encoder.
+//
+// The handshake needs SHA-1 and base64 only to compute Sec-WebSocket-Accept, so
+// small implementations of both live here rather than pulling in a crypto library.
+// Client payloads arrive masked; they are unmasked while being copied out of the
+// read buffer by a vectorised XOR kernel, since that is the one step that touches
+// every payload byte. Compression (permessage-deflate) is negotiated during the
+// handshake and implemented in deflate.hpp.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "deflate.hpp" // permessage-deflate negotiation and codec
+#include "pool.hpp"    // Pooled reassembly buffers
+
+#if defined(__x86_64__)
+#include <immintrin.h> // SSE2 and AVX2 intrinsics
+#elif defined(__ARM_NEON)
+#include <arm_neon.h> // NEON intrinsics
+#endif
+
+/**
+ * @brief Computes the SHA-1 digest of a message (FIPS 180-4).
+ */
+inline std::array<uint8_t, 20> sha1(std::string_view message)
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    auto rotl = [](uint32_t value, int bits)
+    { return (value << bits) | (value >> (32 - bits)); };
+
+    // Pad to a multiple of 64 bytes: 0x80, zeros, then the bit length as 64-bit big endian
+    std::string data(message);
+    uint64_t bitLength = static_cast<uint64_t>(message.size()) * 8;
+    data.push_back(static_cast<char>(0x80));
+    while (data.size() % 64 != 56)
+    {
+        data.push_back('\0');
+    }
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        data.push_back(static_cast<char>((bitLength >> shift) & 0xff));
+    }
+
+    for (size_t block = 0; block < data.size(); block += 64)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i)
+        {
+            const auto *p = reinterpret_cast<const uint8_t *>(data.data() + block + i * 4);
+            w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+        }
+        for (int i = 16; i < 80; ++i)
+        {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i)
+        {
+            uint32_t f, k;
+            if (i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    std::array<uint8_t, 20> digest;
+    for (int i = 0; i < 5; ++i)
+    {
+        digest[i * 4] = static_cast<uint8_t>(h[i] >> 24);
+        digest[i * 4 + 1] = static_cast<uint8_t>(h[i] >> 16);
+        digest[i * 4 + 2] = static_cast<uint8_t>(h[i] >> 8);
+        digest[i * 4 + 3] = static_cast<uint8_t>(h[i]);
+    }
+    return digest;
+}
+
+/**
+ * @brief Encodes bytes as standard base64 with padding (RFC 4648).
+ */
+inline std::string base64Encode(const uint8_t *data, size_t length)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((length + 2) / 3 * 4);
+    for (size_t i = 0; i < length; i += 3)
+    {
+        uint32_t group = uint32_t(data[i]) << 16;
+        if (i + 1 < length)
+        {
+            group |= uint32_t(data[i + 1]) << 8;
+        }
+        if (i + 2 < length)
+        {
+            group |= uint32_t(data[i + 2]);
+        }
+        out.push_back(alphabet[(group >> 18) & 0x3f]);
+        out.push_back(alphabet[(group >> 12) & 0x3f]);
+        out.push_back(i + 1 < length ? alphabet[(group >> 6) & 0x3f] : '=');
+        out.push_back(i + 2 < length ? alphabet[group & 0x3f] : '=');
+    }
+    return out;
+}
+
+/**
+ * @brief Computes Sec-WebSocket-Accept for a client's Sec-WebSocket-Key.
+ */
+inline std::string webSocketAcceptKey(std::string_view clientKey)
+{
+    std::string input(clientKey);
+    input += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"; // GUID fixed by RFC 6455
+    std::array<uint8_t, 20> digest = sha1(input);
+    return base64Encode(digest.data(), digest.size());
+}
+
+/**
+ * @brief Copies a masked payload while XOR-ing it with the 4-byte masking key.
+ *
+ * @param dst Destination; may equal src for in-place unmasking.
+ * @param src Masked bytes.
+ * @param length Number of bytes.
+ * @param mask Masking key as four bytes in wire order.
+ * @param offset Position of src[0] within the frame payload, so a payload split
+ *               across reads continues with the right key byte.
+ */
+inline void unmaskCopyScalar(char *dst, const char *src, size_t length, const uint8_t mask[4], size_t offset)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        dst[i] = static_cast<char>(src[i] ^ mask[(offset + i) & 3]);
+    }
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2"))) inline size_t unmaskCopyAvx2(char *dst, const char *src, size_t length, uint32_t key)
+{
+    __m256i keyVector = _mm256_set1_epi32(static_cast<int>(key));
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(chunk, keyVector));
+    }
+    return i;
+}
+
+inline size_t unmaskCopySse2(char *dst, const char *src, size_t length, uint32_t key)
+{
+    __m128i keyVector = _mm_set1_epi32(static_cast<int>(key));
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(chunk, keyVector));
+    }
+    return i;
+}
+
+#endif
+
+/**
+ * @brief Vectorised unmasking: AVX2 when the CPU has it, SSE2 or NEON otherwise, with a
+ * scalar loop for the tail. Same contract as unmaskCopyScalar().
+ */
+inline void unmaskCopy(char *dst, const char *src, size_t length, const uint8_t mask[4], size_t offset)
+{
+    // Rotate the key so that lane byte 0 lines up with src[0]
+    uint8_t rotated[4] = {mask[offset & 3], mask[(offset + 1) & 3], mask[(offset + 2) & 3], mask[(offset + 3) & 3]};
+    uint32_t key;
+    memcpy(&key, rotated, sizeof(key));
+
+    size_t done = 0;
+#if defined(__x86_64__)
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2)
+    {
+        done = unmaskCopyAvx2(dst, src, length, key);
+    }
+    done += unmaskCopySse2(dst + done, src + done, length - done, key);
+#elif defined(__ARM_NEON)
+    uint8x16_t keyVector = vreinterpretq_u8_u32(vdupq_n_u32(key));
+    for (; done + 16 <= length; done += 16)
+    {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(src + done));
+        vst1q_u8(reinterpret_cast<uint8_t *>(dst + done), veorq_u8(chunk, keyVector));
+    }
+#endif
+    // Every vector step covers a multiple of 4 bytes, so the key phase is unchanged
+    unmaskCopyScalar(dst + done, src + done, length - done, rotated, 0);
+}
+
+/**
+ * @brief Checks that a byte sequence is well-formed UTF-8 (required for text messages).
+ */
+inline bool isValidUtf8(std::string_view text)
+{
+    const auto *p = reinterpret_cast<const uint8_t *>(text.data());
+    size_t length = text.size();
+    size_t i = 0;
+    while (i < length)
+    {
+        // Skip ASCII eight bytes at a time
+        if (i + 8 <= length)
+        {
+            uint64_t word;
+            memcpy(&word, p + i, sizeof(word));
+            if ((word & 0x8080808080808080ULL) == 0)
+            {
+                i += 8;
+                continue;
+            }
+        }
+
+        uint8_t byte = p[i];
+        size_t extra;
+        uint32_t codePoint;
+        if (byte < 0x80)
+        {
+            ++i;
+            continue;
+        }
+        else if ((byte & 0xE0) == 0xC0)
+        {
+            extra = 1;
+            codePoint = byte & 0x1F;
+        }
+        else if ((byte & 0xF0) == 0xE0)
+        {
+            extra = 2;
+            codePoint = byte & 0x0F;
+        }
+        else if ((byte & 0xF8) == 0xF0)
+        {
+            extra = 3;
+            codePoint = byte & 0x07;
+        }
+        else
+        {
+            return false;
+        }
+        for (size_t k = 1; k <= extra; ++k)
+        {
+            if (i + k >= length || (p[i + k] & 0xC0) != 0x80)
+            {
+                return false;
+            }
+            codePoint = (codePoint << 6) | (p[i + k] & 0x3F);
+        }
+        static const uint32_t minimum[4] = {0, 0x80, 0x800, 0x10000};
+        if (codePoint < minimum[extra] || codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF))
+        {
+            return false; // Overlong encoding, out of range, or a UTF-16 surrogate
+        }
+        i += extra + 1;
+    }
+    return true;
+}
+
+constexpr uint64_t maxWebSocketMessage = 16u << 20; // Largest message accepted, after decompression
+
+/**
+ * @brief WebSocket frame opcodes.
+ */
+enum class WsOpcode : uint8_t
+{
+    Continuation = 0x0,
+    Text = 0x1,
+    Binary = 0x2,
+    Close = 0x8,
+    Ping = 0x9,
+    Pong = 0xA,
+};
+
+/**
+ * @brief Close status codes sent by the server (RFC 6455 section 7.4.1).
+ */
+enum WsCloseCode : uint16_t
+{
+    WsCloseNormal = 1000,
+    WsCloseGoingAway = 1001,
+    WsCloseProtocolError = 1002,
+    WsCloseInvalidData = 1007,
+    WsCloseTooBig = 1009,
+};
+
+/**
+ * @brief A complete message (data) or control frame. The payload view is only valid
+ * inside the parser callback.
+ */
+struct WsMessage
+{
+    WsOpcode opcode;          // Text, Binary, Close, Ping or Pong
+    std::string_view payload; // Unmasked, reassembled payload
+    bool compressed;          // Sent with RSV1 under permessage-deflate; payload still deflated
+};
+
+/**
+ * @brief Appends an unmasked, unfragmented server frame.
+ *
+ * @param compressed Sets RSV1 to mark a permessage-deflate payload.
+ */
+inline void appendWebSocketFrame(std::string &out, WsOpcode opcode, std::string_view payload, bool compressed = false)
+{
+    out.push_back(static_cast<char>(0x80 | (compressed ? 0x40 : 0) | static_cast<uint8_t>(opcode))); // FIN, RSV1, opcode
+    size_t length = payload.size();
+    if (length < 126)
+    {
+        out.push_back(static_cast<char>(length));
+    }
+    else if (length <= 0xFFFF)
+    {
+        out.push_back(static_cast<char>(126));
+        out.push_back(static_cast<char>(length >> 8));
+        out.push_back(static_cast<char>(length & 0xff));
+    }
+    else
+    {
+        out.push_back(static_cast<char>(127));
+        for (int shift = 56; shift >= 0; shift -= 8)
+        {
+            out.push_back(static_cast<char>((static_cast<uint64_t>(length) >> shift) & 0xff));
+        }
+    }
+    out.append(payload.data(), payload.size());
+}
+
+/**
+ * @brief Appends a close frame carrying a status code.
+ */
+inline void appendWebSocketClose(std::string &out, uint16_t code)
+{
+    char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code & 0xff)};
+    appendWebSocketFrame(out, WsOpcode::Close, std::string_view(payload, sizeof(payload)));
+}
+
+/**
+ * @brief Incremental decoder for the frames a client sends.
+ *
+ * Enforces client masking, the reserved bits, control frame rules and fragmentation
+ * order, reassembles fragmented messages, and validates UTF-8 in text messages and
+ * close reasons. Payload bytes are unmasked straight from the read buffer into the
+ * message being assembled, so each byte is copied once.
+ */
+class WebSocketParser
+{
+private:
+    static constexpr size_t maxHeaderSize = 14;    // 2 + 8 extended length + 4 mask
+    static constexpr size_t releaseThreshold = 4096; // Larger message buffers are freed after use
+    static constexpr size_t reserveAhead = 64 << 10; // Most payload reserved from a frame header
+
+    uint64_t maxMessage; // Largest reassembled message accepted
+
+    // Frame currently being decoded
+    uint8_t header[maxHeaderSize];
+    size_t headerLength = 0;
+    bool inPayload = false;
+    bool fin = false;
+    WsOpcode opcode = WsOpcode::Continuation;
+    uint8_t mask[4] = {0, 0, 0, 0};
+    uint64_t payloadLength = 0;
+    uint64_t payloadRead = 0;
+
+    // Message being reassembled from data frames, and the current control frame
+    PooledString message;
+    WsOpcode messageOpcode = WsOpcode::Continuation; // Continuation = no message in progress
+    bool messageCompressed = false;                  // RSV1 was set on the message's first frame
+    bool compressionAllowed = false;                 // permessage-deflate was negotiated
+    PooledString control;
+
+    uint16_t error = 0; // Close code after a protocol violation
+
+public:
+    explicit WebSocketParser(uint64_t maxMessage = maxWebSocketMessage) : maxMessage(maxMessage) {}
+
+    /**
+     * @brief Accepts RSV1 on the first frame of data messages once permessage-deflate is agreed.
+     */
+    void allowCompression() { compressionAllowed = true; }
+
+    /**
+     * @brief Consumes the bytes from one read and calls onMessage(const WsMessage &) for
+     * every complete message or control frame.
+     *
+     * @return 0 on success, otherwise the close code to send before closing.
+     */
+    template <typename Callback>
+    uint16_t feed(std::string_view data, Callback &&onMessage)
+    {
+        while (!data.empty() && error == 0)
+        {
+            if (!inPayload)
+            {
+                if (!readHeader(data))
+                {
+                    break; // Need more bytes, or the header was invalid
+                }
+            }
+
+            uint64_t remaining = payloadLength - payloadRead;
+            size_t take = static_cast<size_t>(remaining < data.size() ? remaining : data.size());
+            PooledString &target = isControl(opcode) ? control : message;
+            size_t start = target.size();
+            target.resize(start + take);
+            unmaskCopy(&target[start], data.data(), take, mask, static_cast<size_t>(payloadRead));
+            payloadRead += take;
+            data.remove_prefix(take);
+
+            if (payloadRead == payloadLength)
+            {
+                finishFrame(onMessage);
+            }
+        }
+        return error;
+    }
+
+private:
+    static bool isControl(WsOpcode op) { return (static_cast<uint8_t>(op) & 0x8) != 0; }
+
+    /**
+     * @brief Accumulates and validates a frame header.
+     *
+     * @return true once the header is complete and valid.
+     */
+    bool readHeader(std::string_view &data)
+    {
+        // Determine how long the header is from its first two bytes
+        while (headerLength < 2 && !data.empty())
+        {
+            header[headerLength++] = static_cast<uint8_t>(data.front());
+            data.remove_prefix(1);
+        }
+        if (headerLength < 2)
+        {
+            return false;
+        }
+        uint8_t shortLength = header[1] & 0x7f;
+        bool masked = (header[1] & 0x80) != 0;
+        if (!masked)
+        {
+            headerLength = 0;
+            return fail(WsCloseProtocolError); // Clients must mask every frame
+        }
+        size_t needed = 2 + (shortLength == 126 ? 2 : shortLength == 127 ? 8 : 0) + 4;
+        while (headerLength < needed && !data.empty())
+        {
+            header[headerLength++] = static_cast<uint8_t>(data.front());
+            data.remove_prefix(1);
+        }
+        if (headerLength < needed)
+        {
+            return false;
+        }
+
+        fin = (header[0] & 0x80) != 0;
+        opcode = static_cast<WsOpcode>(header[0] & 0x0f);
+        payloadLength = shortLength;
+        if (shortLength == 126)
+        {
+            payloadLength = (uint64_t(header[2]) << 8) | header[3];
+        }
+        else if (shortLength == 127)
+        {
+            payloadLength = 0;
+            for (int i = 2; i < 10; ++i)
+            {
+                payloadLength = (payloadLength << 8) | header[i];
+            }
+        }
+        memcpy(mask, header + needed - 4, 4);
+        headerLength = 0;
+        payloadRead = 0;
+
+        if (payloadLength >> 63)
+        {
+            return fail(WsCloseProtocolError); // The most significant bit of a 64-bit length must be 0
+        }
+        bool rsv1 = (header[0] & 0x40) != 0;
+        if ((header[0] & 0x30) != 0 || (rsv1 && !compressionAllowed))
+        {
+            return fail(WsCloseProtocolError); // Reserved bits without a negotiated extension
+        }
+        if (rsv1 && (isControl(opcode) || opcode == WsOpcode::Continuation))
+        {
+            return fail(WsCloseProtocolError); // Only a message's first frame may carry RSV1
+        }
+        switch (opcode)
+        {
+        case WsOpcode::Close:
+        case WsOpcode::Ping:
+        case WsOpcode::Pong:
+            if (!fin || payloadLength > 125)
+            {
+                return fail(WsCloseProtocolError); // Control frames are never fragmented and stay small
+            }
+            control.clear();
+            break;
+        case WsOpcode::Text:
+        case WsOpcode::Binary:
+            if (messageOpcode != WsOpcode::Continuation)
+            {
+                return fail(WsCloseProtocolError); // New message before the previous one finished
+            }
+            messageOpcode = opcode;
+            messageCompressed = rsv1;
+            break;
+        case WsOpcode::Continuation:
+            if (messageOpcode == WsOpcode::Continuation)
+            {
+                return fail(WsCloseProtocolError); // Nothing to continue
+            }
+            break;
+        default:
+            return fail(WsCloseProtocolError); // Reserved opcode
+        }
+        if (!isControl(opcode) && payloadLength > maxMessage - message.size())
+        {
+            return fail(WsCloseTooBig); // Not a sum, which a huge length would wrap
+        }
+
+        inPayload = true;
+        // The header alone does not prove the payload will come: reserve a little, and
+        // let the buffer grow as the bytes arrive
+        message.reserve(message.size() + static_cast<size_t>(payloadLength < reserveAhead ? payloadLength : reserveAhead));
+        return true;
+    }
+
+    template <typename Callback>
+    void finishFrame(Callback &onMessage)
+    {
+        inPayload = false;
+        if (isControl(opcode))
+        {
+            if (opcode == WsOpcode::Close && !validClosePayload(control))
+            {
+                fail(WsCloseProtocolError);
+                return;
+            }
+            onMessage(WsMessage{opcode, control, false});
+            return;
+        }
+        if (!fin)
+        {
+            return; // Wait for the remaining fragments
+        }
+
+        // Compressed text can only be validated once the receiver has inflated it
+        if (messageOpcode == WsOpcode::Text && !messageCompressed && !isValidUtf8(message))
+        {
+            fail(WsCloseInvalidData);
+            return;
+        }
+        onMessage(WsMessage{messageOpcode, message, messageCompressed});
+        messageOpcode = WsOpcode::Continuation;
+        message.clear();
+        if (message.capacity() > releaseThreshold)
+        {
+            message.shrink_to_fit(); // Don't keep a large message's buffer on an idle connection
+        }
+    }
+
+    /**
+     * @brief Validates a close frame body: empty, or a legal status code plus UTF-8 reason.
+     */
+    static bool validClosePayload(std::string_view payload)
+    {
+        if (payload.empty())
+        {
+            return true;
+        }
+        if (payload.size() == 1)
+        {
+            return false;
+        }
+        uint16_t code = static_cast<uint16_t>((uint8_t(payload[0]) << 8) | uint8_t(payload[1]));
+        bool legal = (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+        return legal && isValidUtf8(payload.substr(2));
+    }
+
+    bool fail(uint16_t code)
+    {
+        error = code;
+        return false;
+    }
+};
+
+/**
+ * @brief Result of processing the client's opening handshake.
+ */
+enum class HandshakeStatus
+{
+    Incomplete, // Request headers not fully received yet
+    Accepted,   // 101 response produced; the connection now speaks WebSocket
+    Rejected,   // Error response produced; close after sending it
+};
+
+/**
+ * @brief Collects the HTTP Upgrade request and produces the server's response.
+ */
+class WebSocketHandshake
+{
+private:
+    static constexpr size_t maxRequestSize = 8192; // Larger requests are rejected
+
+    std::string request;
+
+public:
+    /**
+     * @brief Consumes request bytes.
+     *
+     * @param data Bytes from one read; on success the bytes following the request
+     *             (the first frames, if the client pipelined them) are left in data.
+     * @param response Set to the HTTP response to send once the request is complete.
+     * @param deflateOptions Server settings for permessage-deflate.
+     * @param deflate Set to the connection's compression state if the extension was agreed.
+     */
+    HandshakeStatus feed(std::string_view &data, std::string &response, const DeflateOptions &deflateOptions,
+                         std::unique_ptr<PerMessageDeflate> &deflate)
+    {
+        size_t previous = request.size();
+        request.append(data.data(), data.size());
+        size_t end = request.find("\r\n\r\n", previous >= 3 ? previous - 3 : 0);
+        if (end == std::string::npos)
+        {
+            if (request.size() > maxRequestSize)
+            {
+                response = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+                return HandshakeStatus::Rejected;
+            }
+            data = {};
+            return HandshakeStatus::Incomplete;
+        }
+        end += 4;
+        data.remove_prefix(end - previous);
+        request.resize(end);
+
+        HandshakeStatus status = respond(response, deflateOptions, deflate);
+        request.clear();
+        request.shrink_to_fit();
+        return status;
+    }
+
+private:
+    static char lower(char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c; }
+
+    static bool equalsIgnoreCase(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            if (lower(a[i]) != lower(b[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static std::string_view trim(std::string_view s)
+    {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        {
+            s.remove_suffix(1);
+        }
+        return s;
+    }
+
+    /**
+     * @brief Checks whether a comma separated header value contains a token.
+     */
+    static bool hasToken(std::string_view value, std::string_view token)
+    {
+        while (!value.empty())
+        {
+            size_t comma = value.find(',');
+            if (equalsIgnoreCase(trim(value.substr(0, comma)), token))
+            {
+                return true;
+            }
+            if (comma == std::string_view::npos)
+            {
+                break;
+            }
+            value.remove_prefix(comma + 1);
+        }
+        return false;
+    }
+
+    HandshakeStatus respond(std::string &response, const DeflateOptions &deflateOptions,
+                            std::unique_ptr<PerMessageDeflate> &deflate)
+    {
+        std::string_view text(request);
+        size_t lineEnd = text.find("\r\n");
+        std::string_view requestLine = text.substr(0, lineEnd);
+        text.remove_prefix(lineEnd + 2);
+
+        bool upgrade = false, connectionUpgrade = false, versionOk = false;
+        std::string_view key;
+        std::string extensions; // All Sec-WebSocket-Extensions headers, comma separated
+        while (!text.empty())
+        {
+            lineEnd = text.find("\r\n");
+            std::string_view line = text.substr(0, lineEnd);
+            text.remove_prefix(lineEnd + 2);
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos)
+            {
+                continue;
+            }
+            std::string_view name = trim(line.substr(0, colon));
+            std::string_view value = trim(line.substr(colon + 1));
+            if (equalsIgnoreCase(name, "Upgrade"))
+            {
+                upgrade = hasToken(value, "websocket");
+            }
+            else if (equalsIgnoreCase(name, "Connection"))
+            {
+                connectionUpgrade = hasToken(value, "upgrade");
+            }
+            else if (equalsIgnoreCase(name, "Sec-WebSocket-Key"))
+            {
+                key = value;
+            }
+            else if (equalsIgnoreCase(name, "Sec-WebSocket-Version"))
+            {
+                versionOk = value == "13";
+            }
+            else if (equalsIgnoreCase(name, "Sec-WebSocket-Extensions"))
+            {
+                extensions += extensions.empty() ? "" : ", ";
+                extensions += value;
+            }
+        }
+
+        bool isGet = requestLine.compare(0, 4, "GET ") == 0 && requestLine.find(" HTTP/1.1") != std::string_view::npos;
+        if (!isGet || !upgrade || !connectionUpgrade || key.size() != 24)
+        {
+            response = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+            return HandshakeStatus::Rejected;
+        }
+        if (!versionOk)
+        {
+            response = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+            return HandshakeStatus::Rejected;
+        }
+
+        response = "HTTP/1.1 101 Switching Protocols\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: " +
+                   webSocketAcceptKey(key) + "\r\n";
+
+        // Agree to compression only while the loop has room for the contexts it needs
+        DeflateParams params;
+        std::string agreed;
+        if (deflateOptions.enabled && negotiateDeflate(extensions, deflateOptions, params, agreed))
+        {
+            deflate = PerMessageDeflate::create(params, deflateOptions);
+            if (deflate)
+            {
+                response += "Sec-WebSocket-Extensions: " + agreed + "\r\n";
+            }
+        }
+        response += "\r\n";
+        return HandshakeStatus::Accepted;
+    }
+};
+
+/**
+ * @brief Per-connection WebSocket state: handshake first, then frames.
+ */
+struct WebSocketSession
+{
+    bool upgraded = false;        // Handshake completed
+    bool closeSent = false;       // Server already sent its close frame
+    WebSocketHandshake handshake; // Used until the upgrade completes
+    WebSocketParser parser;       // Used after the upgrade
+    std::unique_ptr<PerMessageDeflate> deflate; // Set if permessage-deflate was agreed
+
+    // Allocated from the owning loop's pool, like the connection
+    static void *operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void *pointer, size_t size) { BufferPool::deallocate(pointer, size); }
+};
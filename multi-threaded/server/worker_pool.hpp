@@ -0,0 +1,478 @@
+// worker_pool.hpp
+// Work-stealing thread pool for message handlers, and the strands that keep each
+// connection's messages in order on it.
+//
+// Event loops parse frames and hand the handler work to the pool, so a slow
+// handler holds up one worker instead of every connection of a loop. Each worker
+// has a deque of runnable tasks that only it pushes to and pops from the bottom;
+// idle workers steal from the top of the others' deques (Chase-Lev). Tasks arrive
+// from the loops through each worker's MPSC mailbox, round-robin, and a worker
+// that moves several at once into its deque wakes an idle peer to steal some.
+// A worker busy with a long task cannot empty its mailbox, so a worker that finds
+// no deque to steal from takes over a peer's mailbox instead, and a submission to
+// a busy worker wakes an idle one to do so.
+//
+// A task is never a single message. Every connection that uses the pool gets a
+// Strand, which queues the connection's messages and is itself the task: it is
+// scheduled when its first message arrives and keeps running until its queue is
+// empty. A strand is therefore on at most one worker at a time, which keeps the
+// connection's messages in order without any per-connection lock. The replies a
+// run produces are posted back to the owning loop as one shared buffer, tagged
+// with the connection's serial number so that a reply never reaches a newer
+// connection that reused the descriptor.
+//
+// The mailboxes are bounded in different ways. A strand is submitted at most once
+// at a time, so a worker's mailbox never holds more tasks than there are
+// connections using the pool, and its overflow is given no limit of its own. A
+// strand's queue is limited: a client that gets too many messages ahead of the
+// workers is turned down, and the loop closes its connection.
+
+#pragma once
+
+#include <sys/eventfd.h> // Waking idle workers
+#include <unistd.h>      // read, write, close
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "io_loop.hpp"    // Replies go back through the owning loop
+#include "mpsc_queue.hpp" // Mailboxes of the workers and strands
+#include "pool.hpp"       // Per-worker memory pool
+
+class WorkerPool
+{
+public:
+    /**
+     * @brief Work scheduled on the pool.
+     */
+    class Task
+    {
+    public:
+        virtual void run() = 0;
+
+    protected:
+        ~Task() = default;
+    };
+
+private:
+    /**
+     * @brief Fixed-size Chase-Lev deque: the owner pushes and pops at the bottom, other
+     * workers steal from the top.
+     */
+    class StealingDeque
+    {
+    private:
+        static constexpr int64_t capacity = 1024; // Power of two
+        std::atomic<int64_t> top{0};
+        std::atomic<int64_t> bottom{0};
+        std::atomic<Task *> slots[capacity];
+
+    public:
+        /**
+         * @return false if the deque is full. Owner only.
+         */
+        bool push(Task *task)
+        {
+            int64_t b = bottom.load(std::memory_order_relaxed);
+            if (b - top.load(std::memory_order_acquire) >= capacity)
+            {
+                return false;
+            }
+            slots[b & (capacity - 1)].store(task, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_seq_cst); // Ordered before checking for idle peers
+            return true;
+        }
+
+        /**
+         * @return The newest task, or null if the deque is empty. Owner only.
+         */
+        Task *pop()
+        {
+            int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            bottom.store(b, std::memory_order_seq_cst);
+            int64_t t = top.load(std::memory_order_seq_cst);
+            if (t > b)
+            {
+                bottom.store(b + 1, std::memory_order_relaxed); // Was empty
+                return nullptr;
+            }
+            Task *task = slots[b & (capacity - 1)].load(std::memory_order_relaxed);
+            if (t == b)
+            {
+                // Last task: race any thief for it
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    task = nullptr;
+                }
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return task;
+        }
+
+        /**
+         * @return The oldest task, or null if the deque is empty or another thread won it.
+         */
+        Task *steal()
+        {
+            int64_t t = top.load(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_seq_cst);
+            if (t >= b)
+            {
+                return nullptr;
+            }
+            Task *task = slots[t & (capacity - 1)].load(std::memory_order_relaxed);
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                return nullptr;
+            }
+            return task;
+        }
+
+        int64_t size() const
+        {
+            return bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+        }
+    };
+
+    struct Worker
+    {
+        static constexpr size_t inboxCapacity = 1024;
+
+        Mailbox<Task *> inbox{inboxCapacity, SIZE_MAX}; // Tasks submitted by the loops; one per strand at most
+        std::atomic<bool> draining{false};    // Held by the worker draining inbox, its one consumer
+        StealingDeque deque;                  // Tasks this worker runs, open to thieves
+        int wakeFd = eventfd(0, EFD_CLOEXEC); // Blocks the worker while it has nothing to do
+        std::atomic<bool> idle{false};        // Asleep, or about to be; peers with spare tasks wake it
+        BufferPool pool;                      // Memory for the strands' replies
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<bool> running{true};
+    std::atomic<size_t> nextWorker{0}; // Round-robin cursor for submit()
+
+public:
+    /**
+     * @param count Number of worker threads, at least one.
+     */
+    explicit WorkerPool(unsigned count)
+    {
+        for (unsigned i = 0; i < (count > 0 ? count : 1); ++i)
+        {
+            workers.push_back(std::make_unique<Worker>());
+            if (workers.back()->wakeFd < 0)
+            {
+                std::cerr << "Failed to create worker " << i << "." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            workers[i]->thread = std::thread(&WorkerPool::work, this, i);
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    /**
+     * @brief Stops the workers once their current task returns; queued tasks are dropped.
+     */
+    ~WorkerPool()
+    {
+        running = false;
+        for (auto &worker : workers)
+        {
+            wake(*worker);
+        }
+        for (auto &worker : workers)
+        {
+            worker->thread.join();
+            close(worker->wakeFd);
+        }
+    }
+
+    size_t size() const { return workers.size(); }
+
+    /**
+     * @brief Schedules a task. Safe to call from any thread; never blocks.
+     */
+    void submit(Task *task)
+    {
+        Worker &worker = *workers[nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+        if (worker.inbox.post(task) == PostResult::WakeUp) // Never Full: see the top of this file
+        {
+            wake(worker);
+        }
+        // Pairs with the fence of a worker going idle: either it sees the task, or this
+        // sees it idle
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!worker.idle.load(std::memory_order_relaxed))
+        {
+            wakeIdlePeers(worker, 1); // The worker may be stuck in a long task
+        }
+    }
+
+private:
+    static void wake(Worker &worker)
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(worker.wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void work(size_t index)
+    {
+        Worker &self = *workers[index];
+        BufferPool::current() = &self.pool;
+        while (running)
+        {
+            Task *task = self.deque.pop();
+            if (task == nullptr)
+            {
+                takeSubmitted(self, self);
+                task = self.deque.pop();
+            }
+            if (task == nullptr)
+            {
+                task = stealFromPeers(index);
+            }
+            if (task != nullptr)
+            {
+                task->run();
+                continue;
+            }
+
+            // Announce idleness before the last look, so a peer that fills its deque
+            // after that look sees the flag and wakes this worker
+            self.idle.store(true, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            task = stealFromPeers(index);
+            if (task != nullptr)
+            {
+                self.idle.store(false, std::memory_order_relaxed);
+                task->run();
+                continue;
+            }
+            uint64_t count;
+            ssize_t ignored = read(self.wakeFd, &count, sizeof(count)); // Submissions also wake it
+            (void)ignored;
+            self.idle.store(false, std::memory_order_relaxed);
+        }
+        BufferPool::current() = nullptr;
+    }
+
+    /**
+     * @brief Moves the tasks submitted to a worker, itself or a peer, into this worker's
+     * deque, then wakes idle peers for all but one of them. Does nothing if another
+     * worker is draining that inbox.
+     */
+    void takeSubmitted(Worker &self, Worker &from)
+    {
+        if (from.draining.exchange(true, std::memory_order_acquire))
+        {
+            return;
+        }
+        from.inbox.drain([&](Task *task)
+                         {
+            if (!self.deque.push(task))
+            {
+                task->run(); // Deque full; this worker would get to it first anyway
+            } });
+        from.draining.store(false, std::memory_order_release);
+        wakeIdlePeers(self, self.deque.size() - 1);
+    }
+
+    /**
+     * @brief Wakes up to count idle workers other than self.
+     */
+    void wakeIdlePeers(Worker &self, int64_t count)
+    {
+        for (auto &peer : workers)
+        {
+            if (count <= 0)
+            {
+                break;
+            }
+            if (peer.get() != &self && peer->idle.load(std::memory_order_seq_cst) && peer->idle.exchange(false))
+            {
+                wake(*peer);
+                --count;
+            }
+        }
+    }
+
+    Task *stealFromPeers(size_t index)
+    {
+        for (size_t i = 1; i < workers.size(); ++i)
+        {
+            if (Task *task = workers[(index + i) % workers.size()]->deque.steal())
+            {
+                return task;
+            }
+        }
+        // Tasks submitted to a worker stuck in a long task still wait in its inbox
+        Worker &self = *workers[index];
+        for (size_t i = 1; i < workers.size(); ++i)
+        {
+            takeSubmitted(self, *workers[(index + i) % workers.size()]);
+            if (Task *task = self.deque.pop())
+            {
+                return task;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/**
+ * @brief Runs one connection's messages on a WorkerPool, one at a time and in order.
+ *
+ * post() and postClose() are called on the owning loop's thread, the handler on
+ * whichever worker runs the strand. The connection keeps the strand alive, and so
+ * does the pool while the strand is scheduled, so a strand outlives a connection
+ * that closes with messages still queued; their replies are then dropped by the
+ * loop.
+ */
+class Strand : public WorkerPool::Task, public std::enable_shared_from_this<Strand>
+{
+public:
+    /**
+     * @brief Handles one message on a worker thread, appending any reply frames.
+     *
+     * @param type The type of the frame that carried the message.
+     */
+    using Handler = std::function<void(int fd, FrameType type, std::string_view message, std::string &reply)>;
+
+    bool closeRequested = false; // A close is queued behind the messages (loop thread only)
+
+private:
+    static constexpr size_t inboxCapacity = 32;   // Messages queued without a lock
+    static constexpr size_t backlogLimit = 4096;  // Messages that may wait behind those
+
+    struct Item
+    {
+        PooledString message;                // The message, or a close item's goodbye frames
+        FrameType type = FrameType::Text;    // Frame the message came in
+        bool close = false;                  // Close the connection once the replies before it are flushed
+    };
+
+    WorkerPool &pool;
+    IoLoop &loop;
+    const Handler &handler;
+    int fd;
+    uint64_t serial;
+    Mailbox<Item> inbox{inboxCapacity, backlogLimit};
+    std::atomic<size_t> pending{0}; // Posted but not yet handled; the strand is scheduled while non-zero
+    bool refused = false;           // The queue was full once; nothing is queued after that (loop thread only)
+    std::shared_ptr<Strand> scheduled; // Keeps the strand alive while the pool holds it
+
+public:
+    Strand(WorkerPool &pool, IoLoop &loop, const Connection &conn, const Handler &handler)
+        : pool(pool), loop(loop), handler(handler), fd(conn.fd), serial(conn.serial) {}
+
+    /**
+     * @brief Queues a message for the handler. Loop thread only.
+     *
+     * @return false if the client is so far ahead of the workers that the strand's
+     *         queue is full; the message is not queued, and the caller should close
+     *         the connection.
+     */
+    bool post(std::string_view message, FrameType type = FrameType::Text)
+    {
+        Item item{PooledString(message), type, false};
+        return enqueue(item);
+    }
+
+    /**
+     * @brief Closes the connection after the replies to every message posted so far.
+     * Loop thread only.
+     *
+     * @param goodbye Encoded frames sent after those replies, before the close.
+     * @return false if the strand's queue is full, as for post().
+     */
+    bool postClose(std::string_view goodbye = {})
+    {
+        closeRequested = true;
+        Item item{PooledString(goodbye), FrameType::Close, true};
+        return enqueue(item);
+    }
+
+    void run() override
+    {
+        std::shared_ptr<Strand> keep = std::move(scheduled);
+        static thread_local std::string reply; // Every reply of one pass, sent as one buffer
+        while (true)
+        {
+            reply.clear();
+            size_t handled = 0;
+            bool close = false;
+            inbox.drain([&](Item &item)
+                        {
+                ++handled;
+                if (item.close && !close)
+                {
+                    close = true;
+                    reply.append(item.message.data(), item.message.size());
+                }
+                else if (!close)
+                {
+                    handler(fd, item.type, item.message, reply);
+                }
+                item = Item(); // Release the message here rather than when the slot is reused
+            });
+            if (!reply.empty() || close)
+            {
+                loop.reply(fd, serial, reply.empty() ? SharedBuffer() : makeSharedBuffer(reply), close);
+            }
+            // Once this drops to zero the loop may schedule the strand again elsewhere,
+            // so nothing but the local keep is touched afterwards
+            if (pending.fetch_sub(handled, std::memory_order_acq_rel) == handled)
+            {
+                return;
+            }
+        }
+    }
+
+private:
+    /**
+     * @brief Queues an item and schedules the strand unless it is already scheduled.
+     *
+     * The item is counted before it is posted, so a running pass can never handle
+     * more items than pending holds; it may instead see a count whose item is not
+     * visible yet, and then just drains again. An item the full queue turned down is
+     * uncounted again, and a pass that saw its count in between just drains once more.
+     * That can bring the count to zero while a pass still runs, so nothing is queued
+     * afterwards: a later item would find the strand idle and start a second pass.
+     *
+     * @return false if the queue is full, or was once.
+     */
+    bool enqueue(Item &item)
+    {
+        if (refused)
+        {
+            return false;
+        }
+        bool idle = pending.fetch_add(1, std::memory_order_acq_rel) == 0;
+        if (inbox.post(item) == PostResult::Full)
+        {
+            pending.fetch_sub(1, std::memory_order_acq_rel); // Not idle: an empty queue has room
+            refused = true;
+            return false;
+        }
+        if (idle)
+        {
+            scheduled = shared_from_this();
+            pool.submit(this);
+        }
+        return true;
+    }
+};
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>  // IP address conversion functions
 #include <unistd.h>     // POSIX operating system API, including socket closure
 #include <cstring>      // string manipulation functions
+#include <vector>       // Receive buffer
 
 using namespace std;
 
@@ -49,10 +50,11 @@ public:
     // Start listening for incoming client connections
     void startListening()
     {
-        if (listen(serverSocket, 5) < 0)
+        // Let the kernel queue as many connections as it allows (net.core.somaxconn). Clients
+        // wait there while another one is served; with a short queue, connects beyond it have
+        // their SYN dropped and stall for a second until it is retried.
+        if (listen(serverSocket, SOMAXCONN) < 0)
         {
-
-            // Listen with a backlog of 5 connections
             cerr << "Error listening on the server socket" << endl;
             closeSocket(); // Properly close the socket before exiting
             exit(1);
@@ -75,20 +77,41 @@ public:
         }
         cout << "Client connected" << endl;
 
-        // Communication loop with the client
-        char buffer[1024] = {0}; // Buffer for client data
+        // Communication loop with the client. The buffer is not cleared between reads:
+        // recv overwrites it and the terminator marks where the data ends. It doubles
+        // when a read fills it, up to 64 KiB, so a long message arrives in one piece,
+        // and halves again, down to 1 KiB, after 16 reads in a row that used no more
+        // than a quarter of it, so one long message does not pin 64 KiB for good.
+        const size_t minimumSize = 1024;
+        const size_t maximumSize = 64 * 1024;
+        vector<char> buffer(minimumSize); // Buffer for client data
+        unsigned smallReads = 0;          // Consecutive reads that used a quarter of the buffer or less
         while (running)
         {
-            memset(buffer, 0, sizeof(buffer)); // Clear the buffer before reading
-
-            int byteRead = recv(acceptedClientSocket, buffer, sizeof(buffer) - 1, 0);
+            int byteRead = recv(acceptedClientSocket, buffer.data(), buffer.size() - 1, 0);
             if (byteRead > 0)
             {
                 buffer[byteRead] = '\0'; // Null-terminate the received data
-                cout << buffer << endl;
+                cout << buffer.data() << endl;
+                size_t used = static_cast<size_t>(byteRead);
+                if (used == buffer.size() - 1 && buffer.size() < maximumSize)
+                {
+                    buffer.resize(buffer.size() * 2);
+                    smallReads = 0;
+                }
+                else if (used <= buffer.size() / 4 && buffer.size() > minimumSize && ++smallReads >= 16)
+                {
+                    buffer.resize(buffer.size() / 2); // Keeps the message and its terminator
+                    buffer.shrink_to_fit();
+                    smallReads = 0;
+                }
+                else if (used > buffer.size() / 4)
+                {
+                    smallReads = 0;
+                }
 
                 // Handle client request to close the connection
-                if (strcmp(buffer, "quit()") == 0)
+                if (strcmp(buffer.data(), "quit()") == 0)
                 {
                     cout << "Client requested to close the connection" << endl;
                     break;
@@ -0,0 +1,188 @@
+// outbound_queue_test.cpp
+// Checks that the slow-consumer policy DropOldest keeps a connection's stream
+// decodable.
+//
+// A queue is filled the way the event loops fill it for a client that stopped
+// reading: the rest of a frame whose start one write already took, replies that
+// are merged into one private segment, shared broadcasts, and a frame header
+// queued in front of a file region. The oldest messages are then dropped, both
+// before and while the queue is sent in uneven pieces. The bytes "sent" must
+// decode with the client's FrameParser into whole messages, in order, with
+// nothing corrupted.
+
+#include <unistd.h> // write, close, unlink
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../multi-threaded/common/framing.hpp"        // The client's frame parser
+#include "../multi-threaded/server/outbound_queue.hpp" // The queue under test
+
+using namespace std;
+
+namespace
+{
+
+int failures = 0;
+
+void check(bool condition, const string &what)
+{
+    if (!condition)
+    {
+        cerr << "FAIL: " << what << endl;
+        ++failures;
+    }
+}
+
+/**
+ * @brief A distinct payload for message number i, of a size that varies with i.
+ */
+string payloadOf(size_t i)
+{
+    string payload = "message " + to_string(i) + " ";
+    payload.append(37 * (i % 11) + 1, static_cast<char>('a' + i % 26));
+    return payload;
+}
+
+/**
+ * @brief Sends up to limit bytes from the front of the queue to the wire.
+ */
+void sendSome(OutboundQueue &queue, string &wire, size_t limit)
+{
+    iovec iov[8];
+    size_t count = queue.gather(iov, 8);
+    size_t sent = 0;
+    for (size_t i = 0; i < count && sent < limit; ++i)
+    {
+        size_t take = min(iov[i].iov_len, limit - sent);
+        wire.append(static_cast<const char *>(iov[i].iov_base), take);
+        sent += take;
+    }
+    queue.consume(sent);
+}
+
+/**
+ * @brief Decodes the wire and checks that it holds whole messages from the expected
+ * list, in order, and ends with the last one.
+ */
+void checkStream(const string &wire, const vector<string> &expected, const string &name)
+{
+    FrameParser parser;
+    vector<string> received;
+    bool parsed = parser.feed(wire, [&](const Frame &frame)
+                              { received.emplace_back(frame.payload); });
+    check(parsed, name + ": the client's parser rejected the stream");
+    check(!received.empty() && received.front() == expected.front(), name + ": the partly written message did not arrive whole");
+    check(!received.empty() && received.back() == expected.back(), name + ": the newest message did not arrive last");
+
+    size_t next = 0;
+    for (const string &payload : received)
+    {
+        while (next < expected.size() && expected[next] != payload)
+        {
+            ++next; // Dropped
+        }
+        if (next == expected.size())
+        {
+            check(false, name + ": a frame matches no message, or arrived out of order");
+            break;
+        }
+        ++next;
+    }
+    check(received.size() < expected.size(), name + ": nothing was dropped, so the test tested nothing");
+}
+
+/**
+ * @brief Fills a queue after a short write, drops from it and sends it in pieces.
+ *
+ * @param dropWhileSending Drop again each time part of the queue has been sent.
+ */
+void runScenario(const SharedFile &file, bool dropWhileSending, const string &name)
+{
+    OutboundQueue queue;
+    string wire;
+    vector<string> expected;
+
+    // A reply the socket took only the first bytes of
+    string first;
+    expected.push_back(payloadOf(0));
+    appendFrame(first, FrameType::Text, expected.back());
+    wire.append(first, 0, 3);
+    queue.append(first.data() + 3, first.size() - 3, true);
+
+    for (size_t i = 1; i < 200; ++i)
+    {
+        string frame;
+        if (i % 7 == 3)
+        {
+            // A frame header followed by its payload in a file, as greet() sends it
+            expected.emplace_back(file->bytes());
+            appendFrameHeader(frame, FrameType::Text, file->size());
+            queue.append(frame.data(), frame.size());
+            queue.append(file, 0, file->size(), true);
+            continue;
+        }
+        expected.push_back(payloadOf(i));
+        appendFrame(frame, FrameType::Text, expected.back());
+        if (i % 3 == 0)
+        {
+            queue.append(makeSharedBuffer(frame)); // A broadcast
+        }
+        else
+        {
+            queue.append(frame.data(), frame.size()); // Replies merge into one segment
+        }
+        if (i % 50 == 0)
+        {
+            queue.dropOldest(4096);
+        }
+    }
+
+    size_t piece = 1;
+    while (!queue.empty())
+    {
+        sendSome(queue, wire, piece);
+        piece = piece * 3 % 1021 + 1; // Uneven pieces, so sends stop inside segments
+        if (dropWhileSending && queue.size() > 2048)
+        {
+            queue.dropOldest(1024);
+        }
+    }
+    checkStream(wire, expected, name);
+}
+
+} // namespace
+
+int main()
+{
+    char path[] = "/tmp/outbound_queue_testXXXXXX";
+    int fd = mkstemp(path);
+    string contents = "message of the day\n";
+    contents.append(300, '-');
+    if (fd < 0 || write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+    {
+        cerr << "Failed to create a temporary file." << endl;
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    SharedFile file = MappedFile::open(path);
+    unlink(path);
+    if (!file)
+    {
+        cerr << "Failed to map the temporary file." << endl;
+        return EXIT_FAILURE;
+    }
+
+    runScenario(file, false, "drop before sending");
+    runScenario(file, true, "drop while sending");
+
+    if (failures > 0)
+    {
+        cerr << failures << " check(s) failed." << endl;
+        return EXIT_FAILURE;
+    }
+    cout << "outbound_queue_test: all checks passed." << endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+// worker_pool_test.cpp
+// Checks that tasks never wait behind a long task while other workers are idle.
+//
+// One slow task is submitted, and once it runs, many short ones follow. Submission
+// is round-robin, so some of the short tasks land in the inbox of the worker that
+// is busy with the slow one. The slow task stays blocked until every short task has
+// finished, so they can only all finish if the idle workers take them over. If they
+// do not, the slow task gives up after a safety timeout, which only keeps a failing
+// run from hanging; no result depends on how long anything took.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../multi-threaded/server/worker_pool.hpp" // The pool under test
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+namespace
+{
+
+constexpr auto safetyTimeout = chrono::seconds(30); // Only reached when stealing is broken
+
+class SlowTask : public WorkerPool::Task
+{
+public:
+    const atomic<int> *done = nullptr;
+    int expected = 0;
+    atomic<bool> started{false};
+    atomic<bool> finished{false};
+    bool released = false; // Every short task finished while this one was still running
+
+    void run() override
+    {
+        started = true;
+        Clock::time_point giveUp = Clock::now() + safetyTimeout;
+        while (*done < expected && Clock::now() < giveUp)
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        released = *done == expected;
+        finished = true;
+    }
+};
+
+class ShortTask : public WorkerPool::Task
+{
+public:
+    atomic<int> *done = nullptr;
+
+    void run() override { done->fetch_add(1); }
+};
+
+/**
+ * @return true if every short task finished while the slow one was blocked.
+ */
+bool runRound(unsigned workers, int shortTasks)
+{
+    WorkerPool pool(workers);
+    atomic<int> done{0};
+    SlowTask slow;
+    slow.done = &done;
+    slow.expected = shortTasks;
+    pool.submit(&slow);
+    while (!slow.started)
+    {
+        this_thread::yield();
+    }
+
+    vector<ShortTask> tasks(static_cast<size_t>(shortTasks));
+    for (ShortTask &task : tasks)
+    {
+        task.done = &done;
+        pool.submit(&task);
+    }
+    while (!slow.finished || done < shortTasks)
+    {
+        this_thread::sleep_for(chrono::milliseconds(1)); // The pool drops queued tasks when destroyed
+    }
+
+    cout << workers << " workers, " << shortTasks << " short tasks: "
+         << (slow.released ? "all finished while the slow task ran" : "some waited for the slow task  FAIL")
+         << endl;
+    return slow.released;
+}
+
+} // namespace
+
+int main()
+{
+    bool passed = true;
+    passed &= runRound(2, 10);
+    passed &= runRound(4, 1000);
+    passed &= runRound(8, 5000);
+    if (!passed)
+    {
+        cerr << "Short tasks waited behind the slow one." << endl;
+        return EXIT_FAILURE;
+    }
+    cout << "worker_pool_test: all checks passed." << endl;
+    return EXIT_SUCCESS;
+}